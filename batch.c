@@ -0,0 +1,475 @@
+// For `pthread_setaffinity_np` and `CPU_SET`
+#define _GNU_SOURCE
+
+#include "batch.h"
+
+// Libc
+#include <stdatomic.h>  // atomic_load_explicit, etc
+#include <stdbool.h>    // bool
+#include <stdio.h>      // fprintf
+#include <stdlib.h>     // aligned_alloc, strtol
+#include <string.h>     // memcpy, memset, strcmp
+// POSIX
+#include <pthread.h>  // pthread_create, etc
+#include <sched.h>    // cpu_set_t, CPU_SET
+// Local
+#include "fileio.h"  // file_queue_read, etc
+#include "perf.h"    // perf_now
+
+#define CACHE_LINE 64
+
+// Results of taking a job from a deque
+#define DEQUE_EMPTY SIZE_MAX
+#define DEQUE_ABORT (SIZE_MAX - 1)  // Lost a race with another thief
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+// Chase-Lev work-stealing deque of job indices, with a fixed capacity
+// The owner pushes and pops at the bottom; thieves take from the top. The
+// ends are on separate cache lines, so the owner only contends with thieves
+// when the deque is nearly empty
+struct Deque {
+    _Alignas(CACHE_LINE) _Atomic int64_t top;
+    _Alignas(CACHE_LINE) _Atomic int64_t bottom;
+    _Atomic size_t *jobs;
+    size_t mask;  // Capacity is a power of 2
+};
+
+struct Worker {
+    struct Deque deque;
+    // Only used by this worker
+    _Alignas(CACHE_LINE) struct BatchStats stats;
+    struct FileQueue *files;
+    int id;
+    pthread_t thread;
+    struct Batch *batch;
+};
+
+struct Batch {
+    struct BatchJob *jobs;
+    const struct BatchOptions *options;
+    struct Worker *workers;
+    int worker_count;
+};
+
+void deque_push(struct Deque *const deque, const size_t job) {
+    const int64_t bottom =
+        atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    atomic_store_explicit(
+        &deque->jobs[(size_t)bottom & deque->mask], job, memory_order_relaxed
+    );
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+}
+
+size_t deque_pop(struct Deque *const deque) {
+    const int64_t bottom =
+        atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+    if (top > bottom) {
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        return DEQUE_EMPTY;
+    }
+    size_t job = atomic_load_explicit(
+        &deque->jobs[(size_t)bottom & deque->mask], memory_order_relaxed
+    );
+    if (top == bottom) {
+        // Last job, which a thief may be taking too
+        if (!atomic_compare_exchange_strong_explicit(
+                &deque->top,
+                &top,
+                top + 1,
+                memory_order_seq_cst,
+                memory_order_relaxed
+            ))
+            job = DEQUE_EMPTY;
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    }
+    return job;
+}
+
+size_t deque_steal(struct Deque *const deque) {
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    const int64_t bottom =
+        atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    if (top >= bottom)
+        return DEQUE_EMPTY;
+    const size_t job = atomic_load_explicit(
+        &deque->jobs[(size_t)top & deque->mask], memory_order_relaxed
+    );
+    if (!atomic_compare_exchange_strong_explicit(
+            &deque->top,
+            &top,
+            top + 1,
+            memory_order_seq_cst,
+            memory_order_relaxed
+        ))
+        return DEQUE_ABORT;
+    return job;
+}
+
+// Steal from each other worker in turn
+// No jobs are added once workers start, so if every deque is empty, there
+// is nothing left to do
+size_t steal(const struct Worker *const thief) {
+    const struct Batch *const batch = thief->batch;
+    for (int i = 1; i < batch->worker_count; ++i) {
+        struct Worker *const victim =
+            &batch->workers[(thief->id + i) % batch->worker_count];
+        size_t job;
+        do {
+            job = deque_steal(&victim->deque);
+        } while (job == DEQUE_ABORT);
+        if (job != DEQUE_EMPTY)
+            return job;
+    }
+    return DEQUE_EMPTY;
+}
+
+// I/O of the job running on this thread
+struct JobIo {
+    struct InputBuffer input;
+    uint64_t output_hash;
+    // Everything output, if the job has an output file
+    bool keep_output;
+    char *output;
+    size_t output_length;
+    size_t output_capacity;
+};
+
+int job_read_char(void *const context) {
+    return buffer_read_char(&((struct JobIo *)context)->input);
+}
+size_t job_read(void *const context, char *const buffer, const size_t size) {
+    return buffer_read(&((struct JobIo *)context)->input, buffer, size);
+}
+void job_write(
+    void *const context, const char *const data, const size_t length
+) {
+    struct JobIo *const job_io = context;
+    for (size_t i = 0; i < length; ++i)
+        job_io->output_hash =
+            (job_io->output_hash ^ (unsigned char)data[i]) * FNV_PRIME;
+    if (!job_io->keep_output)
+        return;
+    while (job_io->output_capacity - job_io->output_length < length) {
+        job_io->output_capacity =
+            job_io->output_capacity == 0 ? 4096 : job_io->output_capacity * 2;
+        job_io->output = realloc(job_io->output, job_io->output_capacity);
+        assert(job_io->output != NULL, "Out of memory");
+    }
+    memcpy(job_io->output + job_io->output_length, data, length);
+    job_io->output_length += length;
+}
+void job_write_char(void *const context, const char ch) {
+    job_write(context, &ch, 1);
+}
+
+// The program which this worker loaded last, so jobs which run the same
+// program again can copy it instead of reading the file
+struct LoadedProgram {
+    const char *filename;
+    Word *memory;
+    Word origin;
+};
+
+// Files of a job, read while the job before it runs
+// Buffers are kept for the next job to use this slot
+struct Prefetch {
+    struct FileRequest program;  // No `path` if it should already be loaded
+    struct FileRequest input;    // No `path` if the job has no input file
+};
+
+// Start reading the files of `job`, which runs after `previous`
+void prefetch(
+    struct FileQueue *const files,
+    struct Prefetch *const prefetch,
+    const struct BatchJob *const job,
+    const struct BatchJob *const previous
+) {
+    prefetch->program.path = NULL;
+    if (previous == NULL || strcmp(previous->filename, job->filename) != 0) {
+        prefetch->program.path = job->filename;
+        file_queue_read(files, &prefetch->program);
+    }
+    prefetch->input.path = job->input_filename;
+    if (prefetch->input.path != NULL)
+        file_queue_read(files, &prefetch->input);
+}
+
+// Wait for the files of a job
+// Returns false if one could not be read
+bool finish_prefetch(
+    struct Worker *const worker, struct Prefetch *const prefetch
+) {
+    bool ok = true;
+    struct FileRequest *const requests[] = {
+        &prefetch->program,
+        &prefetch->input,
+    };
+    for (size_t i = 0; i < sizeof(requests) / sizeof(requests[0]); ++i) {
+        if (requests[i]->path == NULL)
+            continue;
+        if (file_queue_wait(worker->files, requests[i]))
+            ++worker->stats.prefetched;
+        if (requests[i]->error != 0) {
+            fprintf(stderr, "Failed to read %s.\n", requests[i]->path);
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+void load_job(
+    struct BatchJob *const job,
+    const struct Prefetch *const prefetch,
+    struct LoadedProgram *const loaded
+) {
+    if (loaded->filename != NULL &&
+        strcmp(loaded->filename, job->filename) == 0) {
+        memcpy(memory, loaded->memory, sizeof(memory));
+        reset_state(loaded->origin);
+        return;
+    }
+    memset(memory, 0, sizeof(memory));
+    // Not read ahead if the job before was expected to load it, but failed
+    job->error = prefetch->program.path == NULL
+                     ? load_file(job->filename)
+                     : load_data(
+                           job->filename,
+                           prefetch->program.data,
+                           prefetch->program.length
+                       );
+    if (job->error != ERR_OK)
+        return;
+    memcpy(loaded->memory, memory, sizeof(memory));
+    loaded->filename = job->filename;
+    loaded->origin = pc;
+}
+
+void run_job(
+    struct Worker *const worker,
+    struct BatchJob *const job,
+    struct Prefetch *const prefetch,
+    struct LoadedProgram *const loaded,
+    struct JobIo *const job_io
+) {
+    if (!finish_prefetch(worker, prefetch)) {
+        job->error = ERR_FILE;
+        return;
+    }
+    load_job(job, prefetch, loaded);
+    if (job->error != ERR_OK)
+        return;
+
+    const struct BatchOptions *const options = worker->batch->options;
+    job_io->input = (struct InputBuffer){0};
+    if (job->input_filename != NULL) {
+        job_io->input.data = prefetch->input.data;
+        job_io->input.length = prefetch->input.length;
+    } else if (options->input != NULL) {
+        job_io->input = *options->input;
+        job_io->input.position = 0;
+    }
+    job_io->output_hash = FNV_OFFSET;
+    job_io->keep_output = job->output_filename != NULL;
+    job->error = options->engine->execute();
+    job->instructions = instructions_retired;
+    job->output_hash = job_io->output_hash;
+
+    // Written while the next job runs; the queue frees the buffer after
+    if (job_io->keep_output) {
+        file_queue_write(
+            worker->files,
+            job->output_filename,
+            job_io->output,
+            job_io->output_length
+        );
+        job_io->output = NULL;
+        job_io->output_length = 0;
+        job_io->output_capacity = 0;
+    }
+}
+
+void *worker_main(void *const argument) {
+    struct Worker *const worker = argument;
+    const struct Batch *const batch = worker->batch;
+    const struct BatchOptions *const options = batch->options;
+
+    if (options->cpu_count > 0) {
+        const int cpu = options->cpus[worker->id % options->cpu_count];
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+            fprintf(stderr, "Failed to pin worker to CPU %d.\n", cpu);
+    }
+
+    struct JobIo job_io = {0};
+    io.read_char = job_read_char;
+    io.write_char = job_write_char;
+    io.flush = flush_nothing;
+    io.context = &job_io;
+    io.read = job_read;
+    io.write = job_write;
+    io.input_ready = NULL;
+
+    struct LoadedProgram loaded = {0};
+    loaded.memory = aligned_alloc(CACHE_LINE, sizeof(memory));
+    assert(loaded.memory != NULL, "Out of memory");
+
+    worker->files = file_queue_create();
+    struct Prefetch prefetches[2] = {0};
+    int current = 0;
+
+    // Only jobs from this worker's own deque are read ahead; others are
+    // stolen once this worker is free, so they stay with their owner until
+    // then
+    struct BatchStats *const stats = &worker->stats;
+    size_t index = deque_pop(&worker->deque);
+    const struct BatchJob *previous = NULL;
+    while (true) {
+        if (index == DEQUE_EMPTY) {
+            index = steal(worker);
+            if (index == DEQUE_EMPTY)
+                break;
+            ++stats->stolen;
+            prefetch(
+                worker->files,
+                &prefetches[current],
+                &batch->jobs[index],
+                previous
+            );
+        } else if (previous == NULL) {
+            prefetch(
+                worker->files, &prefetches[current], &batch->jobs[index], NULL
+            );
+        }
+        struct BatchJob *const job = &batch->jobs[index];
+        const size_t next = deque_pop(&worker->deque);
+        if (next != DEQUE_EMPTY)
+            prefetch(
+                worker->files, &prefetches[!current], &batch->jobs[next], job
+            );
+
+        const uint64_t start = perf_now();
+        run_job(worker, job, &prefetches[current], &loaded, &job_io);
+        stats->busy_ns += perf_now() - start;
+        ++stats->jobs;
+        stats->instructions += job->instructions;
+        if (job->error != ERR_OK)
+            ++stats->failed;
+
+        previous = job;
+        current = !current;
+        index = next;
+    }
+
+    stats->failed_writes = file_queue_drain(worker->files);
+    stats->io_backend = file_queue_backend(worker->files);
+    file_queue_destroy(worker->files);
+    for (int i = 0; i < 2; ++i) {
+        free(prefetches[i].program.data);
+        free(prefetches[i].input.data);
+    }
+    free(loaded.memory);
+    return NULL;
+}
+
+void batch_run(
+    struct BatchJob *const jobs,
+    const size_t job_count,
+    const struct BatchOptions *const options,
+    struct BatchStats *const total,
+    struct BatchStats *const per_worker
+) {
+    struct Batch batch = {jobs, options, NULL, options->workers};
+    assert(
+        batch.worker_count > 0 && batch.worker_count <= MAX_WORKERS,
+        "Invalid worker count %d",
+        batch.worker_count
+    );
+    batch.workers =
+        aligned_alloc(CACHE_LINE, batch.worker_count * sizeof(struct Worker));
+    assert(batch.workers != NULL, "Out of memory");
+
+    // Each worker starts with a contiguous block of jobs, so runs of the
+    // same program stay on one worker
+    const size_t per_block = job_count / batch.worker_count + 1;
+    size_t capacity = 1;
+    while (capacity < per_block)
+        capacity *= 2;
+    for (int i = 0; i < batch.worker_count; ++i) {
+        struct Worker *const worker = &batch.workers[i];
+        memset(worker, 0, sizeof(*worker));
+        worker->id = i;
+        worker->batch = &batch;
+        worker->deque.mask = capacity - 1;
+        worker->deque.jobs = calloc(capacity, sizeof(*worker->deque.jobs));
+        assert(worker->deque.jobs != NULL, "Out of memory");
+
+        // Pushed in reverse, so the owner pops them in order
+        const size_t start = job_count * i / batch.worker_count;
+        const size_t end = job_count * (i + 1) / batch.worker_count;
+        for (size_t job = end; job > start; --job)
+            deque_push(&worker->deque, job - 1);
+    }
+
+    for (int i = 0; i < batch.worker_count; ++i) {
+        const int error = pthread_create(
+            &batch.workers[i].thread, NULL, worker_main, &batch.workers[i]
+        );
+        assert(error == 0, "Failed to create worker thread");
+    }
+
+    memset(total, 0, sizeof(*total));
+    for (int i = 0; i < batch.worker_count; ++i) {
+        const struct Worker *const worker = &batch.workers[i];
+        (void)pthread_join(worker->thread, NULL);
+        const struct BatchStats *const stats = &worker->stats;
+        total->jobs += stats->jobs;
+        total->failed += stats->failed;
+        total->stolen += stats->stolen;
+        total->instructions += stats->instructions;
+        total->busy_ns += stats->busy_ns;
+        total->prefetched += stats->prefetched;
+        total->failed_writes += stats->failed_writes;
+        total->io_backend = stats->io_backend;
+        if (per_worker != NULL)
+            per_worker[i] = *stats;
+        free(worker->deque.jobs);
+    }
+    free(batch.workers);
+}
+
+int parse_cpu_list(const char *list, int *const cpus, const int max_cpus) {
+    int count = 0;
+    while (true) {
+        char *end;
+        const long first = strtol(list, &end, 10);
+        if (end == list || first < 0 || first >= CPU_SETSIZE)
+            return -1;
+        long last = first;
+        list = end;
+        if (*list == '-') {
+            ++list;
+            last = strtol(list, &end, 10);
+            if (end == list || last < first || last >= CPU_SETSIZE)
+                return -1;
+            list = end;
+        }
+        for (long cpu = first; cpu <= last; ++cpu) {
+            if (count == max_cpus)
+                return -1;
+            cpus[count++] = (int)cpu;
+        }
+        if (*list == '\0')
+            return count;
+        if (*list++ != ',')
+            return -1;
+    }
+}
@@ -0,0 +1,66 @@
+// Running many programs in parallel
+// Each worker thread has its own VM (see `vm.h`), optionally pinned to one
+// CPU, and its own work-stealing deque of jobs: a worker takes jobs from the
+// bottom of its own deque, and steals from the top of others' when it runs
+// out. Workers share nothing else while running; their statistics are kept
+// apart and only merged at the end.
+// Files are read and written asynchronously (see `fileio.h`): while a worker
+// runs one job, the program and input of its next job are being read, and
+// the output of its previous job is being written.
+
+#ifndef BATCH_H
+#define BATCH_H
+
+// Libc
+#include <stddef.h>  // size_t
+#include <stdint.h>  // uint64_t
+// Local
+#include "vm.h"  // struct Engine, etc
+
+#define MAX_WORKERS 256
+
+// One program to run, and its results
+struct BatchJob {
+    const char *filename;
+    const char *input_filename;   // Instead of `BatchOptions.input`, if set
+    const char *output_filename;  // Written with everything output, if set
+    enum Error error;
+    uint64_t instructions;
+    uint64_t output_hash;  // FNV-1a of everything output
+};
+
+struct BatchOptions {
+    const struct Engine *engine;
+    int workers;
+    const int *cpus;  // Worker `i` is pinned to `cpus[i % cpu_count]`
+    int cpu_count;    // Not pinned if 0
+    // Every job reads this input from the start, if not NULL
+    const struct InputBuffer *input;
+};
+
+struct BatchStats {
+    uint64_t jobs;
+    uint64_t failed;
+    uint64_t stolen;  // Jobs taken from another worker's deque
+    uint64_t instructions;
+    uint64_t busy_ns;     // Time spent running jobs
+    uint64_t prefetched;  // Files which were read before a job needed them
+    uint64_t failed_writes;
+    const char *io_backend;  // See `file_queue_backend`
+};
+
+// Run every job, and merge the statistics of each worker into `total`
+// `per_worker` may be NULL, otherwise it has an entry for each worker
+void batch_run(
+    struct BatchJob *jobs,
+    size_t job_count,
+    const struct BatchOptions *options,
+    struct BatchStats *total,
+    struct BatchStats *per_worker
+);
+
+// Parse a list of CPUs like `0-3,8,10-11`
+// Returns the number of CPUs, or -1 if the list is invalid
+int parse_cpu_list(const char *list, int *cpus, int max_cpus);
+
+#endif
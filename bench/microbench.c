@@ -0,0 +1,334 @@
+// Per-handler microbenchmarks
+// Each stream is a synthetic program which stresses one instruction handler:
+// the instruction under test is unrolled `UNROLL` times inside a counted
+// loop, so about 2 of every `UNROLL + 2` instructions are loop overhead.
+// Every stream is run once on every engine.
+
+// Libc
+#include <stdbool.h>  // bool
+#include <stdio.h>    // printf, etc
+#include <stdlib.h>   // strtoul
+#include <string.h>   // strcmp, strncmp, memset
+// Local
+#include "../perf.h"
+#include "../vm.h"
+
+#define ORIGIN 0x3000
+#define UNROLL 64
+// Start of the area used by streams for data and subroutines
+#define DATA 0x3100
+// Start of the area used by pointer-walking streams
+#define HEAP 0x4000
+#define HEAP_NODES 0x1000
+
+// Loop iterations are split into an inner and outer loop, since a register
+// can only count to 0x7fff
+#define INNER_ITERATIONS 1024
+#define DEFAULT_ITERATIONS (1 << 18)
+
+// Registers used as loop counters; streams must not write to these
+#define INNER_REG 6
+#define OUTER_REG 5
+
+// Instruction encoders
+Word encode_add_imm(int dest, int src, int imm) {
+    return OP_ADD << 12 | dest << 9 | src << 6 | 0x20 | (imm & 0x1f);
+}
+Word encode_not(int dest, int src) {
+    return OP_NOT << 12 | dest << 9 | src << 6 | 0x3f;
+}
+Word encode_pc_offset_9(enum Opcode opcode, int reg, Word from, Word to) {
+    return opcode << 12 | reg << 9 | ((to - (from + 1)) & 0x1ff);
+}
+Word encode_base_offset_6(enum Opcode opcode, int reg, int base, int offset) {
+    return opcode << 12 | reg << 9 | base << 6 | (offset & 0x3f);
+}
+Word encode_br(int condition, Word from, Word to) {
+    return OP_BR << 12 | condition << 9 | ((to - (from + 1)) & 0x1ff);
+}
+Word encode_jsr(Word from, Word to) {
+    return OP_JSR_JSRR << 12 | 1 << 11 | ((to - (from + 1)) & 0x7ff);
+}
+
+#define COND_N 0x4
+#define COND_P 0x1
+
+// Fill in the body of the loop; `address` is where the instruction goes
+typedef Word (*Generator)(int slot, Word address);
+
+Word gen_add_dependent(const int slot, const Word address) {
+    (void)slot, (void)address;
+    return encode_add_imm(1, 1, 1);
+}
+Word gen_add_independent(const int slot, const Word address) {
+    (void)address;
+    return encode_add_imm(slot % 4 + 1, 0, 1);
+}
+Word gen_not(const int slot, const Word address) {
+    (void)slot, (void)address;
+    return encode_not(1, 1);
+}
+Word gen_lea(const int slot, const Word address) {
+    (void)slot;
+    return encode_pc_offset_9(OP_LEA, 1, address, DATA);
+}
+Word gen_ld(const int slot, const Word address) {
+    (void)slot;
+    return encode_pc_offset_9(OP_LD, 1, address, DATA);
+}
+Word gen_ldi(const int slot, const Word address) {
+    (void)slot;
+    return encode_pc_offset_9(OP_LDI, 1, address, DATA);
+}
+Word gen_st(const int slot, const Word address) {
+    (void)slot;
+    return encode_pc_offset_9(OP_ST, 2, address, DATA);
+}
+Word gen_sti(const int slot, const Word address) {
+    (void)slot;
+    return encode_pc_offset_9(OP_STI, 2, address, DATA);
+}
+Word gen_ldr_walk(const int slot, const Word address) {
+    (void)slot, (void)address;
+    return encode_base_offset_6(OP_LDR, 1, 1, 0);
+}
+Word gen_str(const int slot, const Word address) {
+    (void)address;
+    return encode_base_offset_6(OP_STR, 2, 1, slot % 32);
+}
+// Branches always go to the next instruction, so only the condition differs.
+// The condition code is always positive inside the loop
+Word gen_br_taken_0(const int slot, const Word address) {
+    (void)slot;
+    return encode_br(COND_N, address, address + 1);
+}
+Word gen_br_taken_50(const int slot, const Word address) {
+    return encode_br(slot % 2 ? COND_P : COND_N, address, address + 1);
+}
+Word gen_br_taken_100(const int slot, const Word address) {
+    (void)slot;
+    return encode_br(COND_P, address, address + 1);
+}
+Word gen_br_random_50(const int slot, const Word address) {
+    // Fixed pseudo-random pattern, so every run is identical
+    const bool taken = (0x9e3779b97f4a7c15ULL >> slot) & 1;
+    return encode_br(taken ? COND_P : COND_N, address, address + 1);
+}
+Word gen_jsr_ret(const int slot, const Word address) {
+    (void)slot;
+    return encode_jsr(address, DATA);
+}
+
+// Set up data used by the loop body
+typedef void (*Setup)();
+
+void setup_none() {
+}
+void setup_ldi() {
+    memory[DATA] = HEAP;
+    memory[HEAP] = 1;
+}
+void setup_sti() {
+    memory[DATA] = HEAP;
+}
+void setup_ldr_walk() {
+    // Ring of nodes in a shuffled order, spread out to defeat prefetching
+    static Word order[HEAP_NODES];
+    for (int i = 0; i < HEAP_NODES; ++i)
+        order[i] = (Word)i;
+    unsigned seed = 1;
+    for (int i = HEAP_NODES - 1; i > 0; --i) {
+        seed = seed * 1103515245 + 12345;
+        const int j = (int)((seed >> 8) % (unsigned)(i + 1));
+        const Word swap = order[i];
+        order[i] = order[j];
+        order[j] = swap;
+    }
+    for (int i = 0; i < HEAP_NODES; ++i) {
+        const Word node = HEAP + order[i] * 8;
+        const Word next = HEAP + order[(i + 1) % HEAP_NODES] * 8;
+        memory[node] = next;
+    }
+    registers[1] = HEAP + order[0] * 8;
+}
+void setup_str() {
+    registers[1] = HEAP;
+}
+void setup_jsr_ret() {
+    memory[DATA] = 0xc1c0;  // RET
+}
+
+struct Stream {
+    const char *name;
+    Generator generate;
+    Setup setup;
+};
+
+static const struct Stream streams[] = {
+    {"add-dep", gen_add_dependent, setup_none},
+    {"add-indep", gen_add_independent, setup_none},
+    {"not", gen_not, setup_none},
+    {"lea", gen_lea, setup_none},
+    {"ld", gen_ld, setup_none},
+    {"ldi", gen_ldi, setup_ldi},
+    {"ldr-walk", gen_ldr_walk, setup_ldr_walk},
+    {"st", gen_st, setup_none},
+    {"sti", gen_sti, setup_sti},
+    {"str", gen_str, setup_str},
+    {"br-taken-0", gen_br_taken_0, setup_none},
+    {"br-taken-50", gen_br_taken_50, setup_none},
+    {"br-taken-100", gen_br_taken_100, setup_none},
+    {"br-random-50", gen_br_random_50, setup_none},
+    {"jsr-ret", gen_jsr_ret, setup_jsr_ret},
+};
+static const size_t stream_count = sizeof(streams) / sizeof(streams[0]);
+
+// Write the stream's program into memory and reset registers
+// Layout:
+//     outer:  LD R6, inner_count
+//     inner:  (UNROLL instructions)
+//             ADD R6, R6, #-1
+//             BRp inner
+//             ADD R5, R5, #-1
+//             BRp outer
+//             HALT
+//     inner_count: .FILL INNER_ITERATIONS
+void load_stream(const struct Stream *const stream, const Word outer_count) {
+    memset(memory, 0, sizeof(memory));
+    for (int i = 0; i < 8; ++i)
+        registers[i] = 0;
+
+    const Word outer = ORIGIN;
+    const Word inner = ORIGIN + 1;
+    const Word inner_count = inner + UNROLL + 5;
+    Word address = inner;
+    for (int slot = 0; slot < UNROLL; ++slot, ++address)
+        memory[address] = stream->generate(slot, address);
+    memory[address] = encode_add_imm(INNER_REG, INNER_REG, -1);
+    ++address;
+    memory[address] = encode_br(COND_P, address, inner);
+    ++address;
+    memory[address] = encode_add_imm(OUTER_REG, OUTER_REG, -1);
+    ++address;
+    memory[address] = encode_br(COND_P, address, outer);
+    ++address;
+    memory[address] = OP_TRAP << 12 | TRAP_HALT;
+    memory[outer] = encode_pc_offset_9(OP_LD, INNER_REG, outer, inner_count);
+    memory[inner_count] = INNER_ITERATIONS;
+
+    stream->setup();
+    registers[OUTER_REG] = outer_count;
+    pc = ORIGIN;
+    cc = COND_P;
+    instructions_retired = 0;
+    // Translations of the previous stream are stale
+    if (code_watch != NULL)
+        code_watch(0, MEMORY_SIZE);
+}
+
+// Print a counter per guest instruction, or a placeholder if unavailable
+void print_ratio(
+    const struct PerfCounters *const counters, const enum PerfEvent event
+) {
+    if (!perf_available(counters, event) || instructions_retired == 0) {
+        printf("  %12s", "-");
+        return;
+    }
+    printf(
+        "  %12.3f",
+        (double)counters->values[event] / (double)instructions_retired
+    );
+}
+
+bool run_stream(
+    const struct Stream *const stream,
+    const struct Engine *const engine,
+    const Word outer_count
+) {
+    load_stream(stream, outer_count);
+
+    struct PerfCounters counters;
+    perf_open(&counters);
+    perf_start(&counters);
+    const enum Error error = engine->execute();
+    perf_stop(&counters);
+    perf_close(&counters);
+    if (error != ERR_OK) {
+        fprintf(stderr, "Stream %s failed on %s\n", stream->name, engine->name);
+        return false;
+    }
+
+    const double nanoseconds = (double)counters.nanoseconds;
+    printf(
+        "%-14s%-10s%10.3f%10.1f",
+        stream->name,
+        engine->name,
+        nanoseconds / (double)instructions_retired,
+        (double)instructions_retired / nanoseconds * 1e3
+    );
+    print_ratio(&counters, PERF_CYCLES);
+    print_ratio(&counters, PERF_BRANCH_MISSES);
+    printf("\n");
+    return true;
+}
+
+int main(const int argc, const char *const *const argv) {
+    unsigned long iterations = DEFAULT_ITERATIONS;
+    bool selected[sizeof(streams) / sizeof(streams[0])] = {false};
+    bool any_selected = false;
+
+    for (int i = 1; i < argc; ++i) {
+        if (strncmp(argv[i], "--iterations=", 13) == 0) {
+            iterations = strtoul(argv[i] + 13, NULL, 0);
+            continue;
+        }
+        if (strcmp(argv[i], "--list") == 0) {
+            for (size_t j = 0; j < stream_count; ++j)
+                printf("%s\n", streams[j].name);
+            return ERR_OK;
+        }
+        bool found = false;
+        for (size_t j = 0; j < stream_count; ++j) {
+            if (strcmp(argv[i], streams[j].name) == 0) {
+                selected[j] = found = any_selected = true;
+            }
+        }
+        if (!found) {
+            fprintf(
+                stderr,
+                "Usage: minilc3-microbench [--iterations=N] [--list] "
+                "[STREAM...]\n"
+            );
+            return ERR_CLI;
+        }
+    }
+    // Outer loop counter is a positive signed word
+    const unsigned long outer_count = iterations / INNER_ITERATIONS;
+    if (outer_count == 0 || outer_count > 0x7fff) {
+        fprintf(
+            stderr,
+            "Iterations must be between %d and %d.\n",
+            INNER_ITERATIONS,
+            INNER_ITERATIONS * 0x7fff
+        );
+        return ERR_CLI;
+    }
+
+    printf(
+        "%-14s%-10s%10s%10s  %12s  %12s\n",
+        "stream",
+        "engine",
+        "ns/instr",
+        "MIPS",
+        "cycles/instr",
+        "misses/instr"
+    );
+    bool ok = true;
+    for (size_t i = 0; i < stream_count; ++i) {
+        if (any_selected && !selected[i])
+            continue;
+        for (size_t j = 0; j < engine_count; ++j)
+            ok &= run_stream(&streams[i], &engines[j], (Word)outer_count);
+    }
+    return ok ? ERR_OK : ERR_INSTRUCTION;
+}
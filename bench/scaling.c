@@ -0,0 +1,221 @@
+// Batch scaling benchmark
+// Runs the same batch of compute-bound jobs with 1 to N workers, each pinned
+// to its own CPU, and reports throughput and speedup over one worker.
+// With `--preload`, instead reports how long the jit engine takes to
+// translate images of growing size ahead of time, on 1 to N threads.
+
+// Libc
+#include <stdbool.h>  // bool
+#include <stdio.h>    // printf, etc
+#include <stdlib.h>   // strtoul
+#include <string.h>   // strcmp, strncmp
+// POSIX
+#include <unistd.h>  // mkstemp, sysconf, write
+// Local
+#include "../batch.h"
+#include "../jit.h"
+#include "../perf.h"
+#include "../vm.h"
+
+#define ORIGIN 0x3000
+#define DEFAULT_JOBS 64
+#define DEFAULT_ITERATIONS 64  // Of the outer loop; about 200K instructions
+#define MAX_JOBS 100000
+#define PRELOAD_REPEATS 5  // Of each preload, keeping the fastest
+
+// Write a program which counts down two nested loops, then halts
+// Returns false if the file could not be written
+bool write_program(const int file, const unsigned long iterations) {
+    const Word program[] = {
+        ORIGIN,
+        0x5260,  // AND R1, R1, #0
+        0x2607,  // LD R3, OUTER
+        0x2407,  // LD R2, INNER      ; Outer loop
+        0x1261,  // ADD R1, R1, #1    ; Inner loop
+        0x14bf,  // ADD R2, R2, #-1
+        0x03fd,  // BRp (inner loop)
+        0x16ff,  // ADD R3, R3, #-1
+        0x03fa,  // BRp (outer loop)
+        0xf025,  // HALT
+        (Word)iterations,  // OUTER
+        0x0400,            // INNER
+    };
+    // Object files are big-endian
+    unsigned char bytes[sizeof(program)];
+    for (size_t i = 0; i < sizeof(program) / sizeof(Word); ++i) {
+        bytes[i * 2] = (unsigned char)(program[i] >> 8);
+        bytes[i * 2 + 1] = (unsigned char)program[i];
+    }
+    return write(file, bytes, sizeof(bytes)) == (ssize_t)sizeof(bytes);
+}
+
+// Fill `size` words from `ORIGIN` with a chain of 8-word blocks, each
+// falling through to the next and branching over it, then HALT
+void generate_image(const size_t size) {
+    const Word block[] = {
+        0x1261,  // ADD R1, R1, #1
+        0x1481,  // ADD R2, R2, R1
+        0x56a7,  // AND R3, R2, #7
+        0x7380,  // STR R1, R6, #0
+        0x6981,  // LDR R4, R6, #1
+        0x9b3f,  // NOT R5, R4
+        0x103f,  // ADD R0, R0, #-1
+        0x0808,  // BRn (next block but one)
+    };
+    const size_t length = sizeof(block) / sizeof(Word);
+    for (size_t i = 0; i < size - 1; ++i)
+        memory[ORIGIN + i] = block[i % length];
+    memory[ORIGIN + size - 1] = 0xf025;  // HALT
+    // The last branches would go past the end
+    for (size_t i = length - 1; i < size - 1; i += length) {
+        if (i + 1 + length >= size - 1)
+            memory[ORIGIN + i] = 0x0800;  // BRn (next word)
+    }
+}
+
+// 1, 2, 4, etc, and finally `max`
+long next_thread_count(const long threads, const long max) {
+    return threads < max && threads * 2 > max ? max : threads * 2;
+}
+
+// Time translating images of growing size ahead of time
+int report_preload(const long max_threads) {
+    const size_t sizes[] = {1024, 4096, 16384, 49152};
+    printf(
+        "%-10s%10s%10s%12s%14s%10s\n",
+        "Words",
+        "Blocks",
+        "Threads",
+        "Time (ms)",
+        "Blocks/ms",
+        "Speedup"
+    );
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        generate_image(sizes[i]);
+        double baseline = 0;
+        for (long threads = 1; threads <= max_threads;
+             threads = next_thread_count(threads, max_threads)) {
+            uint64_t best = UINT64_MAX;
+            size_t blocks = 0;
+            for (int repeat = 0; repeat < PRELOAD_REPEATS; ++repeat) {
+                reset_state(ORIGIN);  // Throws earlier translations away
+                const uint64_t start = perf_now();
+                blocks = jit_preload((unsigned)threads);
+                const uint64_t elapsed = perf_now() - start;
+                if (elapsed < best)
+                    best = elapsed;
+            }
+            if (blocks == 0) {
+                fprintf(stderr, "The jit engine is not available.\n");
+                return ERR_INSTRUCTION;
+            }
+            const double milliseconds = best / 1e6;
+            if (threads == 1)
+                baseline = milliseconds;
+            printf(
+                "%-10zu%10zu%10ld%12.3f%14.1f%9.2fx\n",
+                sizes[i],
+                blocks,
+                threads,
+                milliseconds,
+                blocks / milliseconds,
+                baseline / milliseconds
+            );
+        }
+    }
+    return ERR_OK;
+}
+
+int main(const int argc, const char *const *const argv) {
+    unsigned long jobs = DEFAULT_JOBS;
+    unsigned long iterations = DEFAULT_ITERATIONS;
+    long max_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    bool preload = false;
+    bool valid = true;
+    for (int i = 1; i < argc; ++i) {
+        if (strncmp(argv[i], "--jobs=", 7) == 0)
+            jobs = strtoul(argv[i] + 7, NULL, 0);
+        else if (strncmp(argv[i], "--iterations=", 13) == 0)
+            iterations = strtoul(argv[i] + 13, NULL, 0);
+        else if (strncmp(argv[i], "--max-workers=", 14) == 0)
+            max_workers = (long)strtoul(argv[i] + 14, NULL, 0);
+        else if (strcmp(argv[i], "--preload") == 0)
+            preload = true;
+        else
+            valid = false;
+    }
+    if (!valid || jobs == 0 || jobs > MAX_JOBS || iterations == 0 ||
+        iterations > 0x7fff || max_workers <= 0 || max_workers > MAX_WORKERS) {
+        fprintf(
+            stderr,
+            "Usage: minilc3-scaling [--jobs=N] [--iterations=N] "
+            "[--max-workers=N] [--preload]\n"
+        );
+        return ERR_CLI;
+    }
+    if (preload)
+        return report_preload(max_workers);
+
+    char filename[] = "/tmp/minilc3-scaling-XXXXXX";
+    const int file = mkstemp(filename);
+    if (file < 0 || !write_program(file, iterations)) {
+        fprintf(stderr, "Failed to write program.\n");
+        return ERR_FILE;
+    }
+    (void)close(file);
+
+    struct BatchJob *const batch = calloc(jobs, sizeof(struct BatchJob));
+    assert(batch != NULL, "Out of memory");
+    int cpus[MAX_WORKERS];
+    for (int i = 0; i < MAX_WORKERS; ++i)
+        cpus[i] = i;
+
+    printf(
+        "%-10s%14s%18s%10s%12s\n",
+        "Workers",
+        "Jobs/s",
+        "Instructions/s",
+        "Speedup",
+        "Efficiency"
+    );
+    double baseline = 0;
+    for (long workers = 1; workers <= max_workers; ++workers) {
+        for (unsigned long i = 0; i < jobs; ++i) {
+            batch[i] = (struct BatchJob){0};
+            batch[i].filename = filename;
+        }
+        const struct BatchOptions options = {
+            &engines[0],
+            (int)workers,
+            cpus,
+            (int)workers,
+            NULL,
+        };
+        struct BatchStats total;
+        const uint64_t start = perf_now();
+        batch_run(batch, jobs, &options, &total, NULL);
+        const double seconds = (perf_now() - start) / 1e9;
+        if (total.failed > 0) {
+            fprintf(stderr, "Jobs failed.\n");
+            (void)unlink(filename);
+            return ERR_INSTRUCTION;
+        }
+
+        const double jobs_per_second = total.jobs / seconds;
+        if (workers == 1)
+            baseline = jobs_per_second;
+        const double speedup = jobs_per_second / baseline;
+        printf(
+            "%-10ld%14.1f%18.0f%9.2fx%11.0f%%\n",
+            workers,
+            jobs_per_second,
+            total.instructions / seconds,
+            speedup,
+            speedup / workers * 100
+        );
+    }
+
+    free(batch);
+    (void)unlink(filename);
+    return ERR_OK;
+}
@@ -0,0 +1,217 @@
+// Startup latency benchmark
+// Spawns minilc3 many times with `--timings`, and splits the time from exec
+// to exit into phases using the timestamps which minilc3 prints. Both the
+// normal and fast-start builds are compared by default.
+
+// Libc
+#include <inttypes.h>  // PRIu64, SCNu64
+#include <stdbool.h>   // bool
+#include <stdio.h>     // printf, etc
+#include <stdlib.h>    // qsort, strtoul
+#include <string.h>    // strcmp, strncmp
+// POSIX
+#include <fcntl.h>     // O_WRONLY
+#include <spawn.h>     // posix_spawn, etc
+#include <sys/wait.h>  // waitpid
+#include <unistd.h>    // access, pipe, read
+// Local
+#include "../perf.h"
+#include "../vm.h"
+
+#define DEFAULT_RUNS 200
+#define MAX_RUNS 100000
+#define MAX_BINARIES 8
+// End-to-end time we are aiming for
+#define TARGET_MICROSECONDS 200
+
+extern char **environ;
+
+// Phases between consecutive timestamps
+enum Phase {
+    PHASE_EXEC,     // Spawn to `main`: exec, dynamic linking, libc start
+    PHASE_LOAD,     // Reading the object file
+    PHASE_SETUP,    // Anything between loading and the first instruction
+    PHASE_EXECUTE,  // Running the program, including its output
+    PHASE_FLUSH,    // Halt until about to return from `main`
+    PHASE_EXIT,     // Returning from `main` until the process is reaped
+    PHASE_TOTAL,
+    PHASE_COUNT,
+};
+
+static const char *const phase_names[PHASE_COUNT] = {
+    "exec->main",
+    "load",
+    "setup",
+    "execute",
+    "halt->return",
+    "return->exit",
+    "total",
+};
+
+// Timestamps printed by `minilc3 --timings`, in order
+enum Timestamp {
+    STAMP_SPAWN,
+    STAMP_MAIN,
+    STAMP_LOADED,
+    STAMP_FIRST_INSTRUCTION,
+    STAMP_HALT,
+    STAMP_RETURN,
+    STAMP_REAPED,
+    STAMP_COUNT,
+};
+
+// Run the binary once, and fill in the timestamps
+bool run_once(
+    const char *const binary,
+    const char *const filename,
+    uint64_t *const stamps
+) {
+    int timings_pipe[2];
+    if (pipe(timings_pipe) < 0) {
+        perror("pipe");
+        return false;
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(
+        &actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0
+    );
+    posix_spawn_file_actions_adddup2(&actions, timings_pipe[1], STDERR_FILENO);
+    posix_spawn_file_actions_addclose(&actions, timings_pipe[0]);
+    posix_spawn_file_actions_addclose(&actions, timings_pipe[1]);
+
+    char *const argv[] = {
+        (char *)binary, "--timings", (char *)filename, NULL
+    };
+    pid_t child;
+    stamps[STAMP_SPAWN] = perf_now();
+    const int spawn_error =
+        posix_spawn(&child, binary, &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    (void)close(timings_pipe[1]);
+    if (spawn_error != 0) {
+        fprintf(stderr, "Failed to spawn %s\n", binary);
+        (void)close(timings_pipe[0]);
+        return false;
+    }
+
+    int status;
+    (void)waitpid(child, &status, 0);
+    stamps[STAMP_REAPED] = perf_now();
+
+    char output[512];
+    const ssize_t length = read(timings_pipe[0], output, sizeof(output) - 1);
+    (void)close(timings_pipe[0]);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != ERR_OK || length <= 0) {
+        fprintf(stderr, "%s failed to run %s\n", binary, filename);
+        return false;
+    }
+    output[length] = '\0';
+
+    const char *const line = strstr(output, "timings:");
+    if (line == NULL ||
+        sscanf(
+            line,
+            "timings: %" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64
+            " %" SCNu64,
+            &stamps[STAMP_MAIN],
+            &stamps[STAMP_LOADED],
+            &stamps[STAMP_FIRST_INSTRUCTION],
+            &stamps[STAMP_HALT],
+            &stamps[STAMP_RETURN]
+        ) != 5) {
+        fprintf(stderr, "%s did not print timings\n", binary);
+        return false;
+    }
+    return true;
+}
+
+int compare_u64(const void *const a, const void *const b) {
+    const uint64_t left = *(const uint64_t *)a;
+    const uint64_t right = *(const uint64_t *)b;
+    return (left > right) - (left < right);
+}
+
+// Time every phase over all runs, and print min/median/p99 of each
+bool benchmark(
+    const char *const binary,
+    const char *const filename,
+    const unsigned long runs
+) {
+    static uint64_t durations[PHASE_COUNT][MAX_RUNS];
+    for (unsigned long run = 0; run < runs; ++run) {
+        uint64_t stamps[STAMP_COUNT];
+        if (!run_once(binary, filename, stamps))
+            return false;
+        for (int phase = 0; phase < PHASE_TOTAL; ++phase)
+            durations[phase][run] = stamps[phase + 1] - stamps[phase];
+        durations[PHASE_TOTAL][run] =
+            stamps[STAMP_REAPED] - stamps[STAMP_SPAWN];
+    }
+
+    printf("%s (%lu runs)\n", binary, runs);
+    printf("  %-14s%10s%10s%10s\n", "phase (us)", "min", "median", "p99");
+    for (int phase = 0; phase < PHASE_COUNT; ++phase) {
+        qsort(durations[phase], runs, sizeof(uint64_t), compare_u64);
+        printf(
+            "  %-14s%10.1f%10.1f%10.1f\n",
+            phase_names[phase],
+            durations[phase][0] / 1e3,
+            durations[phase][runs / 2] / 1e3,
+            durations[phase][runs * 99 / 100] / 1e3
+        );
+    }
+    const double median = durations[PHASE_TOTAL][runs / 2] / 1e3;
+    printf(
+        "  median total is %s the %d us target\n",
+        median <= TARGET_MICROSECONDS ? "within" : "over",
+        TARGET_MICROSECONDS
+    );
+    return true;
+}
+
+int main(const int argc, const char *const *const argv) {
+    unsigned long runs = DEFAULT_RUNS;
+    const char *binaries[MAX_BINARIES];
+    int binary_count = 0;
+    const char *filename = NULL;
+
+    for (int i = 1; i < argc; ++i) {
+        if (strncmp(argv[i], "--runs=", 7) == 0) {
+            runs = strtoul(argv[i] + 7, NULL, 0);
+            continue;
+        }
+        if (strncmp(argv[i], "--binary=", 9) == 0 &&
+            binary_count < MAX_BINARIES) {
+            binaries[binary_count++] = argv[i] + 9;
+            continue;
+        }
+        // Invalid arguments
+        if (filename != NULL || argv[i][0] == '-' || argv[i][0] == '\0') {
+            filename = NULL;
+            break;
+        }
+        filename = argv[i];
+    }
+    if (filename == NULL || runs == 0 || runs > MAX_RUNS) {
+        fprintf(
+            stderr,
+            "Usage: minilc3-startup [--runs=N] [--binary=PATH]... FILE\n"
+        );
+        return ERR_CLI;
+    }
+
+    // Compare both builds, if they have been built
+    if (binary_count == 0) {
+        binaries[binary_count++] = "./minilc3";
+        if (access("./minilc3-fast", X_OK) == 0)
+            binaries[binary_count++] = "./minilc3-fast";
+    }
+
+    for (int i = 0; i < binary_count; ++i) {
+        if (!benchmark(binaries[i], filename, runs))
+            return ERR_FILE;
+    }
+    return ERR_OK;
+}
@@ -0,0 +1,221 @@
+#include "channel.h"
+
+// Libc
+#include <stdio.h>   // fprintf
+#include <stdlib.h>  // calloc, free
+// Local
+#include "pipe.h"  // pipe_read, etc
+#include "vm.h"    // attach_device, etc
+
+#define CHANNEL_PIPE_SIZE (8 << 10)  // Bytes; a power of 2
+
+// From VM `i` to VM `j` at `i * channel_count + j`
+static struct Pipe **channel_pipes = NULL;
+static size_t channel_count = 0;
+
+_Thread_local struct ChannelStats channel_stats;
+static _Thread_local size_t channel_self = 0;
+static _Thread_local bool channel_failed = false;
+
+// The channels between this VM and CHPEER, or false if there are none
+// A VM has no channel to itself, which could only wait for itself forever
+bool channel_peer(struct Pipe **const from, struct Pipe **const to) {
+    const size_t peer = memory[CHANNEL_CHPEER];
+    if (channel_pipes == NULL || peer >= channel_count ||
+        peer == channel_self) {
+        channel_failed = true;
+        return false;
+    }
+    *from = channel_pipes[peer * channel_count + channel_self];
+    *to = channel_pipes[channel_self * channel_count + peer];
+    return true;
+}
+
+// Whether the program may access every word of a buffer
+bool channel_buffer_allowed(
+    const Word address, const size_t words, const uint8_t permission
+) {
+    if (address + words > DEVICE_BASE)
+        return false;
+    if (words == 0)
+        return true;
+    const size_t last_page = (address + words - 1) >> PROTECTION_PAGE_SHIFT;
+    for (size_t page = address >> PROTECTION_PAGE_SHIFT; page <= last_page;
+         ++page) {
+        if (!user_may_access((Word)(page << PROTECTION_PAGE_SHIFT), permission))
+            return false;
+    }
+    return true;
+}
+
+// Move the buffer, and set CHCNT to the number of words moved
+// Returns false if the command is unknown, the buffer is out of range or not
+// allowed, or there is no CHPEER
+bool channel_transfer(const Word command) {
+    if (command < CHANNEL_SEND || command > CHANNEL_POLL)
+        return false;
+    struct Pipe *from;
+    struct Pipe *to;
+    if (!channel_peer(&from, &to))
+        return false;
+    const Word address = memory[CHANNEL_CHADR];
+    const size_t words = memory[CHANNEL_CHCNT];
+    const uint8_t permission = command == CHANNEL_SEND ? PERM_READ : PERM_WRITE;
+    if (!channel_buffer_allowed(address, words, permission))
+        return false;
+
+    char *const start = (char *)&memory[address];
+    const size_t size = words * sizeof(Word);
+    size_t moved = 0;
+    switch (command) {
+        case CHANNEL_SEND:
+            (void)pipe_write(to, start, size, &channel_stats.blocked_ns);
+            moved = size;
+            channel_stats.words_sent += words;
+            break;
+        case CHANNEL_RECEIVE:
+            moved = pipe_read(from, start, size, &channel_stats.starved_ns);
+            break;
+        case CHANNEL_POLL:
+            moved = pipe_read_some(from, start, size);
+            break;
+    }
+    if (command != CHANNEL_SEND) {
+        channel_stats.words_received += moved / sizeof(Word);
+        if (moved > 0 && code_watch != NULL)
+            code_watch(address, moved / sizeof(Word));
+    }
+    memory[CHANNEL_CHCNT] = (Word)(moved / sizeof(Word));
+    return true;
+}
+
+void channel_load(void *const data, const Word address) {
+    (void)data;
+    struct Pipe *from;
+    struct Pipe *to;
+    switch (address) {
+        case CHANNEL_CHID:
+            memory[CHANNEL_CHID] = (Word)channel_self;
+            break;
+        case CHANNEL_CHN:
+            memory[CHANNEL_CHN] = (Word)channel_count;
+            break;
+        case CHANNEL_CHSR: {
+            Word status = 0;
+            if (channel_peer(&from, &to)) {
+                if (pipe_available(from) >= sizeof(Word))
+                    status |= CHANNEL_DATA;
+                else if (pipe_ended(from))
+                    status |= CHANNEL_END;
+                if (pipe_room(to) >= sizeof(Word))
+                    status |= CHANNEL_ROOM;
+            }
+            if (channel_failed)
+                status |= CHANNEL_FAILED;
+            memory[CHANNEL_CHSR] = status;
+            break;
+        }
+        case CHANNEL_CHDR: {
+            Word word = 0;
+            channel_failed = false;
+            if (channel_peer(&from, &to)) {
+                const size_t size = pipe_read(
+                    from,
+                    (char *)&word,
+                    sizeof(word),
+                    &channel_stats.starved_ns
+                );
+                channel_stats.words_received += size / sizeof(word);
+            }
+            memory[CHANNEL_CHDR] = word;
+            break;
+        }
+    }
+}
+
+void channel_store(void *const data, const Word address, const Word value) {
+    (void)data;
+    struct Pipe *from;
+    struct Pipe *to;
+    switch (address) {
+        case CHANNEL_CHDR:
+            channel_failed = false;
+            if (channel_peer(&from, &to)) {
+                (void)pipe_write(
+                    to,
+                    (const char *)&value,
+                    sizeof(value),
+                    &channel_stats.blocked_ns
+                );
+                ++channel_stats.words_sent;
+            }
+            break;
+        case CHANNEL_CHCMD:
+            channel_failed = !channel_transfer(value);
+            break;
+    }
+}
+
+void channel_reset(void *const data) {
+    (void)data;
+    for (Word address = CHANNEL_CHID; address <= CHANNEL_CHCMD; ++address)
+        memory[address] = 0;
+    memory[CHANNEL_CHID] = (Word)channel_self;
+    memory[CHANNEL_CHN] = (Word)channel_count;
+    channel_failed = false;
+}
+
+bool channels_open(const size_t count) {
+    channel_pipes = calloc(count * count, sizeof(struct Pipe *));
+    if (channel_pipes == NULL) {
+        fprintf(stderr, "Failed to create channels.\n");
+        return false;
+    }
+    channel_count = count;
+    for (size_t i = 0; i < count * count; ++i) {
+        channel_pipes[i] = pipe_create(CHANNEL_PIPE_SIZE);
+        if (channel_pipes[i] == NULL) {
+            fprintf(stderr, "Failed to create channels.\n");
+            channels_close();
+            return false;
+        }
+    }
+    const struct Device device = {
+        CHANNEL_CHID,
+        CHANNEL_CHCMD - CHANNEL_CHID + 1,
+        channel_load,
+        channel_store,
+        channel_reset,
+        NULL,
+    };
+    if (!attach_device(&device)) {
+        fprintf(stderr, "Failed to attach channels.\n");
+        channels_close();
+        return false;
+    }
+    return true;
+}
+
+void channels_close() {
+    if (channel_pipes == NULL)
+        return;
+    for (size_t i = 0; i < channel_count * channel_count; ++i)
+        pipe_free(channel_pipes[i]);
+    free(channel_pipes);
+    channel_pipes = NULL;
+    channel_count = 0;
+}
+
+void channel_enter(const size_t vm) {
+    channel_self = vm;
+    channel_stats = (struct ChannelStats){0};
+}
+
+void channel_leave() {
+    if (channel_pipes == NULL)
+        return;
+    for (size_t peer = 0; peer < channel_count; ++peer) {
+        pipe_close(channel_pipes[channel_self * channel_count + peer]);
+        pipe_abandon(channel_pipes[peer * channel_count + channel_self]);
+    }
+}
@@ -0,0 +1,70 @@
+// Message channels between the VMs of a pipeline
+// Every VM (each stage of `--pipeline`) has a channel to every other one,
+// which is a pipe of words (see `pipe.h`), so neither sending nor receiving
+// takes a lock. Buffers are copied straight between memory and the channel.
+// Registers (see `struct Device`):
+// * xFE20 CHID: Number of this VM, from 0 (read only)
+// * xFE21 CHN: Number of VMs (read only)
+// * xFE22 CHPEER: VM to send to and receive from
+// * xFE23 CHSR: Bit 15 is set when a word can be received from CHPEER
+//   without waiting, bit 14 when one can be sent without waiting, bit 13
+//   when CHPEER has halted and every word it sent has been received, and
+//   bit 12 if the last access failed (eg. CHPEER is out of range, or is
+//   this VM)
+// * xFE24 CHDR: Loading receives a word from CHPEER, waiting for it if
+//   needed (0 once CHPEER has halted), and storing sends one
+// * xFE25 CHADR: Memory address of a buffer
+// * xFE26 CHCNT: Number of words; set to the number moved by a command
+// * xFE27 CHCMD: Storing a `ChannelCommand` moves the buffer
+// Sends wait for room, unless the receiver has halted, in which case the
+// words are thrown away.
+
+#ifndef CHANNEL_H
+#define CHANNEL_H
+
+// Libc
+#include <stdbool.h>  // bool
+#include <stddef.h>   // size_t
+#include <stdint.h>   // uint64_t
+
+#define CHANNEL_CHID 0xfe20
+#define CHANNEL_CHN 0xfe21
+#define CHANNEL_CHPEER 0xfe22
+#define CHANNEL_CHSR 0xfe23
+#define CHANNEL_CHDR 0xfe24
+#define CHANNEL_CHADR 0xfe25
+#define CHANNEL_CHCNT 0xfe26
+#define CHANNEL_CHCMD 0xfe27
+
+enum ChannelCommand {
+    CHANNEL_SEND = 1,     // Every word, waiting for room
+    CHANNEL_RECEIVE = 2,  // Waiting for every word, or for CHPEER to halt
+    CHANNEL_POLL = 3,     // Only the words which have arrived already
+};
+
+#define CHANNEL_DATA 0x8000
+#define CHANNEL_ROOM 0x4000
+#define CHANNEL_END 0x2000
+#define CHANNEL_FAILED 0x1000
+
+// Of the VM running on this thread, since `channel_enter`
+struct ChannelStats {
+    uint64_t words_sent;
+    uint64_t words_received;
+    uint64_t starved_ns;  // Waiting for words to arrive
+    uint64_t blocked_ns;  // Waiting for room
+};
+extern _Thread_local struct ChannelStats channel_stats;
+
+// Create channels between `count` VMs, and attach the device
+// Returns false if out of memory, or the registers are taken
+bool channels_open(size_t count);
+void channels_close();
+
+// Run VM number `vm` on this thread, from before its program is loaded
+void channel_enter(size_t vm);
+// The VM has halted: close its channels to every other VM, and stop
+// receiving from them
+void channel_leave();
+
+#endif
@@ -0,0 +1,934 @@
+// For dladdr1
+#define _GNU_SOURCE
+
+#include "cjit.h"
+
+// Libc
+#include <errno.h>      // errno, EINTR
+#include <signal.h>     // kill, SIGKILL
+#include <stdatomic.h>  // atomic_load_explicit, etc
+#include <stdbool.h>    // bool
+#include <stdio.h>      // fprintf, fdopen, snprintf
+#include <stdlib.h>     // calloc, free, getenv
+#include <string.h>     // memcpy, memset, strlen
+// POSIX
+#ifndef NO_PLUGINS
+#include <dlfcn.h>  // dladdr1, dlopen, dlsym
+#include <link.h>   // ElfW
+#endif
+#include <fcntl.h>     // O_RDWR
+#include <pthread.h>   // pthread_mutex_lock, etc
+#include <sched.h>     // sched_yield
+#include <spawn.h>     // posix_spawnp
+#include <sys/stat.h>  // stat
+#include <sys/wait.h>  // waitpid
+#include <unistd.h>    // unlink
+// Local
+#include "jit.h"      // branch_target, classify, field, scan_block
+#include "metrics.h"  // metrics, metrics_add
+#include "perfmap.h"  // perfmap_add, perfmap_enabled
+
+#define CJIT_MAX_REGION 512      // Words after its start a region may use
+#define CJIT_HOT 1024            // Interpreter runs before a region is wanted
+#define CJIT_CHAIN 65536         // Most instructions between dispatches
+#define CJIT_BATCH 64            // Regions compiled together
+#define CJIT_MAX_LIBRARIES 1024  // Compiled by the whole process
+
+// Why compiled code returned, if not at a jump out of its region
+#define EXIT_INTERPRET 0x1  // At an instruction for the interpreter
+#define EXIT_WRITTEN 0x2    // After a store to translated code
+
+// Everything compiled code uses
+// Declared again, with the same layout, in `prelude`
+struct CjitFrame {
+    Word *memory;
+    Word *registers;
+    uint8_t *cc;
+    Word *pc;
+    const uint8_t *code_words;  // See `CjitContext`
+    int64_t budget;             // Instructions it may still retire
+    bool stored;                // Set by regions which store to memory
+};
+
+typedef uint32_t (*CjitCode)(struct CjitFrame *frame);
+
+// A compiled region, never changed once installed
+struct CjitRegion {
+    uint64_t generation;  // Of translations
+    Word start;
+    CjitCode code;
+};
+
+struct CjitContext;
+
+struct CjitRequest {
+    struct CjitContext *context;
+    uint64_t generation;
+    Word start;
+    uint16_t span;                  // Words up to its last instruction
+    Word words[CJIT_MAX_REGION];    // As they were when requested
+    bool reached[CJIT_MAX_REGION];  // Whether each word is in the region
+};
+
+// Translations for one VM
+struct CjitContext {
+    // Only used by the VM's thread
+    uint16_t heat[MEMORY_SIZE];       // Interpreter runs from each address
+    uint8_t code_words[MEMORY_SIZE];  // Nonzero if translated or requested
+    size_t requested;                 // Since the last flush
+    struct CjitFrame frame;
+    // Shared with the compiler thread
+    _Atomic(const struct CjitRegion *) regions[MEMORY_SIZE];
+    _Atomic uint64_t generation;  // Bumped when translations are thrown away
+    _Atomic unsigned in_flight;   // Requests the compiler is not done with
+    // Installed regions, for metrics
+    // A region installed just as the translations are thrown away may be
+    // counted until the next time
+    _Atomic uint64_t code_bytes;
+    _Atomic uint64_t code_regions;
+};
+
+static _Thread_local struct CjitContext *context = NULL;
+static _Thread_local bool context_failed = false;
+static pthread_key_t context_key;  // To destroy the context at thread exit
+
+// Requests from every VM, waiting for the compiler
+// Compiling takes far longer than waiting for the lock
+static struct CjitRequest pending[CJIT_BATCH];
+static size_t pending_count = 0;
+static pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pending_ready = PTHREAD_COND_INITIALIZER;
+#ifndef NO_PLUGINS
+static pthread_once_t builder_once = PTHREAD_ONCE_INIT;
+#endif
+static bool builder_running = false;
+static _Atomic bool builder_failed = false;  // The C compiler did not work
+
+// Files of the batch being compiled, removed if the process exits first
+static char source_path[4096];
+static char library_path[4096 + 3];
+static _Atomic bool building = false;
+static _Atomic pid_t build_child = 0;
+
+extern char **environ;
+
+// Returns false if too many requests are waiting
+bool push_region_request(const struct CjitRequest *const request) {
+    pthread_mutex_lock(&pending_lock);
+    const bool pushed = pending_count < CJIT_BATCH;
+    if (pushed) {
+        pending[pending_count++] = *request;
+        pthread_cond_signal(&pending_ready);
+    }
+    pthread_mutex_unlock(&pending_lock);
+    return pushed;
+}
+
+// Wait for requests, and take every one into `batch`
+size_t take_region_requests(struct CjitRequest *const batch) {
+    pthread_mutex_lock(&pending_lock);
+    while (pending_count == 0)
+        pthread_cond_wait(&pending_ready, &pending_lock);
+    const size_t count = pending_count;
+    memcpy(batch, pending, count * sizeof(*batch));
+    pending_count = 0;
+    pthread_mutex_unlock(&pending_lock);
+    return count;
+}
+
+// Whether a translated instruction may go on to the next one
+bool falls_through(const Word instruction, const enum Kind kind) {
+    return kind == KIND_PLAIN ||
+           ((enum Opcode)(instruction >> 12) == OP_BR &&
+            (instruction & 0x0e00) != 0x0e00);
+}
+
+// Find the instructions reachable from `start` without leaving the
+// `CJIT_MAX_REGION` words after it, or running one left to the interpreter
+// Returns how many words the region spans, or 0 if it has no instructions
+unsigned form_region(const Word start, bool *const reached) {
+    memset(reached, 0, CJIT_MAX_REGION * sizeof(*reached));
+    // Each instruction pushes at most two more
+    uint16_t stack[2 * CJIT_MAX_REGION + 1];
+    size_t depth = 0;
+    stack[depth++] = 0;
+    unsigned span = 0;
+    while (depth > 0) {
+        const unsigned offset = stack[--depth];
+        const Word address = (Word)(start + offset);
+        if (offset >= CJIT_MAX_REGION || reached[offset] ||
+            address >= DEVICE_BASE)
+            continue;
+        const Word instruction = memory[address];
+        const enum Kind kind = classify(instruction, address);
+        if (kind == KIND_OTHER)
+            continue;
+        reached[offset] = true;
+        if (offset + 1 > span)
+            span = offset + 1;
+        Word target;
+        if (branch_target(instruction, address, &target) &&
+            (Word)(target - start) < CJIT_MAX_REGION)
+            stack[depth++] = (Word)(target - start);
+        // Where a subroutine called from here returns to
+        if (falls_through(instruction, kind) ||
+            (enum Opcode)(instruction >> 12) == OP_JSR_JSRR)
+            stack[depth++] = (uint16_t)(offset + 1);
+    }
+    return span;
+}
+
+// Declarations for compiled code, matching `CjitFrame`
+static const char prelude[] =
+    "#include <stdint.h>\n"
+    "struct F {\n"
+    "    uint16_t *m, *r;\n"
+    "    uint8_t *cc;\n"
+    "    uint16_t *pc;\n"
+    "    const uint8_t *w;\n"
+    "    int64_t b;\n"
+    "    _Bool s;\n"
+    "};\n"
+    "#define CC(v) ((int16_t)(v) < 0 ? 4 : (v) == 0 ? 2 : 1)\n";
+
+// Instructions from a leader to the next one: the most which can run before
+// the budget is checked again
+unsigned block_length(
+    const struct CjitRequest *const request,
+    const bool *const leaders,
+    const unsigned offset
+) {
+    unsigned length = 0;
+    for (unsigned i = offset; i < request->span && request->reached[i]; ++i) {
+        if (i != offset && leaders[i])
+            break;
+        ++length;
+    }
+    return length;
+}
+
+// Continue at `target`: in this region if it is in it, otherwise return
+void emit_goto(
+    FILE *const out,
+    const struct CjitRequest *const request,
+    const Word target
+) {
+    const Word offset = (Word)(target - request->start);
+    if (offset < request->span && request->reached[offset])
+        fprintf(out, "goto L%u;\n", offset);
+    else
+        fprintf(out, "{ pc = 0x%04x; goto out; }\n", target);
+}
+
+// Continue at the address in `pc`: at a leader of this region if it is one,
+// otherwise return
+void emit_indirect(
+    FILE *const out,
+    const struct CjitRequest *const request,
+    const bool *const leaders
+) {
+    fprintf(out, "    switch (pc) {\n");
+    for (unsigned i = 0; i < request->span; ++i) {
+        if (leaders[i] && request->reached[i])
+            fprintf(
+                out,
+                "        case 0x%04x: goto L%u;\n",
+                (Word)(request->start + i),
+                i
+            );
+    }
+    fprintf(out, "    }\n");
+    fprintf(out, "    goto out;\n");
+}
+
+// Write a region as the C function `r<index>`
+// Guest registers, the condition code and the budget are kept in locals,
+// and only written back when it returns
+void emit_region(
+    FILE *const out, const struct CjitRequest *const request, size_t index
+) {
+    // Where the budget is checked: the start, and wherever a branch goes
+    bool leaders[CJIT_MAX_REGION] = {false};
+    bool stores = false;
+    leaders[0] = true;
+    for (unsigned i = 0; i < request->span; ++i) {
+        if (!request->reached[i])
+            continue;
+        const Word instruction = request->words[i];
+        const Word address = (Word)(request->start + i);
+        const enum Opcode opcode = (enum Opcode)(instruction >> 12);
+        stores |= opcode == OP_ST || opcode == OP_STI || opcode == OP_STR;
+        if (classify(instruction, address) != KIND_BRANCH)
+            continue;
+        if (i + 1 < request->span)
+            leaders[i + 1] = true;
+        Word target;
+        if (branch_target(instruction, address, &target) &&
+            (Word)(target - request->start) < request->span)
+            leaders[(Word)(target - request->start)] = true;
+    }
+
+    fprintf(out, "uint32_t r%zu(struct F *f) {\n", index);
+    fprintf(out, "    uint16_t *m = f->m;\n");
+    fprintf(out, "    const uint8_t *w = f->w;\n");
+    for (unsigned reg = 0; reg < 8; ++reg)
+        fprintf(out, "    uint16_t r%u = f->r[%u];\n", reg, reg);
+    fprintf(out, "    uint8_t n = *f->cc;\n");
+    fprintf(out, "    int64_t b = f->b;\n");
+    fprintf(out, "    uint16_t pc, a;\n");
+    fprintf(out, "    uint32_t x = 0;\n");
+    if (stores)
+        fprintf(out, "    f->s = 1;\n");
+
+    for (unsigned i = 0; i < request->span; ++i) {
+        if (!request->reached[i])
+            continue;
+        const Word instruction = request->words[i];
+        const Word address = (Word)(request->start + i);
+        const Word next = (Word)(address + 1);
+        const unsigned reg_a = (instruction >> 9) & 0x7;
+        const unsigned reg_b = (instruction >> 6) & 0x7;
+        const unsigned reg_c = instruction & 0x7;
+        const Word target = (Word)(next + field(instruction, 9));
+        const Word offset = field(instruction, 6);
+        const enum Kind kind = classify(instruction, address);
+
+        if (leaders[i])
+            fprintf(
+                out,
+                "L%u: if (b < %u) { pc = 0x%04x; goto out; }\n",
+                i,
+                block_length(request, leaders, i),
+                address
+            );
+        // Device registers are left to the interpreter, for an address in `a`
+        char device[64];
+        snprintf(
+            device,
+            sizeof(device),
+            "if (a >= 0x%04x) { pc = 0x%04x; x = %d; goto out; }",
+            DEVICE_BASE,
+            address,
+            EXIT_INTERPRET
+        );
+        // After a store to translated code, at an address in `a`
+        char written[64];
+        snprintf(
+            written,
+            sizeof(written),
+            "if (w[a]) { pc = 0x%04x; x = %d; goto out; }",
+            next,
+            EXIT_WRITTEN
+        );
+
+        switch ((enum Opcode)(instruction >> 12)) {
+            case OP_ADD:
+            case OP_AND: {
+                const char *const op =
+                    (instruction >> 12) == OP_ADD ? "+" : "&";
+                if (instruction & 0x20)
+                    fprintf(
+                        out,
+                        "    r%u = (uint16_t)(r%u %s 0x%04x);",
+                        reg_a,
+                        reg_b,
+                        op,
+                        field(instruction, 5)
+                    );
+                else
+                    fprintf(
+                        out,
+                        "    r%u = (uint16_t)(r%u %s r%u);",
+                        reg_a,
+                        reg_b,
+                        op,
+                        reg_c
+                    );
+                fprintf(out, " n = CC(r%u); b -= 1;\n", reg_a);
+            } break;
+
+            case OP_NOT:
+                fprintf(
+                    out,
+                    "    r%u = (uint16_t)~r%u; n = CC(r%u); b -= 1;\n",
+                    reg_a,
+                    reg_b,
+                    reg_a
+                );
+                break;
+
+            case OP_LEA:
+                fprintf(out, "    r%u = 0x%04x; b -= 1;\n", reg_a, target);
+                break;
+
+            case OP_LD:
+                fprintf(
+                    out,
+                    "    r%u = m[0x%04x]; n = CC(r%u); b -= 1;\n",
+                    reg_a,
+                    target,
+                    reg_a
+                );
+                break;
+
+            case OP_LDI:
+            case OP_LDR:
+                if ((instruction >> 12) == OP_LDI)
+                    fprintf(out, "    a = m[0x%04x];", target);
+                else
+                    fprintf(
+                        out, "    a = (uint16_t)(r%u + 0x%04x);", reg_b, offset
+                    );
+                fprintf(
+                    out,
+                    " %s r%u = m[a]; n = CC(r%u); b -= 1;\n",
+                    device,
+                    reg_a,
+                    reg_a
+                );
+                break;
+
+            case OP_ST:
+                fprintf(
+                    out,
+                    "    a = 0x%04x; m[a] = r%u; b -= 1; %s\n",
+                    target,
+                    reg_a,
+                    written
+                );
+                break;
+
+            case OP_STI:
+            case OP_STR:
+                if ((instruction >> 12) == OP_STI)
+                    fprintf(out, "    a = m[0x%04x];", target);
+                else
+                    fprintf(
+                        out, "    a = (uint16_t)(r%u + 0x%04x);", reg_b, offset
+                    );
+                fprintf(
+                    out,
+                    " %s m[a] = r%u; b -= 1; %s\n",
+                    device,
+                    reg_a,
+                    written
+                );
+                break;
+
+            case OP_BR:
+                fprintf(out, "    b -= 1;\n");
+                if (instruction == 0x0000)
+                    break;  // NOP
+                if (reg_a != 0x7)
+                    fprintf(out, "    if (n & %u) ", reg_a);
+                else
+                    fprintf(out, "    ");
+                emit_goto(out, request, target);
+                break;
+
+            case OP_JMP_RET:
+                fprintf(out, "    b -= 1; pc = r%u;\n", reg_b);
+                emit_indirect(out, request, leaders);
+                break;
+
+            case OP_JSR_JSRR:
+                // R7 is set first, like the interpreter
+                fprintf(out, "    r7 = 0x%04x; b -= 1;\n", next);
+                if (instruction & 0x0800) {
+                    fprintf(out, "    ");
+                    emit_goto(
+                        out, request, (Word)(next + field(instruction, 11))
+                    );
+                } else {
+                    fprintf(out, "    pc = r%u;\n", reg_b);
+                    emit_indirect(out, request, leaders);
+                }
+                break;
+
+            // Never in a region
+            default:
+                break;
+        }
+
+        const bool next_reached =
+            i + 1 < request->span && request->reached[i + 1];
+        if (falls_through(instruction, kind) && !next_reached)
+            fprintf(out, "    pc = 0x%04x; goto out;\n", next);
+    }
+
+    fprintf(out, "out:\n");
+    for (unsigned reg = 0; reg < 8; ++reg)
+        fprintf(out, "    f->r[%u] = r%u;\n", reg, reg);
+    fprintf(out, "    *f->cc = n;\n");
+    fprintf(out, "    *f->pc = pc;\n");
+    fprintf(out, "    f->b = b;\n");
+    fprintf(out, "    return x;\n");
+    fprintf(out, "}\n");
+}
+
+// Compile C source to a shared library with the system's C compiler
+// Returns false if it failed
+bool build_library(const char *const source, const char *const library) {
+    const char *compiler = getenv("CC");
+    if (compiler == NULL || compiler[0] == '\0')
+        compiler = "cc";
+    // Source files have no extension, so the language is given
+    char *const argv[] = {
+        (char *)compiler,
+        "-O2",
+        "-shared",
+        "-fPIC",
+        "-w",
+        "-x",
+        "c",
+        (char *)source,
+        "-o",
+        (char *)library,
+        NULL,
+    };
+    // Diagnostics would only be mixed into the program's output
+    posix_spawn_file_actions_t actions;
+    if (posix_spawn_file_actions_init(&actions) != 0)
+        return false;
+    posix_spawn_file_actions_addopen(
+        &actions, STDIN_FILENO, "/dev/null", O_RDWR, 0
+    );
+    posix_spawn_file_actions_adddup2(&actions, STDIN_FILENO, STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, STDIN_FILENO, STDERR_FILENO);
+    // In its own process group, so it can be killed with its children
+    posix_spawnattr_t attributes;
+    if (posix_spawnattr_init(&attributes) != 0) {
+        posix_spawn_file_actions_destroy(&actions);
+        return false;
+    }
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETPGROUP);
+    posix_spawnattr_setpgroup(&attributes, 0);
+    pid_t child;
+    const int spawned =
+        posix_spawnp(&child, compiler, &actions, &attributes, argv, environ);
+    posix_spawnattr_destroy(&attributes);
+    posix_spawn_file_actions_destroy(&actions);
+    if (spawned != 0)
+        return false;
+    atomic_store(&build_child, child);
+    int status;
+    pid_t waited;
+    do
+        waited = waitpid(child, &status, 0);
+    while (waited < 0 && errno == EINTR);
+    atomic_store(&build_child, 0);
+    return waited >= 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// Load a library, and find the code of its `count` regions, and its size
+// from the symbol table
+// Returns false if it could not be loaded
+bool load_library(
+    const char *const library,
+    CjitCode *const codes,
+    size_t *const sizes,
+    const size_t count
+) {
+#ifdef NO_PLUGINS
+    (void)library;
+    (void)codes;
+    (void)sizes;
+    (void)count;
+    return false;
+#else
+    // Never closed, as a VM may be running any region until it exits
+    void *const handle = dlopen(library, RTLD_NOW | RTLD_LOCAL);
+    if (handle == NULL)
+        return false;
+    for (size_t i = 0; i < count; ++i) {
+        char name[32];
+        snprintf(name, sizeof(name), "r%zu", i);
+        // Object pointers cannot be cast to function pointers in ISO C
+        void *const symbol = dlsym(handle, name);
+        memcpy(&codes[i], &symbol, sizeof(codes[i]));
+        Dl_info info;
+        const ElfW(Sym) *entry = NULL;
+        sizes[i] = 0;
+        if (symbol != NULL &&
+            dladdr1(symbol, &info, (void **)&entry, RTLD_DL_SYMENT) != 0 &&
+            entry != NULL)
+            sizes[i] = entry->st_size;
+    }
+    return true;
+#endif
+}
+
+// Write, compile and load a batch of regions, and set the size of the
+// library
+// Returns false (leaving `codes` unset) if any step failed
+bool compile_regions(
+    const struct CjitRequest *const batch,
+    const size_t count,
+    CjitCode *const codes,
+    size_t *const sizes,
+    uint64_t *const bytes
+) {
+    const char *directory = getenv("TMPDIR");
+    if (directory == NULL || directory[0] == '\0')
+        directory = "/tmp";
+    char *const source = source_path;
+    char *const library = library_path;
+    snprintf(
+        source, sizeof(source_path), "%s/minilc3-cjit-XXXXXX", directory
+    );
+    snprintf(library, sizeof(library_path), "%s.so", source);
+    const int file = mkstemp(source);
+    if (file < 0)
+        return false;
+    memcpy(library, source, strlen(source));
+    atomic_store(&building, true);
+
+    FILE *const out = fdopen(file, "w");
+    if (out == NULL) {
+        (void)close(file);
+        (void)unlink(source);
+        atomic_store(&building, false);
+        return false;
+    }
+    fputs(prelude, out);
+    for (size_t i = 0; i < count; ++i)
+        emit_region(out, &batch[i], i);
+    const bool written = fclose(out) == 0;
+
+    struct stat built;
+    const bool loaded = written && build_library(source, library) &&
+                        stat(library, &built) == 0 &&
+                        load_library(library, codes, sizes, count);
+    if (loaded)
+        *bytes = (uint64_t)built.st_size;
+    (void)unlink(source);
+    (void)unlink(library);  // Stays mapped while loaded
+    atomic_store(&building, false);
+    return loaded;
+}
+
+// At exit, if a batch is still being compiled
+void remove_build_files() {
+    if (!atomic_load(&building))
+        return;
+    // Not a failure of the compiler, so not worth reporting
+    atomic_store(&builder_failed, true);
+    const pid_t child = atomic_load(&build_child);
+    if (child > 0) {
+        (void)kill(-child, SIGKILL);
+        (void)waitpid(child, NULL, 0);
+    }
+    (void)unlink(source_path);
+    (void)unlink(library_path);
+}
+
+// Publish the size of a VM's installed code
+void publish_regions(struct CjitContext *const jit) {
+    if (metrics == NULL)
+        return;
+    atomic_store_explicit(
+        &metrics->cache_bytes,
+        atomic_load(&jit->code_bytes),
+        memory_order_relaxed
+    );
+    atomic_store_explicit(
+        &metrics->cache_blocks,
+        atomic_load(&jit->code_regions),
+        memory_order_relaxed
+    );
+}
+
+// Install a compiled region of `size` bytes of code, counted as `bytes` of
+// the library, if it is still wanted
+void install_region(
+    struct CjitRegion *const region,
+    const struct CjitRequest *const request,
+    const CjitCode code,
+    const size_t size,
+    const uint64_t bytes
+) {
+    struct CjitContext *const jit = request->context;
+    if (code == NULL)
+        return;
+    region->generation = request->generation;
+    region->start = request->start;
+    region->code = code;
+    atomic_store(&jit->regions[request->start], region);
+    // If the translations were thrown away meanwhile, the VM may have missed
+    // this one. Either way, the VM checks the generation before running it
+    if (atomic_load(&jit->generation) != request->generation) {
+        const struct CjitRegion *expected = region;
+        atomic_compare_exchange_strong(
+            &jit->regions[request->start], &expected, NULL
+        );
+        return;
+    }
+    atomic_fetch_add(&jit->code_bytes, bytes);
+    atomic_fetch_add(&jit->code_regions, 1);
+    publish_regions(jit);
+    if (perfmap_enabled() && size > 0) {
+        // Object pointers cannot be cast to function pointers in ISO C
+        const void *address;
+        memcpy(&address, &code, sizeof(address));
+        perfmap_add(
+            address,
+            size,
+            request->start,
+            (Word)(request->start + request->span - 1)
+        );
+    }
+}
+
+void *builder_main(void *const arg) {
+    (void)arg;
+    static struct CjitRequest batch[CJIT_BATCH];
+    size_t libraries = 0;
+    while (true) {
+        size_t count = take_region_requests(batch);
+        // Leave out regions which were written over while waiting
+        size_t wanted = 0;
+        for (size_t i = 0; i < count; ++i) {
+            struct CjitContext *const jit = batch[i].context;
+            if (atomic_load(&jit->generation) == batch[i].generation)
+                batch[wanted++] = batch[i];
+            else
+                atomic_fetch_sub_explicit(
+                    &jit->in_flight, 1, memory_order_release
+                );
+        }
+        count = wanted;
+
+        CjitCode codes[CJIT_BATCH] = {NULL};
+        size_t sizes[CJIT_BATCH] = {0};
+        uint64_t library_bytes = 0;
+        struct CjitRegion *regions = NULL;
+        if (count > 0 && libraries < CJIT_MAX_LIBRARIES &&
+            !atomic_load(&builder_failed)) {
+            // Never freed, like the library
+            regions = calloc(count, sizeof(struct CjitRegion));
+            if (regions != NULL &&
+                compile_regions(batch, count, codes, sizes, &library_bytes)) {
+                ++libraries;
+            } else if (!atomic_exchange(&builder_failed, true)) {
+                fprintf(
+                    stderr,
+                    "Failed to compile regions with the C compiler; "
+                    "interpreting instead.\n"
+                );
+            }
+        }
+        for (size_t i = 0; i < count; ++i) {
+            // Each counts for an equal share of the library
+            if (regions != NULL)
+                install_region(
+                    &regions[i],
+                    &batch[i],
+                    codes[i],
+                    sizes[i],
+                    library_bytes / count
+                );
+            atomic_fetch_sub_explicit(
+                &batch[i].context->in_flight, 1, memory_order_release
+            );
+        }
+    }
+    return NULL;
+}
+
+// Throw away every translation
+void drop_regions(struct CjitContext *const jit) {
+    atomic_fetch_add(&jit->generation, 1);
+    if (jit->requested > 0) {
+        for (size_t i = 0; i < MEMORY_SIZE; ++i)
+            atomic_store_explicit(
+                &jit->regions[i], NULL, memory_order_relaxed
+            );
+        jit->requested = 0;
+    }
+    memset(jit->heat, 0, sizeof(jit->heat));
+    memset(jit->code_words, 0, sizeof(jit->code_words));
+    atomic_store(&jit->code_bytes, 0);
+    atomic_store(&jit->code_regions, 0);
+    publish_regions(jit);
+}
+
+// See `code_watch`
+void cjit_code_watch(const Word start, const size_t count) {
+    struct CjitContext *const jit = context;
+    if (jit == NULL)
+        return;
+    if (count >= MEMORY_SIZE) {
+        drop_regions(jit);
+        return;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        if (jit->code_words[(Word)(start + i)]) {
+            drop_regions(jit);
+            return;
+        }
+    }
+}
+
+// At thread exit
+void cjit_context_destroy(void *const data) {
+    struct CjitContext *const jit = data;
+    while (atomic_load_explicit(&jit->in_flight, memory_order_acquire) > 0)
+        sched_yield();
+    free(jit);
+}
+
+// Start the compiler thread, when the engine is first used
+void builder_start() {
+    if (pthread_key_create(&context_key, cjit_context_destroy) != 0)
+        return;
+    pthread_t thread;
+    if (start_helper_thread(&thread, builder_main, NULL) != 0)
+        return;
+    (void)pthread_detach(thread);
+    builder_running = add_code_watch(cjit_code_watch);
+    atexit(remove_build_files);
+}
+
+// Returns NULL if the engine cannot be used
+struct CjitContext *cjit_context_create() {
+#ifdef NO_PLUGINS
+    // Compiled code is loaded with the dynamic linker
+    return NULL;
+#else
+    pthread_once(&builder_once, builder_start);
+    if (!builder_running)
+        return NULL;
+    struct CjitContext *const jit = calloc(1, sizeof(struct CjitContext));
+    if (jit == NULL)
+        return NULL;
+    jit->frame = (struct CjitFrame){
+        memory, registers, &cc, &pc, jit->code_words, 0, false
+    };
+    atomic_init(&jit->generation, 1);
+    atomic_init(&jit->code_bytes, 0);
+    atomic_init(&jit->code_regions, 0);
+    (void)pthread_setspecific(context_key, jit);
+    return jit;
+#endif
+}
+
+// Ask the compiler for the region starting at `start`
+// Returns false if it has no instructions, or too many requests are waiting
+bool request_region(struct CjitContext *const jit, const Word start) {
+    static _Thread_local struct CjitRequest request;
+    request.context = jit;
+    request.generation =
+        atomic_load_explicit(&jit->generation, memory_order_relaxed);
+    request.start = start;
+    request.span = (uint16_t)form_region(start, request.reached);
+    if (request.span == 0)
+        return false;
+    memcpy(request.words, &memory[start], request.span * sizeof(Word));
+    atomic_fetch_add_explicit(&jit->in_flight, 1, memory_order_relaxed);
+    if (!push_region_request(&request)) {
+        atomic_fetch_sub_explicit(&jit->in_flight, 1, memory_order_relaxed);
+        return false;
+    }
+    // Stores to these words now throw the translation away
+    for (unsigned i = 0; i < request.span; ++i)
+        jit->code_words[(Word)(start + i)] |= request.reached[i];
+    ++jit->requested;
+    return true;
+}
+
+// The installed region starting at `start`, if there is one
+const struct CjitRegion *find_region(
+    struct CjitContext *const jit, const Word start
+) {
+    const struct CjitRegion *const region =
+        atomic_load_explicit(&jit->regions[start], memory_order_acquire);
+    if (region == NULL ||
+        region->generation !=
+            atomic_load_explicit(&jit->generation, memory_order_relaxed) ||
+        region->start != start)
+        return NULL;
+    return region;
+}
+
+// Run compiled regions where there are any, and the interpreter elsewhere
+enum Error cjit_dispatch(
+    struct CjitContext *const jit, const unsigned features
+) {
+    const bool bounded = features & FEATURE_BOUNDED;
+    const uint64_t limit = bounded ? current_run_limit() : UINT64_MAX;
+    // The interpreter runs one block at a time, and tells us of its stores
+    const unsigned interpreter =
+        features | FEATURE_BOUNDED | EVENT_MEMORY_WRITE;
+    bool interpret = false;  // Last region stopped without progress
+    while (true) {
+        if (instructions_retired >= limit ||
+            (bounded && execution_interrupted()))
+            return ERR_LIMIT;
+        if (atomic_load_explicit(&builder_failed, memory_order_relaxed)) {
+            set_instruction_limit(limit);
+            return execute_variant(features);
+        }
+        const Word start = pc;
+
+        const struct CjitRegion *const region =
+            interpret ? NULL : find_region(jit, start);
+        if (region != NULL) {
+            const int64_t budget = limit - instructions_retired < CJIT_CHAIN
+                                       ? (int64_t)(limit - instructions_retired)
+                                       : CJIT_CHAIN;
+            jit->frame.budget = budget;
+            const uint32_t result = region->code(&jit->frame);
+            instructions_retired += (uint64_t)(budget - jit->frame.budget);
+            if (jit->frame.stored) {
+                jit->frame.stored = false;
+                if (features & FEATURE_DEVICES)
+                    count_side_effect();
+            }
+            if (result & EXIT_WRITTEN)
+                drop_regions(jit);
+            // At a device register, or too close to the limit
+            interpret =
+                (result & EXIT_INTERPRET) || jit->frame.budget == budget;
+            if (metrics != NULL)
+                metrics_add(&metrics->cache_hits, 1);
+            continue;
+        }
+        interpret = false;
+
+        unsigned translated;
+        const unsigned length = scan_block(start, &translated);
+        if (jit->heat[start] < CJIT_HOT && ++jit->heat[start] == CJIT_HOT &&
+            translated > 0 && !request_region(jit, start))
+            jit->heat[start] = 0;  // Try again later
+        if (metrics != NULL)
+            metrics_add(&metrics->cache_misses, 1);
+        set_instruction_limit(
+            limit - instructions_retired > length
+                ? instructions_retired + length
+                : limit
+        );
+        const enum Error error = execute_variant(interpreter);
+        if (error != ERR_LIMIT)
+            return error;
+    }
+}
+
+enum Error cjit_run(const unsigned features) {
+    if (context == NULL && !context_failed) {
+        context = cjit_context_create();
+        context_failed = context == NULL;
+    }
+    struct CjitContext *const jit = context;
+    // Plugins and protection need the interpreter for every instruction
+    if (jit == NULL || (features & ~(FEATURE_BOUNDED | FEATURE_DEVICES)) != 0)
+        return execute_variant(features);
+    return cjit_dispatch(jit, features);
+}
+
+enum Error cjit_execute() {
+    return execute_with_runner(cjit_run);
+}
+
+enum Error cjit_execute_until(const uint64_t limit) {
+    return execute_until_with_runner(cjit_run, limit);
+}
@@ -0,0 +1,24 @@
+// Engine which compiles C
+// Regions of code which the interpreter runs often are written out as C
+// functions by a background thread, shared by every VM, compiled with the
+// system's C compiler (`cc`, or `$CC`) into a shared library, and loaded
+// with `dlopen`. A region is every instruction reachable from a hot address
+// without leaving a window after it, so whole loops run in one function
+// with guest registers in host registers. It is slower to warm up than
+// `jit.h`, but runs on any host with a C compiler.
+// Like `jit.h`, stores to translated code throw every region away, and
+// anything not translated is left to the interpreter, which is all that
+// runs without a compiler, or in builds without the dynamic linker.
+
+#ifndef CJIT_H
+#define CJIT_H
+
+// Libc
+#include <stdint.h>  // uint64_t
+// Local
+#include "vm.h"  // enum Error
+
+enum Error cjit_execute();
+enum Error cjit_execute_until(uint64_t limit);
+
+#endif
@@ -0,0 +1,122 @@
+#include "disk.h"
+
+// Libc
+#include <stdio.h>  // fprintf
+// POSIX
+#include <fcntl.h>   // open
+#include <unistd.h>  // pread, pwrite
+
+#define DISK_MODE 0644
+
+static int disk_file = -1;
+
+// Swap every word between big-endian and host order, in place
+void swap_words(Word *const words, const size_t count) {
+    for (size_t i = 0; i < count; ++i)
+        words[i] = (Word)(words[i] << 8 | words[i] >> 8);
+}
+
+// Copy blocks between the file and memory
+// Returns false if the transfer is out of range, not allowed or fails
+bool disk_transfer(const Word command) {
+    const off_t offset =
+        (off_t)memory[DISK_DBLK] * DISK_BLOCK_WORDS * sizeof(Word);
+    const Word address = memory[DISK_DADR];
+    const size_t words = (size_t)memory[DISK_DCNT] * DISK_BLOCK_WORDS;
+    if (words == 0 || address + words > DEVICE_BASE)
+        return false;
+    // Done on behalf of the program, so only to memory it could access
+    const uint8_t permission = command == DISK_READ ? PERM_WRITE : PERM_READ;
+    const size_t last_page = (address + words - 1) >> PROTECTION_PAGE_SHIFT;
+    for (size_t page = address >> PROTECTION_PAGE_SHIFT; page <= last_page;
+         ++page) {
+        if (!user_may_access((Word)(page << PROTECTION_PAGE_SHIFT), permission))
+            return false;
+    }
+
+    Word *const start = &memory[address];
+    const size_t size = words * sizeof(Word);
+    if (command == DISK_READ) {
+        size_t total = 0;
+        while (total < size) {
+            const ssize_t count = pread(
+                disk_file,
+                (char *)start + total,
+                size - total,
+                offset + (off_t)total
+            );
+            if (count < 0)
+                return false;
+            if (count == 0)
+                break;
+            total += (size_t)count;
+        }
+        // Past the end of the file
+        for (size_t i = total / sizeof(Word); i < words; ++i)
+            start[i] = 0;
+        swap_words(start, words);
+        if (code_watch != NULL)
+            code_watch(address, words);
+        return true;
+    }
+
+    // Swapped in place and back, rather than copied
+    swap_words(start, words);
+    size_t total = 0;
+    bool ok = true;
+    while (total < size) {
+        const ssize_t count = pwrite(
+            disk_file,
+            (char *)start + total,
+            size - total,
+            offset + (off_t)total
+        );
+        if (count < 0) {
+            ok = false;
+            break;
+        }
+        total += (size_t)count;
+    }
+    swap_words(start, words);
+    return ok;
+}
+
+void disk_store(void *const data, const Word address, const Word value) {
+    (void)data;
+    if (address != DISK_DCMD)
+        return;
+    bool ok = false;
+    if (value == DISK_READ || value == DISK_WRITE)
+        ok = disk_transfer(value);
+    memory[DISK_DSR] = DISK_READY | (ok ? 0 : DISK_FAILED);
+}
+
+void disk_reset(void *const data) {
+    (void)data;
+    for (Word address = DISK_DBLK; address < DISK_DSR; ++address)
+        memory[address] = 0;
+    memory[DISK_DSR] = DISK_READY;
+}
+
+bool disk_open(const char *const filename) {
+    disk_file = open(filename, O_RDWR | O_CREAT, DISK_MODE);
+    if (disk_file < 0) {
+        fprintf(stderr, "Failed to open disk.\n");
+        return false;
+    }
+    const struct Device device = {
+        DISK_DBLK,
+        DISK_DSR - DISK_DBLK + 1,
+        NULL,
+        disk_store,
+        disk_reset,
+        NULL,
+    };
+    if (!attach_device(&device)) {
+        fprintf(stderr, "Failed to attach disk.\n");
+        (void)close(disk_file);
+        return false;
+    }
+    disk_reset(NULL);
+    return true;
+}
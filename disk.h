@@ -0,0 +1,43 @@
+// Block storage device, backed by a host file
+// Registers (see `struct Device`):
+// * xFE10 DBLK: First block number
+// * xFE11 DADR: Memory address of the first block
+// * xFE12 DCNT: Number of blocks
+// * xFE13 DCMD: Storing `DISK_READ` or `DISK_WRITE` starts a transfer
+// * xFE14 DSR: Bit 15 is set when ready, and bit 14 if the last transfer
+//   failed
+// Blocks are 256 words, stored big-endian like object files, so the disk
+// holds up to 32 MiB. A transfer copies every block with one host call,
+// directly between the file and memory, and is finished by the time the
+// store to DCMD retires, so DSR is always ready when the program reads it.
+// Blocks past the end of the file read as zeros.
+
+#ifndef DISK_H
+#define DISK_H
+
+// Libc
+#include <stdbool.h>  // bool
+// Local
+#include "vm.h"  // Word
+
+#define DISK_BLOCK_WORDS 256
+
+#define DISK_DBLK 0xfe10
+#define DISK_DADR 0xfe11
+#define DISK_DCNT 0xfe12
+#define DISK_DCMD 0xfe13
+#define DISK_DSR 0xfe14
+
+enum DiskCommand {
+    DISK_READ = 1,   // From the disk into memory
+    DISK_WRITE = 2,  // From memory onto the disk
+};
+
+#define DISK_READY 0x8000
+#define DISK_FAILED 0x4000
+
+// Open (or create) the backing file, and attach the device
+// Returns false if the file could not be opened
+bool disk_open(const char *filename);
+
+#endif
@@ -0,0 +1,509 @@
+// For `syscall`
+#define _GNU_SOURCE
+
+#include "fileio.h"
+
+// Libc
+#include <errno.h>   // errno, EIO, ECANCELED
+#include <stdint.h>  // uintptr_t
+#include <stdio.h>   // fprintf
+#include <stdlib.h>  // calloc, free, realloc
+#include <string.h>  // memset, strerror
+// POSIX
+#include <fcntl.h>        // open, O_*
+#include <pthread.h>      // pthread_mutex_lock, etc
+#include <sys/mman.h>     // mmap, munmap
+#include <sys/syscall.h>  // SYS_io_uring_*
+#include <unistd.h>       // close, pread, syscall, write
+// Linux
+#include <linux/io_uring.h>  // struct io_uring_sqe, etc
+// Local
+#include "vm.h"  // assert, start_helper_thread
+
+#define QUEUE_SLOTS 64    // Registered files, so also requests in flight
+#define RING_ENTRIES 256  // Each request takes 3
+#define POOL_THREADS 4    // Shared by every queue
+#define READ_CHUNK 65536  // Initial capacity of a read with none
+#define OUTPUT_MODE 0644
+
+// Stages of a request, kept in the low bits of `user_data`
+enum Stage {
+    STAGE_OPEN,
+    STAGE_TRANSFER,  // Read or write
+    STAGE_CLOSE,
+};
+#define STAGE_MASK 3
+
+struct Ring {
+    int fd;
+    void *sq_map;
+    size_t sq_map_size;
+    void *cq_map;
+    size_t cq_map_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    _Atomic unsigned *sq_head;
+    _Atomic unsigned *sq_tail;
+    unsigned *sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    _Atomic unsigned *cq_head;
+    _Atomic unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+};
+
+struct FileQueue {
+    bool uring;
+    struct Ring ring;
+    unsigned free_slots[QUEUE_SLOTS];
+    unsigned free_count;
+    _Atomic size_t writes;  // In flight
+    _Atomic size_t failed_writes;
+};
+
+// Thread pool, started by the first queue which needs it and left idle once
+// there is nothing to do
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+static struct FileRequest *pool_head = NULL;
+static struct FileRequest *pool_tail = NULL;
+static bool pool_started = false;
+
+// Synchronous I/O, for the thread pool and for retries
+
+// Read the rest of a file, from `request->length`, growing the buffer
+void read_rest(struct FileRequest *const request) {
+    request->error = 0;
+    const int file = open(request->path, O_RDONLY);
+    if (file < 0) {
+        request->error = errno;
+        return;
+    }
+    while (true) {
+        if (request->length == request->capacity) {
+            request->capacity =
+                request->capacity == 0 ? READ_CHUNK : request->capacity * 2;
+            request->data = realloc(request->data, request->capacity);
+            assert(request->data != NULL, "Out of memory");
+        }
+        const ssize_t count = pread(
+            file,
+            request->data + request->length,
+            request->capacity - request->length,
+            (off_t)request->length
+        );
+        if (count < 0) {
+            request->error = errno;
+            break;
+        }
+        if (count == 0)
+            break;
+        request->length += (size_t)count;
+    }
+    (void)close(file);
+}
+
+void write_whole(struct FileRequest *const request) {
+    request->error = 0;
+    const int file =
+        open(request->path, O_WRONLY | O_CREAT | O_TRUNC, OUTPUT_MODE);
+    if (file < 0) {
+        request->error = errno;
+        return;
+    }
+    for (size_t total = 0; total < request->length;) {
+        const ssize_t count =
+            write(file, request->data + total, request->length - total);
+        if (count < 0) {
+            request->error = errno;
+            break;
+        }
+        total += (size_t)count;
+    }
+    if (close(file) != 0 && request->error == 0)
+        request->error = errno;
+}
+
+// A write has finished, on any thread
+void finish_write(struct FileRequest *const request) {
+    struct FileQueue *const queue = request->queue;
+    if (request->error != 0) {
+        fprintf(
+            stderr,
+            "Failed to write %s: %s.\n",
+            request->path,
+            strerror(request->error)
+        );
+        atomic_fetch_add(&queue->failed_writes, 1);
+    }
+    free(request->data);
+    free(request);
+    atomic_fetch_sub(&queue->writes, 1);
+}
+
+// Thread pool
+
+void *pool_main(void *const argument) {
+    (void)argument;
+    (void)pthread_mutex_lock(&pool_lock);
+    while (true) {
+        while (pool_head == NULL)
+            (void)pthread_cond_wait(&pool_ready, &pool_lock);
+        struct FileRequest *const request = pool_head;
+        pool_head = request->next;
+        (void)pthread_mutex_unlock(&pool_lock);
+
+        if (request->write) {
+            write_whole(request);
+            finish_write(request);
+        } else {
+            request->length = 0;
+            read_rest(request);
+            atomic_store_explicit(&request->done, true, memory_order_release);
+        }
+
+        (void)pthread_mutex_lock(&pool_lock);
+        (void)pthread_cond_broadcast(&pool_done);
+    }
+    return NULL;
+}
+
+void pool_submit(struct FileRequest *const request) {
+    (void)pthread_mutex_lock(&pool_lock);
+    if (!pool_started) {
+        for (int i = 0; i < POOL_THREADS; ++i) {
+            pthread_t thread;
+            const int error = start_helper_thread(&thread, pool_main, NULL);
+            assert(error == 0, "Failed to create I/O thread");
+            (void)pthread_detach(thread);
+        }
+        pool_started = true;
+    }
+    request->next = NULL;
+    if (pool_head == NULL)
+        pool_head = request;
+    else
+        pool_tail->next = request;
+    pool_tail = request;
+    (void)pthread_cond_signal(&pool_ready);
+    (void)pthread_mutex_unlock(&pool_lock);
+}
+
+// io_uring, through raw system calls, since liburing is not a dependency
+
+bool ring_open(struct Ring *const ring) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = (int)syscall(SYS_io_uring_setup, RING_ENTRIES, &params);
+    if (ring->fd < 0)
+        return false;
+
+    ring->sq_map_size =
+        params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_map_size =
+        params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sq_map = mmap(
+        NULL,
+        ring->sq_map_size,
+        PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE,
+        ring->fd,
+        IORING_OFF_SQ_RING
+    );
+    ring->cq_map = mmap(
+        NULL,
+        ring->cq_map_size,
+        PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE,
+        ring->fd,
+        IORING_OFF_CQ_RING
+    );
+    ring->sqes = mmap(
+        NULL,
+        ring->sqes_size,
+        PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE,
+        ring->fd,
+        IORING_OFF_SQES
+    );
+    if (ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED ||
+        ring->sqes == MAP_FAILED)
+        goto fail;
+
+    char *const sq = ring->sq_map;
+    ring->sq_head = (_Atomic unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (_Atomic unsigned *)(sq + params.sq_off.tail);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    char *const cq = ring->cq_map;
+    ring->cq_head = (_Atomic unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (_Atomic unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    // Empty slots, which requests open files into
+    int files[QUEUE_SLOTS];
+    for (int i = 0; i < QUEUE_SLOTS; ++i)
+        files[i] = -1;
+    if (syscall(
+            SYS_io_uring_register,
+            ring->fd,
+            IORING_REGISTER_FILES,
+            files,
+            QUEUE_SLOTS
+        ) != 0)
+        goto fail;
+    return true;
+
+fail:
+    if (ring->sq_map != MAP_FAILED)
+        (void)munmap(ring->sq_map, ring->sq_map_size);
+    if (ring->cq_map != MAP_FAILED)
+        (void)munmap(ring->cq_map, ring->cq_map_size);
+    if (ring->sqes != MAP_FAILED)
+        (void)munmap(ring->sqes, ring->sqes_size);
+    (void)close(ring->fd);
+    return false;
+}
+
+void ring_close(struct Ring *const ring) {
+    (void)munmap(ring->sq_map, ring->sq_map_size);
+    (void)munmap(ring->cq_map, ring->cq_map_size);
+    (void)munmap(ring->sqes, ring->sqes_size);
+    (void)close(ring->fd);
+}
+
+// Every request is submitted as soon as it is queued, and takes at most a
+// third of the ring, so there is always room
+struct io_uring_sqe *ring_next(
+    struct Ring *const ring,
+    struct FileRequest *const request,
+    const enum Stage stage
+) {
+    const unsigned tail =
+        atomic_load_explicit(ring->sq_tail, memory_order_relaxed);
+    const unsigned index = tail & ring->sq_mask;
+    struct io_uring_sqe *const sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = (uintptr_t)request | stage;
+    ring->sq_array[index] = index;
+    atomic_store_explicit(ring->sq_tail, tail + 1, memory_order_release);
+    return sqe;
+}
+
+void ring_submit(struct Ring *const ring, const unsigned count) {
+    while (syscall(SYS_io_uring_enter, ring->fd, count, 0, 0, NULL, 0) < 0) {
+        assert(errno == EINTR || errno == EAGAIN, "Failed to submit I/O");
+    }
+}
+
+// Submit a chain which opens `request->path` into its slot, reads or writes
+// the whole buffer in one go, then closes it again
+// The transfer is hard-linked, since a short read is expected and must not
+// cancel the close
+void ring_start(
+    struct FileQueue *const queue, struct FileRequest *const request
+) {
+    struct Ring *const ring = &queue->ring;
+    request->slot = queue->free_slots[--queue->free_count];
+    request->completions = 3;
+    request->error = 0;
+
+    struct io_uring_sqe *sqe = ring_next(ring, request, STAGE_OPEN);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t)request->path;
+    sqe->open_flags = request->write ? O_WRONLY | O_CREAT | O_TRUNC : O_RDONLY;
+    sqe->len = request->write ? OUTPUT_MODE : 0;
+    sqe->file_index = request->slot + 1;
+    sqe->flags = IOSQE_IO_LINK;
+
+    sqe = ring_next(ring, request, STAGE_TRANSFER);
+    sqe->opcode = request->write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = (int)request->slot;
+    sqe->addr = (uintptr_t)request->data;
+    sqe->len = (unsigned)(request->write ? request->length : request->capacity);
+    sqe->off = 0;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+
+    sqe = ring_next(ring, request, STAGE_CLOSE);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->file_index = request->slot + 1;
+
+    ring_submit(ring, 3);
+}
+
+void ring_complete(
+    struct FileQueue *const queue,
+    struct FileRequest *const request,
+    const enum Stage stage,
+    const int result
+) {
+    if (stage == STAGE_OPEN && result < 0) {
+        request->error = -result;
+    } else if (result < 0) {
+        if (request->error == 0)
+            request->error = -result;
+    } else if (stage == STAGE_TRANSFER) {
+        if (!request->write)
+            request->length = (size_t)result;
+        else if ((size_t)result != request->length && request->error == 0)
+            request->error = EIO;
+    }
+    if (--request->completions > 0)
+        return;
+
+    queue->free_slots[queue->free_count++] = request->slot;
+    if (!request->write) {
+        atomic_store_explicit(&request->done, true, memory_order_release);
+        return;
+    }
+    // Retried synchronously, in case the kernel lacks part of the chain
+    if (request->error != 0)
+        write_whole(request);
+    finish_write(request);
+}
+
+// Handle every completion, waiting for at least one if `wait`
+void ring_reap(struct FileQueue *const queue, const bool wait) {
+    struct Ring *const ring = &queue->ring;
+    unsigned head = atomic_load_explicit(ring->cq_head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(ring->cq_tail, memory_order_acquire);
+    while (wait && head == tail) {
+        const long result = syscall(
+            SYS_io_uring_enter,
+            ring->fd,
+            0,
+            1,
+            IORING_ENTER_GETEVENTS,
+            NULL,
+            0
+        );
+        assert(result >= 0 || errno == EINTR, "Failed to wait for I/O");
+        tail = atomic_load_explicit(ring->cq_tail, memory_order_acquire);
+    }
+    for (; head != tail; ++head) {
+        const struct io_uring_cqe *const cqe =
+            &ring->cqes[head & ring->cq_mask];
+        struct FileRequest *const request =
+            (struct FileRequest *)(uintptr_t)(cqe->user_data & ~STAGE_MASK);
+        const enum Stage stage = (enum Stage)(cqe->user_data & STAGE_MASK);
+        const int result = cqe->res;
+        atomic_store_explicit(ring->cq_head, head + 1, memory_order_release);
+        ring_complete(queue, request, stage, result);
+    }
+}
+
+// Queues
+
+struct FileQueue *file_queue_create() {
+    struct FileQueue *const queue = calloc(1, sizeof(*queue));
+    assert(queue != NULL, "Out of memory");
+    queue->uring = ring_open(&queue->ring);
+    for (unsigned i = 0; i < QUEUE_SLOTS; ++i)
+        queue->free_slots[i] = QUEUE_SLOTS - 1 - i;
+    queue->free_count = QUEUE_SLOTS;
+    return queue;
+}
+
+void file_queue_destroy(struct FileQueue *const queue) {
+    (void)file_queue_drain(queue);
+    if (queue->uring)
+        ring_close(&queue->ring);
+    free(queue);
+}
+
+const char *file_queue_backend(const struct FileQueue *const queue) {
+    return queue->uring ? "io_uring" : "threads";
+}
+
+void file_queue_read(
+    struct FileQueue *const queue, struct FileRequest *const request
+) {
+    request->write = false;
+    request->length = 0;
+    request->error = 0;
+    request->queue = queue;
+    atomic_store_explicit(&request->done, false, memory_order_relaxed);
+    if (request->capacity == 0) {
+        request->capacity = READ_CHUNK;
+        request->data = realloc(request->data, request->capacity);
+        assert(request->data != NULL, "Out of memory");
+    }
+    if (!queue->uring) {
+        pool_submit(request);
+        return;
+    }
+    while (queue->free_count == 0)
+        ring_reap(queue, true);
+    ring_start(queue, request);
+}
+
+bool file_queue_wait(
+    struct FileQueue *const queue, struct FileRequest *const request
+) {
+    if (!queue->uring) {
+        if (atomic_load_explicit(&request->done, memory_order_acquire))
+            return true;
+        (void)pthread_mutex_lock(&pool_lock);
+        while (!atomic_load_explicit(&request->done, memory_order_acquire))
+            (void)pthread_cond_wait(&pool_done, &pool_lock);
+        (void)pthread_mutex_unlock(&pool_lock);
+        return false;
+    }
+    ring_reap(queue, false);
+    const bool finished =
+        atomic_load_explicit(&request->done, memory_order_relaxed);
+    while (!atomic_load_explicit(&request->done, memory_order_relaxed))
+        ring_reap(queue, true);
+    // The buffer may have been too small, or the kernel may lack part of
+    // the chain; either way, the rest is read synchronously
+    if (request->error != 0) {
+        request->length = 0;
+        read_rest(request);
+    } else if (request->length == request->capacity) {
+        read_rest(request);
+    }
+    return finished;
+}
+
+void file_queue_write(
+    struct FileQueue *const queue,
+    const char *const path,
+    char *const data,
+    const size_t length
+) {
+    struct FileRequest *const request = calloc(1, sizeof(*request));
+    assert(request != NULL, "Out of memory");
+    request->path = path;
+    request->data = data;
+    request->length = length;
+    request->write = true;
+    request->queue = queue;
+    atomic_fetch_add(&queue->writes, 1);
+    if (!queue->uring) {
+        pool_submit(request);
+        return;
+    }
+    while (queue->free_count == 0)
+        ring_reap(queue, true);
+    ring_start(queue, request);
+    ring_reap(queue, false);
+}
+
+size_t file_queue_drain(struct FileQueue *const queue) {
+    if (queue->uring) {
+        while (atomic_load(&queue->writes) > 0)
+            ring_reap(queue, true);
+    } else {
+        (void)pthread_mutex_lock(&pool_lock);
+        while (atomic_load(&queue->writes) > 0)
+            (void)pthread_cond_wait(&pool_done, &pool_lock);
+        (void)pthread_mutex_unlock(&pool_lock);
+    }
+    return atomic_exchange(&queue->failed_writes, 0);
+}
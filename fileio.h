@@ -0,0 +1,56 @@
+// Asynchronous whole-file reads and writes, for batch mode
+// Requests go through io_uring where the kernel allows it: each is one
+// linked chain of open, read or write, and close, using a registered file
+// slot, so it needs no attention from the submitting thread until it is
+// waited for. Otherwise they are run by a small pool of I/O threads.
+// A queue belongs to one thread.
+
+#ifndef FILEIO_H
+#define FILEIO_H
+
+// Libc
+#include <stdatomic.h>  // _Atomic
+#include <stdbool.h>    // bool
+#include <stddef.h>     // size_t
+
+struct FileQueue;
+
+// Reads are owned by the caller, which sets `path`, `data` and `capacity`
+// `data` may be reallocated, if the file is larger than `capacity`
+struct FileRequest {
+    const char *path;
+    char *data;
+    size_t capacity;
+    size_t length;  // Of data read, or to write
+    int error;      // `errno` of the failed operation, or 0
+    bool write;
+    // Private to the queue
+    int completions;  // io_uring completions still to come
+    unsigned slot;    // Registered file slot
+    _Atomic bool done;
+    struct FileQueue *queue;
+    struct FileRequest *next;  // In the thread pool's queue
+};
+
+// Never fails: falls back to the thread pool if io_uring is unavailable
+struct FileQueue *file_queue_create();
+void file_queue_destroy(struct FileQueue *queue);
+// Name of the backend in use: `io_uring` or `threads`
+const char *file_queue_backend(const struct FileQueue *queue);
+
+// Start reading a whole file into `request->data`
+void file_queue_read(struct FileQueue *queue, struct FileRequest *request);
+// Wait for a read to finish
+// Returns true if it had already finished, without waiting
+bool file_queue_wait(struct FileQueue *queue, struct FileRequest *request);
+
+// Start writing `data` to a new file at `path`, taking ownership of `data`
+// Errors are reported on stderr
+void file_queue_write(
+    struct FileQueue *queue, const char *path, char *data, size_t length
+);
+// Wait for every write to finish
+// Returns the number of writes which failed since the last drain
+size_t file_queue_drain(struct FileQueue *queue);
+
+#endif
@@ -0,0 +1,258 @@
+#include "formats.h"
+
+// Libc
+#include <stdbool.h>  // bool
+#include <stdint.h>   // uint32_t, uint64_t
+#include <stdio.h>    // fprintf
+#include <string.h>   // strrchr, strcmp
+// POSIX
+#include <sys/mman.h>  // mmap
+#include <sys/stat.h>  // fstat
+#ifdef __SSE2__
+#include <emmintrin.h>  // _mm_loadu_si128, etc
+#endif
+
+// Result of parsing one line
+enum Line {
+    LINE_WORD,
+    LINE_BLANK,
+    LINE_INVALID,
+};
+
+enum Format detect_format(
+    const char *const filename, const char *const head, const size_t length
+) {
+    const char *const extension = strrchr(filename, '.');
+    if (extension != NULL) {
+        if (strcmp(extension, ".hex") == 0)
+            return FORMAT_HEX;
+        if (strcmp(extension, ".bin") == 0)
+            return FORMAT_BIN;
+        if (strcmp(extension, ".obj") == 0 || strcmp(extension, ".lc3") == 0)
+            return FORMAT_OBJECT;
+    }
+
+    // Binary files are very unlikely to start with a line of digits
+    size_t hex_digits = 0;
+    size_t bin_digits = 0;
+    size_t i = length > 0 && (head[0] == 'x' || head[0] == 'X') ? 1 : 0;
+    for (; i < length; ++i) {
+        const char ch = head[i];
+        if (ch == '\n' || ch == '\r')
+            break;
+        const bool is_bin = ch == '0' || ch == '1';
+        const bool is_hex = is_bin || (ch >= '2' && ch <= '9') ||
+                            ((ch | 0x20) >= 'a' && (ch | 0x20) <= 'f');
+        if (!is_hex)
+            return FORMAT_OBJECT;
+        hex_digits += 1;
+        bin_digits += is_bin;
+    }
+    if (i == length)
+        return FORMAT_OBJECT;  // No newline
+    if (hex_digits == 16 && bin_digits == 16)
+        return FORMAT_BIN;
+    if (hex_digits >= 1 && hex_digits <= 4)
+        return FORMAT_HEX;
+    return FORMAT_OBJECT;
+}
+
+// Convert 4 hex digits to a word, all at once, using bytes of a 32-bit word
+// as lanes (SWAR). Returns false if any character is not a hex digit
+static inline bool hex4_to_word(const char *const digits, Word *const word) {
+    // Built byte by byte so the first digit is the lowest byte on any host;
+    // compilers turn this into a single load
+    const uint32_t chars = (uint32_t)(unsigned char)digits[0] |
+                           (uint32_t)(unsigned char)digits[1] << 8 |
+                           (uint32_t)(unsigned char)digits[2] << 16 |
+                           (uint32_t)(unsigned char)digits[3] << 24;
+    // Adding `0x80 - c` to a byte sets its high bit iff it is at least `c`
+    // Bytes are checked to be ASCII first, so no addition carries
+    const uint32_t lanes = 0x01010101;
+    const uint32_t high = lanes * 0x80;
+    if (chars & high)
+        return false;
+    const uint32_t lower = chars | lanes * 0x20;
+    const uint32_t is_digit =
+        (chars + lanes * (0x80 - '0')) & ~(chars + lanes * (0x80 - '9' - 1));
+    const uint32_t is_letter =
+        (lower + lanes * (0x80 - 'a')) & ~(lower + lanes * (0x80 - 'f' - 1));
+    if (((is_digit | is_letter) & high) != high)
+        return false;
+
+    // Letters are 9 more than their low nibble
+    const uint32_t nibbles =
+        (chars & lanes * 0x0f) + ((is_letter & high) >> 7) * 9;
+    // Pair up nibbles into bytes, then bytes into the word
+    const uint32_t bytes = ((nibbles << 4) | (nibbles >> 8)) & 0x00ff00ff;
+    *word = (Word)((bytes & 0xff) << 8 | (bytes >> 16));
+    return true;
+}
+
+// Convert 16 binary digits to a word, all at once
+// Returns false if any character is not `0` or `1`
+static inline bool bin16_to_word(const char *const digits, Word *const word) {
+#ifdef __SSE2__
+    const __m128i chars = _mm_loadu_si128((const __m128i *)digits);
+    const __m128i ones = _mm_cmpeq_epi8(chars, _mm_set1_epi8('1'));
+    const __m128i zeros = _mm_cmpeq_epi8(chars, _mm_set1_epi8('0'));
+    if (_mm_movemask_epi8(_mm_or_si128(ones, zeros)) != 0xffff)
+        return false;
+    // The mask has the first character in its lowest bit, but that is the
+    // most significant bit of the word, so reverse the bytes first
+    __m128i reversed = _mm_shuffle_epi32(ones, _MM_SHUFFLE(0, 1, 2, 3));
+    reversed = _mm_shufflelo_epi16(reversed, _MM_SHUFFLE(2, 3, 0, 1));
+    reversed = _mm_shufflehi_epi16(reversed, _MM_SHUFFLE(2, 3, 0, 1));
+    reversed =
+        _mm_or_si128(_mm_slli_epi16(reversed, 8), _mm_srli_epi16(reversed, 8));
+    *word = (Word)_mm_movemask_epi8(reversed);
+    return true;
+#else
+    // Each half as 8 byte lanes of a 64-bit word (SWAR)
+    uint64_t halves[2];
+    for (int half = 0; half < 2; ++half) {
+        uint64_t chars = 0;
+        for (int i = 0; i < 8; ++i)
+            chars |= (uint64_t)(unsigned char)digits[half * 8 + i] << (i * 8);
+        const uint64_t lanes = 0x0101010101010101;
+        if ((chars & ~lanes) != lanes * '0')
+            return false;
+        // Gather the low bit of every lane into the top byte, first lane
+        // most significant
+        halves[half] = ((chars & lanes) * 0x8040201008040201) >> 56;
+    }
+    *word = (Word)(halves[0] << 8 | halves[1]);
+    return true;
+#endif
+}
+
+// Parse a line which does not fit the fast path: surrounding whitespace, an
+// `x` or `0x` prefix (for hex), fewer digits, or a blank line
+enum Line parse_line(
+    const char *line, const char *const end, const int base, Word *const word
+) {
+    while (line < end && (*line == ' ' || *line == '\t' || *line == '\r'))
+        ++line;
+    if (line == end)
+        return LINE_BLANK;
+    if (base == 16) {
+        if (end - line >= 2 && line[0] == '0' && (line[1] | 0x20) == 'x')
+            line += 2;
+        else if ((*line | 0x20) == 'x')
+            ++line;
+    }
+
+    const int max_digits = base == 16 ? 4 : 16;
+    uint32_t value = 0;
+    int digits = 0;
+    for (; line < end; ++line, ++digits) {
+        const char ch = *line;
+        int digit;
+        if (ch >= '0' && ch <= '9')
+            digit = ch - '0';
+        else if ((ch | 0x20) >= 'a' && (ch | 0x20) <= 'f')
+            digit = (ch | 0x20) - 'a' + 10;
+        else
+            break;
+        if (digit >= base || digits == max_digits)
+            return LINE_INVALID;
+        value = value * base + digit;
+    }
+    while (line < end && (*line == ' ' || *line == '\t' || *line == '\r'))
+        ++line;
+    if (digits == 0 || line != end)
+        return LINE_INVALID;
+    *word = (Word)value;
+    return LINE_WORD;
+}
+
+// Parse the line at `*cursor`, and move past it and its newline
+static inline enum Line next_line(
+    const char **const cursor,
+    const char *const end,
+    const enum Format format,
+    Word *const word
+) {
+    const char *const line = *cursor;
+    // Fast path: a line of exactly as many digits as a word takes
+    // Only taken when whole chunks can be read without going past the end
+    if (format == FORMAT_HEX && end - line >= 5 && line[4] == '\n' &&
+        hex4_to_word(line, word)) {
+        *cursor = line + 5;
+        return LINE_WORD;
+    }
+    if (format == FORMAT_BIN && end - line >= 17 && line[16] == '\n' &&
+        bin16_to_word(line, word)) {
+        *cursor = line + 17;
+        return LINE_WORD;
+    }
+
+    const char *newline = memchr(line, '\n', (size_t)(end - line));
+    if (newline == NULL)
+        newline = end;
+    *cursor = newline == end ? end : newline + 1;
+    return parse_line(line, newline, format == FORMAT_HEX ? 16 : 2, word);
+}
+
+enum Error load_text(
+    const char *const data, const size_t length, const enum Format format
+) {
+    const char *const end = data + length;
+    const char *cursor = data;
+    bool has_origin = false;
+    Word origin = 0;
+    size_t address = 0;
+    size_t line_number = 0;
+    while (cursor < end) {
+        Word word;
+        ++line_number;
+        const enum Line line = next_line(&cursor, end, format, &word);
+        if (line == LINE_BLANK)
+            continue;
+        if (line == LINE_INVALID) {
+            fprintf(stderr, "Invalid word on line %zu.\n", line_number);
+            return ERR_FILE;
+        }
+        if (!has_origin) {
+            origin = word;
+            address = origin;
+            has_origin = true;
+            continue;
+        }
+        if (address >= MEMORY_SIZE) {
+            fprintf(stderr, "File is too long.\n");
+            return ERR_FILE;
+        }
+        memory[address++] = word;
+    }
+    if (!has_origin || address == origin) {
+        fprintf(stderr, "File is too short.\n");
+        return ERR_FILE;
+    }
+
+    reset_state(origin);
+    return ERR_OK;
+}
+
+enum Error load_text_file(const int file, const enum Format format) {
+    // Mapped rather than read, so nothing is copied before parsing
+    struct stat status;
+    if (fstat(file, &status) != 0) {
+        fprintf(stderr, "Failed to read file.\n");
+        return ERR_FILE;
+    }
+    const size_t length = (size_t)status.st_size;
+    if (length == 0) {
+        fprintf(stderr, "File is too short.\n");
+        return ERR_FILE;
+    }
+    const char *const data =
+        mmap(NULL, length, PROT_READ, MAP_PRIVATE, file, 0);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Failed to read file.\n");
+        return ERR_FILE;
+    }
+    const enum Error error = load_text(data, length, format);
+    (void)munmap((void *)data, length);
+    return error;
+}
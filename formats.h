@@ -0,0 +1,32 @@
+// Text object formats written by LC-3 assemblers, besides the binary `.obj`
+// `.hex` files have one word per line as 4 hex digits, and `.bin` files have
+// one word per line as 16 binary digits. In both, the first line is the
+// origin. `.lc3` files are binary, like `.obj`.
+
+#ifndef FORMATS_H
+#define FORMATS_H
+
+// Libc
+#include <stddef.h>  // size_t
+// Local
+#include "vm.h"  // enum Error
+
+enum Format {
+    FORMAT_OBJECT,  // Big-endian binary
+    FORMAT_HEX,
+    FORMAT_BIN,
+};
+
+// Bytes of the start of a file needed by `detect_format`
+#define FORMAT_SNIFF_SIZE 20
+
+// Guess the format from the extension of `filename`, or otherwise from the
+// first line of the file, in `head`
+enum Format detect_format(const char *filename, const char *head, size_t length);
+
+// Load a text object file into memory and reset registers to run it
+enum Error load_text_file(int file, enum Format format);
+// Same, from the contents of the file
+enum Error load_text(const char *data, size_t length, enum Format format);
+
+#endif
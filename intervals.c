@@ -0,0 +1,631 @@
+#include "intervals.h"
+
+// Libc
+#include <inttypes.h>   // PRIu64
+#include <stdatomic.h>  // atomic_fetch_add
+#include <stdlib.h>     // malloc, realloc, free
+#include <string.h>     // memcpy, memcmp
+// POSIX
+#include <sys/mman.h>  // mmap, munmap
+#include <sys/wait.h>  // waitpid
+#include <unistd.h>    // fork, pipe, read, write, sysconf
+// Local
+#include "perf.h"      // perf_now
+#include "simpoint.h"  // simpoint_choose, etc
+
+#define MAX_INTERVAL_WORKERS 256
+#define SNAPSHOT_PAGE_SHIFT 8  // 256 words per page
+#define SNAPSHOT_PAGE_WORDS (1 << SNAPSHOT_PAGE_SHIFT)
+#define SNAPSHOT_PAGES (MEMORY_SIZE >> SNAPSHOT_PAGE_SHIFT)
+
+typedef Word SnapshotPage[SNAPSHOT_PAGE_WORDS];
+
+// The VM at the start of an interval
+// Memory is a table of pages in `snapshot_pages`, which only has a new page
+// where memory differs from the snapshot before
+struct Snapshot {
+    uint32_t pages[SNAPSHOT_PAGES];
+    Word registers[8];
+    Word pc;
+    uint8_t cc;
+    bool stdout_on_new_line;
+    uint64_t instructions;
+    size_t input_position;  // Into the input log
+    // Basic block vector of the interval from here, when sampling phases
+    double vector[SIMPOINT_DIMENSIONS];
+};
+
+// Every byte of input which the first run reads
+// Output goes straight through to the caller's I/O
+struct InputLog {
+    struct Io outer;
+    char *data;
+    size_t length;
+    size_t capacity;
+};
+
+// What a worker sends back, before the results of each plugin
+struct WorkerReport {
+    uint64_t intervals;
+    uint64_t instructions;
+    uint64_t busy_ns;
+    uint64_t diverged;  // Intervals which did not end at the next snapshot
+};
+
+// A worker's report and results, kept until every worker is done, since a
+// worker forked after they were merged would start with them
+struct WorkerResults {
+    struct WorkerReport report;
+    void *results[MAX_INTERVAL_PLUGINS];
+    uint64_t sizes[MAX_INTERVAL_PLUGINS];
+};
+
+static struct Plugin interval_plugins[MAX_INTERVAL_PLUGINS];
+static int interval_plugin_count = 0;
+
+static struct InputLog input_log = {0};
+static struct Snapshot *snapshots = NULL;
+static size_t snapshot_count = 0;
+static size_t snapshot_capacity = 0;
+static SnapshotPage *snapshot_pages = NULL;
+static size_t snapshot_page_count = 0;
+static size_t snapshot_page_capacity = 0;
+static size_t snapshot_budget = 0;  // Bytes, for snapshots and pages
+
+bool intervals_add_plugin(
+    const struct Plugin *const plugin, const char *const name
+) {
+    if (plugin->save_results == NULL || plugin->merge_results == NULL) {
+        fprintf(stderr, "Plugin %s cannot merge results.\n", name);
+        return false;
+    }
+    if (interval_plugin_count >= MAX_INTERVAL_PLUGINS) {
+        fprintf(stderr, "Too many plugins.\n");
+        return false;
+    }
+    interval_plugins[interval_plugin_count++] = *plugin;
+    return true;
+}
+
+void log_append(struct InputLog *const log, const char *data, size_t size) {
+    if (log->length + size > log->capacity) {
+        size_t capacity = log->capacity > 0 ? log->capacity * 2 : 4096;
+        while (capacity < log->length + size)
+            capacity *= 2;
+        log->data = realloc(log->data, capacity);
+        assert(log->data != NULL, "Out of memory");
+        log->capacity = capacity;
+    }
+    memcpy(log->data + log->length, data, size);
+    log->length += size;
+}
+
+int logged_read_char(void *const context) {
+    struct InputLog *const log = context;
+    const int ch = log->outer.read_char(log->outer.context);
+    if (ch != EOF) {
+        const char byte = (char)ch;
+        log_append(log, &byte, 1);
+    }
+    return ch;
+}
+size_t logged_read(void *const context, char *const buffer, const size_t size) {
+    struct InputLog *const log = context;
+    size_t count = 0;
+    if (log->outer.read != NULL) {
+        count = log->outer.read(log->outer.context, buffer, size);
+    } else {
+        int ch;
+        while (count < size &&
+               (ch = log->outer.read_char(log->outer.context)) != EOF)
+            buffer[count++] = (char)ch;
+    }
+    log_append(log, buffer, count);
+    return count;
+}
+bool logged_input_ready(void *const context, const int timeout_ms) {
+    struct InputLog *const log = context;
+    return log->outer.input_ready(log->outer.context, timeout_ms);
+}
+void logged_write(
+    void *const context, const char *const data, const size_t length
+) {
+    struct InputLog *const log = context;
+    if (log->outer.write != NULL) {
+        log->outer.write(log->outer.context, data, length);
+        return;
+    }
+    for (size_t i = 0; i < length; ++i)
+        log->outer.write_char(log->outer.context, data[i]);
+}
+void logged_write_char(void *const context, const char ch) {
+    struct InputLog *const log = context;
+    log->outer.write_char(log->outer.context, ch);
+}
+void logged_flush(void *const context) {
+    struct InputLog *const log = context;
+    log->outer.flush(log->outer.context);
+}
+
+// Make room for one more of `count` items of `size` bytes in `*array`
+// Returns false if snapshots and pages would take more than the budget
+bool snapshot_reserve(
+    void **const array,
+    size_t *const capacity,
+    const size_t count,
+    const size_t size
+) {
+    if (count < *capacity)
+        return true;
+    const size_t grown = *capacity > 0 ? *capacity * 2 : 16;
+    const size_t used = snapshot_capacity * sizeof(struct Snapshot) +
+                        snapshot_page_capacity * sizeof(SnapshotPage);
+    if (used + (grown - *capacity) * size > snapshot_budget)
+        return false;
+    void *const resized = realloc(*array, grown * size);
+    if (resized == NULL)
+        return false;
+    *array = resized;
+    *capacity = grown;
+    return true;
+}
+
+// Returns false if there is no room for it
+bool take_snapshot(const struct InputLog *const log) {
+    if (!snapshot_reserve(
+            (void **)&snapshots,
+            &snapshot_capacity,
+            snapshot_count,
+            sizeof(struct Snapshot)
+        ))
+        return false;
+    struct Snapshot *const snapshot = &snapshots[snapshot_count];
+    const struct Snapshot *const previous =
+        snapshot_count > 0 ? &snapshots[snapshot_count - 1] : NULL;
+    for (size_t page = 0; page < SNAPSHOT_PAGES; ++page) {
+        const Word *const words = &memory[page << SNAPSHOT_PAGE_SHIFT];
+        if (previous != NULL &&
+            memcmp(
+                snapshot_pages[previous->pages[page]],
+                words,
+                sizeof(SnapshotPage)
+            ) == 0) {
+            snapshot->pages[page] = previous->pages[page];
+            continue;
+        }
+        if (!snapshot_reserve(
+                (void **)&snapshot_pages,
+                &snapshot_page_capacity,
+                snapshot_page_count,
+                sizeof(SnapshotPage)
+            ))
+            return false;
+        memcpy(
+            snapshot_pages[snapshot_page_count], words, sizeof(SnapshotPage)
+        );
+        snapshot->pages[page] = (uint32_t)snapshot_page_count++;
+    }
+    memcpy(snapshot->registers, registers, sizeof(registers));
+    snapshot->pc = pc;
+    snapshot->cc = cc;
+    snapshot->stdout_on_new_line = stdout_on_new_line;
+    snapshot->instructions = instructions_retired;
+    snapshot->input_position = log->length;
+    ++snapshot_count;
+    return true;
+}
+
+void restore_snapshot(const struct Snapshot *const snapshot) {
+    for (size_t page = 0; page < SNAPSHOT_PAGES; ++page)
+        memcpy(
+            &memory[page << SNAPSHOT_PAGE_SHIFT],
+            snapshot_pages[snapshot->pages[page]],
+            sizeof(SnapshotPage)
+        );
+    reset_state(snapshot->pc);
+    memcpy(registers, snapshot->registers, sizeof(registers));
+    cc = snapshot->cc;
+    stdout_on_new_line = snapshot->stdout_on_new_line;
+    instructions_retired = snapshot->instructions;
+}
+
+// Whether the VM is in the state of `snapshot`, except device registers
+bool matches_snapshot(const struct Snapshot *const snapshot) {
+    if (pc != snapshot->pc || cc != snapshot->cc ||
+        instructions_retired != snapshot->instructions ||
+        memcmp(registers, snapshot->registers, sizeof(registers)) != 0)
+        return false;
+    for (size_t page = 0; page < DEVICE_BASE >> SNAPSHOT_PAGE_SHIFT; ++page) {
+        if (memcmp(
+                &memory[page << SNAPSHOT_PAGE_SHIFT],
+                snapshot_pages[snapshot->pages[page]],
+                sizeof(SnapshotPage)
+            ) != 0)
+            return false;
+    }
+    return true;
+}
+
+// Run the program with `engine`, taking a snapshot at the start of each
+// interval, and counting basic blocks per interval if `sample`
+enum Error record_intervals(
+    const struct Engine *const engine, const uint64_t length, const bool sample
+) {
+    struct InputLog *const log = &input_log;
+    log->outer = io;
+    io.read_char = logged_read_char;
+    io.write_char = logged_write_char;
+    io.flush = logged_flush;
+    io.context = log;
+    io.read = logged_read;
+    io.write = logged_write;
+    io.input_ready = log->outer.input_ready != NULL ? logged_input_ready : NULL;
+
+    if (sample)
+        assert(simpoint_attach(), "Failed to attach block counter");
+    // Snapshots live until every worker is done, so they may use at most
+    // half of memory
+    snapshot_budget = (size_t)sysconf(_SC_PHYS_PAGES) / 2 *
+                      (size_t)sysconf(_SC_PAGE_SIZE);
+    enum Error error;
+    do {
+        if (!take_snapshot(log)) {
+            print_on_new_line();
+            fprintf(
+                stderr,
+                "Snapshots would take more than %zu MB of memory after %zu "
+                "intervals; use longer intervals.\n",
+                snapshot_budget >> 20,
+                snapshot_count
+            );
+            error = ERR_CLI;
+            break;
+        }
+        error = engine->execute_until(instructions_retired + length);
+        if (sample)
+            simpoint_end_interval(snapshots[snapshot_count - 1].vector);
+    } while (error == ERR_LIMIT);
+    io.flush(io.context);
+    io = log->outer;
+    return error;
+}
+
+bool worker_write(const int file, const void *const data, const size_t size) {
+    size_t total = 0;
+    while (total < size) {
+        const ssize_t count =
+            write(file, (const char *)data + total, size - total);
+        if (count <= 0)
+            return false;
+        total += (size_t)count;
+    }
+    return true;
+}
+
+bool worker_read(const int file, void *const data, const size_t size) {
+    size_t total = 0;
+    while (total < size) {
+        const ssize_t count = read(file, (char *)data + total, size - total);
+        if (count <= 0)
+            return false;
+        total += (size_t)count;
+    }
+    return true;
+}
+
+// Run `count` of `intervals` in turn, taking the next from `next`, then send
+// back a report and the results of every plugin
+void interval_worker(
+    const size_t *const intervals,
+    const size_t count,
+    _Atomic size_t *const next,
+    const int results
+) {
+    struct InputBuffer input = {input_log.data, input_log.length, 0};
+    io.read_char = buffer_read_char;
+    io.write_char = discard_char;
+    io.flush = flush_nothing;
+    io.context = &input;
+    io.read = buffer_read;
+    io.write = discard;
+    io.input_ready = NULL;
+    // Only the results merged into this process's copy are reported
+    detach_plugins();
+    for (int i = 0; i < interval_plugin_count; ++i) {
+        struct Plugin plugin = interval_plugins[i];
+        plugin.events &= ~(unsigned)EVENT_HALT;
+        assert(attach_plugin(&plugin), "Failed to attach plugin");
+    }
+
+    struct WorkerReport report = {0};
+    size_t n;
+    while ((n = atomic_fetch_add(next, 1)) < count) {
+        const size_t interval = intervals[n];
+        const struct Snapshot *const snapshot = &snapshots[interval];
+        const bool last = interval + 1 == snapshot_count;
+        restore_snapshot(snapshot);
+        input.position = snapshot->input_position;
+
+        const uint64_t start = perf_now();
+        const enum Error error =
+            execute_until(last ? UINT64_MAX : snapshot[1].instructions);
+        report.busy_ns += perf_now() - start;
+        ++report.intervals;
+        report.instructions += instructions_retired - snapshot->instructions;
+        if (last ? error != ERR_OK
+                 : error != ERR_LIMIT || !matches_snapshot(&snapshot[1]))
+            ++report.diverged;
+    }
+
+    bool ok = worker_write(results, &report, sizeof(report));
+    for (int i = 0; ok && i < interval_plugin_count; ++i) {
+        const struct Plugin *const plugin = &interval_plugins[i];
+        const uint64_t size = plugin->save_results(plugin->data, NULL, 0);
+        void *const buffer = malloc(size);
+        assert(buffer != NULL, "Out of memory");
+        (void)plugin->save_results(plugin->data, buffer, size);
+        ok = worker_write(results, &size, sizeof(size)) &&
+             worker_write(results, buffer, size);
+        free(buffer);
+    }
+}
+
+// Read a worker's report and the results of each plugin
+// Returns false if the worker did not send them all
+bool read_worker(const int file, struct WorkerResults *const worker) {
+    *worker = (struct WorkerResults){0};
+    if (!worker_read(file, &worker->report, sizeof(worker->report)))
+        return false;
+    for (int i = 0; i < interval_plugin_count; ++i) {
+        uint64_t size;
+        if (!worker_read(file, &size, sizeof(size)))
+            return false;
+        worker->results[i] = malloc(size);
+        assert(worker->results[i] != NULL, "Out of memory");
+        worker->sizes[i] = size;
+        if (!worker_read(file, worker->results[i], size))
+            return false;
+    }
+    return true;
+}
+
+// Merge a worker's results into these plugins `weight` times, and free them
+void merge_worker(struct WorkerResults *const worker, const size_t weight) {
+    for (int i = 0; i < interval_plugin_count; ++i) {
+        const struct Plugin *const plugin = &interval_plugins[i];
+        for (size_t n = 0; worker->results[i] != NULL && n < weight; ++n)
+            plugin->merge_results(
+                plugin->data, worker->results[i], worker->sizes[i]
+            );
+        free(worker->results[i]);
+    }
+}
+
+// Start a worker process on `count` of `intervals`, taking them in turn from
+// `next`
+// Returns the read end of the pipe which it sends its results to, or -1 if
+// it could not be started
+int start_worker(
+    const size_t *const intervals,
+    const size_t count,
+    _Atomic size_t *const next,
+    pid_t *const pid
+) {
+    int fds[2];
+    if (pipe(fds) != 0)
+        return -1;
+    *pid = fork();
+    if (*pid < 0) {
+        (void)close(fds[0]);
+        (void)close(fds[1]);
+        return -1;
+    }
+    if (*pid == 0) {
+        (void)close(fds[0]);
+        interval_worker(intervals, count, next, fds[1]);
+        // Without the parent's exit handlers
+        _exit(0);
+    }
+    (void)close(fds[1]);
+    return fds[0];
+}
+
+enum Error intervals_run(
+    const struct Engine *const engine,
+    const uint64_t length,
+    const size_t max_phases,
+    unsigned workers,
+    FILE *const report
+) {
+    const bool sample = max_phases > 0;
+    const uint64_t start = perf_now();
+    const enum Error error = record_intervals(engine, length, sample);
+    const uint64_t record_ns = perf_now() - start;
+    const uint64_t instructions = instructions_retired;
+    print_on_new_line();
+    flush_output();
+    if (error != ERR_OK)
+        return error;
+
+    // Every interval, shared by `workers` processes; or a process for the
+    // representative of each phase, weighted by the intervals in it
+    size_t *const intervals = malloc(snapshot_count * sizeof(size_t));
+    assert(intervals != NULL, "Out of memory");
+    size_t weights[MAX_PHASES];
+    size_t processes;
+    size_t interval_count;
+    const uint64_t cluster_start = perf_now();
+    if (sample) {
+        double(*const vectors)[SIMPOINT_DIMENSIONS] =
+            malloc(snapshot_count * sizeof(*vectors));
+        assert(vectors != NULL, "Out of memory");
+        for (size_t i = 0; i < snapshot_count; ++i)
+            memcpy(vectors[i], snapshots[i].vector, sizeof(*vectors));
+        processes = simpoint_choose(
+            (const double(*)[SIMPOINT_DIMENSIONS])vectors,
+            snapshot_count,
+            max_phases,
+            intervals,
+            weights
+        );
+        interval_count = processes;
+        free(vectors);
+    } else {
+        for (size_t i = 0; i < snapshot_count; ++i)
+            intervals[i] = i;
+        interval_count = snapshot_count;
+        processes = workers < snapshot_count ? workers : snapshot_count;
+        if (processes > MAX_INTERVAL_WORKERS)
+            processes = MAX_INTERVAL_WORKERS;
+    }
+    const uint64_t cluster_ns = perf_now() - cluster_start;
+    if (workers > processes)
+        workers = (unsigned)processes;
+    if (workers > MAX_INTERVAL_WORKERS)
+        workers = MAX_INTERVAL_WORKERS;
+
+    // Shared by every worker, or one for each
+    const size_t counter_count = sample ? processes : 1;
+    _Atomic size_t *const counters = mmap(
+        NULL,
+        counter_count * sizeof(*counters),
+        PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS,
+        -1,
+        0
+    );
+    assert(counters != MAP_FAILED, "Failed to map interval counters");
+    for (size_t i = 0; i < counter_count; ++i)
+        atomic_init(&counters[i], 0);
+
+    // At most `workers` run at once
+    const uint64_t detail_start = perf_now();
+    pid_t pids[MAX_INTERVAL_WORKERS];
+    int results[MAX_INTERVAL_WORKERS];
+    struct WorkerResults finished[MAX_INTERVAL_WORKERS];
+    bool ok = true;
+    for (size_t i = 0; i < processes + workers; ++i) {
+        if (i >= workers) {
+            const size_t done = i - workers;
+            if (results[done] < 0) {
+                finished[done] = (struct WorkerResults){0};
+            } else {
+                if (!read_worker(results[done], &finished[done])) {
+                    fprintf(stderr, "Worker %zu failed.\n", done);
+                    ok = false;
+                }
+                (void)close(results[done]);
+                (void)waitpid(pids[done], NULL, 0);
+            }
+        }
+        if (i < processes) {
+            results[i] = start_worker(
+                sample ? &intervals[i] : intervals,
+                sample ? 1 : interval_count,
+                &counters[sample ? i : 0],
+                &pids[i]
+            );
+            if (results[i] < 0) {
+                fprintf(stderr, "Failed to start worker %zu.\n", i);
+                ok = false;
+            }
+        }
+    }
+    for (size_t i = 0; i < processes; ++i)
+        merge_worker(&finished[i], !ok ? 0 : sample ? weights[i] : 1);
+    const uint64_t detail_ns = perf_now() - detail_start;
+    (void)munmap((void *)counters, counter_count * sizeof(*counters));
+    if (!ok) {
+        free(intervals);
+        return ERR_PLUGIN;
+    }
+
+    for (int i = 0; i < interval_plugin_count; ++i) {
+        const struct Plugin *const plugin = &interval_plugins[i];
+        if (plugin->events & EVENT_HALT)
+            plugin->halt(plugin->data, instructions);
+    }
+
+    fprintf(
+        report,
+        "%-28s%" PRIu64 " instructions, %zu intervals, %.3f ms (%s)\n",
+        "First run:",
+        instructions,
+        snapshot_count,
+        record_ns / 1e6,
+        sample ? "interpreter, counting blocks" : engine->name
+    );
+    uint64_t diverged = 0;
+    if (sample) {
+        fprintf(
+            report,
+            "%-28s%zu phases, %.3f ms\n",
+            "Clustering:",
+            processes,
+            cluster_ns / 1e6
+        );
+        fprintf(
+            report,
+            "%-8s%12s%16s%16s%14s%10s\n",
+            "Phase",
+            "Intervals",
+            "Representative",
+            "Instructions",
+            "Busy (ms)",
+            "Diverged"
+        );
+        for (size_t i = 0; i < processes; ++i) {
+            fprintf(
+                report,
+                "%-8zu%12zu%16zu%16" PRIu64 "%14.3f%10" PRIu64 "\n",
+                i,
+                weights[i],
+                intervals[i],
+                finished[i].report.instructions,
+                finished[i].report.busy_ns / 1e6,
+                finished[i].report.diverged
+            );
+            diverged += finished[i].report.diverged;
+        }
+    } else {
+        fprintf(
+            report,
+            "%-8s%12s%16s%14s%10s\n",
+            "Worker",
+            "Intervals",
+            "Instructions",
+            "Busy (ms)",
+            "Diverged"
+        );
+        for (size_t i = 0; i < processes; ++i) {
+            fprintf(
+                report,
+                "%-8zu%12" PRIu64 "%16" PRIu64 "%14.3f%10" PRIu64 "\n",
+                i,
+                finished[i].report.intervals,
+                finished[i].report.instructions,
+                finished[i].report.busy_ns / 1e6,
+                finished[i].report.diverged
+            );
+            diverged += finished[i].report.diverged;
+        }
+    }
+    fprintf(report, "%-28s%.3f ms\n", "Detailed runs:", detail_ns / 1e6);
+    if (sample)
+        fprintf(
+            report,
+            "Results are estimated from %zu of %zu intervals, each weighted by "
+            "the intervals in its phase.\n",
+            processes,
+            snapshot_count
+        );
+    if (diverged > 0)
+        fprintf(
+            report,
+            "%" PRIu64 " intervals did not end where the first run did, so "
+            "results may be inexact.\n",
+            diverged
+        );
+    free(intervals);
+    return ERR_OK;
+}
@@ -0,0 +1,51 @@
+// Detailed simulation of a long run, in parallel from snapshots
+// The program first runs with the chosen engine and no plugins, saving a
+// snapshot of the VM (memory, registers and instruction count) at the start of
+// every interval, and logging all of its input. A snapshot only copies the
+// pages of memory which changed since the one before, and snapshots may use at
+// most half of physical memory. Worker processes then take intervals in turn:
+// each restores the snapshot and runs the interval again in the interpreter
+// with the plugins attached, with the input replayed from where it was, until
+// the instruction count of the next snapshot. An interval which does not end in
+// the state of the next snapshot is reported as diverged. Workers are
+// processes, so plugins keep their state in globals as usual, but each sees
+// only some intervals: at the end, the results of every worker's copy of a
+// plugin are merged into this process's copy (see `merge_results` in
+// `plugin.h`), which then reports as if it had seen the whole run.
+
+#ifndef INTERVALS_H
+#define INTERVALS_H
+
+// Libc
+#include <stdbool.h>  // bool
+#include <stddef.h>   // size_t
+#include <stdint.h>   // uint64_t
+#include <stdio.h>    // FILE
+// Local
+#include "plugin.h"  // struct Plugin
+#include "vm.h"      // struct Engine, etc
+
+#define MAX_INTERVAL_PLUGINS 8
+
+// Attach `plugin` to the detailed runs, instead of this VM
+// `name` is only for errors
+// Returns false if there are too many, or it cannot merge results
+bool intervals_add_plugin(const struct Plugin *plugin, const char *name);
+
+// Run the loaded program with `engine`, saving a snapshot every `length`
+// instructions, then run every interval again with the plugins on up to
+// `workers` processes, merge their results and report the time taken to
+// `report`
+// If `max_phases` is not 0, the first run counts basic blocks instead (see
+// `simpoint.h`), and only the representative interval of each of up to that
+// many phases runs again, its results merged once per interval in its phase
+// Output is only written by the first run
+enum Error intervals_run(
+    const struct Engine *engine,
+    uint64_t length,
+    size_t max_phases,
+    unsigned workers,
+    FILE *report
+);
+
+#endif
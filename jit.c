@@ -0,0 +1,1482 @@
+// For memfd_create
+#define _GNU_SOURCE
+
+#include "jit.h"
+
+// Libc
+#include <stdatomic.h>  // atomic_load_explicit, etc
+#include <stdbool.h>    // bool
+#include <stddef.h>     // offsetof
+#include <stdlib.h>     // calloc, free, malloc
+#include <string.h>     // memcpy, memset
+// POSIX
+#include <pthread.h>    // pthread_mutex_lock, etc
+#include <sched.h>      // sched_yield
+#include <semaphore.h>  // sem_t, sem_post, sem_wait
+#include <sys/mman.h>   // memfd_create, mmap, munmap
+#include <unistd.h>     // close, ftruncate
+// Local
+#include "metrics.h"  // metrics, metrics_add
+#include "perfmap.h"  // perfmap_add, perfmap_enabled
+
+#define JIT_MAX_BLOCK 64     // Instructions in a block
+#define JIT_HOT 16           // Interpreter runs before a block is requested
+#define JIT_PROMOTE 1024     // Runs in a sweep before a block is made hot
+#define JIT_CHAIN 65536      // Most instructions between dispatches
+#define JIT_SWEEP (1 << 22)  // Instructions between sweeps of the counters
+#define JIT_MAX_LINKS 16384  // Chained exits for each VM
+#define QUEUE_SIZE 256       // Requests waiting for the compiler
+#define MAX_PRELOAD_THREADS 64
+// Bytes of code for each VM, in segments which are evicted whole
+// Both may be overridden, eg. to test eviction
+#ifndef JIT_CODE_SIZE
+#define JIT_CODE_SIZE (4 << 20)
+#endif
+#ifndef JIT_SEGMENT_SIZE
+#define JIT_SEGMENT_SIZE (64 << 10)
+#endif
+#define JIT_SEGMENTS (JIT_CODE_SIZE / JIT_SEGMENT_SIZE)
+// Segments at the start of the buffer, for blocks which run the most
+#define JIT_HOT_SEGMENTS ((JIT_SEGMENTS + 7) / 8)
+_Static_assert(JIT_SEGMENTS >= 2, "Hot and cold regions need a segment each");
+
+// Why translated code returned, if not at the end of a block
+#define EXIT_INTERPRET 0x1  // At an instruction for the interpreter
+#define EXIT_WRITTEN 0x2    // After a store to translated code
+
+// Everything translated code uses, passed to it in a register
+// Translated code has these offsets built in
+struct JitFrame {
+    Word *memory;
+    Word *registers;
+    uint8_t *cc;
+    Word *pc;
+    const uint8_t *code_words;  // See `JitContext`
+    int64_t budget;             // Instructions it may still retire
+    uint32_t *runs;             // See `JitContext`
+    const uint8_t *link;        // Cell of the last exit, if it can be chained
+    bool stored;                // Set by blocks which store to memory
+};
+_Static_assert(
+    offsetof(struct JitFrame, code_words) == 32 &&
+        offsetof(struct JitFrame, budget) == 40 &&
+        offsetof(struct JitFrame, runs) == 48 &&
+        offsetof(struct JitFrame, link) == 56 &&
+        offsetof(struct JitFrame, stored) == 64,
+    "Frame layout is built in"
+);
+
+typedef uint32_t (*JitCode)(struct JitFrame *frame);
+
+// Header of a translated block, followed by its code
+// Exits to a constant address jump through a cell after the code, which
+// points to a tail returning to the dispatcher until the exit is chained to
+// the block at that address
+struct JitBlock {
+    _Atomic uint64_t generation;  // Of translations; 0 while being written
+    uint32_t size;                // Bytes to the next block in its segment
+    Word start;
+    uint16_t length;   // Most instructions it can retire
+    uint16_t chained;  // Offset in `code` of the entry for chained exits
+    bool stores;
+    bool hot;  // In the hot region
+    uint8_t code[] __attribute__((aligned(16)));
+};
+
+struct JitContext;
+
+struct JitRequest {
+    struct JitContext *context;
+    uint64_t generation;
+    Word start;
+    uint16_t length;
+    bool hot;
+    Word words[JIT_MAX_BLOCK];  // As they were when requested
+};
+
+// The compiler fills one segment of each region at a time, and the VM
+// empties full ones when the compiler runs out
+enum SegmentState {
+    SEGMENT_FREE,
+    SEGMENT_FILLING,
+    SEGMENT_FULL,
+};
+
+struct Segment {
+    _Atomic uint8_t state;
+    _Atomic uint32_t used;  // Bytes of finished blocks
+};
+
+enum Region {
+    REGION_HOT,
+    REGION_COLD,
+};
+
+// A chained exit, so it can be unlinked
+struct Link {
+    const uint8_t *cell;
+    const uint8_t *tail;  // What the cell pointed to before
+    const struct JitBlock *to;
+};
+
+// Translations for one VM
+struct JitContext {
+    // Only used by the VM's thread
+    uint8_t heat[MEMORY_SIZE];        // Interpreter runs from each address
+    uint8_t code_words[MEMORY_SIZE];  // Nonzero if translated or requested
+    uint8_t translated[MEMORY_SIZE];  // Nonzero if ever requested
+    uint8_t promoting[MEMORY_SIZE];   // Nonzero while moving to the hot region
+    uint32_t runs[MEMORY_SIZE];  // Of blocks from each address, aged by sweeps
+    size_t requested;            // Since the last flush
+    struct JitFrame frame;
+    struct Link links[JIT_MAX_LINKS];
+    size_t link_count;
+    unsigned hands[2];    // Of the eviction clock, for each region
+    uint64_t swept_at;    // Instructions retired at the last sweep
+    bool preload_wanted;  // A program was loaded, and not yet preloaded
+    // Shared with the compiler thread
+    _Atomic(const struct JitBlock *) blocks[MEMORY_SIZE];
+    _Atomic uint64_t generation;    // Bumped when translations are thrown away
+    _Atomic unsigned in_flight;     // Requests the compiler is not done with
+    _Atomic unsigned evict_wanted;  // Bit for each region with no free segment
+    struct Segment segments[JIT_SEGMENTS];
+    const uint8_t *executable;  // Code buffer
+    // Only used by the compiler thread
+    uint8_t *writable;         // Another mapping of the code buffer
+    int filling[2];            // Segment of each region, or -1
+    uint64_t code_generation;  // Of blocks in the `filling` segments
+};
+
+static _Thread_local struct JitContext *context = NULL;
+static _Thread_local bool context_failed = false;
+static pthread_key_t context_key;  // To destroy the context at thread exit
+
+// Bounded queue of requests from every VM to the compiler
+// Each cell's sequence number says whether it is free for the producer at
+// that position, or full for the consumer
+struct QueueCell {
+    _Atomic size_t sequence;
+    struct JitRequest request;
+};
+static struct QueueCell queue[QUEUE_SIZE];
+static _Atomic size_t queue_head = 0;  // Next position to fill
+static size_t queue_tail = 0;          // Next position to take
+static sem_t queue_ready;              // Posted for every request
+static pthread_once_t compiler_once = PTHREAD_ONCE_INIT;
+static bool compiler_running = false;
+
+// Blocks found when a program is loaded, translated by a pool of threads
+struct Preload {
+    struct JitContext *context;
+    const struct JitRequest *requests;
+    size_t count;
+    _Atomic size_t next;        // Request to translate next
+    _Atomic size_t translated;  // Blocks installed
+};
+
+static unsigned preload_threads = 0;  // See `jit_set_preload`
+// Held by the VM preloading, as the pool works on one program at a time
+static pthread_mutex_t preload_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+static struct Preload *pool_job = NULL;
+static unsigned pool_size = 0;     // Threads started
+static unsigned pool_wanted = 0;   // Threads still to join `pool_job`
+static unsigned pool_working = 0;  // Threads which joined it and are not done
+
+// Returns false if the queue is full
+bool queue_push(const struct JitRequest *const request) {
+    size_t position = atomic_load_explicit(&queue_head, memory_order_relaxed);
+    while (true) {
+        struct QueueCell *const cell = &queue[position % QUEUE_SIZE];
+        const size_t sequence =
+            atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        if (sequence == position) {
+            if (atomic_compare_exchange_weak_explicit(
+                    &queue_head,
+                    &position,
+                    position + 1,
+                    memory_order_relaxed,
+                    memory_order_relaxed
+                )) {
+                cell->request = *request;
+                atomic_store_explicit(
+                    &cell->sequence, position + 1, memory_order_release
+                );
+                return true;
+            }
+        } else if ((ptrdiff_t)(sequence - position) < 0) {
+            return false;
+        } else {
+            position =
+                atomic_load_explicit(&queue_head, memory_order_relaxed);
+        }
+    }
+}
+
+// Only called by the compiler thread
+// Returns false if the queue is empty
+bool queue_pop(struct JitRequest *const request) {
+    struct QueueCell *const cell = &queue[queue_tail % QUEUE_SIZE];
+    const size_t sequence =
+        atomic_load_explicit(&cell->sequence, memory_order_acquire);
+    if (sequence != queue_tail + 1)
+        return false;
+    *request = cell->request;
+    atomic_store_explicit(
+        &cell->sequence, queue_tail + QUEUE_SIZE, memory_order_release
+    );
+    ++queue_tail;
+    return true;
+}
+
+Word field(const Word instruction, const unsigned bits) {
+    const unsigned sign = 1U << (bits - 1);
+    return (Word)(((instruction & ((1U << bits) - 1)) ^ sign) - sign);
+}
+
+enum Kind classify(const Word instruction, const Word address) {
+    const Word target = (Word)(address + 1 + field(instruction, 9));
+    switch ((enum Opcode)(instruction >> 12)) {
+        case OP_ADD:
+        case OP_AND:
+            return (instruction & 0x20) || (instruction & 0x18) == 0
+                       ? KIND_PLAIN
+                       : KIND_OTHER;
+        case OP_NOT:
+            return (instruction & 0x3f) == 0x3f ? KIND_PLAIN : KIND_OTHER;
+        case OP_LEA:
+        case OP_LDR:
+        case OP_STR:
+            return KIND_PLAIN;
+        // Device registers at a fixed address are left to the interpreter
+        case OP_LD:
+        case OP_LDI:
+        case OP_ST:
+        case OP_STI:
+            return target < DEVICE_BASE ? KIND_PLAIN : KIND_OTHER;
+        case OP_BR:
+            if (instruction == 0x0000)
+                return KIND_PLAIN;  // NOP
+            return (instruction & 0x0e00) != 0 ? KIND_BRANCH : KIND_OTHER;
+        case OP_JMP_RET:
+            return (instruction & 0x0e3f) == 0 ? KIND_BRANCH : KIND_OTHER;
+        case OP_JSR_JSRR:
+            return (instruction & 0x0800) || (instruction & 0x0e3f) == 0
+                       ? KIND_BRANCH
+                       : KIND_OTHER;
+        default:
+            return KIND_OTHER;
+    }
+}
+
+bool branch_target(
+    const Word instruction, const Word address, Word *const target
+) {
+    const Word next = (Word)(address + 1);
+    switch ((enum Opcode)(instruction >> 12)) {
+        case OP_BR:
+            *target = (Word)(next + field(instruction, 9));
+            return instruction != 0x0000;  // NOP
+        case OP_JSR_JSRR:
+            *target = (Word)(next + field(instruction, 11));
+            return instruction & 0x0800;
+        default:
+            return false;
+    }
+}
+
+unsigned scan_block(const Word start, unsigned *const translated) {
+    *translated = 0;
+    for (unsigned count = 0; count < JIT_MAX_BLOCK; ++count) {
+        const Word address = (Word)(start + count);
+        if (address >= DEVICE_BASE)
+            return count > 0 ? count : 1;
+        const enum Kind kind = classify(memory[address], address);
+        if (kind != KIND_OTHER)
+            *translated = count + 1;
+        if (kind != KIND_PLAIN)
+            return count + 1;
+    }
+    return JIT_MAX_BLOCK;
+}
+
+#if defined(__x86_64__)
+
+// Code generation
+// Guest registers and memory stay in memory. While a block runs:
+// * rbx: `registers`
+// * rbp: the frame, for loading the rest
+// * r12: `memory`
+// * r13: `cc`
+// * r14: `pc`
+// * r15: `code_words`
+// * eax, ecx, edx: scratch
+// Chained blocks keep these, and only `pc` is left stale between them
+
+struct Emitter {
+    uint8_t *code;
+    size_t size;  // May pass `capacity`, in which case nothing more is written
+    size_t capacity;
+};
+
+void emit(struct Emitter *const emitter, const uint8_t *bytes, size_t count) {
+    if (emitter->size + count <= emitter->capacity)
+        memcpy(emitter->code + emitter->size, bytes, count);
+    emitter->size += count;
+}
+#define EMIT(_emitter, ...)                   \
+    emit(                                     \
+        _emitter,                             \
+        (const uint8_t[]){__VA_ARGS__},       \
+        sizeof((const uint8_t[]){__VA_ARGS__}) \
+    )
+// Little-endian immediates
+#define IMM16(_value) (uint8_t)(_value), (uint8_t)((_value) >> 8)
+#define IMM32(_value) \
+    IMM16(_value), (uint8_t)((_value) >> 16), (uint8_t)((_value) >> 24)
+// Displacement of a guest register from rbx
+#define REG(_reg) (uint8_t)((_reg) * sizeof(Word))
+
+// Point the 32-bit displacement at `at` to `target`
+void patch(
+    struct Emitter *const emitter, const size_t at, const size_t target
+) {
+    const uint32_t displacement = (uint32_t)(target - at - 4);
+    if (at + 4 <= emitter->capacity)
+        memcpy(emitter->code + at, (uint8_t[]){IMM32(displacement)}, 4);
+}
+
+// A conditional jump out of the block, emitted after the rest of it
+struct Exit {
+    size_t patch;  // Of the jump's displacement
+    Word pc;
+    uint8_t count;  // Instructions retired
+    uint8_t flags;  // `EXIT_*`, or 0 if it can be chained
+};
+
+// An exit through a cell, at most two for each block
+struct Cell {
+    size_t jump;  // Displacement of its `jmp [rip+cell]`
+    size_t load;  // Displacement of its tail's `lea rax, [rip+cell]`
+    size_t tail;
+    Word pc;
+};
+#define MAX_CELLS 2
+
+void emit_return(struct Emitter *const emitter, const uint32_t result) {
+    EMIT(emitter, 0xb8, IMM32(result));  // mov eax, result
+    // pop r15, r14, r13, r12, rbp, rbx; ret
+    EMIT(emitter, 0x41, 0x5f, 0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c);
+    EMIT(emitter, 0x5d, 0x5b, 0xc3);
+}
+
+// Take retired instructions from the budget
+void emit_retire(struct Emitter *const emitter, const uint8_t count) {
+    if (count > 0)
+        EMIT(emitter, 0x48, 0x83, 0x6d, 0x28, count);  // sub [rbp+40], count
+}
+
+// Set `pc`, and return `result`
+void emit_exit(
+    struct Emitter *const emitter, const Word pc, const uint32_t result
+) {
+    EMIT(emitter, 0x66, 0x41, 0xc7, 0x46, 0x00, IMM16(pc));  // mov [r14], pc
+    emit_return(emitter, result);
+}
+
+// Retire `count` instructions and go on at `pc`, through a new cell
+void emit_chained(
+    struct Emitter *const emitter,
+    struct Cell *const cells,
+    size_t *const cell_count,
+    const Word pc,
+    const uint8_t count
+) {
+    emit_retire(emitter, count);
+    EMIT(emitter, 0xff, 0x25, IMM32(0));  // jmp [rip+cell]
+    cells[*cell_count] = (struct Cell){emitter->size - 4, 0, 0, pc};
+    ++*cell_count;
+}
+
+// Jump to an exit if the flags satisfy `condition` (the second byte of a
+// `jcc rel32`)
+void emit_jump_out(
+    struct Emitter *const emitter,
+    struct Exit *const exits,
+    size_t *const exit_count,
+    const uint8_t condition,
+    const struct Exit exit
+) {
+    EMIT(emitter, 0x0f, condition, IMM32(0));
+    exits[*exit_count] = exit;
+    exits[*exit_count].patch = emitter->size - 4;
+    ++*exit_count;
+}
+#define JAE 0x83
+#define JNE 0x85
+
+// Store ax to a guest register, and set the condition code from it
+void emit_result(struct Emitter *const emitter, const unsigned reg) {
+    EMIT(emitter, 0x66, 0x89, 0x43, REG(reg));  // mov [rbx+reg], ax
+    EMIT(emitter, 0x66, 0x85, 0xc0);            // test ax, ax
+    EMIT(emitter, 0xb9, IMM32(0x1));            // mov ecx, positive
+    EMIT(emitter, 0xba, IMM32(0x2));            // mov edx, zero
+    EMIT(emitter, 0x0f, 0x44, 0xca);            // cmovz ecx, edx
+    EMIT(emitter, 0xba, IMM32(0x4));            // mov edx, negative
+    EMIT(emitter, 0x0f, 0x48, 0xca);            // cmovs ecx, edx
+    EMIT(emitter, 0x41, 0x88, 0x4d, 0x00);      // mov [r13], cl
+}
+
+// Translate a requested block into the code of `block`, which will run at
+// `address`, and set its `stores` and `chained`
+// Returns the size of the code, or 0 if it does not fit in `capacity`
+size_t translate(
+    const struct JitRequest *const request,
+    struct JitBlock *const block,
+    const uint8_t *const address,
+    const size_t capacity
+) {
+    struct Emitter emitter = {block->code, 0, capacity};
+    struct Emitter *const e = &emitter;
+    struct Exit exits[2 * JIT_MAX_BLOCK];
+    size_t exit_count = 0;
+    struct Cell cells[MAX_CELLS];
+    size_t cell_count = 0;
+
+    block->stores = false;
+    for (unsigned i = 0; i < request->length; ++i) {
+        const enum Opcode opcode = (enum Opcode)(request->words[i] >> 12);
+        if (opcode == OP_ST || opcode == OP_STI || opcode == OP_STR)
+            block->stores = true;
+    }
+
+    // push rbx, rbp, r12, r13, r14, r15
+    EMIT(e, 0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57);
+    EMIT(e, 0x48, 0x89, 0xfd);        // mov rbp, rdi
+    EMIT(e, 0x4c, 0x8b, 0x65, 0x00);  // mov r12, [rbp]
+    EMIT(e, 0x48, 0x8b, 0x5d, 0x08);  // mov rbx, [rbp+8]
+    EMIT(e, 0x4c, 0x8b, 0x6d, 0x10);  // mov r13, [rbp+16]
+    EMIT(e, 0x4c, 0x8b, 0x75, 0x18);  // mov r14, [rbp+24]
+    EMIT(e, 0x4c, 0x8b, 0x7d, 0x20);  // mov r15, [rbp+32]
+
+    // Chained exits enter here, and return to the dispatcher at the start
+    // of the block if it could overrun the budget
+    block->chained = (uint16_t)e->size;
+    EMIT(e, 0x48, 0x83, 0x7d, 0x28, (uint8_t)request->length);
+    EMIT(e, 0x0f, 0x8c, IMM32(0));  // jl bail
+    const size_t bail = e->size - 4;
+    EMIT(e, 0x48, 0x8b, 0x4d, 0x30);  // mov rcx, [rbp+48]
+    // inc dword [rcx+start*4]
+    EMIT(e, 0xff, 0x81, IMM32(request->start * sizeof(uint32_t)));
+    if (block->stores)
+        EMIT(e, 0xc6, 0x45, 0x40, 0x01);  // mov byte [rbp+64], 1
+
+    bool ended = false;
+    for (unsigned i = 0; i < request->length && !ended; ++i) {
+        const Word instruction = request->words[i];
+        const Word address = (Word)(request->start + i);
+        const Word next = (Word)(address + 1);
+        const unsigned reg_a = (instruction >> 9) & 0x7;
+        const unsigned reg_b = (instruction >> 6) & 0x7;
+        const unsigned reg_c = instruction & 0x7;
+        const Word target = (Word)(next + field(instruction, 9));
+        const uint8_t count = (uint8_t)(i + 1);
+        // Leave device registers to the interpreter, for an address in ecx
+        const struct Exit device = {0, address, (uint8_t)i, EXIT_INTERPRET};
+        // After a store to translated code
+        const struct Exit written = {0, next, count, EXIT_WRITTEN};
+
+        switch ((enum Opcode)(instruction >> 12)) {
+            case OP_ADD:
+            case OP_AND: {
+                const bool add = (instruction >> 12) == OP_ADD;
+                EMIT(e, 0x0f, 0xb7, 0x43, REG(reg_b));  // movzx eax, [rbx+b]
+                if (instruction & 0x20) {
+                    // add/and ax, imm
+                    const Word immediate = field(instruction, 5);
+                    EMIT(e, 0x66, add ? 0x05 : 0x25, IMM16(immediate));
+                } else {
+                    // add/and ax, [rbx+c]
+                    EMIT(e, 0x66, add ? 0x03 : 0x23, 0x43, REG(reg_c));
+                }
+                emit_result(e, reg_a);
+            } break;
+
+            case OP_NOT:
+                EMIT(e, 0x0f, 0xb7, 0x43, REG(reg_b));  // movzx eax, [rbx+b]
+                EMIT(e, 0x66, 0xf7, 0xd0);              // not ax
+                emit_result(e, reg_a);
+                break;
+
+            case OP_LEA:
+                // mov word [rbx+a], target
+                EMIT(e, 0x66, 0xc7, 0x43, REG(reg_a), IMM16(target));
+                break;
+
+            case OP_LD:
+                // movzx eax, [r12+target*2]
+                EMIT(e, 0x41, 0x0f, 0xb7, 0x84, 0x24, IMM32(target * 2));
+                emit_result(e, reg_a);
+                break;
+
+            case OP_LDI:
+                // movzx ecx, [r12+target*2]
+                EMIT(e, 0x41, 0x0f, 0xb7, 0x8c, 0x24, IMM32(target * 2));
+                EMIT(e, 0x81, 0xf9, IMM32(DEVICE_BASE));  // cmp ecx, base
+                emit_jump_out(e, exits, &exit_count, JAE, device);
+                // movzx eax, [r12+rcx*2]
+                EMIT(e, 0x41, 0x0f, 0xb7, 0x04, 0x4c);
+                emit_result(e, reg_a);
+                break;
+
+            case OP_LDR:
+                EMIT(e, 0x0f, 0xb7, 0x4b, REG(reg_b));  // movzx ecx, [rbx+b]
+                // add cx, offset; movzx ecx, cx
+                EMIT(e, 0x66, 0x81, 0xc1, IMM16(field(instruction, 6)));
+                EMIT(e, 0x0f, 0xb7, 0xc9);
+                EMIT(e, 0x81, 0xf9, IMM32(DEVICE_BASE));  // cmp ecx, base
+                emit_jump_out(e, exits, &exit_count, JAE, device);
+                // movzx eax, [r12+rcx*2]
+                EMIT(e, 0x41, 0x0f, 0xb7, 0x04, 0x4c);
+                emit_result(e, reg_a);
+                break;
+
+            case OP_ST:
+                EMIT(e, 0x0f, 0xb7, 0x43, REG(reg_a));  // movzx eax, [rbx+a]
+                // mov [r12+target*2], ax
+                EMIT(e, 0x66, 0x41, 0x89, 0x84, 0x24, IMM32(target * 2));
+                // cmp byte [r15+target], 0
+                EMIT(e, 0x41, 0x80, 0xbf, IMM32(target), 0x00);
+                emit_jump_out(e, exits, &exit_count, JNE, written);
+                break;
+
+            case OP_STI:
+                // movzx ecx, [r12+target*2]
+                EMIT(e, 0x41, 0x0f, 0xb7, 0x8c, 0x24, IMM32(target * 2));
+                EMIT(e, 0x81, 0xf9, IMM32(DEVICE_BASE));  // cmp ecx, base
+                emit_jump_out(e, exits, &exit_count, JAE, device);
+                EMIT(e, 0x0f, 0xb7, 0x43, REG(reg_a));  // movzx eax, [rbx+a]
+                EMIT(e, 0x66, 0x41, 0x89, 0x04, 0x4c);  // mov [r12+rcx*2], ax
+                EMIT(e, 0x41, 0x80, 0x3c, 0x0f, 0x00);  // cmp byte [r15+rcx], 0
+                emit_jump_out(e, exits, &exit_count, JNE, written);
+                break;
+
+            case OP_STR:
+                EMIT(e, 0x0f, 0xb7, 0x4b, REG(reg_b));  // movzx ecx, [rbx+b]
+                // add cx, offset; movzx ecx, cx
+                EMIT(e, 0x66, 0x81, 0xc1, IMM16(field(instruction, 6)));
+                EMIT(e, 0x0f, 0xb7, 0xc9);
+                EMIT(e, 0x81, 0xf9, IMM32(DEVICE_BASE));  // cmp ecx, base
+                emit_jump_out(e, exits, &exit_count, JAE, device);
+                EMIT(e, 0x0f, 0xb7, 0x43, REG(reg_a));  // movzx eax, [rbx+a]
+                EMIT(e, 0x66, 0x41, 0x89, 0x04, 0x4c);  // mov [r12+rcx*2], ax
+                EMIT(e, 0x41, 0x80, 0x3c, 0x0f, 0x00);  // cmp byte [r15+rcx], 0
+                emit_jump_out(e, exits, &exit_count, JNE, written);
+                break;
+
+            case OP_BR: {
+                if (instruction == 0x0000)
+                    break;  // NOP
+                const uint8_t condition = reg_a;
+                ended = true;
+                if (condition == 0x7) {
+                    emit_chained(e, cells, &cell_count, target, count);
+                    break;
+                }
+                EMIT(e, 0x41, 0xf6, 0x45, 0x00, condition);  // test [r13], nzp
+                const struct Exit taken = {0, target, count, 0};
+                emit_jump_out(e, exits, &exit_count, JNE, taken);
+                emit_chained(e, cells, &cell_count, next, count);
+            } break;
+
+            case OP_JMP_RET:
+                ended = true;
+                EMIT(e, 0x0f, 0xb7, 0x43, REG(reg_b));  // movzx eax, [rbx+b]
+                EMIT(e, 0x66, 0x41, 0x89, 0x46, 0x00);  // mov [r14], ax
+                emit_retire(e, count);
+                emit_return(e, 0);
+                break;
+
+            case OP_JSR_JSRR:
+                ended = true;
+                // mov word [rbx+14], next
+                EMIT(e, 0x66, 0xc7, 0x43, REG(7), IMM16(next));
+                if (instruction & 0x0800) {
+                    const Word to = (Word)(next + field(instruction, 11));
+                    emit_chained(e, cells, &cell_count, to, count);
+                    break;
+                }
+                // After R7 is set, like the interpreter
+                EMIT(e, 0x0f, 0xb7, 0x43, REG(reg_b));  // movzx eax, [rbx+b]
+                EMIT(e, 0x66, 0x41, 0x89, 0x46, 0x00);  // mov [r14], ax
+                emit_retire(e, count);
+                emit_return(e, 0);
+                break;
+
+            // Never requested
+            default:
+                return 0;
+        }
+    }
+    if (!ended) {
+        const Word end = (Word)(request->start + request->length);
+        emit_chained(e, cells, &cell_count, end, (uint8_t)request->length);
+    }
+
+    for (size_t i = 0; i < exit_count; ++i) {
+        const struct Exit *const exit = &exits[i];
+        patch(e, exit->patch, e->size);
+        if (exit->flags == 0) {
+            emit_chained(e, cells, &cell_count, exit->pc, exit->count);
+        } else {
+            emit_retire(e, exit->count);
+            emit_exit(e, exit->pc, exit->flags);
+        }
+    }
+    patch(e, bail, e->size);
+    emit_exit(e, request->start, 0);
+
+    // Until it is chained, each cell points to a tail which returns it to the
+    // dispatcher
+    for (size_t i = 0; i < cell_count; ++i) {
+        cells[i].tail = e->size;
+        EMIT(e, 0x66, 0x41, 0xc7, 0x46, 0x00, IMM16(cells[i].pc));
+        EMIT(e, 0x48, 0x8d, 0x05, IMM32(0));  // lea rax, [rip+cell]
+        cells[i].load = e->size - 4;
+        EMIT(e, 0x48, 0x89, 0x45, 0x38);  // mov [rbp+56], rax
+        emit_return(e, 0);
+    }
+    while (e->size % sizeof(void *) != 0)
+        EMIT(e, 0xcc);  // int3
+    for (size_t i = 0; i < cell_count; ++i) {
+        patch(e, cells[i].jump, e->size);
+        patch(e, cells[i].load, e->size);
+        const uint8_t *const tail = address + cells[i].tail;
+        emit(e, (const uint8_t *)&tail, sizeof(tail));
+    }
+    return e->size <= e->capacity ? e->size : 0;
+}
+
+#else
+
+size_t translate(
+    const struct JitRequest *const request,
+    struct JitBlock *const block,
+    const uint8_t *const address,
+    const size_t capacity
+) {
+    (void)request;
+    (void)block;
+    (void)address;
+    (void)capacity;
+    return 0;
+}
+
+#endif
+
+// First segment of a region, and how many it has
+void region_segments(
+    const enum Region region, size_t *const first, size_t *const count
+) {
+    *first = region == REGION_HOT ? 0 : JIT_HOT_SEGMENTS;
+    *count = region == REGION_HOT ? JIT_HOT_SEGMENTS
+                                  : JIT_SEGMENTS - JIT_HOT_SEGMENTS;
+}
+
+// Take a free segment of a region for the compiler to fill
+// Returns -1, and asks the VM to evict one, if there are none
+int take_segment(struct JitContext *const jit, const enum Region region) {
+    size_t first, count;
+    region_segments(region, &first, &count);
+    for (size_t i = first; i < first + count; ++i) {
+        uint8_t expected = SEGMENT_FREE;
+        if (atomic_compare_exchange_strong_explicit(
+                &jit->segments[i].state,
+                &expected,
+                SEGMENT_FILLING,
+                memory_order_acquire,
+                memory_order_relaxed
+            ))
+            return (int)i;
+    }
+    atomic_fetch_or_explicit(
+        &jit->evict_wanted, 1U << region, memory_order_relaxed
+    );
+    return -1;
+}
+
+// Translate a block into the segment being filled for its region, out of
+// `filling` (the compiler's, or a preload thread's)
+// Returns NULL if there is no room for it
+struct JitBlock *place(
+    struct JitContext *const jit,
+    int *const filling,
+    const struct JitRequest *const request,
+    const uint64_t generation
+) {
+    const enum Region region = request->hot ? REGION_HOT : REGION_COLD;
+    while (true) {
+        if (filling[region] < 0) {
+            filling[region] = take_segment(jit, region);
+            if (filling[region] < 0)
+                return NULL;
+        }
+        struct Segment *const segment = &jit->segments[filling[region]];
+        const size_t used =
+            atomic_load_explicit(&segment->used, memory_order_relaxed);
+        const size_t offset =
+            (size_t)filling[region] * JIT_SEGMENT_SIZE + used;
+        struct JitBlock *const block =
+            (struct JitBlock *)(jit->writable + offset);
+        size_t size = 0;
+        if (used + sizeof(struct JitBlock) < JIT_SEGMENT_SIZE) {
+            atomic_store_explicit(&block->generation, 0, memory_order_relaxed);
+            size = translate(
+                request,
+                block,
+                jit->executable + offset + sizeof(struct JitBlock),
+                JIT_SEGMENT_SIZE - used - sizeof(struct JitBlock)
+            );
+        }
+        if (size > 0) {
+            block->size =
+                (sizeof(struct JitBlock) + size + 15) & ~(uint32_t)15;
+            block->start = request->start;
+            block->length = request->length;
+            block->hot = request->hot;
+            atomic_store_explicit(
+                &block->generation, generation, memory_order_release
+            );
+            atomic_store_explicit(
+                &segment->used, used + block->size, memory_order_release
+            );
+            return block;
+        }
+        if (used == 0)
+            return NULL;  // Not translatable
+        // Go on in the next free segment
+        atomic_store_explicit(
+            &segment->state, SEGMENT_FULL, memory_order_release
+        );
+        filling[region] = -1;
+    }
+}
+
+// Leave the segments being filled, so the VM can evict them
+void leave_segments(struct JitContext *const jit, int *const filling) {
+    for (int region = 0; region < 2; ++region) {
+        if (filling[region] < 0)
+            continue;
+        atomic_store_explicit(
+            &jit->segments[filling[region]].state,
+            SEGMENT_FULL,
+            memory_order_release
+        );
+        filling[region] = -1;
+    }
+}
+
+// Make a placed block the one run from its start
+// Returns false if the translations were thrown away meanwhile
+bool install(
+    struct JitContext *const jit,
+    const struct JitRequest *const request,
+    const struct JitBlock *const block,
+    const uint64_t generation
+) {
+    const struct JitBlock *const installed =
+        (const struct JitBlock *)(jit->executable +
+                                  ((const uint8_t *)block - jit->writable));
+    atomic_store(&jit->blocks[request->start], installed);
+    // If the translations were thrown away meanwhile, the VM may have missed
+    // this one. Either way, the VM checks the generation before running it
+    if (atomic_load(&jit->generation) != generation) {
+        const struct JitBlock *expected = installed;
+        atomic_compare_exchange_strong(
+            &jit->blocks[request->start], &expected, NULL
+        );
+        return false;
+    }
+    if (perfmap_enabled())
+        perfmap_add(
+            installed->code,
+            installed->size - sizeof(struct JitBlock),
+            request->start,
+            (Word)(request->start + request->length - 1)
+        );
+    return true;
+}
+
+// Translate and install a block, if it is still wanted
+void compile(const struct JitRequest *const request) {
+    struct JitContext *const jit = request->context;
+    const uint64_t generation = atomic_load(&jit->generation);
+    if (request->generation != generation)
+        return;  // Written over since it was requested
+    if (jit->code_generation != generation) {
+        // Nothing older is run any more. Start new segments, so the VM can
+        // evict the old ones whole
+        leave_segments(jit, jit->filling);
+        jit->code_generation = generation;
+    }
+
+    const struct JitBlock *const block =
+        place(jit, jit->filling, request, generation);
+    if (block == NULL)
+        return;  // Dropped until the VM has evicted a segment
+    (void)install(jit, request, block, generation);
+}
+
+void *compiler_main(void *const arg) {
+    (void)arg;
+    struct JitRequest request;
+    while (true) {
+        if (sem_wait(&queue_ready) != 0)
+            continue;
+        // Every post follows a push
+        while (!queue_pop(&request))
+            sched_yield();
+        compile(&request);
+        atomic_fetch_sub_explicit(
+            &request.context->in_flight, 1, memory_order_release
+        );
+    }
+    return NULL;
+}
+
+// Translate requests of a preload until there are none left
+void preload_blocks(struct Preload *const job) {
+    struct JitContext *const jit = job->context;
+    int filling[2] = {-1, -1};
+    size_t translated = 0;
+    while (true) {
+        const size_t i =
+            atomic_fetch_add_explicit(&job->next, 1, memory_order_relaxed);
+        if (i >= job->count)
+            break;
+        const struct JitRequest *const request = &job->requests[i];
+        const struct JitBlock *const block =
+            place(jit, filling, request, request->generation);
+        if (block != NULL && install(jit, request, block, request->generation))
+            ++translated;
+    }
+    leave_segments(jit, filling);
+    atomic_fetch_add_explicit(
+        &job->translated, translated, memory_order_relaxed
+    );
+}
+
+void *preload_main(void *const arg) {
+    (void)arg;
+    pthread_mutex_lock(&pool_lock);
+    while (true) {
+        while (pool_wanted == 0)
+            pthread_cond_wait(&pool_wake, &pool_lock);
+        --pool_wanted;
+        ++pool_working;
+        struct Preload *const job = pool_job;
+        pthread_mutex_unlock(&pool_lock);
+        preload_blocks(job);
+        pthread_mutex_lock(&pool_lock);
+        if (--pool_working == 0)
+            pthread_cond_signal(&pool_done);
+    }
+    return NULL;
+}
+
+// Start pool threads until there are `count`, or as many as can be started
+// Called with `pool_lock` held
+void grow_preload_pool(const unsigned count) {
+    while (pool_size < count) {
+        pthread_t thread;
+        if (start_helper_thread(&thread, preload_main, NULL) != 0)
+            break;
+        (void)pthread_detach(thread);
+        ++pool_size;
+    }
+}
+
+// Whether the instructions before the next word can go on to it
+bool goes_on(const Word instruction, const enum Kind kind) {
+    switch (kind) {
+        case KIND_PLAIN:
+            return true;
+        case KIND_BRANCH:
+            // Calls return to the next word
+            return (enum Opcode)(instruction >> 12) == OP_JSR_JSRR ||
+                   ((enum Opcode)(instruction >> 12) == OP_BR &&
+                    (instruction & 0x0e00) != 0x0e00);
+        default:
+            // Traps return, except HALT
+            return instruction != 0xf025;
+    }
+}
+
+// Find the start of every block statically reachable from `pc`: through
+// branches and calls to a constant address, and on past the end of blocks
+// which can go on, including traps and calls
+// Returns how many there are, or 0 if memory ran out
+size_t find_blocks(Word *const starts) {
+    uint8_t *const seen = calloc(MEMORY_SIZE, sizeof(*seen));
+    // Each block pushes at most two more
+    Word *const stack = malloc((2 * MEMORY_SIZE + 1) * sizeof(*stack));
+    size_t count = 0;
+    size_t depth = 0;
+    if (seen != NULL && stack != NULL)
+        stack[depth++] = pc;
+    while (depth > 0) {
+        const Word start = stack[--depth];
+        if (start >= DEVICE_BASE || seen[start])
+            continue;
+        seen[start] = 1;
+        unsigned translated;
+        const unsigned length = scan_block(start, &translated);
+        if (translated > 0)
+            starts[count++] = start;
+        const Word last = (Word)(start + length - 1);
+        const Word instruction = memory[last];
+        Word target;
+        if (branch_target(instruction, last, &target))
+            stack[depth++] = target;
+        if (goes_on(instruction, classify(instruction, last)))
+            stack[depth++] = (Word)(last + 1);
+    }
+    free(seen);
+    free(stack);
+    return count;
+}
+
+// Translate every block statically reachable from `pc` now, on `threads`
+// threads including this one
+// Returns how many were translated
+size_t preload(struct JitContext *const jit, const unsigned threads) {
+    Word *const starts = malloc(MEMORY_SIZE * sizeof(*starts));
+    if (starts == NULL)
+        return 0;
+    const size_t count = find_blocks(starts);
+    struct JitRequest *const requests =
+        count > 0 ? malloc(count * sizeof(*requests)) : NULL;
+    if (requests == NULL) {
+        free(starts);
+        return 0;
+    }
+    const uint64_t generation =
+        atomic_load_explicit(&jit->generation, memory_order_relaxed);
+    for (size_t i = 0; i < count; ++i) {
+        struct JitRequest *const request = &requests[i];
+        unsigned translated;
+        (void)scan_block(starts[i], &translated);
+        request->context = jit;
+        request->generation = generation;
+        request->start = starts[i];
+        request->length = (uint16_t)translated;
+        request->hot = false;
+        memcpy(request->words, &memory[starts[i]], translated * sizeof(Word));
+        // Stores to these words now throw the translation away
+        memset(&jit->code_words[starts[i]], 1, translated);
+        jit->translated[starts[i]] = 1;
+    }
+    jit->requested += count;
+    free(starts);
+
+    struct Preload job = {jit, requests, count, 0, 0};
+    pthread_mutex_lock(&preload_lock);
+    pthread_mutex_lock(&pool_lock);
+    grow_preload_pool(threads - 1);
+    pool_job = &job;
+    pool_wanted = threads - 1 < pool_size ? threads - 1 : pool_size;
+    pthread_cond_broadcast(&pool_wake);
+    pthread_mutex_unlock(&pool_lock);
+    preload_blocks(&job);
+    // Threads which have not woken up yet are not needed any more
+    pthread_mutex_lock(&pool_lock);
+    pool_wanted = 0;
+    while (pool_working > 0)
+        pthread_cond_wait(&pool_done, &pool_lock);
+    pool_job = NULL;
+    pthread_mutex_unlock(&pool_lock);
+    pthread_mutex_unlock(&preload_lock);
+
+    free(requests);
+    return atomic_load_explicit(&job.translated, memory_order_relaxed);
+}
+
+// The installed block starting at `start`, if there is one
+const struct JitBlock *lookup(
+    struct JitContext *const jit, const Word start
+) {
+    const struct JitBlock *const block =
+        atomic_load_explicit(&jit->blocks[start], memory_order_acquire);
+    if (block == NULL ||
+        atomic_load_explicit(&block->generation, memory_order_acquire) !=
+            atomic_load_explicit(&jit->generation, memory_order_relaxed) ||
+        block->start != start)
+        return NULL;
+    return block;
+}
+
+// Whether a block is still the one its start address dispatches to
+bool is_installed(
+    struct JitContext *const jit, const struct JitBlock *const block
+) {
+    return atomic_load_explicit(
+               &jit->blocks[block->start], memory_order_relaxed
+           ) == block;
+}
+
+size_t segment_of(struct JitContext *const jit, const void *const address) {
+    return (size_t)((const uint8_t *)address - jit->executable) /
+           JIT_SEGMENT_SIZE;
+}
+
+// The block at `offset` in a segment
+const struct JitBlock *segment_block(
+    struct JitContext *const jit, const size_t segment, const size_t offset
+) {
+    return (const struct JitBlock *)(jit->executable +
+                                     segment * JIT_SEGMENT_SIZE + offset);
+}
+
+// Chain the cell of an exit to the block at `target`, if there is one
+// Only the VM's thread writes cells, while no translated code is running
+void chain(
+    struct JitContext *const jit, const uint8_t *const cell, const Word target
+) {
+    const struct JitBlock *const to = lookup(jit, target);
+    if (to == NULL || jit->link_count == JIT_MAX_LINKS)
+        return;
+    uint8_t *const writable = jit->writable + (cell - jit->executable);
+    struct Link *const link = &jit->links[jit->link_count++];
+    link->cell = cell;
+    memcpy(&link->tail, writable, sizeof(link->tail));
+    link->to = to;
+    const uint8_t *const entry = to->code + to->chained;
+    memcpy(writable, &entry, sizeof(entry));
+}
+
+// Point a chained exit back to its tail, and forget it
+void unchain(struct JitContext *const jit, const size_t index) {
+    struct Link *const link = &jit->links[index];
+    memcpy(
+        jit->writable + (link->cell - jit->executable),
+        &link->tail,
+        sizeof(link->tail)
+    );
+    *link = jit->links[--jit->link_count];
+}
+
+// Remove a full segment's blocks from the dispatch table, unlink every exit
+// chained into them, and give it back to the compiler
+void evict_segment(struct JitContext *const jit, const size_t segment) {
+    const size_t used = atomic_load_explicit(
+        &jit->segments[segment].used, memory_order_relaxed
+    );
+    uint64_t evicted = 0;
+    for (size_t offset = 0; offset < used;) {
+        const struct JitBlock *const block =
+            segment_block(jit, segment, offset);
+        offset += block->size;
+        const struct JitBlock *expected = block;
+        if (atomic_compare_exchange_strong(
+                &jit->blocks[block->start], &expected, NULL
+            ))
+            ++evicted;
+    }
+    for (size_t i = 0; i < jit->link_count;) {
+        const struct Link *const link = &jit->links[i];
+        if (segment_of(jit, link->cell) == segment) {
+            // Its code is going away anyway
+            jit->links[i] = jit->links[--jit->link_count];
+        } else if (segment_of(jit, link->to) == segment) {
+            unchain(jit, i);
+        } else {
+            ++i;
+        }
+    }
+    atomic_store_explicit(
+        &jit->segments[segment].used, 0, memory_order_relaxed
+    );
+    atomic_store_explicit(
+        &jit->segments[segment].state, SEGMENT_FREE, memory_order_release
+    );
+    // Let evicted blocks, and requests dropped for want of space, be
+    // requested again
+    memset(jit->heat, 0, sizeof(jit->heat));
+    memset(jit->promoting, 0, sizeof(jit->promoting));
+    if (metrics != NULL)
+        metrics_add(&metrics->cache_evictions, evicted);
+}
+
+// Sum the counters of a segment's installed blocks, and halve them
+uint64_t age_segment(struct JitContext *const jit, const size_t segment) {
+    const size_t used = atomic_load_explicit(
+        &jit->segments[segment].used, memory_order_acquire
+    );
+    uint64_t runs = 0;
+    for (size_t offset = 0; offset < used;) {
+        const struct JitBlock *const block =
+            segment_block(jit, segment, offset);
+        offset += block->size;
+        if (!is_installed(jit, block))
+            continue;
+        runs += jit->runs[block->start];
+        jit->runs[block->start] /= 2;
+    }
+    return runs;
+}
+
+// Evict one full segment of a region with a clock over the counters: a
+// segment whose blocks ran since the hand last passed gets another chance,
+// with its counters halved
+void evict(struct JitContext *const jit, const enum Region region) {
+    size_t first, count;
+    region_segments(region, &first, &count);
+    bool any = false;
+    for (size_t i = first; i < first + count; ++i)
+        any |= atomic_load_explicit(
+                   &jit->segments[i].state, memory_order_acquire
+               ) == SEGMENT_FULL;
+    if (!any)
+        return;
+    while (true) {
+        const size_t segment = first + jit->hands[region]++ % count;
+        if (atomic_load_explicit(
+                &jit->segments[segment].state, memory_order_acquire
+            ) != SEGMENT_FULL)
+            continue;
+        if (age_segment(jit, segment) == 0) {
+            evict_segment(jit, segment);
+            return;
+        }
+    }
+}
+
+// Ask the compiler to translate the first `length` instructions of the
+// block at `start`, into the hot region if `hot`
+// Returns false if the queue is full
+bool request_block(
+    struct JitContext *const jit,
+    const Word start,
+    const unsigned length,
+    const bool hot
+) {
+    struct JitRequest request = {
+        jit,
+        atomic_load_explicit(&jit->generation, memory_order_relaxed),
+        start,
+        (uint16_t)length,
+        hot,
+        {0},
+    };
+    memcpy(request.words, &memory[start], length * sizeof(Word));
+    atomic_fetch_add_explicit(&jit->in_flight, 1, memory_order_relaxed);
+    if (!queue_push(&request)) {
+        atomic_fetch_sub_explicit(&jit->in_flight, 1, memory_order_relaxed);
+        return false;
+    }
+    // Stores to these words now throw the translation away
+    memset(&jit->code_words[start], 1, length);
+    ++jit->requested;
+    if (jit->translated[start] && metrics != NULL)
+        metrics_add(&metrics->cache_recompilations, 1);
+    jit->translated[start] = 1;
+    (void)sem_post(&queue_ready);
+    return true;
+}
+
+// Move blocks which ran often since the last sweep to the hot region, age
+// every counter, and relink exits chained to blocks which were replaced
+void sweep(struct JitContext *const jit) {
+    for (size_t segment = 0; segment < JIT_SEGMENTS; ++segment) {
+        const size_t used = atomic_load_explicit(
+            &jit->segments[segment].used, memory_order_acquire
+        );
+        for (size_t offset = 0; offset < used;) {
+            const struct JitBlock *const block =
+                segment_block(jit, segment, offset);
+            offset += block->size;
+            if (!is_installed(jit, block))
+                continue;
+            const Word start = block->start;
+            if (!block->hot && !jit->promoting[start] &&
+                jit->runs[start] >= JIT_PROMOTE)
+                jit->promoting[start] =
+                    request_block(jit, start, block->length, true);
+            jit->runs[start] /= 2;
+        }
+    }
+    for (size_t i = 0; i < jit->link_count;) {
+        if (!is_installed(jit, jit->links[i].to))
+            unchain(jit, i);
+        else
+            ++i;
+    }
+}
+
+// Publish how much of the cache is used
+void publish_occupancy(struct JitContext *const jit) {
+    uint64_t bytes = 0;
+    uint64_t blocks = 0;
+    for (size_t segment = 0; segment < JIT_SEGMENTS; ++segment) {
+        const size_t used = atomic_load_explicit(
+            &jit->segments[segment].used, memory_order_acquire
+        );
+        bytes += used;
+        for (size_t offset = 0; offset < used;) {
+            const struct JitBlock *const block =
+                segment_block(jit, segment, offset);
+            offset += block->size;
+            blocks += is_installed(jit, block);
+        }
+    }
+    atomic_store_explicit(&metrics->cache_bytes, bytes, memory_order_relaxed);
+    atomic_store_explicit(&metrics->cache_blocks, blocks, memory_order_relaxed);
+}
+
+// Evict what the compiler is waiting for, and sweep if it is due
+void maintain(struct JitContext *const jit) {
+    const unsigned wanted =
+        atomic_exchange_explicit(&jit->evict_wanted, 0, memory_order_relaxed);
+    for (int region = 0; region < 2; ++region) {
+        if (wanted & (1U << region))
+            evict(jit, (enum Region)region);
+    }
+    if (instructions_retired - jit->swept_at >= JIT_SWEEP || wanted != 0) {
+        sweep(jit);
+        jit->swept_at = instructions_retired;
+    }
+}
+
+// Throw away every translation
+void flush(struct JitContext *const jit) {
+    atomic_fetch_add(&jit->generation, 1);
+    if (jit->requested > 0) {
+        for (size_t i = 0; i < MEMORY_SIZE; ++i)
+            atomic_store_explicit(&jit->blocks[i], NULL, memory_order_relaxed);
+        jit->requested = 0;
+    }
+    memset(jit->heat, 0, sizeof(jit->heat));
+    memset(jit->code_words, 0, sizeof(jit->code_words));
+    memset(jit->promoting, 0, sizeof(jit->promoting));
+    memset(jit->runs, 0, sizeof(jit->runs));
+    // No block left can be run, so neither can any chained exit
+    jit->link_count = 0;
+    // The compiler leaves the segments it is filling once it sees the new
+    // generation
+    for (size_t segment = 0; segment < JIT_SEGMENTS; ++segment) {
+        if (atomic_load_explicit(
+                &jit->segments[segment].state, memory_order_relaxed
+            ) != SEGMENT_FULL)
+            continue;
+        atomic_store_explicit(
+            &jit->segments[segment].used, 0, memory_order_relaxed
+        );
+        atomic_store_explicit(
+            &jit->segments[segment].state, SEGMENT_FREE, memory_order_release
+        );
+    }
+}
+
+// See `code_watch`
+void jit_code_watch(const Word start, const size_t count) {
+    struct JitContext *const jit = context;
+    if (jit == NULL)
+        return;
+    if (count >= MEMORY_SIZE) {
+        flush(jit);
+        jit->preload_wanted = true;  // A program was loaded
+        return;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        if (jit->code_words[(Word)(start + i)]) {
+            flush(jit);
+            return;
+        }
+    }
+}
+
+// At thread exit
+void context_destroy(void *const data) {
+    struct JitContext *const jit = data;
+    while (atomic_load_explicit(&jit->in_flight, memory_order_acquire) > 0)
+        sched_yield();
+    (void)munmap(jit->writable, JIT_CODE_SIZE);
+    (void)munmap((void *)jit->executable, JIT_CODE_SIZE);
+    free(jit);
+}
+
+// Start the compiler thread, when the engine is first used
+void compiler_start() {
+    for (size_t i = 0; i < QUEUE_SIZE; ++i)
+        atomic_init(&queue[i].sequence, i);
+    if (sem_init(&queue_ready, 0, 0) != 0 ||
+        pthread_key_create(&context_key, context_destroy) != 0)
+        return;
+    pthread_t thread;
+    if (start_helper_thread(&thread, compiler_main, NULL) != 0)
+        return;
+    (void)pthread_detach(thread);
+    compiler_running = add_code_watch(jit_code_watch);
+}
+
+// Code is written through one mapping and run through another, so no memory
+// is both writable and executable
+// Returns NULL if the engine cannot be used
+struct JitContext *context_create() {
+    pthread_once(&compiler_once, compiler_start);
+    if (!compiler_running)
+        return NULL;
+    struct JitContext *const jit = calloc(1, sizeof(struct JitContext));
+    if (jit == NULL)
+        return NULL;
+    const int file = memfd_create("minilc3-jit", MFD_CLOEXEC);
+    if (file < 0 || ftruncate(file, JIT_CODE_SIZE) != 0) {
+        if (file >= 0)
+            (void)close(file);
+        free(jit);
+        return NULL;
+    }
+    void *const writable = mmap(
+        NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0
+    );
+    void *const executable = mmap(
+        NULL, JIT_CODE_SIZE, PROT_READ | PROT_EXEC, MAP_SHARED, file, 0
+    );
+    (void)close(file);  // Mappings stay valid
+    if (writable == MAP_FAILED || executable == MAP_FAILED) {
+        if (writable != MAP_FAILED)
+            (void)munmap(writable, JIT_CODE_SIZE);
+        if (executable != MAP_FAILED)
+            (void)munmap(executable, JIT_CODE_SIZE);
+        free(jit);
+        return NULL;
+    }
+    jit->writable = writable;
+    jit->executable = executable;
+    jit->frame = (struct JitFrame){
+        memory, registers, &cc, &pc, jit->code_words, 0, jit->runs, NULL, false
+    };
+    jit->filling[REGION_HOT] = -1;
+    jit->filling[REGION_COLD] = -1;
+    jit->preload_wanted = true;
+    atomic_init(&jit->generation, 1);
+    (void)pthread_setspecific(context_key, jit);
+    return jit;
+}
+
+// Run translated blocks where there are any, and the interpreter elsewhere
+enum Error dispatch(struct JitContext *const jit, const unsigned features) {
+    const bool bounded = features & FEATURE_BOUNDED;
+    const uint64_t limit = bounded ? current_run_limit() : UINT64_MAX;
+    // The interpreter runs one block at a time, and tells us of its stores
+    const unsigned interpreter =
+        features | FEATURE_BOUNDED | EVENT_MEMORY_WRITE;
+    bool interpret = false;  // Last block stopped at an instruction it skips
+    while (true) {
+        if (instructions_retired >= limit ||
+            (bounded && execution_interrupted()))
+            return ERR_LIMIT;
+        if (atomic_load_explicit(&jit->evict_wanted, memory_order_relaxed) ||
+            instructions_retired - jit->swept_at >= JIT_SWEEP)
+            maintain(jit);
+        const Word start = pc;
+
+        const struct JitBlock *const block =
+            interpret ? NULL : lookup(jit, start);
+        if (block != NULL && limit - instructions_retired >= block->length) {
+            // Chained blocks run until the budget is spent
+            const int64_t budget = limit - instructions_retired < JIT_CHAIN
+                                       ? (int64_t)(limit - instructions_retired)
+                                       : JIT_CHAIN;
+            jit->frame.budget = budget;
+            const void *const entry = block->code;
+            JitCode code;
+            memcpy(&code, &entry, sizeof(code));
+            const uint32_t result = code(&jit->frame);
+            instructions_retired += (uint64_t)(budget - jit->frame.budget);
+            if (jit->frame.stored) {
+                jit->frame.stored = false;
+                if (features & FEATURE_DEVICES)
+                    count_side_effect();
+            }
+            if (jit->frame.link != NULL) {
+                chain(jit, jit->frame.link, pc);
+                jit->frame.link = NULL;
+            }
+            if (result & EXIT_WRITTEN)
+                flush(jit);
+            interpret = result & EXIT_INTERPRET;
+            if (metrics != NULL)
+                metrics_add(&metrics->cache_hits, 1);
+            continue;
+        }
+        interpret = false;
+
+        unsigned translated;
+        const unsigned length = scan_block(start, &translated);
+        if (jit->heat[start] < JIT_HOT && ++jit->heat[start] == JIT_HOT &&
+            translated > 0 && !request_block(jit, start, translated, false))
+            jit->heat[start] = 0;  // Try again later
+        if (metrics != NULL)
+            metrics_add(&metrics->cache_misses, 1);
+        set_instruction_limit(
+            limit - instructions_retired > length
+                ? instructions_retired + length
+                : limit
+        );
+        const enum Error error = execute_variant(interpreter);
+        if (error != ERR_LIMIT)
+            return error;
+    }
+}
+
+// This thread's context, created when first used
+// Returns NULL if the engine cannot be used
+struct JitContext *current_context() {
+    if (context == NULL && !context_failed) {
+        context = context_create();
+        context_failed = context == NULL;
+    }
+    return context;
+}
+
+enum Error jit_run(const unsigned features) {
+    struct JitContext *const jit = current_context();
+    // Plugins and protection need the interpreter for every instruction
+    if (jit == NULL || (features & ~(FEATURE_BOUNDED | FEATURE_DEVICES)) != 0)
+        return execute_variant(features);
+    if (jit->preload_wanted) {
+        jit->preload_wanted = false;
+        if (preload_threads > 0)
+            (void)preload(jit, preload_threads);
+    }
+    const enum Error error = dispatch(jit, features);
+    if (metrics != NULL)
+        publish_occupancy(jit);
+    return error;
+}
+
+enum Error jit_execute() {
+    return execute_with_runner(jit_run);
+}
+
+enum Error jit_execute_until(const uint64_t limit) {
+    return execute_until_with_runner(jit_run, limit);
+}
+
+void jit_set_preload(const unsigned threads) {
+    preload_threads =
+        threads < MAX_PRELOAD_THREADS ? threads : MAX_PRELOAD_THREADS;
+}
+
+size_t jit_preload(const unsigned threads) {
+    struct JitContext *const jit = current_context();
+    if (jit == NULL || threads == 0)
+        return 0;
+    jit->preload_wanted = false;
+    return preload(
+        jit, threads < MAX_PRELOAD_THREADS ? threads : MAX_PRELOAD_THREADS
+    );
+}
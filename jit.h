@@ -0,0 +1,64 @@
+// Native code engine
+// Blocks of straight-line code which the interpreter runs often are
+// translated to x86-64 code by a background compiler thread, shared by every
+// VM, while the interpreter carries on running them. Requests go to it over
+// a lock-free queue, and finished blocks are installed in the VM's dispatch
+// table with an atomic pointer store. Translations are thrown away once the
+// program writes over them, even while they are still being translated.
+// Anything not translated (traps, device registers, and every instruction
+// when plugins or protection are enabled) is left to the interpreter, which
+// is all that runs on other hosts.
+// Blocks which jump to a known address are chained to the block there, so
+// loops run without returning to the dispatcher. Each VM's code cache has a
+// fixed size, in segments: when it fills up, the least recently run segment
+// (by a clock over per-block execution counters) is evicted whole, and exits
+// chained into it are unlinked. Blocks which keep running are translated
+// again into a hot region at the start of the cache, so they share as few
+// cache lines and pages as possible.
+
+#ifndef JIT_H
+#define JIT_H
+
+// Libc
+#include <stdbool.h>  // bool
+#include <stddef.h>   // size_t
+#include <stdint.h>   // uint64_t
+// Local
+#include "vm.h"  // enum Error, Word
+
+enum Error jit_execute();
+enum Error jit_execute_until(uint64_t limit);
+
+// Translate every block statically reachable from the entry point of each
+// program loaded, on `threads` threads, before running it. 0 (the default)
+// leaves blocks to be translated once they are hot
+void jit_set_preload(unsigned threads);
+// Translate every block statically reachable from `pc` now, on `threads`
+// threads including this one
+// Returns how many blocks were translated
+size_t jit_preload(unsigned threads);
+
+// Shared with other engines which translate code
+
+// How a block treats each instruction
+enum Kind {
+    KIND_PLAIN,   // Translated, and the block goes on
+    KIND_BRANCH,  // Translated, and ends the block
+    KIND_OTHER,   // Left to the interpreter, and ends the block
+};
+
+// Invalid instructions, and device registers at a fixed address, are left to
+// the interpreter
+enum Kind classify(Word instruction, Word address);
+// Sign-extended low `bits` bits of an instruction
+Word field(Word instruction, unsigned bits);
+// Where a BR or JSR at `address` jumps to
+// Returns false for other instructions, whose target is not constant
+bool branch_target(Word instruction, Word address, Word *target);
+// Find the block starting at `start`, which ends at its first instruction
+// which is not plain, and never reaches the device registers
+// Returns how many instructions the interpreter should run for it, and sets
+// `translated` to how many of them can be translated
+unsigned scan_block(Word start, unsigned *translated);
+
+#endif
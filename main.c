@@ -1,507 +1,965 @@
 // Libc
-#include <stdbool.h>  // true, false
-#include <stdint.h>   // uint16_t, etc
-#include <stdio.h>    // printf, FILE, etc
-#include <stdlib.h>   // exit
+#include <inttypes.h>  // PRIu64, PRIx64
+#include <stdbool.h>   // true, false
+#include <stdio.h>     // fprintf, etc
+#include <stdlib.h>    // malloc, qsort, etc
+#include <string.h>    // strcmp, memcpy, etc
 // POSIX
-#include <termios.h>  // struct termios, etc
-#include <unistd.h>   // STDIN_FILENO
-
-// Total amount of words in memory
-#define MEMORY_SIZE 0x10000L
-
-// Sanity check for functions
-// If condition fails then the program is incorrect and should exit
-#define assert(_condition, ...)                                      \
-    {                                                                \
-        if (!(_condition)) {                                         \
-            fprintf(stderr, "Assertion failed:\n" #_condition "\n"); \
-            fprintf(stderr, "" __VA_ARGS__);                         \
-            fprintf(stderr, "\n");                                   \
-            exit(ERR_ASSERT);                                        \
-        }                                                            \
-    }
-
-// 1 Word = 2 Bytes
-typedef uint16_t Word;
-typedef int16_t SignedWord;
-
-// All program state
-static Word memory[MEMORY_SIZE];
-static Word registers[8];  // General purpose registers
-static Word pc;            // Program counter
-static uint8_t cc;         // Condition code
-
-// All opcodes. Note that some refer to multiple instruction names
-enum Opcode {
-    OP_BR = 0x0,  // For all BR[nzp] instructions
-    OP_ADD = 0x1,
-    OP_LD = 0x2,
-    OP_ST = 0x3,
-    OP_JSR_JSRR = 0x4,  // Bitflag determines immediate or register
-    OP_AND = 0x5,
-    OP_LDR = 0x6,
-    OP_STR = 0x7,
-    OP_RTI = 0x8,  // Not used in non-supervisor mode
-    OP_NOT = 0x9,
-    OP_LDI = 0xa,
-    OP_STI = 0xb,
-    OP_JMP_RET = 0xc,   // RET == JMP R7
-    OP_RESERVED = 0xd,  // Reserved instruction
-    OP_LEA = 0xe,
-    OP_TRAP = 0xf,
+#include <signal.h>  // sigaction
+#include <unistd.h>  // sysconf
+#ifndef NO_PLUGINS
+#include <dlfcn.h>  // dlopen, dlsym, dlclose
+#endif
+// Local
+#include "batch.h"      // batch_run, etc
+#include "channel.h"    // channels_open, etc
+#include "disk.h"       // disk_open
+#include "intervals.h"  // intervals_run, etc
+#include "jit.h"        // jit_set_preload
+#include "metrics.h"    // metrics_open
+#include "perf.h"       // struct PerfCounters, etc
+#include "perfmap.h"    // perfmap_open
+#include "pipeline.h"   // pipeline_run, etc
+#include "script.h"     // script_load, etc
+#include "simpoint.h"   // MAX_PHASES
+#include "state.h"      // state_save, state_load
+#include "symbols.h"    // symbols_load_for
+#include "trace.h"      // trace_start, etc
+#include "vm.h"         // execute, etc
+
+// Phases of a run, timed with `--timings`
+// Timestamps are from the monotonic clock, so they can be compared with ones
+// taken by the process which started this one
+enum Timing {
+    TIMING_MAIN,               // Entered `main`
+    TIMING_LOADED,             // Object file is in memory
+    TIMING_FIRST_INSTRUCTION,  // About to fetch the first instruction
+    TIMING_HALT,               // Program halted
+    TIMING_EXIT,               // Output flushed, about to return from `main`
+    TIMING_COUNT,
 };
 
-// All trap vectors
-enum TrapVect {
-    TRAP_GETC = 0x20,
-    TRAP_OUT = 0x21,
-    TRAP_PUTS = 0x22,
-    TRAP_IN = 0x23,
-    TRAP_PUTSP = 0x24,
-    TRAP_HALT = 0x25,
-};
+// Print timestamps of each startup phase, for `minilc3-startup`
+void print_timings(const uint64_t *const timings) {
+    fprintf(stderr, "timings:");
+    for (int i = 0; i < TIMING_COUNT; ++i)
+        fprintf(stderr, " %" PRIu64, timings[i]);
+    fprintf(stderr, "\n");
+}
 
-// Kinds of user errors
-enum Error {
-    ERR_OK,           // Halted successfully
-    ERR_CLI,          // Parsing command-line arguments
-    ERR_FILE,         // Opening/reading file, invalid file structure
-    ERR_INSTRUCTION,  // Invalid instruction or padding
-    ERR_ASSERT,       // Assertion failed; this codebase has a bug
+// Command-line options
+struct Options {
+    const char *filename;
+    const char *input_filename;   // Scripted input instead of the terminal
+    const char *script_filename;  // Interaction to drive and check
+    const char *engine_name;
+    unsigned long bench_runs;  // Run in-process this many times, if not 0
+    const char *plugins[MAX_PLUGINS];  // `PATH[:ARGS]` of each plugin
+    int plugin_count;
+    bool parallel_plugins;  // Analyze a recorded trace on a thread each
+    uint64_t intervals;     // Run plugins on snapshots this far apart
+    size_t phases;          // Only on representatives of this many, if not 0
+    bool show_perf;
+    bool show_timings;
+    bool perf_map;  // Register generated native code with `perf`
+    bool jitdump;
+    bool shared_metrics;           // Publish live metrics in shared memory
+    const char *metrics_filename;  // Prometheus textfile, if not NULL
+    const char *load_state_filename;  // Start from a saved state
+    const char *save_state_filename;
+    uint64_t save_at;  // Also save at this instruction count, if not 0
+    bool protect;
+    const char *protect_regions;  // `START-END:PERMISSIONS,...`, or NULL
+    const char *batch_filename;   // List of programs to run in parallel
+    int workers;                  // Batch or interval workers; 0 for all CPUs
+    const char *cpus;             // CPUs to pin batch workers to
+    const char *disk_filename;    // Backing file of the block device
+    bool console;                 // Attach the keyboard and display
+    bool preload;                 // Translate reachable code before running
+    int preload_threads;          // 0 for one per CPU
+    bool pipeline;                // Run every file, each feeding the next
+    const char *stages[MAX_STAGES];  // Every file given
+    int stage_count;
+    bool channels;  // Between the VMs of a pipeline
 };
 
-// Swap high and low bytes of a word
-// 0x12ab -> 0xab12
-// Object file is stored in different 'endianess' to program memory
-Word swap_endian(const Word word) {
-    return (word << 8) | (word >> 8);
+// If `arg` is `name=VALUE`, return VALUE
+const char *option_value(const char *const arg, const char *const name) {
+    const size_t length = strlen(name);
+    if (strncmp(arg, name, length) != 0 || arg[length] != '=')
+        return NULL;
+    return arg + length + 1;
 }
 
-// Set the condition code based on the value stored into a register
-void set_cc(const SignedWord result) {
-    if (result < 0) {
-        cc = 0x4;  // Negative
-    } else if (result == 0) {
-        cc = 0x2;  // Zero
-    } else {
-        cc = 0x1;  // Positive
+bool parse_options(
+    const int argc,
+    const char *const *const argv,
+    struct Options *const options
+) {
+    const char *value;
+    for (int i = 1; i < argc; ++i) {
+        const char *const arg = argv[i];
+        if (strcmp(arg, "--perf") == 0) {
+            options->show_perf = true;
+        } else if (strcmp(arg, "--timings") == 0) {
+            options->show_timings = true;
+        } else if (strcmp(arg, "--perf-map") == 0) {
+            options->perf_map = true;
+        } else if (strcmp(arg, "--jitdump") == 0) {
+            options->perf_map = options->jitdump = true;
+        } else if (strcmp(arg, "--metrics") == 0) {
+            options->shared_metrics = true;
+        } else if ((value = option_value(arg, "--metrics-file")) != NULL) {
+            options->metrics_filename = value;
+        } else if ((value = option_value(arg, "--bench")) != NULL) {
+            char *end;
+            options->bench_runs = strtoul(value, &end, 10);
+            if (*end != '\0' || options->bench_runs == 0)
+                return false;
+        } else if (strcmp(arg, "--protect") == 0) {
+            options->protect = true;
+        } else if ((value = option_value(arg, "--protect")) != NULL) {
+            options->protect = true;
+            options->protect_regions = value;
+        } else if ((value = option_value(arg, "--save-at")) != NULL) {
+            char *end;
+            options->save_at = strtoull(value, &end, 10);
+            if (*end != '\0' || options->save_at == 0)
+                return false;
+        } else if ((value = option_value(arg, "--intervals")) != NULL) {
+            char *end;
+            options->intervals = strtoull(value, &end, 10);
+            if (*end != '\0' || options->intervals == 0)
+                return false;
+        } else if ((value = option_value(arg, "--phases")) != NULL) {
+            char *end;
+            const unsigned long phases = strtoul(value, &end, 10);
+            if (*end != '\0' || phases == 0 || phases > MAX_PHASES)
+                return false;
+            options->phases = phases;
+        } else if ((value = option_value(arg, "--save-state")) != NULL) {
+            options->save_state_filename = value;
+        } else if ((value = option_value(arg, "--load-state")) != NULL) {
+            options->load_state_filename = value;
+        } else if ((value = option_value(arg, "--batch")) != NULL) {
+            options->batch_filename = value;
+        } else if ((value = option_value(arg, "--workers")) != NULL) {
+            char *end;
+            const unsigned long workers = strtoul(value, &end, 10);
+            if (*end != '\0' || workers == 0 || workers > MAX_WORKERS)
+                return false;
+            options->workers = (int)workers;
+        } else if ((value = option_value(arg, "--cpus")) != NULL) {
+            options->cpus = value;
+        } else if (strcmp(arg, "--preload") == 0) {
+            options->preload = true;
+        } else if ((value = option_value(arg, "--preload")) != NULL) {
+            char *end;
+            const unsigned long threads = strtoul(value, &end, 10);
+            if (*end != '\0' || threads == 0 || threads > MAX_WORKERS)
+                return false;
+            options->preload = true;
+            options->preload_threads = (int)threads;
+        } else if (strcmp(arg, "--console") == 0) {
+            options->console = true;
+        } else if ((value = option_value(arg, "--disk")) != NULL) {
+            options->disk_filename = value;
+        } else if ((value = option_value(arg, "--script")) != NULL) {
+            options->script_filename = value;
+        } else if ((value = option_value(arg, "--input")) != NULL) {
+            options->input_filename = value;
+        } else if ((value = option_value(arg, "--engine")) != NULL) {
+            options->engine_name = value;
+        } else if ((value = option_value(arg, "--plugin")) != NULL) {
+            if (options->plugin_count >= MAX_PLUGINS)
+                return false;
+            options->plugins[options->plugin_count++] = value;
+        } else if (strcmp(arg, "--parallel-plugins") == 0) {
+            options->parallel_plugins = true;
+        } else if (strcmp(arg, "--pipeline") == 0) {
+            options->pipeline = true;
+        } else if (strcmp(arg, "--channels") == 0) {
+            options->channels = true;
+        } else if (options->stage_count >= MAX_STAGES || arg[0] == '-' ||
+                   arg[0] == '\0') {
+            return false;
+        } else {
+            options->stages[options->stage_count++] = arg;
+        }
     }
+    if (options->channels && !options->pipeline)
+        return false;
+    if (options->parallel_plugins &&
+        (options->plugin_count == 0 || options->bench_runs > 0))
+        return false;
+    if (options->phases > 0 && options->intervals == 0)
+        return false;
+    // Only the jit engine translates code ahead of running it
+    if (options->preload &&
+        (options->engine_name == NULL ||
+         strcmp(options->engine_name, "jit") != 0))
+        return false;
+    // Runs in other processes, so only with options they need not know of
+    if (options->intervals > 0 &&
+        (options->plugin_count == 0 || options->parallel_plugins ||
+         options->bench_runs > 0 || options->script_filename != NULL ||
+         options->save_state_filename != NULL || options->shared_metrics ||
+         options->metrics_filename != NULL || options->disk_filename != NULL ||
+         options->show_perf))
+        return false;
+    // A pipeline runs its own programs, and only supports options which are
+    // safe with many VMs at once
+    if (options->pipeline)
+        return options->stage_count > 0 && options->batch_filename == NULL &&
+               options->load_state_filename == NULL &&
+               options->script_filename == NULL &&
+               options->save_state_filename == NULL &&
+               options->bench_runs == 0 && options->plugin_count == 0 &&
+               !options->shared_metrics && options->metrics_filename == NULL &&
+               options->disk_filename == NULL && options->workers == 0 &&
+               options->cpus == NULL;
+    if (options->stage_count > 1)
+        return false;
+    options->filename = options->stages[0];
+    if (options->script_filename != NULL &&
+        (options->input_filename != NULL || options->bench_runs > 0 ||
+         options->save_state_filename != NULL))
+        return false;
+    if (options->save_at != 0 && options->save_state_filename == NULL)
+        return false;
+    // A batch runs its own programs, and only supports options which are
+    // safe with many VMs at once
+    if (options->batch_filename != NULL)
+        return options->filename == NULL &&
+               options->load_state_filename == NULL &&
+               options->script_filename == NULL &&
+               options->save_state_filename == NULL &&
+               options->bench_runs == 0 && options->plugin_count == 0 &&
+               !options->shared_metrics && options->metrics_filename == NULL &&
+               options->disk_filename == NULL;
+    if ((options->workers != 0 && options->intervals == 0) ||
+        options->cpus != NULL)
+        return false;
+    // A saved state replaces the object file
+    return (options->filename != NULL) !=
+           (options->load_state_filename != NULL);
 }
 
-// Sign extend a number to be a valid signed word
-// This just makes the number valid in 2's compliment, at a larger size
-SignedWord sign_extend(const Word value, const uint8_t bits) {
-    Word sign_bit = 1 << (bits - 1);
-    return (SignedWord)(value ^ sign_bit) - (SignedWord)sign_bit;
-}
-// Get bits highest to lowest (both inclusive)
-// Note that bits ordered low to high, from 0
-Word bits(const Word instruction, const uint8_t highest, const uint8_t lowest) {
-    assert(highest >= lowest, "%d >= %d", highest, lowest);
-    return (instruction >> lowest) & ((1 << (highest - lowest + 1)) - 1);
-}
-// Get bits and sign extend
-SignedWord bits_sext(
-    const Word instruction, const uint8_t highest, const uint8_t lowest
-) {
-    return sign_extend(
-        bits(instruction, highest, lowest), highest - lowest + 1
+void print_usage() {
+    fprintf(
+        stderr,
+        "Usage: minilc3 [OPTIONS] [FILE]\n"
+        "Options:\n"
+        "  --input=FILE    Read trap input from FILE instead of the terminal\n"
+        "  --script=FILE   Drive and check input and output with a script\n"
+        "  --batch=LIST    Run every program listed in LIST (one per line) in\n"
+        "                  parallel, instead of FILE\n"
+        "  --workers=N     Run a batch or intervals with N workers (default:\n"
+        "                  one per CPU)\n"
+        "  --pipeline FILE...\n"
+        "                  Run every FILE in parallel, each one's output\n"
+        "                  being the next one's input\n"
+        "  --channels      Let the VMs of a pipeline message each other\n"
+        "  --cpus=LIST     Pin batch workers to CPUs, eg. 0-3,8\n"
+        "  --engine=NAME   Execute with engine NAME\n"
+        "  --preload[=N]   With the jit engine, translate all reachable code\n"
+        "                  on N threads (default: one per CPU) before running\n"
+        "  --console       Attach keyboard and display registers\n"
+        "  --disk=FILE     Attach a block device backed by FILE\n"
+        "  --plugin=PATH[:ARGS]\n"
+        "                  Load an instrumentation plugin (repeatable)\n"
+        "  --parallel-plugins\n"
+        "                  Run each plugin on its own thread, from a trace\n"
+        "  --intervals=N   Run plugins on intervals of N instructions in\n"
+        "                  parallel, from snapshots of a run without them\n"
+        "  --phases=K      With --intervals, cluster intervals into up to K\n"
+        "                  phases and only run one of each, weighted\n"
+        "  --bench=N       Run N times in-process, with output discarded\n"
+        "  --perf          Print hardware counters per instruction\n"
+        "  --timings       Print timestamps of startup phases\n"
+        "  --perf-map      Write /tmp/perf-PID.map for generated code\n"
+        "  --jitdump       Also write a jitdump file for `perf inject`\n"
+        "  --metrics       Publish live metrics for `minilc3-top`\n"
+        "  --metrics-file=PATH\n"
+        "                  Write metrics to a Prometheus textfile\n"
+        "  --save-state=FILE\n"
+        "                  Save the VM state to FILE on HALT and on SIGUSR1\n"
+        "  --save-at=N     Save after N instructions instead of on HALT\n"
+        "  --load-state=FILE\n"
+        "                  Start from a saved state instead of an object file\n"
+        "  --protect[=START-END:PERMISSIONS,...]\n"
+        "                  Protect system memory, and set permissions (`rwx`,\n"
+        "                  or `-` for none) of user regions\n"
     );
 }
 
-// Alias functions for common `bits` calls, for readability
-uint8_t bits_reg_a(Word instruction) {
-    return bits(instruction, 11, 9);
-}
-uint8_t bits_reg_b(Word instruction) {
-    return bits(instruction, 8, 6);
-}
-uint8_t bits_reg_c(Word instruction) {
-    return bits(instruction, 2, 0);
+// Load a plugin from `PATH[:ARGS]`
+bool load_plugin(const char *const spec, struct Plugin *const plugin) {
+#ifdef NO_PLUGINS
+    (void)spec, (void)plugin;
+    fprintf(stderr, "Plugins are not supported in this build.\n");
+    return false;
+#else
+    const char *const separator = strchr(spec, ':');
+    const size_t path_length =
+        separator == NULL ? strlen(spec) : (size_t)(separator - spec);
+    const char *const args = separator == NULL ? "" : separator + 1;
+
+    // Without a slash, dlopen would search the library path instead
+    const char *const prefix =
+        memchr(spec, '/', path_length) == NULL ? "./" : "";
+    char path[4096];
+    const int written = snprintf(
+        path, sizeof(path), "%s%.*s", prefix, (int)path_length, spec
+    );
+    if (written < 0 || (size_t)written >= sizeof(path)) {
+        fprintf(stderr, "Plugin path is too long.\n");
+        return false;
+    }
+
+    void *const handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (handle == NULL) {
+        fprintf(stderr, "Failed to load plugin: %s\n", dlerror());
+        return false;
+    }
+    // Object pointers cannot be cast to function pointers in ISO C
+    PluginInit init;
+    void *const symbol = dlsym(handle, PLUGIN_INIT_SYMBOL);
+    if (symbol == NULL) {
+        fprintf(stderr, "Plugin %s has no %s.\n", path, PLUGIN_INIT_SYMBOL);
+        (void)dlclose(handle);
+        return false;
+    }
+    memcpy(&init, &symbol, sizeof(init));
+
+    if (init(plugin, args) != 0) {
+        fprintf(stderr, "Plugin %s failed to initialize.\n", path);
+        (void)dlclose(handle);
+        return false;
+    }
+    return true;
+#endif
 }
-SignedWord bits_imm_5(Word instruction) {
-    return bits_sext(instruction, 4, 0);
+
+// Attach a plugin to the VM, or to whatever runs it instead
+bool add_plugin(
+    const struct Options *const options,
+    const struct Plugin *const plugin,
+    const char *const spec
+) {
+    if (options->intervals > 0)
+        return intervals_add_plugin(plugin, spec);
+    if (options->parallel_plugins ? !trace_add_analyzer(plugin, spec)
+                                  : !attach_plugin(plugin)) {
+        fprintf(stderr, "Too many plugins.\n");
+        return false;
+    }
+    return true;
 }
-SignedWord bits_offset_6(Word instruction) {
-    return bits_sext(instruction, 5, 0);
+
+// Parse a hex address, with an optional `x` or `0x` prefix, and move past it
+bool parse_region_address(const char **const spec, Word *const address) {
+    const char *start = *spec;
+    if (start[0] == '0' && (start[1] == 'x' || start[1] == 'X'))
+        start += 2;
+    else if (start[0] == 'x' || start[0] == 'X')
+        ++start;
+    char *end;
+    const unsigned long value = strtoul(start, &end, 16);
+    if (end == start || value > 0xffff)
+        return false;
+    *address = (Word)value;
+    *spec = end;
+    return true;
 }
-SignedWord bits_pc_offset_9(Word instruction) {
-    return bits_sext(instruction, 8, 0);
+
+// Apply `START-END:PERMISSIONS` regions, separated by commas, over the
+// standard layout
+bool protect_regions(const char *spec) {
+    enable_protection();
+    if (spec == NULL)
+        return true;
+    while (true) {
+        Word start, end;
+        if (!parse_region_address(&spec, &start) || *spec++ != '-' ||
+            !parse_region_address(&spec, &end) || *spec++ != ':' ||
+            end < start)
+            return false;
+        uint8_t permissions = PERM_USER;
+        for (; *spec != ',' && *spec != '\0'; ++spec) {
+            if (*spec == 'r')
+                permissions |= PERM_READ;
+            else if (*spec == 'w')
+                permissions |= PERM_WRITE;
+            else if (*spec == 'x')
+                permissions |= PERM_EXECUTE;
+            else if (*spec != '-')
+                return false;
+        }
+        protect_region(start, end, permissions);
+        if (*spec == '\0')
+            return true;
+        ++spec;
+    }
 }
-SignedWord bits_pc_offset_11(Word instruction) {
-    return bits_sext(instruction, 10, 0);
+
+// Read a whole file into a new buffer
+bool read_whole_file(
+    const char *const filename, struct InputBuffer *const buffer
+) {
+    FILE *const file = fopen(filename, "rb");
+    if (file == NULL)
+        return false;
+    char *data = NULL;
+    size_t length = 0;
+    size_t capacity = 0;
+    while (!feof(file) && !ferror(file)) {
+        if (length == capacity) {
+            capacity = capacity == 0 ? 4096 : capacity * 2;
+            data = realloc(data, capacity);
+            assert(data != NULL, "Out of memory");
+        }
+        length += fread(data + length, 1, capacity - length, file);
+    }
+    const bool ok = !ferror(file);
+    (void)fclose(file);
+    buffer->data = data;
+    buffer->length = length;
+    buffer->position = 0;
+    return ok;
 }
 
-// Helper functions to make sure some `IN` prompt is printed on it's own line
-static bool stdout_on_new_line = true;
-void print_char(const char ch) {
-    printf("%c", ch);
-    stdout_on_new_line = ch == '\n';
+int compare_u64(const void *const a, const void *const b) {
+    const uint64_t left = *(const uint64_t *)a;
+    const uint64_t right = *(const uint64_t *)b;
+    return (left > right) - (left < right);
 }
-void print_on_new_line() {
-    if (stdout_on_new_line)
-        return;
-    printf("\n");
-    stdout_on_new_line = true;
+
+// Run the loaded program `runs` times from a pristine copy of memory, with
+// input rewound and output discarded, and report the distribution of times
+enum Error run_benchmark(
+    const struct Engine *const engine,
+    const unsigned long runs,
+    struct InputBuffer *const input,
+    const bool show_perf
+) {
+    // Registers are kept too, since the program may start from a saved state
+    static Word pristine[MEMORY_SIZE];
+    memcpy(pristine, memory, sizeof(memory));
+    Word pristine_registers[8];
+    memcpy(pristine_registers, registers, sizeof(registers));
+    const Word origin = pc;
+    const uint8_t origin_cc = cc;
+    const uint64_t origin_instructions = instructions_retired;
+    const size_t origin_position = input->position;
+
+    io.read_char = buffer_read_char;
+    io.write_char = discard_char;
+    io.flush = flush_nothing;
+    io.context = input;
+    io.read = buffer_read;
+    io.write = discard;
+    io.input_ready = NULL;
+
+    uint64_t *const durations = malloc(runs * sizeof(uint64_t));
+    assert(durations != NULL, "Out of memory");
+    struct PerfCounters counters;
+    if (show_perf)
+        perf_open(&counters);
+
+    uint64_t instructions = 0;
+    for (unsigned long run = 0; run < runs; ++run) {
+        memcpy(memory, pristine, sizeof(memory));
+        reset_state(origin);
+        memcpy(registers, pristine_registers, sizeof(registers));
+        cc = origin_cc;
+        instructions_retired = origin_instructions;
+        input->position = origin_position;
+
+        if (show_perf)
+            perf_start(&counters);
+        const uint64_t start = perf_now();
+        const enum Error error = engine->execute();
+        durations[run] = perf_now() - start;
+        if (show_perf)
+            perf_stop(&counters);
+
+        if (error != ERR_OK) {
+            free(durations);
+            return error;
+        }
+        instructions += instructions_retired - origin_instructions;
+    }
+
+    qsort(durations, runs, sizeof(uint64_t), compare_u64);
+    const uint64_t median = durations[runs / 2];
+    fprintf(stderr, "%-28s%s\n", "Engine:", engine->name);
+    fprintf(stderr, "%-28s%lu\n", "Runs:", runs);
+    fprintf(
+        stderr,
+        "%-28s%" PRIu64 "\n",
+        "Instructions per run:",
+        instructions / runs
+    );
+    fprintf(stderr, "%-28s%.3f us\n", "Min:", durations[0] / 1e3);
+    fprintf(stderr, "%-28s%.3f us\n", "Median:", median / 1e3);
+    fprintf(
+        stderr, "%-28s%.3f us\n", "P99:", durations[runs * 99 / 100] / 1e3
+    );
+    if (median > 0)
+        fprintf(
+            stderr,
+            "%-28s%.0f\n",
+            "Instructions/s (median):",
+            instructions / runs * 1e9 / median
+        );
+    free(durations);
+
+    if (show_perf) {
+        perf_close(&counters);
+        fprintf(stderr, "Hardware counters, over all runs:\n");
+        perf_report(stderr, &counters, instructions);
+    }
+    return ERR_OK;
 }
 
-// Don't worry about this. It's to disable line buffering for stdin.
-void enable_raw_terminal() {
-    struct termios tty;
-    (void)tcgetattr(STDIN_FILENO, &tty);
-    tty.c_lflag &= ~ICANON;
-    tty.c_lflag &= ~ECHO;
-    (void)tcsetattr(STDIN_FILENO, TCSANOW, &tty);
+void handle_save_signal(const int signal) {
+    (void)signal;
+    interrupt_execution();
 }
-void disable_raw_terminal() {
-    struct termios tty;
-    (void)tcgetattr(STDIN_FILENO, &tty);
-    tty.c_lflag |= ICANON;
-    tty.c_lflag |= ECHO;
-    (void)tcsetattr(STDIN_FILENO, TCSANOW, &tty);
+
+// Run the program, saving its state whenever SIGUSR1 is received, and at
+// instruction `save_at`, or when it halts if `save_at` is 0
+// A signal which arrives while waiting for input is handled once the input
+// has been read
+enum Error run_saving_state(
+    const struct Engine *const engine,
+    const char *const filename,
+    const uint64_t save_at
+) {
+    struct sigaction action = {0};
+    action.sa_handler = handle_save_signal;
+    action.sa_flags = SA_RESTART;
+    (void)sigemptyset(&action.sa_mask);
+    (void)sigaction(SIGUSR1, &action, NULL);
+
+    while (true) {
+        const uint64_t limit =
+            save_at > instructions_retired ? save_at : UINT64_MAX;
+        const enum Error error = engine->execute_until(limit);
+        if (error == ERR_OK && save_at != 0)
+            return ERR_OK;
+        if (error != ERR_OK && error != ERR_LIMIT)
+            return error;
+        const enum Error save_error = state_save(filename, error == ERR_OK);
+        if (save_error != ERR_OK || error == ERR_OK)
+            return save_error;
+    }
 }
 
-int main(const int argc, const char *const *const argv) {
-    // Invalid arguments
-    if (argc != 2 || argv[1][0] == '-' || argv[1][0] == '\0') {
-        fprintf(stderr, "Usage: minilc3 [FILE]\n");
-        return ERR_CLI;
+// Split a line of a batch list, `PROGRAM [INPUT [OUTPUT]]`, in place
+// Returns false if it has too many fields
+bool parse_batch_line(char *line, struct BatchJob *const job) {
+    const char **const fields[] = {
+        &job->filename,
+        &job->input_filename,
+        &job->output_filename,
+    };
+    size_t count = 0;
+    while (true) {
+        while (*line == ' ' || *line == '\t' || *line == '\r')
+            *line++ = '\0';
+        if (*line == '\0')
+            return count > 0;
+        if (count == sizeof(fields) / sizeof(fields[0]))
+            return false;
+        *fields[count++] = line;
+        while (*line != '\0' && *line != ' ' && *line != '\t' &&
+               *line != '\r')
+            ++line;
     }
+}
 
-    // Try to open file
-    FILE *const file = fopen(argv[1], "rb");
-    size_t words_read;
-    if (file == NULL) {
-        fprintf(stderr, "Failed to open file.\n");
-        return ERR_FILE;
+// Run every program in the `--batch` list in parallel, then print the
+// result of each, and statistics of each worker
+enum Error run_batch(
+    const struct Options *const options,
+    const struct Engine *const engine,
+    const struct InputBuffer *const input
+) {
+    int cpus[MAX_WORKERS];
+    int cpu_count = 0;
+    if (options->cpus != NULL) {
+        cpu_count = parse_cpu_list(options->cpus, cpus, MAX_WORKERS);
+        if (cpu_count <= 0) {
+            fprintf(stderr, "Invalid CPU list.\n");
+            return ERR_CLI;
+        }
     }
 
-    // Read the first word: the memory origin
-    Word origin;
-    words_read = fread(&origin, sizeof(Word), 1, file);
-    if (ferror(file)) {
-        fprintf(stderr, "Failed to read file.");
-        (void)fclose(file);
+    static struct InputBuffer list;
+    if (!read_whole_file(options->batch_filename, &list)) {
+        fprintf(stderr, "Failed to read batch list.\n");
         return ERR_FILE;
     }
-    if (words_read < 1) {
-        fprintf(stderr, "File is too short.");
-        (void)fclose(file);
-        return ERR_FILE;
+    // Filenames point into the list, with lines terminated in place
+    char *const text = realloc((char *)list.data, list.length + 1);
+    assert(text != NULL, "Out of memory");
+    text[list.length] = '\0';
+    size_t job_count = 0;
+    struct BatchJob *jobs = NULL;
+    int line_number = 0;
+    for (size_t start = 0; start < list.length;) {
+        size_t end = start;
+        while (end < list.length && text[end] != '\n')
+            ++end;
+        text[end] = '\0';
+        ++line_number;
+        if (text[start] != '\0' && text[start] != '#') {
+            jobs = realloc(jobs, (job_count + 1) * sizeof(*jobs));
+            assert(jobs != NULL, "Out of memory");
+            memset(&jobs[job_count], 0, sizeof(*jobs));
+            if (!parse_batch_line(text + start, &jobs[job_count++])) {
+                fprintf(
+                    stderr,
+                    "%s:%d: Invalid job.\n",
+                    options->batch_filename,
+                    line_number
+                );
+                free(jobs);
+                free(text);
+                return ERR_CLI;
+            }
+        }
+        start = end + 1;
     }
-    origin = swap_endian(origin);  // Fix endianess
 
-    // Read the rest of the file into memory
-    words_read =
-        fread(memory + origin, sizeof(Word), MEMORY_SIZE - origin, file);
-    if (ferror(file)) {
-        fprintf(stderr, "Failed to read file.");
-        (void)fclose(file);
-        return ERR_FILE;
+    int workers = options->workers;
+    if (workers == 0)
+        workers =
+            cpu_count > 0 ? cpu_count : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (workers > MAX_WORKERS)
+        workers = MAX_WORKERS;
+
+    const struct BatchOptions batch_options = {
+        engine,
+        workers,
+        cpus,
+        cpu_count,
+        options->input_filename != NULL ? input : NULL,
+    };
+    struct BatchStats total;
+    struct BatchStats per_worker[MAX_WORKERS];
+    const uint64_t start = perf_now();
+    batch_run(jobs, job_count, &batch_options, &total, per_worker);
+    const uint64_t wall_ns = perf_now() - start;
+
+    enum Error first_error = ERR_OK;
+    for (size_t i = 0; i < job_count; ++i) {
+        const struct BatchJob *const job = &jobs[i];
+        if (job->error != ERR_OK) {
+            printf("%s: error %d\n", job->filename, job->error);
+            if (first_error == ERR_OK)
+                first_error = job->error;
+            continue;
+        }
+        printf(
+            "%s: ok, %" PRIu64 " instructions, output %016" PRIx64 "\n",
+            job->filename,
+            job->instructions,
+            job->output_hash
+        );
     }
-    if (!feof(file)) {
-        fprintf(stderr, "File is too long.");
-        (void)fclose(file);
-        return ERR_FILE;
+    if (first_error == ERR_OK && total.failed_writes > 0)
+        first_error = ERR_FILE;
+    free(jobs);
+    free(text);
+
+    fprintf(
+        stderr,
+        "%-8s%10s%10s%10s%18s%12s\n",
+        "Worker",
+        "Jobs",
+        "Failed",
+        "Stolen",
+        "Instructions",
+        "Busy (ms)"
+    );
+    for (int i = 0; i < workers; ++i) {
+        const struct BatchStats *const stats = &per_worker[i];
+        fprintf(
+            stderr,
+            "%-8d%10" PRIu64 "%10" PRIu64 "%10" PRIu64 "%18" PRIu64 "%12.3f\n",
+            i,
+            stats->jobs,
+            stats->failed,
+            stats->stolen,
+            stats->instructions,
+            stats->busy_ns / 1e6
+        );
     }
-    (void)fclose(file);  // Close file
-    if (words_read == 0) {
-        fprintf(stderr, "File is too short.");
+    fprintf(
+        stderr,
+        "%-8s%10" PRIu64 "%10" PRIu64 "%10" PRIu64 "%18" PRIu64 "%12.3f\n",
+        "Total",
+        total.jobs,
+        total.failed,
+        total.stolen,
+        total.instructions,
+        total.busy_ns / 1e6
+    );
+    fprintf(stderr, "%-28s%s\n", "File I/O:", total.io_backend);
+    fprintf(
+        stderr,
+        "%-28s%" PRIu64 "\n",
+        "Files read ahead:",
+        total.prefetched
+    );
+    fprintf(stderr, "%-28s%.3f ms\n", "Wall time:", wall_ns / 1e6);
+    if (wall_ns > 0) {
+        fprintf(stderr, "%-28s%.1f\n", "Jobs/s:", total.jobs * 1e9 / wall_ns);
+        fprintf(
+            stderr,
+            "%-28s%.0f\n",
+            "Instructions/s:",
+            total.instructions * 1e9 / wall_ns
+        );
+    }
+    return first_error;
+}
+
+// Run the `--pipeline` programs, then print statistics of each stage
+enum Error run_pipeline(
+    const struct Options *const options, const struct Engine *const engine
+) {
+    struct PipelineStage stages[MAX_STAGES] = {0};
+    const size_t stage_count = (size_t)options->stage_count;
+    for (size_t i = 0; i < stage_count; ++i)
+        stages[i].filename = options->stages[i];
+    if (options->channels && !channels_open(stage_count))
         return ERR_FILE;
+    const uint64_t start = perf_now();
+    pipeline_run(stages, stage_count, engine);
+    const uint64_t wall_ns = perf_now() - start;
+    channels_close();
+    // Output was written by the last stage's thread
+    stdout_on_new_line = stages[stage_count - 1].on_new_line;
+    print_on_new_line();
+    flush_output();
+
+    enum Error first_error = ERR_OK;
+    fprintf(
+        stderr,
+        "%-7s%16s%12s%12s",
+        "Stage",
+        "Instructions",
+        "Read",
+        "Written"
+    );
+    if (options->channels)
+        fprintf(stderr, "%12s%12s", "Sent", "Received");
+    fprintf(
+        stderr,
+        "%14s%14s%14s  %s\n",
+        "Starved (ms)",
+        "Blocked (ms)",
+        "Instr/s",
+        "Program"
+    );
+    for (size_t i = 0; i < stage_count; ++i) {
+        const struct PipelineStage *const stage = &stages[i];
+        if (stage->error != ERR_OK && first_error == ERR_OK)
+            first_error = stage->error;
+        fprintf(
+            stderr,
+            "%-7zu%16" PRIu64 "%12" PRIu64 "%12" PRIu64,
+            i,
+            stage->instructions,
+            stage->bytes_read,
+            stage->bytes_written
+        );
+        if (options->channels)
+            fprintf(
+                stderr,
+                "%12" PRIu64 "%12" PRIu64,
+                stage->words_sent,
+                stage->words_received
+            );
+        fprintf(
+            stderr,
+            "%14.3f%14.3f%14.0f  %s",
+            stage->starved_ns / 1e6,
+            stage->blocked_ns / 1e6,
+            stage->busy_ns > 0 ? stage->instructions * 1e9 / stage->busy_ns
+                               : 0,
+            stage->filename
+        );
+        if (stage->error != ERR_OK)
+            fprintf(stderr, " (error %d)", stage->error);
+        fprintf(stderr, "\n");
     }
+    fprintf(stderr, "%-28s%.3f ms\n", "Wall time:", wall_ns / 1e6);
+    return first_error;
+}
 
-    // Fix endianess
-    for (size_t i = origin; i < origin + words_read; ++i)
-        memory[i] = swap_endian(memory[i]);
+int main(const int argc, const char *const *const argv) {
+    uint64_t timings[TIMING_COUNT];
+    timings[TIMING_MAIN] = perf_now();
 
-    // Reset registers
-    pc = origin;
-    cc = 0x2;  // Zero flag
-    for (int i = 0; i < 8; ++i)
-        registers[i] = 0;
+    struct Options options = {0};
+    if (!parse_options(argc, argv, &options)) {
+        print_usage();
+        return ERR_CLI;
+    }
 
-    // See LC-3 instruction set for details on how instructions are layed
-    // out in binary.
+    const struct Engine *engine = &engines[0];
+    if (options.engine_name != NULL) {
+        engine = find_engine(options.engine_name);
+        if (engine == NULL) {
+            fprintf(stderr, "Unknown engine %s. Engines:", options.engine_name);
+            for (size_t i = 0; i < engine_count; ++i)
+                fprintf(stderr, " %s", engines[i].name);
+            fprintf(stderr, "\n");
+            return ERR_CLI;
+        }
+    }
+
+    static struct InputBuffer input = {0};
+    if (options.input_filename != NULL) {
+        if (!read_whole_file(options.input_filename, &input)) {
+            fprintf(stderr, "Failed to read input file.\n");
+            return ERR_FILE;
+        }
+        io.read_char = buffer_read_char;
+        io.context = &input;
+        io.read = buffer_read;
+        io.input_ready = NULL;
+    }
+    if (options.script_filename != NULL) {
+        if (!script_load(options.script_filename))
+            return ERR_FILE;
+        script_attach();
+    }
 
-    // General layout of instructions (bits ordered low to high, from 0):
-    // * Bits 12-15: Opcode
-    // * Bits 9-11: Destination register (DR) or condition code for BR[nzp]
-    // * Bits 6-8: Source register 1 (SR1) or base register (BaseR)
-    // * Remaining low bits: Immediate (imm5), PC offset
-    //     (PCoffset9/PCoffset11), base offset (offset6), trap vector
-    //     (trapvect8)
+    for (int i = 0; i < options.plugin_count; ++i) {
+        struct Plugin plugin = {0};
+        if (!load_plugin(options.plugins[i], &plugin) ||
+            !add_plugin(&options, &plugin, options.plugins[i]))
+            return ERR_PLUGIN;
+    }
+    if (options.parallel_plugins)
+        trace_start();
+
+    if (options.preload)
+        jit_set_preload(
+            options.preload_threads > 0
+                ? (unsigned)options.preload_threads
+                : (unsigned)sysconf(_SC_NPROCESSORS_ONLN)
+        );
+
+    if (options.protect && !protect_regions(options.protect_regions)) {
+        fprintf(stderr, "Invalid protection regions.\n");
+        return ERR_CLI;
+    }
+
+    if (options.console && !attach_console()) {
+        fprintf(stderr, "Failed to attach console.\n");
+        return ERR_CLI;
+    }
+    if (options.batch_filename != NULL)
+        return run_batch(&options, engine, &input);
+    if (options.pipeline)
+        return run_pipeline(&options, engine);
 
-    // Some instructions can have single-bit 'flags' to indicate whether some
-    // bits refer to a register or an immediate (ADD, AND, JSR/JSRR).
+    if (options.disk_filename != NULL && !disk_open(options.disk_filename))
+        return ERR_FILE;
 
-    // Some instructions use the same opcode, or are aliases of other
-    // instructions. Eg. RET is JMP R7, and JSR and JSRR use the same opcode,
-    // with a flag.
+    const char *const program = options.filename != NULL
+                                    ? options.filename
+                                    : options.load_state_filename;
+    bool halted = false;
+    const enum Error load_error =
+        options.filename != NULL
+            ? load_file(options.filename)
+            : state_load(options.load_state_filename, &halted);
+    if (load_error != ERR_OK)
+        return load_error;
+    if (options.perf_map) {
+        (void)symbols_load_for(program);
+        if (!perfmap_open(options.jitdump))
+            return ERR_FILE;
+    }
+    if (options.shared_metrics || options.metrics_filename != NULL) {
+        if (!metrics_open(
+                options.shared_metrics,
+                options.metrics_filename,
+                program,
+                engine->name
+            ))
+            return ERR_FILE;
+        atexit(metrics_close);
+    }
+    timings[TIMING_LOADED] = perf_now();
+
+    if (options.bench_runs > 0 && !halted)
+        return run_benchmark(
+            engine, options.bench_runs, &input, options.show_perf
+        );
+    if (options.intervals > 0 && !halted)
+        return intervals_run(
+            engine,
+            options.intervals,
+            options.phases,
+            options.workers > 0 ? (unsigned)options.workers
+                                : (unsigned)sysconf(_SC_NPROCESSORS_ONLN),
+            stderr
+        );
+
+    // Counters are opened before the run, so opening them is not measured
+    struct PerfCounters counters;
+    if (options.show_perf) {
+        perf_open(&counters);
+        perf_start(&counters);
+    }
 
-    // Instructions can have padding of 0's (or 1's for NOT) which can be
-    // ignored, but is checked here anyway.
+    timings[TIMING_FIRST_INSTRUCTION] = perf_now();
+    // A state saved on HALT has nothing left to run
+    enum Error error = ERR_OK;
+    if (!halted) {
+        if (options.save_state_filename != NULL)
+            error = run_saving_state(
+                engine, options.save_state_filename, options.save_at
+            );
+        else if (options.script_filename != NULL)
+            // Bounded, so a failing script can stop the program
+            error = engine->execute_until(UINT64_MAX);
+        else
+            error = engine->execute();
+    }
+    if (options.script_filename != NULL)
+        error = script_finish(error);
+    timings[TIMING_HALT] = perf_now();
+    if (options.parallel_plugins) {
+        flush_output();
+        trace_finish(stderr);
+    }
+    if (error != ERR_OK)
+        return error;
 
-    while (true) {
-        // Get next instruction, then increment PC
-        const Word instruction = memory[pc++];
-        const enum Opcode opcode = (enum Opcode)bits(instruction, 15, 12);
-
-        switch (opcode) {
-            // ADD*
-            case OP_ADD: {
-                const uint8_t dest_reg = bits_reg_a(instruction);
-                const uint8_t src_reg = bits_reg_b(instruction);
-                SignedWord second_operand;
-                if (bits(instruction, 5, 5) == 0) {
-                    // Second operand is a register
-                    if (bits(instruction, 4, 3) != 0) {
-                        fprintf(stderr, "Invalid padding for ADD\n");
-                        return ERR_INSTRUCTION;
-                    }
-                    second_operand =
-                        (SignedWord)registers[bits_reg_c(instruction)];
-                } else {
-                    // Second operand is an immediate
-                    second_operand = bits_imm_5(instruction);
-                }
-                const SignedWord result =
-                    (SignedWord)registers[src_reg] + second_operand;
-                registers[dest_reg] = (Word)result;
-                set_cc(result);
-            } break;
-
-            // AND*
-            case OP_AND: {
-                const uint8_t dest_reg = bits_reg_a(instruction);
-                const uint8_t src_reg = bits_reg_b(instruction);
-                Word second_operand;
-                if (bits(instruction, 5, 5) == 0) {
-                    // Second operand is a register
-                    if (bits(instruction, 4, 3) != 0) {
-                        fprintf(stderr, "Invalid padding for ADD\n");
-                        return ERR_INSTRUCTION;
-                    }
-                    second_operand = registers[bits_reg_c(instruction)];
-                } else {
-                    // Second operand is an immediate
-                    second_operand = (Word)bits_imm_5(instruction);
-                }
-                const Word result = registers[src_reg] & second_operand;
-                registers[dest_reg] = result;
-                set_cc((SignedWord)result);
-            } break;
-
-            // NOT*
-            case OP_NOT: {
-                const uint8_t dest_reg = bits_reg_a(instruction);
-                const uint8_t src_reg = bits_reg_b(instruction);
-                if (bits(instruction, 5, 0) != 0x3f) {
-                    fprintf(stderr, "Invalid padding for NOT\n");
-                    return ERR_INSTRUCTION;
-                }
-                const Word result = ~registers[src_reg];
-                registers[dest_reg] = result;
-                set_cc((SignedWord)result);
-            } break;
-
-            // LEA*
-            case OP_LEA: {
-                const uint8_t dest_reg = bits_reg_a(instruction);
-                const SignedWord pc_offset = bits_pc_offset_9(instruction);
-                registers[dest_reg] = pc + pc_offset;
-            } break;
-
-            // LD*
-            case OP_LD: {
-                const uint8_t dest_reg = bits_reg_a(instruction);
-                const SignedWord pc_offset = bits_pc_offset_9(instruction);
-                const Word result = memory[pc + pc_offset];
-                registers[dest_reg] = result;
-                set_cc((SignedWord)result);
-            } break;
-
-            // LDI*
-            case OP_LDI: {
-                const uint8_t dest_reg = bits_reg_a(instruction);
-                const SignedWord pc_offset = bits_pc_offset_9(instruction);
-                const Word address = memory[pc + pc_offset];
-                const Word result = memory[address];
-                registers[dest_reg] = result;
-                set_cc((SignedWord)result);
-            } break;
-
-            // LDR*
-            case OP_LDR: {
-                const uint8_t dest_reg = bits_reg_a(instruction);
-                const uint8_t base_reg = bits_reg_b(instruction);
-                const SignedWord offset = bits_offset_6(instruction);
-                const Word result = memory[registers[base_reg] + offset];
-                registers[dest_reg] = result;
-                set_cc((SignedWord)result);
-            } break;
-
-            // ST
-            case OP_ST: {
-                const uint8_t src_reg = bits_reg_a(instruction);
-                const SignedWord pc_offset = bits_pc_offset_9(instruction);
-                const Word result = registers[src_reg];
-                memory[pc + pc_offset] = result;
-            } break;
-
-            // STI
-            case OP_STI: {
-                const uint8_t src_reg = bits_reg_a(instruction);
-                const SignedWord pc_offset = bits_pc_offset_9(instruction);
-                const Word address = memory[pc + pc_offset];
-                const Word result = registers[src_reg];
-                memory[address] = result;
-            } break;
-
-            // STR
-            case OP_STR: {
-                const uint8_t src_reg = bits_reg_a(instruction);
-                const uint8_t base_reg = bits_reg_b(instruction);
-                const SignedWord offset = bits_offset_6(instruction);
-                const Word result = registers[src_reg];
-                memory[registers[base_reg] + offset] = result;
-            } break;
-
-            // BR[nzp]
-            case OP_BR: {
-                // Skip NOP case
-                if (instruction == 0x0000)
-                    continue;
-                const uint8_t condition = bits_reg_a(instruction);
-                // Cannot have no flags. `BR` is assembled as `BRnzp`
-                if (condition == 0) {
-                    fprintf(stderr, "Invalid condition for BR[nzp]\n");
-                    return ERR_INSTRUCTION;
-                }
-                const SignedWord pc_offset = bits_pc_offset_9(instruction);
-                if (cc & condition)
-                    pc += pc_offset;
-            } break;
-
-            // JMP/RET
-            case OP_JMP_RET: {
-                if (bits(instruction, 11, 9) != 0 ||
-                    bits(instruction, 5, 0) != 0) {
-                    fprintf(stderr, "Invalid padding for JMP/RET\n");
-                    return ERR_INSTRUCTION;
-                }
-                const uint8_t base_reg = bits_reg_b(instruction);
-                pc = registers[base_reg];
-            } break;
-
-            // JSR/JSRR
-            case OP_JSR_JSRR: {
-                registers[7] = pc;
-                if (bits(instruction, 11, 11)) {
-                    // JSR
-                    const SignedWord pc_offset = bits_pc_offset_11(instruction);
-                    pc += pc_offset;
-                } else {
-                    // JSRR
-                    if (bits(instruction, 11, 9) != 0 ||
-                        bits(instruction, 5, 0) != 0) {
-                        fprintf(stderr, "Invalid padding for JSRR\n");
-                        return ERR_INSTRUCTION;
-                    }
-                    const uint8_t base_reg = bits_reg_b(instruction);
-                    pc = registers[base_reg];
-                }
-            } break;
-
-            // TRAP
-            case OP_TRAP: {
-                if (bits(instruction, 11, 8) != 0) {
-                    fprintf(stderr, "Invalid padding for TRAP\n");
-                    return ERR_INSTRUCTION;
-                }
-                const enum TrapVect trap_vect =
-                    (enum TrapVect)bits(instruction, 8, 0);
-                switch (trap_vect) {
-                    // GETC
-                    case TRAP_GETC: {
-                        enable_raw_terminal();
-                        const char input = (char)getchar();
-                        disable_raw_terminal();
-                        registers[0] = (Word)input;
-                    }; break;
-
-                    // IN
-                    case TRAP_IN: {
-                        print_on_new_line();
-                        printf("Input> ");
-                        enable_raw_terminal();
-                        const char input = (char)getchar();
-                        disable_raw_terminal();
-                        print_char(input);
-                        print_on_new_line();
-                        registers[0] = (Word)input;
-                    }; break;
-
-                    // OUT
-                    case TRAP_OUT: {
-                        print_char((char)(registers[0]));
-                        (void)fflush(stdout);
-                    }; break;
-
-                    // PUTS
-                    case TRAP_PUTS: {
-                        for (Word i = registers[0];; ++i) {
-                            const char ch = (char)(memory[i]);
-                            if (ch == '\0')
-                                break;
-                            print_char(ch);
-                        }
-                        (void)fflush(stdout);
-                    }; break;
-
-                    // PUTSP
-                    case TRAP_PUTSP: {
-                        for (Word i = registers[0];; ++i) {
-                            const Word word = memory[i];
-                            const char chars[2] = {
-                                (char)(word >> 8), (char)word
-                            };
-
-                            if (chars[0] == '\0')
-                                break;
-                            print_char(chars[0]);
-                            if (chars[1] == '\0')
-                                break;
-                            print_char(chars[1]);
-                        }
-                        (void)fflush(stdout);
-                    }; break;
-
-                    // HALT
-                    case TRAP_HALT:
-                        goto halt;
-
-                    // Could be a non-standard trap, so not unreachable
-                    default:
-                        fprintf(
-                            stderr, "Invalid TRAP vector 0x%02hhx\n", trap_vect
-                        );
-                        return ERR_INSTRUCTION;
-                }
-            } break;
-
-            // RTI
-            case OP_RTI:
-                fprintf(stderr, "Cannot use RTI in non-supervisor mode\n");
-                return ERR_INSTRUCTION;
-            // Reserved
-            case OP_RESERVED:
-                fprintf(stderr, "Cannot use reserved instruction\n");
-                return ERR_INSTRUCTION;
-        }
+    if (options.show_perf) {
+        perf_stop(&counters);
+        perf_close(&counters);
     }
-halt:
 
     print_on_new_line();
+    if (options.show_perf) {
+        flush_output();
+        perf_report(stderr, &counters, instructions_retired);
+    }
+    if (options.show_timings) {
+        flush_output();
+        timings[TIMING_EXIT] = perf_now();
+        print_timings(timings);
+    }
     return ERR_OK;
 }
@@ -0,0 +1,221 @@
+#include "metrics.h"
+
+// Libc
+#include <inttypes.h>  // PRIu64
+#include <stdio.h>     // fprintf, fputc, rename
+#include <stdlib.h>    // calloc
+#include <string.h>    // strncpy, strrchr
+#include <time.h>      // clock_gettime
+// POSIX
+#include <fcntl.h>     // O_CREAT, etc
+#include <sys/mman.h>  // shm_open, mmap
+#include <unistd.h>    // ftruncate, getpid, close
+// Local
+#include "vm.h"  // assert
+
+// Time between rewrites of the textfile
+#define TEXTFILE_INTERVAL_NS 1000000000ULL
+
+struct Metrics *metrics = NULL;
+
+static char segment_name[64];
+static const char *textfile_path = NULL;
+static uint64_t textfile_written_at = 0;
+
+uint64_t realtime_now() {
+    struct timespec time;
+    (void)clock_gettime(CLOCK_REALTIME, &time);
+    return (uint64_t)time.tv_sec * 1000000000 + (uint64_t)time.tv_nsec;
+}
+
+bool metrics_open(
+    const bool shared,
+    const char *const textfile,
+    const char *const program,
+    const char *const engine
+) {
+    if (shared) {
+        snprintf(
+            segment_name,
+            sizeof(segment_name),
+            "/" METRICS_PREFIX "%d",
+            (int)getpid()
+        );
+        const int fd =
+            shm_open(segment_name, O_CREAT | O_RDWR | O_TRUNC, 0644);
+        if (fd < 0 || ftruncate(fd, sizeof(struct Metrics)) < 0) {
+            fprintf(stderr, "Failed to create shared memory for metrics.\n");
+            if (fd >= 0) {
+                (void)close(fd);
+                (void)shm_unlink(segment_name);
+            }
+            segment_name[0] = '\0';
+            return false;
+        }
+        void *const segment = mmap(
+            NULL,
+            sizeof(struct Metrics),
+            PROT_READ | PROT_WRITE,
+            MAP_SHARED,
+            fd,
+            0
+        );
+        (void)close(fd);
+        if (segment == MAP_FAILED) {
+            fprintf(stderr, "Failed to map shared memory for metrics.\n");
+            return false;
+        }
+        metrics = segment;
+    } else {
+        metrics = calloc(1, sizeof(struct Metrics));
+        assert(metrics != NULL, "Out of memory");
+    }
+
+    // Only the file name, since the full path may not fit
+    const char *const base_name = strrchr(program, '/');
+    strncpy(
+        metrics->program,
+        base_name == NULL ? program : base_name + 1,
+        sizeof(metrics->program) - 1
+    );
+    strncpy(metrics->engine, engine, sizeof(metrics->engine) - 1);
+    metrics->pid = (int32_t)getpid();
+    metrics->version = METRICS_VERSION;
+    atomic_store_explicit(&metrics->running, 1, memory_order_relaxed);
+    atomic_store_explicit(
+        &metrics->started_at, realtime_now(), memory_order_relaxed
+    );
+    atomic_store_explicit(
+        &metrics->magic, METRICS_MAGIC, memory_order_release
+    );
+    textfile_path = textfile;
+    return true;
+}
+
+// Write a label value, escaped as the text format requires
+void write_label_value(FILE *const file, const char *value) {
+    for (; *value != '\0'; ++value) {
+        if (*value == '\\' || *value == '"')
+            fputc('\\', file);
+        if (*value == '\n')
+            fputs("\\n", file);
+        else
+            fputc(*value, file);
+    }
+}
+
+// Write one labelled sample of a metric
+// Write a sample's name and labels, up to its value
+void write_sample_name(
+    FILE *const file, const char *const name, const char *const extra_labels
+) {
+    fprintf(file, "minilc3_%s{pid=\"%d\",program=\"", name, (int)metrics->pid);
+    write_label_value(file, metrics->program);
+    fprintf(file, "\",engine=\"");
+    write_label_value(file, metrics->engine);
+    fprintf(file, "\"%s} ", extra_labels);
+}
+
+void write_sample(
+    FILE *const file,
+    const char *const name,
+    const char *const extra_labels,
+    const uint64_t value
+) {
+    write_sample_name(file, name, extra_labels);
+    fprintf(file, "%" PRIu64 "\n", value);
+}
+
+void write_sample_seconds(
+    FILE *const file,
+    const char *const name,
+    const char *const extra_labels,
+    const uint64_t nanoseconds
+) {
+    write_sample_name(file, name, extra_labels);
+    fprintf(file, "%.9f\n", nanoseconds / 1e9);
+}
+
+#define LOAD(_field) \
+    atomic_load_explicit(&metrics->_field, memory_order_relaxed)
+
+// Write all metrics in the Prometheus text format, replacing the file
+// atomically so a scraper never sees half of it
+void write_textfile() {
+    char temporary_path[4096];
+    snprintf(
+        temporary_path, sizeof(temporary_path), "%s.tmp", textfile_path
+    );
+    FILE *const file = fopen(temporary_path, "w");
+    if (file == NULL)
+        return;
+
+    char labels[64];
+    fprintf(file, "# TYPE minilc3_running gauge\n");
+    write_sample(file, "running", "", LOAD(running));
+    fprintf(file, "# TYPE minilc3_instructions_retired_total counter\n");
+    write_sample(
+        file, "instructions_retired_total", "", LOAD(instructions)
+    );
+    fprintf(file, "# TYPE minilc3_traps_total counter\n");
+    for (int vector = 0; vector < 256; ++vector) {
+        const uint64_t count = LOAD(traps[vector]);
+        if (count == 0)
+            continue;
+        snprintf(labels, sizeof(labels), ",vector=\"0x%02x\"", vector);
+        write_sample(file, "traps_total", labels, count);
+    }
+    fprintf(file, "# TYPE minilc3_input_bytes_total counter\n");
+    write_sample(file, "input_bytes_total", "", LOAD(bytes_in));
+    fprintf(file, "# TYPE minilc3_output_bytes_total counter\n");
+    write_sample(file, "output_bytes_total", "", LOAD(bytes_out));
+    fprintf(file, "# TYPE minilc3_input_wait_seconds_total counter\n");
+    write_sample_seconds(
+        file, "input_wait_seconds_total", "", LOAD(input_wait_ns)
+    );
+    fprintf(file, "# TYPE minilc3_cache_hits_total counter\n");
+    write_sample(file, "cache_hits_total", "", LOAD(cache_hits));
+    fprintf(file, "# TYPE minilc3_cache_misses_total counter\n");
+    write_sample(file, "cache_misses_total", "", LOAD(cache_misses));
+    fprintf(file, "# TYPE minilc3_cache_bytes gauge\n");
+    write_sample(file, "cache_bytes", "", LOAD(cache_bytes));
+    fprintf(file, "# TYPE minilc3_cache_blocks gauge\n");
+    write_sample(file, "cache_blocks", "", LOAD(cache_blocks));
+    fprintf(file, "# TYPE minilc3_cache_evictions_total counter\n");
+    write_sample(file, "cache_evictions_total", "", LOAD(cache_evictions));
+    fprintf(file, "# TYPE minilc3_cache_recompilations_total counter\n");
+    write_sample(
+        file, "cache_recompilations_total", "", LOAD(cache_recompilations)
+    );
+
+    (void)fclose(file);
+    (void)rename(temporary_path, textfile_path);
+}
+
+void metrics_publish(const uint64_t instructions) {
+    const uint64_t now = realtime_now();
+    atomic_store_explicit(
+        &metrics->instructions, instructions, memory_order_relaxed
+    );
+    atomic_store_explicit(&metrics->updated_at, now, memory_order_relaxed);
+    if (textfile_path != NULL &&
+        now - textfile_written_at >= TEXTFILE_INTERVAL_NS) {
+        write_textfile();
+        textfile_written_at = now;
+    }
+}
+
+void metrics_close() {
+    if (metrics == NULL)
+        return;
+    atomic_store_explicit(&metrics->running, 0, memory_order_relaxed);
+    if (textfile_path != NULL)
+        write_textfile();
+    if (segment_name[0] != '\0') {
+        (void)munmap(metrics, sizeof(struct Metrics));
+        (void)shm_unlink(segment_name);
+    } else {
+        free(metrics);
+    }
+    metrics = NULL;
+}
@@ -0,0 +1,73 @@
+// Live metrics of a running VM
+// Counters live in a shared-memory segment (`/dev/shm/minilc3-<pid>`) which
+// the VM updates with relaxed atomic stores, so readers such as
+// `minilc3-top` can watch it without the VM making any syscalls. They can
+// also be written as a Prometheus textfile, for local scraping.
+
+#ifndef METRICS_H
+#define METRICS_H
+
+// Libc
+#include <stdatomic.h>  // _Atomic
+#include <stdbool.h>    // bool
+#include <stdint.h>     // uint64_t
+
+#define METRICS_MAGIC 0x4d334c43  // "LC3M"
+#define METRICS_VERSION 2
+#define METRICS_PREFIX "minilc3-"
+
+// Instructions between updates of the instruction counter
+#define METRICS_SLICE (1 << 20)
+
+// Layout of the shared-memory segment
+// There is one writer (the VM), so counters are updated with a relaxed load
+// and store rather than a locked read-modify-write
+struct Metrics {
+    _Atomic uint32_t magic;  // Set last, once the rest is initialized
+    uint32_t version;
+    int32_t pid;
+    char program[64];
+    char engine[16];
+    _Atomic uint32_t running;       // Cleared when the program stops
+    _Atomic uint64_t started_at;    // Realtime clock, in nanoseconds
+    _Atomic uint64_t updated_at;    // Realtime clock, in nanoseconds
+    _Atomic uint64_t instructions;  // Updated every `METRICS_SLICE`
+    _Atomic uint64_t traps[256];    // Per trap vector
+    _Atomic uint64_t bytes_in;
+    _Atomic uint64_t bytes_out;
+    _Atomic uint64_t input_wait_ns;  // Time blocked reading input
+    // Only counted by engines which cache translated code
+    _Atomic uint64_t cache_hits;
+    _Atomic uint64_t cache_misses;
+    _Atomic uint64_t cache_bytes;      // Of code, updated now and then
+    _Atomic uint64_t cache_blocks;     // Which can run, updated now and then
+    _Atomic uint64_t cache_evictions;  // Blocks evicted for want of space
+    // Blocks translated again: after being evicted or thrown away, or to move
+    // them to the hot region
+    _Atomic uint64_t cache_recompilations;
+};
+
+// NULL unless metrics are enabled
+extern struct Metrics *metrics;
+
+// Enable metrics in shared memory (if `shared`), or in private memory if only
+// a textfile is wanted. `textfile` may be NULL
+// Returns false (after printing why) if the segment could not be created
+bool metrics_open(
+    bool shared,
+    const char *textfile,
+    const char *program,
+    const char *engine
+);
+// Publish final values and remove the shared-memory segment
+void metrics_close();
+
+static inline void metrics_add(_Atomic uint64_t *const counter, uint64_t n) {
+    const uint64_t value = atomic_load_explicit(counter, memory_order_relaxed);
+    atomic_store_explicit(counter, value + n, memory_order_relaxed);
+}
+
+// Publish the instruction counter, and rewrite the textfile if it is due
+void metrics_publish(uint64_t instructions);
+
+#endif
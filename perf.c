@@ -0,0 +1,182 @@
+#include "perf.h"
+
+// Libc
+#include <errno.h>     // errno
+#include <inttypes.h>  // PRIu64
+#include <string.h>    // memset, strerror
+#include <time.h>      // clock_gettime
+// POSIX
+#include <unistd.h>  // close, read
+#ifdef __linux__
+// Linux
+#include <linux/perf_event.h>  // struct perf_event_attr, etc
+#include <sys/ioctl.h>         // ioctl
+#include <sys/syscall.h>       // SYS_perf_event_open
+#endif
+
+uint64_t perf_now() {
+    struct timespec time;
+    (void)clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000 + (uint64_t)time.tv_nsec;
+}
+
+#ifdef __linux__
+
+// Cache events are encoded as `id | (op << 8) | (result << 16)`
+#define CACHE_READ_MISS(_cache)                      \
+    ((_cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | \
+     (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static const struct {
+    uint32_t type;
+    uint64_t config;
+} events[PERF_EVENT_COUNT] = {
+    [PERF_CYCLES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    [PERF_INSTRUCTIONS] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    [PERF_BRANCH_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    [PERF_L1I_MISSES] =
+        {PERF_TYPE_HW_CACHE, CACHE_READ_MISS(PERF_COUNT_HW_CACHE_L1I)},
+    [PERF_L1D_MISSES] =
+        {PERF_TYPE_HW_CACHE, CACHE_READ_MISS(PERF_COUNT_HW_CACHE_L1D)},
+    [PERF_ITLB_MISSES] =
+        {PERF_TYPE_HW_CACHE, CACHE_READ_MISS(PERF_COUNT_HW_CACHE_ITLB)},
+};
+
+void perf_open(struct PerfCounters *const counters) {
+    memset(counters, 0, sizeof(*counters));
+    for (int i = 0; i < PERF_EVENT_COUNT; ++i) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[i].type;
+        attr.config = events[i].config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        // More events than hardware counters get multiplexed; scale by these
+        attr.read_format =
+            PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        counters->fds[i] =
+            (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (counters->fds[i] < 0 && i == PERF_CYCLES)
+            counters->open_errno = errno;
+    }
+}
+
+void perf_start(struct PerfCounters *const counters) {
+    for (int i = 0; i < PERF_EVENT_COUNT; ++i) {
+        if (counters->fds[i] < 0)
+            continue;
+        (void)ioctl(counters->fds[i], PERF_EVENT_IOC_RESET, 0);
+        (void)ioctl(counters->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+    counters->started_at = perf_now();
+}
+
+void perf_stop(struct PerfCounters *const counters) {
+    counters->nanoseconds += perf_now() - counters->started_at;
+    for (int i = 0; i < PERF_EVENT_COUNT; ++i) {
+        if (counters->fds[i] < 0)
+            continue;
+        (void)ioctl(counters->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+
+        // Value, time enabled, time running
+        uint64_t data[3];
+        if (read(counters->fds[i], data, sizeof(data)) != sizeof(data))
+            continue;
+        if (data[2] == 0)
+            continue;  // Never scheduled onto a hardware counter
+        if (data[2] < data[1])
+            data[0] = (uint64_t)((double)data[0] * data[1] / data[2]);
+        counters->values[i] += data[0];
+    }
+}
+
+#else
+
+void perf_open(struct PerfCounters *const counters) {
+    memset(counters, 0, sizeof(*counters));
+    for (int i = 0; i < PERF_EVENT_COUNT; ++i)
+        counters->fds[i] = -1;
+    counters->open_errno = ENOSYS;
+}
+
+void perf_start(struct PerfCounters *const counters) {
+    counters->started_at = perf_now();
+}
+
+void perf_stop(struct PerfCounters *const counters) {
+    counters->nanoseconds += perf_now() - counters->started_at;
+}
+
+#endif
+
+void perf_close(struct PerfCounters *const counters) {
+    for (int i = 0; i < PERF_EVENT_COUNT; ++i) {
+        if (counters->fds[i] >= 0)
+            (void)close(counters->fds[i]);
+        counters->fds[i] = -1;
+    }
+}
+
+bool perf_available(
+    const struct PerfCounters *const counters, const enum PerfEvent event
+) {
+    return counters->fds[event] >= 0;
+}
+
+// How each event is reported, relative to guest instructions
+static const struct {
+    const char *label;
+    double scale;
+} ratios[PERF_EVENT_COUNT] = {
+    [PERF_CYCLES] = {"Host cycles / instr:", 1},
+    [PERF_INSTRUCTIONS] = {"Host instrs / instr:", 1},
+    [PERF_BRANCH_MISSES] = {"Mispredicts / dispatch:", 1},
+    [PERF_L1I_MISSES] = {"L1i misses / 1k instr:", 1000},
+    [PERF_L1D_MISSES] = {"L1d misses / 1k instr:", 1000},
+    [PERF_ITLB_MISSES] = {"iTLB misses / 1k instr:", 1000},
+};
+
+void perf_report(
+    FILE *const stream,
+    const struct PerfCounters *const counters,
+    const uint64_t guest_instructions
+) {
+    const double seconds = (double)counters->nanoseconds / 1e9;
+    fprintf(
+        stream,
+        "%-28s%" PRIu64 "\n",
+        "Guest instructions:",
+        guest_instructions
+    );
+    fprintf(stream, "%-28s%.3f ms\n", "Time:", seconds * 1e3);
+    if (seconds > 0)
+        fprintf(
+            stream, "%-28s%.2f\n", "MIPS:", guest_instructions / seconds / 1e6
+        );
+
+    if (counters->open_errno != 0) {
+        fprintf(
+            stream,
+            "Hardware counters unavailable: %s\n",
+            strerror(counters->open_errno)
+        );
+        return;
+    }
+    for (int i = 0; i < PERF_EVENT_COUNT; ++i) {
+        fprintf(stream, "%-28s", ratios[i].label);
+        if (!perf_available(counters, (enum PerfEvent)i))
+            fprintf(stream, "unavailable\n");
+        else if (guest_instructions == 0)
+            fprintf(stream, "-\n");
+        else
+            fprintf(
+                stream,
+                "%.3f\n",
+                (double)counters->values[i] * ratios[i].scale /
+                    (double)guest_instructions
+            );
+    }
+}
@@ -0,0 +1,52 @@
+#ifndef PERF_H
+#define PERF_H
+
+// Libc
+#include <stdbool.h>  // bool
+#include <stdint.h>   // uint64_t
+#include <stdio.h>    // FILE
+
+// Hardware events counted around a run
+enum PerfEvent {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_BRANCH_MISSES,
+    PERF_L1I_MISSES,
+    PERF_L1D_MISSES,
+    PERF_ITLB_MISSES,
+    PERF_EVENT_COUNT,
+};
+
+// Counters for one benchmarked region
+// Values accumulate over every `perf_start`/`perf_stop` pair, so repeated
+// runs can be summed and then reported together
+struct PerfCounters {
+    int fds[PERF_EVENT_COUNT];  // -1 if the event is unavailable
+    uint64_t values[PERF_EVENT_COUNT];
+    uint64_t nanoseconds;  // Wall time between start and stop
+    uint64_t started_at;
+    int open_errno;  // Why the cycle counter could not be opened, or 0
+};
+
+// Monotonic clock, in nanoseconds
+uint64_t perf_now();
+
+// Open every event that the host allows. Never fails: events which cannot be
+// opened (eg. in a container, or with a high `perf_event_paranoid`) are
+// reported as unavailable
+void perf_open(struct PerfCounters *counters);
+void perf_close(struct PerfCounters *counters);
+
+void perf_start(struct PerfCounters *counters);
+void perf_stop(struct PerfCounters *counters);
+
+bool perf_available(const struct PerfCounters *counters, enum PerfEvent event);
+
+// Print counters relative to the amount of guest instructions retired
+void perf_report(
+    FILE *stream,
+    const struct PerfCounters *counters,
+    uint64_t guest_instructions
+);
+
+#endif
@@ -0,0 +1,190 @@
+#include "perfmap.h"
+
+// Libc
+#include <stdint.h>  // uint32_t, etc
+#include <stdio.h>   // fprintf, etc
+#include <stdlib.h>  // getenv
+#include <string.h>  // strlen
+// POSIX
+#include <pthread.h>   // pthread_mutex_t
+#include <sys/mman.h>  // mmap
+#include <unistd.h>    // getpid
+#ifdef __linux__
+#include <sys/syscall.h>  // SYS_gettid
+#endif
+// Local
+#include "perf.h"     // perf_now
+#include "symbols.h"  // symbol_at
+
+// See `tools/perf/Documentation/jitdump-specification.txt` in Linux
+#define JITDUMP_MAGIC 0x4A695444
+#define JITDUMP_VERSION 1
+#define JIT_CODE_LOAD 0
+
+#if defined(__x86_64__)
+#define ELF_MACHINE 62
+#elif defined(__aarch64__)
+#define ELF_MACHINE 183
+#elif defined(__i386__)
+#define ELF_MACHINE 3
+#elif defined(__riscv)
+#define ELF_MACHINE 243
+#else
+#define ELF_MACHINE 0
+#endif
+
+struct JitdumpHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t total_size;
+    uint32_t elf_machine;
+    uint32_t padding;
+    uint32_t pid;
+    uint64_t timestamp;
+    uint64_t flags;
+};
+
+// Followed by the null-terminated name, then the code itself
+struct JitdumpCodeLoad {
+    uint32_t id;
+    uint32_t total_size;
+    uint64_t timestamp;
+    uint32_t pid;
+    uint32_t tid;
+    uint64_t vma;
+    uint64_t code_address;
+    uint64_t code_size;
+    uint64_t code_index;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *map_file = NULL;
+static FILE *jitdump_file = NULL;
+static void *jitdump_marker = NULL;
+static uint64_t code_index = 0;
+
+bool perfmap_open(const bool jitdump) {
+    char path[4096];
+    snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+    map_file = fopen(path, "w");
+    if (map_file == NULL) {
+        fprintf(stderr, "Failed to create %s.\n", path);
+        return false;
+    }
+    if (!jitdump)
+        return true;
+
+    const char *directory = getenv("JITDUMPDIR");
+    if (directory == NULL)
+        directory = "/tmp";
+    snprintf(path, sizeof(path), "%s/jit-%d.dump", directory, (int)getpid());
+    jitdump_file = fopen(path, "w+");
+    if (jitdump_file == NULL) {
+        fprintf(stderr, "Failed to create %s.\n", path);
+        return false;
+    }
+
+    const struct JitdumpHeader header = {
+        JITDUMP_MAGIC,
+        JITDUMP_VERSION,
+        sizeof(struct JitdumpHeader),
+        ELF_MACHINE,
+        0,
+        (uint32_t)getpid(),
+        perf_now(),
+        0,
+    };
+    (void)fwrite(&header, sizeof(header), 1, jitdump_file);
+    (void)fflush(jitdump_file);
+
+    // `perf record` finds the file through this executable mapping of it
+    jitdump_marker = mmap(
+        NULL,
+        (size_t)sysconf(_SC_PAGESIZE),
+        PROT_READ | PROT_EXEC,
+        MAP_PRIVATE,
+        fileno(jitdump_file),
+        0
+    );
+    if (jitdump_marker == MAP_FAILED) {
+        jitdump_marker = NULL;
+        fprintf(stderr, "Failed to map %s.\n", path);
+        return false;
+    }
+    return true;
+}
+
+void perfmap_close() {
+    pthread_mutex_lock(&lock);
+    if (map_file != NULL)
+        (void)fclose(map_file);
+    if (jitdump_marker != NULL)
+        (void)munmap(jitdump_marker, (size_t)sysconf(_SC_PAGESIZE));
+    if (jitdump_file != NULL)
+        (void)fclose(jitdump_file);
+    map_file = jitdump_file = NULL;
+    jitdump_marker = NULL;
+    pthread_mutex_unlock(&lock);
+}
+
+bool perfmap_enabled() {
+    return map_file != NULL;
+}
+
+void perfmap_add(
+    const void *const code,
+    const size_t size,
+    const Word start,
+    const Word end
+) {
+    if (map_file == NULL)
+        return;
+
+    // Eg. `lc3:LOOP+0x2 [x3004-x3009]`
+    char name[128];
+    Word offset;
+    const char *const label = symbol_at(start, &offset);
+    if (label == NULL)
+        snprintf(name, sizeof(name), "lc3 [x%04x-x%04x]", start, end);
+    else if (offset == 0)
+        snprintf(name, sizeof(name), "lc3:%s [x%04x-x%04x]", label, start, end);
+    else
+        snprintf(
+            name,
+            sizeof(name),
+            "lc3:%s+0x%x [x%04x-x%04x]",
+            label,
+            offset,
+            start,
+            end
+        );
+
+    pthread_mutex_lock(&lock);
+    fprintf(map_file, "%lx %zx %s\n", (unsigned long)code, size, name);
+    (void)fflush(map_file);
+
+    if (jitdump_file != NULL) {
+        const size_t name_size = strlen(name) + 1;
+#ifdef __linux__
+        const uint32_t tid = (uint32_t)syscall(SYS_gettid);
+#else
+        const uint32_t tid = (uint32_t)getpid();
+#endif
+        const struct JitdumpCodeLoad record = {
+            JIT_CODE_LOAD,
+            (uint32_t)(sizeof(record) + name_size + size),
+            perf_now(),
+            (uint32_t)getpid(),
+            tid,
+            (uint64_t)(uintptr_t)code,
+            (uint64_t)(uintptr_t)code,
+            size,
+            code_index++,
+        };
+        (void)fwrite(&record, sizeof(record), 1, jitdump_file);
+        (void)fwrite(name, 1, name_size, jitdump_file);
+        (void)fwrite(code, 1, size, jitdump_file);
+        (void)fflush(jitdump_file);
+    }
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,27 @@
+// Symbolization of generated native code for Linux `perf`
+// Engines which generate native code register every translated region here,
+// and it is named after the guest address range and the nearest `.sym`
+// label. Entries go to `/tmp/perf-<pid>.map`, and optionally to a jitdump
+// file (`$JITDUMPDIR/jit-<pid>.dump`, default `/tmp`) for `perf inject --jit`.
+
+#ifndef PERFMAP_H
+#define PERFMAP_H
+
+// Libc
+#include <stdbool.h>  // bool
+#include <stddef.h>   // size_t
+// Local
+#include "vm.h"  // Word
+
+// Returns false (after printing why) if a file could not be created
+bool perfmap_open(bool jitdump);
+void perfmap_close();
+
+// Whether generated code should be registered at all
+bool perfmap_enabled();
+
+// Register native code for guest addresses `start` to `end`, inclusive
+// Safe to call from any thread
+void perfmap_add(const void *code, size_t size, Word start, Word end);
+
+#endif
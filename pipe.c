@@ -0,0 +1,304 @@
+#include "pipe.h"
+
+// Libc
+#include <errno.h>      // errno, EINTR
+#include <stdatomic.h>  // atomic_load_explicit, etc
+#include <stdint.h>     // SIZE_MAX
+#include <stdlib.h>     // aligned_alloc, free
+#include <string.h>     // memcpy
+#include <time.h>       // clock_gettime, struct timespec
+// POSIX
+#include <semaphore.h>  // sem_t, sem_post, sem_wait
+// Local
+#include "perf.h"  // perf_now
+
+#define CACHE_LINE 64
+#define PIPE_SPINS 256  // Polls of the other side before sleeping
+
+struct Pipe {
+    // Written by the producer
+    _Alignas(CACHE_LINE) _Atomic size_t head;  // Bytes written
+    _Atomic bool closed;                       // No more will be written
+    size_t tail_seen;                          // Last `tail` loaded
+    // Written by the consumer
+    _Alignas(CACHE_LINE) _Atomic size_t tail;  // Bytes read
+    _Atomic bool abandoned;                    // No more will be read
+    size_t head_seen;                          // Last `head` loaded
+    // Written by both
+    // A side about to sleep says so first, and the other side wakes it
+    // after moving its own position
+    _Alignas(CACHE_LINE) _Atomic bool reader_sleeping;
+    _Atomic bool writer_sleeping;
+    sem_t readable;
+    sem_t writable;
+    _Alignas(CACHE_LINE) size_t size;
+    char data[];
+};
+
+struct Pipe *pipe_create(const size_t size) {
+    struct Pipe *const pipe =
+        aligned_alloc(CACHE_LINE, sizeof(struct Pipe) + size);
+    if (pipe == NULL)
+        return NULL;
+    atomic_init(&pipe->head, 0);
+    atomic_init(&pipe->closed, false);
+    pipe->tail_seen = 0;
+    atomic_init(&pipe->tail, 0);
+    atomic_init(&pipe->abandoned, false);
+    pipe->head_seen = 0;
+    atomic_init(&pipe->reader_sleeping, false);
+    atomic_init(&pipe->writer_sleeping, false);
+    pipe->size = size;
+    if (sem_init(&pipe->readable, 0, 0) != 0) {
+        free(pipe);
+        return NULL;
+    }
+    if (sem_init(&pipe->writable, 0, 0) != 0) {
+        (void)sem_destroy(&pipe->readable);
+        free(pipe);
+        return NULL;
+    }
+    return pipe;
+}
+
+void pipe_free(struct Pipe *const pipe) {
+    if (pipe == NULL)
+        return;
+    (void)sem_destroy(&pipe->readable);
+    (void)sem_destroy(&pipe->writable);
+    free(pipe);
+}
+
+// `sem_wait`, again if interrupted by a signal
+void wait_for_post(sem_t *const semaphore) {
+    while (sem_wait(semaphore) != 0 && errno == EINTR)
+        continue;
+}
+
+// Wake the other side, if it said it is sleeping on `semaphore`
+void pipe_wake(_Atomic bool *const sleeping, sem_t *const semaphore) {
+    if (atomic_load(sleeping) && atomic_exchange(sleeping, false))
+        (void)sem_post(semaphore);
+}
+
+// Sleep on `semaphore` until woken, unless `ready` is already true once
+// `sleeping` is set, or until `timeout_ms` passes (-1 to wait forever)
+void pipe_sleep(
+    _Atomic bool *const sleeping,
+    sem_t *const semaphore,
+    bool (*const ready)(struct Pipe *pipe),
+    struct Pipe *const pipe,
+    const int timeout_ms
+) {
+    atomic_store(sleeping, true);
+    bool woken = false;
+    if (!ready(pipe)) {
+        if (timeout_ms < 0) {
+            wait_for_post(semaphore);
+            return;
+        }
+        struct timespec deadline;
+        (void)clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_nsec -= 1000000000;
+            ++deadline.tv_sec;
+        }
+        woken = sem_timedwait(semaphore, &deadline) == 0;
+    }
+    // The other side may have seen `sleeping` already, and then posts
+    if (!woken && !atomic_exchange(sleeping, false))
+        wait_for_post(semaphore);
+}
+
+bool pipe_has_data(struct Pipe *const pipe) {
+    return atomic_load(&pipe->head) != pipe->head_seen ||
+           atomic_load(&pipe->closed);
+}
+
+bool pipe_has_room(struct Pipe *const pipe) {
+    return atomic_load(&pipe->tail) != pipe->tail_seen ||
+           atomic_load(&pipe->abandoned);
+}
+
+// Wait until there is data after `tail`, or the pipe is closed, for up to
+// `timeout_ms` (-1 to wait for as long as it takes)
+// Returns how many bytes can be read: 0 if it is closed or time ran out
+size_t pipe_wait_data(
+    struct Pipe *const pipe, const size_t tail, const int timeout_ms
+) {
+    bool slept = false;
+    int spins = 0;
+    while (true) {
+        // Closed after the last write, so loaded before the position
+        const bool closed =
+            atomic_load_explicit(&pipe->closed, memory_order_acquire);
+        pipe->head_seen =
+            atomic_load_explicit(&pipe->head, memory_order_acquire);
+        if (pipe->head_seen != tail || closed)
+            return pipe->head_seen - tail;
+        if (spins++ < PIPE_SPINS)
+            continue;
+        if (timeout_ms == 0 || (slept && timeout_ms > 0))
+            return 0;
+        pipe_sleep(
+            &pipe->reader_sleeping,
+            &pipe->readable,
+            pipe_has_data,
+            pipe,
+            timeout_ms
+        );
+        slept = true;
+    }
+}
+
+// Wait until there is room after `head`, or the pipe is abandoned
+// Returns how many bytes can be written: 0 if it is abandoned
+size_t pipe_wait_room(struct Pipe *const pipe, const size_t head) {
+    int spins = 0;
+    while (true) {
+        pipe->tail_seen =
+            atomic_load_explicit(&pipe->tail, memory_order_acquire);
+        const size_t room = pipe->size - (head - pipe->tail_seen);
+        if (room > 0)
+            return room;
+        if (atomic_load_explicit(&pipe->abandoned, memory_order_relaxed))
+            return 0;
+        if (spins++ >= PIPE_SPINS)
+            pipe_sleep(
+                &pipe->writer_sleeping,
+                &pipe->writable,
+                pipe_has_room,
+                pipe,
+                -1
+            );
+    }
+}
+
+// Copy out `size` bytes, which are known to be there
+void pipe_take(struct Pipe *const pipe, char *const data, const size_t size) {
+    size_t tail = atomic_load_explicit(&pipe->tail, memory_order_relaxed);
+    size_t done = 0;
+    while (done < size) {
+        const size_t offset = tail & (pipe->size - 1);
+        size_t count = size - done;
+        if (count > pipe->size - offset)
+            count = pipe->size - offset;
+        memcpy(data + done, pipe->data + offset, count);
+        done += count;
+        tail += count;
+    }
+    atomic_store(&pipe->tail, tail);
+    pipe_wake(&pipe->writer_sleeping, &pipe->writable);
+}
+
+size_t pipe_read(
+    struct Pipe *const pipe,
+    char *const data,
+    const size_t size,
+    uint64_t *const starved_ns
+) {
+    size_t done = 0;
+    while (done < size) {
+        const size_t tail =
+            atomic_load_explicit(&pipe->tail, memory_order_relaxed);
+        size_t available = pipe->head_seen - tail;
+        if (available == 0) {
+            const uint64_t start = perf_now();
+            available = pipe_wait_data(pipe, tail, -1);
+            *starved_ns += perf_now() - start;
+            if (available == 0)
+                break;  // Closed
+        }
+        size_t count = size - done;
+        if (count > available)
+            count = available;
+        pipe_take(pipe, data + done, count);
+        done += count;
+    }
+    return done;
+}
+
+size_t pipe_read_some(
+    struct Pipe *const pipe, char *const data, const size_t size
+) {
+    size_t count = pipe_available(pipe);
+    if (count > size)
+        count = size;
+    if (count > 0)
+        pipe_take(pipe, data, count);
+    return count;
+}
+
+size_t pipe_available(struct Pipe *const pipe) {
+    const size_t tail = atomic_load_explicit(&pipe->tail, memory_order_relaxed);
+    if (pipe->head_seen == tail)
+        pipe->head_seen =
+            atomic_load_explicit(&pipe->head, memory_order_acquire);
+    return pipe->head_seen - tail;
+}
+
+bool pipe_wait(struct Pipe *const pipe, const int timeout_ms) {
+    const size_t tail = atomic_load_explicit(&pipe->tail, memory_order_relaxed);
+    if (pipe->head_seen != tail)
+        return true;
+    return pipe_wait_data(pipe, tail, timeout_ms) > 0 ||
+           atomic_load(&pipe->closed);
+}
+
+bool pipe_ended(struct Pipe *const pipe) {
+    // Closed after the last write, so loaded before the position
+    return atomic_load_explicit(&pipe->closed, memory_order_acquire) &&
+           pipe_available(pipe) == 0;
+}
+
+void pipe_abandon(struct Pipe *const pipe) {
+    atomic_store(&pipe->abandoned, true);
+    pipe_wake(&pipe->writer_sleeping, &pipe->writable);
+}
+
+bool pipe_write(
+    struct Pipe *const pipe,
+    const char *const data,
+    const size_t length,
+    uint64_t *const blocked_ns
+) {
+    size_t done = 0;
+    size_t head = atomic_load_explicit(&pipe->head, memory_order_relaxed);
+    while (done < length) {
+        size_t room = pipe->size - (head - pipe->tail_seen);
+        if (room == 0) {
+            const uint64_t start = perf_now();
+            room = pipe_wait_room(pipe, head);
+            *blocked_ns += perf_now() - start;
+            if (room == 0)
+                return false;
+        }
+        const size_t offset = head & (pipe->size - 1);
+        size_t count = length - done;
+        if (count > room)
+            count = room;
+        if (count > pipe->size - offset)
+            count = pipe->size - offset;
+        memcpy(pipe->data + offset, data + done, count);
+        done += count;
+        head += count;
+        atomic_store(&pipe->head, head);
+        pipe_wake(&pipe->reader_sleeping, &pipe->readable);
+    }
+    return true;
+}
+
+size_t pipe_room(struct Pipe *const pipe) {
+    if (atomic_load_explicit(&pipe->abandoned, memory_order_relaxed))
+        return SIZE_MAX;
+    const size_t head = atomic_load_explicit(&pipe->head, memory_order_relaxed);
+    pipe->tail_seen = atomic_load_explicit(&pipe->tail, memory_order_acquire);
+    return pipe->size - (head - pipe->tail_seen);
+}
+
+void pipe_close(struct Pipe *const pipe) {
+    atomic_store(&pipe->closed, true);
+    pipe_wake(&pipe->reader_sleeping, &pipe->readable);
+}
@@ -0,0 +1,54 @@
+// Single-producer single-consumer byte rings between threads
+// Each side's position is on its own cache line, with a copy of the other
+// side's position which it only reloads once it seems to be out of room or
+// data. A side which runs out spins briefly, then sleeps until the other
+// side moves its position. The producer closes a pipe when it has no more
+// to write, and the consumer abandons it when it will read no more, so
+// neither side is left waiting for the other.
+
+#ifndef PIPE_H
+#define PIPE_H
+
+// Libc
+#include <stdbool.h>  // bool
+#include <stddef.h>   // size_t
+#include <stdint.h>   // uint64_t
+
+struct Pipe;
+
+// `size` is in bytes, and must be a power of 2
+// Returns NULL if out of memory
+struct Pipe *pipe_create(size_t size);
+void pipe_free(struct Pipe *pipe);
+
+// Consumer
+// Read up to `size` bytes, waiting until all are read or the pipe is closed
+// Time spent waiting is added to `starved_ns`
+size_t pipe_read(
+    struct Pipe *pipe, char *data, size_t size, uint64_t *starved_ns
+);
+// Read up to `size` bytes, only as many as there are now
+size_t pipe_read_some(struct Pipe *pipe, char *data, size_t size);
+// Bytes which can be read without waiting
+size_t pipe_available(struct Pipe *pipe);
+// Whether there is data (or the pipe is closed), after waiting up to
+// `timeout_ms` (-1 to wait for as long as it takes)
+bool pipe_wait(struct Pipe *pipe, int timeout_ms);
+// Whether the pipe is closed, and every byte has been read
+bool pipe_ended(struct Pipe *pipe);
+// No more will be read, so the producer need not wait for room
+void pipe_abandon(struct Pipe *pipe);
+
+// Producer
+// Write every byte, waiting for room, unless the consumer abandons the pipe
+// Time spent waiting is added to `blocked_ns`
+// Returns false if it was abandoned
+bool pipe_write(
+    struct Pipe *pipe, const char *data, size_t length, uint64_t *blocked_ns
+);
+// Bytes which can be written without waiting (any number, once abandoned)
+size_t pipe_room(struct Pipe *pipe);
+// No more will be written
+void pipe_close(struct Pipe *pipe);
+
+#endif
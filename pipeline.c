@@ -0,0 +1,193 @@
+#include "pipeline.h"
+
+// Libc
+#include <stdbool.h>  // bool
+#include <stdlib.h>   // calloc, free
+// POSIX
+#include <pthread.h>  // pthread_create, etc
+// Local
+#include "channel.h"  // channel_enter, etc
+#include "perf.h"     // perf_now
+#include "pipe.h"     // pipe_read, etc
+
+#define PIPE_SIZE (64 << 10)  // Bytes between each stage and the next
+
+// I/O of the stage running on this thread
+struct StageIo {
+    struct PipelineStage *stage;
+    struct Pipe *input;   // NULL for the first stage
+    struct Pipe *output;  // NULL for the last stage
+    // Of the calling thread, for the first stage's input and the last
+    // stage's output
+    struct Io outer;
+};
+
+struct StageThread {
+    struct StageIo stage_io;
+    size_t index;  // Also its VM number, for channels
+    const struct Engine *engine;
+    pthread_t thread;
+};
+
+size_t stage_read(void *const context, char *const buffer, const size_t size) {
+    struct StageIo *const stage_io = context;
+    const size_t count = pipe_read(
+        stage_io->input, buffer, size, &stage_io->stage->starved_ns
+    );
+    stage_io->stage->bytes_read += count;
+    return count;
+}
+int stage_read_char(void *const context) {
+    char ch;
+    return stage_read(context, &ch, 1) == 1 ? (unsigned char)ch : EOF;
+}
+bool stage_input_ready(void *const context, const int timeout_ms) {
+    struct StageIo *const stage_io = context;
+    const uint64_t start = perf_now();
+    const bool ready = pipe_wait(stage_io->input, timeout_ms);
+    stage_io->stage->starved_ns += perf_now() - start;
+    return ready;
+}
+void stage_write(
+    void *const context, const char *const data, const size_t length
+) {
+    struct StageIo *const stage_io = context;
+    stage_io->stage->bytes_written += length;
+    (void)pipe_write(
+        stage_io->output, data, length, &stage_io->stage->blocked_ns
+    );
+}
+void stage_write_char(void *const context, const char ch) {
+    stage_write(context, &ch, 1);
+}
+
+// The outer I/O, for the first stage's input and the last stage's output
+int outer_read_char(void *const context) {
+    struct StageIo *const stage_io = context;
+    const int ch = stage_io->outer.read_char(stage_io->outer.context);
+    if (ch != EOF)
+        ++stage_io->stage->bytes_read;
+    return ch;
+}
+size_t outer_read(void *const context, char *const buffer, const size_t size) {
+    struct StageIo *const stage_io = context;
+    size_t count = 0;
+    if (stage_io->outer.read != NULL) {
+        count = stage_io->outer.read(stage_io->outer.context, buffer, size);
+    } else {
+        int ch;
+        while (count < size &&
+               (ch = stage_io->outer.read_char(stage_io->outer.context)) !=
+                   EOF)
+            buffer[count++] = (char)ch;
+    }
+    stage_io->stage->bytes_read += count;
+    return count;
+}
+bool outer_input_ready(void *const context, const int timeout_ms) {
+    struct StageIo *const stage_io = context;
+    return stage_io->outer.input_ready(stage_io->outer.context, timeout_ms);
+}
+void outer_write(
+    void *const context, const char *const data, const size_t length
+) {
+    struct StageIo *const stage_io = context;
+    stage_io->stage->bytes_written += length;
+    if (stage_io->outer.write != NULL) {
+        stage_io->outer.write(stage_io->outer.context, data, length);
+        return;
+    }
+    for (size_t i = 0; i < length; ++i)
+        stage_io->outer.write_char(stage_io->outer.context, data[i]);
+}
+void outer_write_char(void *const context, const char ch) {
+    outer_write(context, &ch, 1);
+}
+void outer_flush(void *const context) {
+    struct StageIo *const stage_io = context;
+    stage_io->outer.flush(stage_io->outer.context);
+}
+
+void *stage_main(void *const argument) {
+    struct StageThread *const thread = argument;
+    struct StageIo *const stage_io = &thread->stage_io;
+    struct PipelineStage *const stage = stage_io->stage;
+
+    const bool first = stage_io->input == NULL;
+    const bool last = stage_io->output == NULL;
+    io.read_char = first ? outer_read_char : stage_read_char;
+    io.read = first ? outer_read : stage_read;
+    io.input_ready = stage_input_ready;
+    if (first)
+        io.input_ready =
+            stage_io->outer.input_ready != NULL ? outer_input_ready : NULL;
+    io.write_char = last ? outer_write_char : stage_write_char;
+    io.write = last ? outer_write : stage_write;
+    io.flush = last ? outer_flush : flush_nothing;
+    io.context = stage_io;
+
+    channel_enter(thread->index);
+    const uint64_t start = perf_now();
+    stage->error = load_file(stage->filename);
+    if (stage->error == ERR_OK)
+        stage->error = thread->engine->execute();
+    io.flush(io.context);
+    stage->busy_ns = perf_now() - start;
+    stage->instructions = instructions_retired;
+    stage->on_new_line = stdout_on_new_line;
+    stage->words_sent = channel_stats.words_sent;
+    stage->words_received = channel_stats.words_received;
+    stage->starved_ns += channel_stats.starved_ns;
+    stage->blocked_ns += channel_stats.blocked_ns;
+
+    channel_leave();
+    if (!last)
+        pipe_close(stage_io->output);
+    if (!first)
+        pipe_abandon(stage_io->input);
+    return NULL;
+}
+
+void pipeline_run(
+    struct PipelineStage *const stages,
+    const size_t stage_count,
+    const struct Engine *const engine
+) {
+    assert(
+        stage_count > 0 && stage_count <= MAX_STAGES,
+        "Invalid stage count %zu",
+        stage_count
+    );
+    struct StageThread *const threads =
+        calloc(stage_count, sizeof(struct StageThread));
+    // Pipes are only between stages
+    struct Pipe **const pipes = calloc(stage_count, sizeof(struct Pipe *));
+    assert(threads != NULL && pipes != NULL, "Out of memory");
+    for (size_t i = 0; i + 1 < stage_count; ++i) {
+        pipes[i] = pipe_create(PIPE_SIZE);
+        assert(pipes[i] != NULL, "Failed to create pipe");
+    }
+
+    for (size_t i = 0; i < stage_count; ++i) {
+        struct StageThread *const thread = &threads[i];
+        stages[i].error = ERR_OK;
+        thread->stage_io.stage = &stages[i];
+        thread->stage_io.input = i > 0 ? pipes[i - 1] : NULL;
+        thread->stage_io.output = i + 1 < stage_count ? pipes[i] : NULL;
+        thread->stage_io.outer = io;
+        thread->index = i;
+        thread->engine = engine;
+    }
+    for (size_t i = 0; i < stage_count; ++i) {
+        const int error =
+            pthread_create(&threads[i].thread, NULL, stage_main, &threads[i]);
+        assert(error == 0, "Failed to create stage thread");
+    }
+    for (size_t i = 0; i < stage_count; ++i)
+        (void)pthread_join(threads[i].thread, NULL);
+
+    for (size_t i = 0; i + 1 < stage_count; ++i)
+        pipe_free(pipes[i]);
+    free(pipes);
+    free(threads);
+}
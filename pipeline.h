@@ -0,0 +1,45 @@
+// Programs connected like a shell pipeline, in one process
+// Each stage runs on its own thread, with its own VM (see `vm.h`).
+// Everything a stage outputs is the input of the next one, through a pipe
+// (see `pipe.h`) which the traps copy straight into and out of. A stage
+// which halts ends the input of the next one, and throws away any more
+// output of the one before. The first stage reads the input of the calling
+// thread's `io`, and the last writes to its output. Stages may also message
+// each other through channels, if they are open (see `channel.h`).
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+// Libc
+#include <stdbool.h>  // bool
+#include <stddef.h>   // size_t
+#include <stdint.h>   // uint64_t
+// Local
+#include "vm.h"  // struct Engine, etc
+
+#define MAX_STAGES 64
+
+// One program in a pipeline, and its statistics
+struct PipelineStage {
+    const char *filename;
+    enum Error error;
+    uint64_t instructions;
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t busy_ns;     // From loading the program to halting
+    uint64_t starved_ns;  // Waiting for input, or words from a channel
+    uint64_t blocked_ns;  // Waiting for room in the next stage or a channel
+    // Through channels
+    uint64_t words_sent;
+    uint64_t words_received;
+    bool on_new_line;  // Whether its last output was a newline
+};
+
+// Run every stage to completion
+void pipeline_run(
+    struct PipelineStage *stages,
+    size_t stage_count,
+    const struct Engine *engine
+);
+
+#endif
@@ -0,0 +1,50 @@
+// Instrumentation plugin interface
+// A plugin is a shared object loaded with `--plugin=PATH[:ARGS]`, which
+// exports `minilc3_plugin_init`. The init function fills in a `struct Plugin`
+// with the events it needs and a callback for each. The VM then runs a
+// dispatch variant with only those events hooked, so unused events (and runs
+// without plugins) cost nothing.
+
+#ifndef PLUGIN_H
+#define PLUGIN_H
+
+// Libc
+#include <stddef.h>  // size_t
+#include <stdint.h>  // uint16_t, etc
+
+// Events which a plugin can ask for
+enum PluginEvent {
+    EVENT_RETIRE = 1 << 0,        // After every instruction (except HALT)
+    EVENT_MEMORY_READ = 1 << 1,   // LD, LDI, LDR
+    EVENT_MEMORY_WRITE = 1 << 2,  // ST, STI, STR
+    EVENT_BRANCH = 1 << 3,        // BR (taken or not), JMP/RET, JSR/JSRR
+    EVENT_TRAP = 1 << 4,          // Before any TRAP, including HALT
+    EVENT_HALT = 1 << 5,          // After HALT
+};
+#define EVENT_ALL 0x3f
+
+struct Plugin {
+    unsigned events;  // Bitset of `enum PluginEvent`
+    // Callbacks for events which are not requested may be NULL
+    void (*retire)(void *data, uint16_t address, uint16_t instruction);
+    void (*memory_read)(void *data, uint16_t address, uint16_t value);
+    void (*memory_write)(void *data, uint16_t address, uint16_t value);
+    void (*branch)(void *data, uint16_t from, uint16_t to, int taken);
+    void (*trap)(void *data, uint16_t address, uint8_t vector);
+    void (*halt)(void *data, uint64_t instructions);
+    void *data;  // Passed to every callback
+    // Needed for `--intervals`, where copies of the plugin in other processes
+    // each see part of the run: copy the results so far into `buffer` (if
+    // it is not NULL) and return their size, and add results copied by
+    // another copy to these ones
+    size_t (*save_results)(void *data, void *buffer, size_t size);
+    void (*merge_results)(void *data, const void *results, size_t size);
+};
+
+// Called once when the plugin is loaded, with the text after `:` in the
+// command-line option (or an empty string)
+// Returns 0 on success
+typedef int (*PluginInit)(struct Plugin *plugin, const char *args);
+#define PLUGIN_INIT_SYMBOL "minilc3_plugin_init"
+
+#endif
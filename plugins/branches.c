@@ -0,0 +1,86 @@
+// Example plugin: simulate a gshare branch predictor
+// Usage: minilc3 --plugin=plugins/branches.so[:BITS] FILE
+// A table of 2^BITS (default 12) two-bit counters is indexed by the branch
+// address XOR the outcomes of the branches before it
+
+// Libc
+#include <inttypes.h>  // PRIu64
+#include <stdio.h>     // fprintf, sscanf
+#include <stdlib.h>    // calloc
+#include <string.h>    // memcpy
+
+#include "../plugin.h"
+
+#define MAX_BITS 24
+
+static uint8_t *counters;
+static unsigned bits = 12;
+static uint32_t history;
+static uint64_t predictions;
+static uint64_t mispredictions;
+
+static void branch(void *data, uint16_t from, uint16_t to, int taken) {
+    (void)data, (void)to;
+    const uint32_t mask = (1u << bits) - 1;
+    uint8_t *const counter = &counters[(from ^ history) & mask];
+    ++predictions;
+    mispredictions += (*counter >= 2) != (taken != 0);
+    if (taken && *counter < 3)
+        ++*counter;
+    else if (!taken && *counter > 0)
+        --*counter;
+    history = ((history << 1) | (taken != 0)) & mask;
+}
+
+static void halt(void *data, uint64_t instructions) {
+    (void)data, (void)instructions;
+    fprintf(
+        stderr,
+        "Branch predictor (gshare, %u bits): %" PRIu64 " branches, %" PRIu64
+        " mispredicted, %.2f%%\n",
+        bits,
+        predictions,
+        mispredictions,
+        predictions > 0 ? mispredictions * 100.0 / predictions : 0
+    );
+}
+
+// Counts, for `--intervals`
+// Each copy starts untrained, so there are a few more mispredictions than in
+// one whole run
+static size_t save_results(void *data, void *buffer, size_t size) {
+    (void)data;
+    const uint64_t results[2] = {predictions, mispredictions};
+    if (buffer != NULL && size >= sizeof(results))
+        memcpy(buffer, results, sizeof(results));
+    return sizeof(results);
+}
+
+static void merge_results(void *data, const void *buffer, size_t size) {
+    (void)data;
+    uint64_t results[2];
+    if (size != sizeof(results))
+        return;
+    memcpy(results, buffer, sizeof(results));
+    predictions += results[0];
+    mispredictions += results[1];
+}
+
+int minilc3_plugin_init(struct Plugin *plugin, const char *args) {
+    if (args[0] != '\0' && sscanf(args, "%u", &bits) != 1)
+        return 1;
+    if (bits == 0 || bits > MAX_BITS)
+        return 1;
+    // Weakly taken
+    counters = calloc((size_t)1 << bits, 1);
+    if (counters == NULL)
+        return 1;
+    for (size_t i = 0; i < (size_t)1 << bits; ++i)
+        counters[i] = 2;
+    plugin->events = EVENT_BRANCH | EVENT_HALT;
+    plugin->branch = branch;
+    plugin->halt = halt;
+    plugin->save_results = save_results;
+    plugin->merge_results = merge_results;
+    return 0;
+}
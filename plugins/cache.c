@@ -0,0 +1,121 @@
+// Example plugin: simulate a set-associative data cache with LRU replacement
+// Usage: minilc3 --plugin=plugins/cache.so[:SETS,WAYS,LINE] FILE
+// SETS and LINE (in words) are powers of 2; default 64 sets of 4 ways of
+// 8-word lines
+
+// Libc
+#include <inttypes.h>  // PRIu64
+#include <stdio.h>     // fprintf, sscanf
+#include <stdlib.h>    // calloc
+#include <string.h>    // memcpy
+
+#include "../plugin.h"
+
+struct Line {
+    uint16_t tag;
+    int valid;
+    uint64_t used;  // Access count when last used
+};
+
+static struct Line *lines;
+static unsigned sets = 64;
+static unsigned ways = 4;
+static unsigned line_words = 8;
+static uint64_t accesses;
+static uint64_t misses;
+static uint64_t write_misses;
+
+// Returns whether `address` hit, and loads its line if not
+static int cache_access(uint16_t address) {
+    ++accesses;
+    const unsigned block = address / line_words;
+    struct Line *const set = &lines[(block % sets) * ways];
+    const uint16_t tag = (uint16_t)(block / sets);
+    struct Line *victim = &set[0];
+    for (unsigned i = 0; i < ways; ++i) {
+        if (set[i].valid && set[i].tag == tag) {
+            set[i].used = accesses;
+            return 1;
+        }
+        if (!set[i].valid || set[i].used < victim->used)
+            victim = &set[i];
+        // Ways are filled in order, so none after an empty one are valid
+        if (!victim->valid)
+            break;
+    }
+    ++misses;
+    victim->tag = tag;
+    victim->valid = 1;
+    victim->used = accesses;
+    return 0;
+}
+
+static void memory_read(void *data, uint16_t address, uint16_t value) {
+    (void)data, (void)value;
+    (void)cache_access(address);
+}
+
+static void memory_write(void *data, uint16_t address, uint16_t value) {
+    (void)data, (void)value;
+    write_misses += !cache_access(address);
+}
+
+static void halt(void *data, uint64_t instructions) {
+    (void)data, (void)instructions;
+    fprintf(
+        stderr,
+        "Cache (%u sets, %u ways, %u-word lines): %" PRIu64
+        " accesses, %" PRIu64 " misses (%" PRIu64 " on writes), %.2f%%\n",
+        sets,
+        ways,
+        line_words,
+        accesses,
+        misses,
+        write_misses,
+        accesses > 0 ? misses * 100.0 / accesses : 0
+    );
+}
+
+// Counts, for `--intervals`
+// Each copy starts with an empty cache, so there are a few more misses than
+// in one whole run
+static size_t save_results(void *data, void *buffer, size_t size) {
+    (void)data;
+    const uint64_t results[3] = {accesses, misses, write_misses};
+    if (buffer != NULL && size >= sizeof(results))
+        memcpy(buffer, results, sizeof(results));
+    return sizeof(results);
+}
+
+static void merge_results(void *data, const void *buffer, size_t size) {
+    (void)data;
+    uint64_t results[3];
+    if (size != sizeof(results))
+        return;
+    memcpy(results, buffer, sizeof(results));
+    accesses += results[0];
+    misses += results[1];
+    write_misses += results[2];
+}
+
+static int is_power_of_2(unsigned value) {
+    return value != 0 && (value & (value - 1)) == 0;
+}
+
+int minilc3_plugin_init(struct Plugin *plugin, const char *args) {
+    if (args[0] != '\0' &&
+        sscanf(args, "%u,%u,%u", &sets, &ways, &line_words) != 3)
+        return 1;
+    if (!is_power_of_2(sets) || ways == 0 || !is_power_of_2(line_words))
+        return 1;
+    lines = calloc((size_t)sets * ways, sizeof(struct Line));
+    if (lines == NULL)
+        return 1;
+    plugin->events = EVENT_MEMORY_READ | EVENT_MEMORY_WRITE | EVENT_HALT;
+    plugin->memory_read = memory_read;
+    plugin->memory_write = memory_write;
+    plugin->halt = halt;
+    plugin->save_results = save_results;
+    plugin->merge_results = merge_results;
+    return 0;
+}
@@ -0,0 +1,81 @@
+// Example plugin: count retired instructions by opcode, and branches taken
+// Usage: minilc3 --plugin=plugins/opcodes.so FILE
+
+// Libc
+#include <inttypes.h>  // PRIu64
+#include <stdio.h>     // fprintf
+#include <string.h>    // memcpy
+
+#include "../plugin.h"
+
+static const char *const names[16] = {
+    "BR",  "ADD", "LD",  "ST",  "JSR", "AND", "LDR", "STR",
+    "RTI", "NOT", "LDI", "STI", "JMP", "RES", "LEA", "TRAP",
+};
+
+static uint64_t counts[16];
+static uint64_t branches;
+static uint64_t branches_taken;
+
+static void retire(void *data, uint16_t address, uint16_t instruction) {
+    (void)data, (void)address;
+    ++counts[instruction >> 12];
+}
+
+static void branch(void *data, uint16_t from, uint16_t to, int taken) {
+    (void)data, (void)from, (void)to;
+    ++branches;
+    branches_taken += taken != 0;
+}
+
+static void halt(void *data, uint64_t instructions) {
+    (void)data;
+    fprintf(stderr, "Instructions: %" PRIu64 "\n", instructions);
+    for (int i = 0; i < 16; ++i) {
+        if (counts[i] > 0)
+            fprintf(stderr, "  %-5s%" PRIu64 "\n", names[i], counts[i]);
+    }
+    fprintf(
+        stderr,
+        "Branches: %" PRIu64 " (%" PRIu64 " taken)\n",
+        branches,
+        branches_taken
+    );
+}
+
+// Every count, in order, for `--intervals`
+#define RESULT_COUNT 18
+
+static size_t save_results(void *data, void *buffer, size_t size) {
+    (void)data;
+    uint64_t results[RESULT_COUNT];
+    memcpy(results, counts, sizeof(counts));
+    results[16] = branches;
+    results[17] = branches_taken;
+    if (buffer != NULL && size >= sizeof(results))
+        memcpy(buffer, results, sizeof(results));
+    return sizeof(results);
+}
+
+static void merge_results(void *data, const void *buffer, size_t size) {
+    (void)data;
+    uint64_t results[RESULT_COUNT];
+    if (size != sizeof(results))
+        return;
+    memcpy(results, buffer, sizeof(results));
+    for (int i = 0; i < 16; ++i)
+        counts[i] += results[i];
+    branches += results[16];
+    branches_taken += results[17];
+}
+
+int minilc3_plugin_init(struct Plugin *plugin, const char *args) {
+    (void)args;
+    plugin->events = EVENT_RETIRE | EVENT_BRANCH | EVENT_HALT;
+    plugin->retire = retire;
+    plugin->branch = branch;
+    plugin->halt = halt;
+    plugin->save_results = save_results;
+    plugin->merge_results = merge_results;
+    return 0;
+}
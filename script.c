@@ -0,0 +1,285 @@
+#include "script.h"
+
+// Libc
+#include <ctype.h>   // isspace, isxdigit
+#include <stdio.h>   // fopen, fgets, etc
+#include <stdlib.h>  // realloc, strtoul
+#include <string.h>  // memcmp, strncmp
+
+enum CommandKind {
+    COMMAND_EXPECT,
+    COMMAND_SEND,
+    COMMAND_ASSERT,
+    COMMAND_HALT,
+};
+
+struct Command {
+    enum CommandKind kind;
+    char *text;
+    size_t length;
+    int line;
+};
+
+static struct Command *commands = NULL;
+static size_t command_count = 0;
+static size_t next_command = 0;
+static int last_line = 0;
+
+// Everything the program has output, and how much of it has been matched
+static char *output = NULL;
+static size_t output_length = 0;
+static size_t output_capacity = 0;
+static size_t matched_until = 0;
+
+// Text of the last `send`, which the program is reading
+static const char *input = NULL;
+static size_t input_length = 0;
+static size_t input_position = 0;
+
+static bool failed = false;
+
+// Parse double-quoted text with escapes, into a new buffer
+bool parse_text(const char *s, char **const text, size_t *const length) {
+    if (*s++ != '"')
+        return false;
+    char *const buffer = malloc(strlen(s) + 1);
+    assert(buffer != NULL, "Out of memory");
+    size_t count = 0;
+    for (; *s != '"'; ++s) {
+        if (*s == '\0' || *s == '\n') {
+            free(buffer);
+            return false;
+        }
+        if (*s != '\\') {
+            buffer[count++] = *s;
+            continue;
+        }
+        switch (*++s) {
+            case 'n':
+                buffer[count++] = '\n';
+                break;
+            case 'r':
+                buffer[count++] = '\r';
+                break;
+            case 't':
+                buffer[count++] = '\t';
+                break;
+            case '\\':
+            case '"':
+                buffer[count++] = *s;
+                break;
+            case 'x':
+                if (!isxdigit((unsigned char)s[1]) ||
+                    !isxdigit((unsigned char)s[2])) {
+                    free(buffer);
+                    return false;
+                }
+                const char digits[3] = {s[1], s[2], '\0'};
+                buffer[count++] = (char)strtoul(digits, NULL, 16);
+                s += 2;
+                break;
+            default:
+                free(buffer);
+                return false;
+        }
+    }
+    // Only a comment may follow
+    for (++s; isspace((unsigned char)*s); ++s) {}
+    if (*s != '\0' && *s != '#') {
+        free(buffer);
+        return false;
+    }
+    *text = buffer;
+    *length = count;
+    return true;
+}
+
+// Parse one line of a script. Returns false if it is invalid
+bool parse_command(const char *line, const int number) {
+    while (isspace((unsigned char)*line))
+        ++line;
+    if (*line == '\0' || *line == '#')
+        return true;
+
+    static const struct {
+        const char *name;
+        enum CommandKind kind;
+    } names[] = {
+        {"expect", COMMAND_EXPECT},
+        {"send", COMMAND_SEND},
+        {"assert", COMMAND_ASSERT},
+        {"halt", COMMAND_HALT},
+    };
+    struct Command command = {0};
+    command.line = number;
+    size_t i = 0;
+    for (; i < sizeof(names) / sizeof(names[0]); ++i) {
+        const size_t length = strlen(names[i].name);
+        if (strncmp(line, names[i].name, length) == 0 &&
+            (line[length] == '\0' || isspace((unsigned char)line[length]))) {
+            command.kind = names[i].kind;
+            line += length;
+            break;
+        }
+    }
+    if (i == sizeof(names) / sizeof(names[0]))
+        return false;
+
+    while (isspace((unsigned char)*line))
+        ++line;
+    if (command.kind == COMMAND_HALT) {
+        if (*line != '\0' && *line != '#')
+            return false;
+    } else if (!parse_text(line, &command.text, &command.length)) {
+        return false;
+    }
+
+    commands = realloc(commands, (command_count + 1) * sizeof(*commands));
+    assert(commands != NULL, "Out of memory");
+    commands[command_count++] = command;
+    return true;
+}
+
+bool script_load(const char *const filename) {
+    FILE *const file = fopen(filename, "r");
+    if (file == NULL) {
+        fprintf(stderr, "Failed to open script.\n");
+        return false;
+    }
+    char line[4096];
+    int number = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        ++number;
+        if (!parse_command(line, number)) {
+            fprintf(stderr, "%s:%d: Invalid command.\n", filename, number);
+            (void)fclose(file);
+            return false;
+        }
+    }
+    (void)fclose(file);
+    last_line = number;
+    return true;
+}
+
+// Print the output which has not been matched yet, then stop the program
+void fail(const int line, const char *const reason) {
+    fprintf(stderr, "Script failed at line %d: %s\n", line, reason);
+    fprintf(stderr, "Output since the last match:\n");
+    (void)fwrite(
+        output + matched_until, 1, output_length - matched_until, stderr
+    );
+    fprintf(stderr, "\n");
+    failed = true;
+    interrupt_execution();
+}
+
+// Find `text` in the output which has not been matched yet
+const char *find_output(const char *const text, const size_t length) {
+    if (output_length - matched_until < length)
+        return NULL;
+    const char *const last = output + output_length - length;
+    for (const char *start = output + matched_until; start <= last; ++start) {
+        if (memcmp(start, text, length) == 0)
+            return start;
+    }
+    return NULL;
+}
+
+// Run commands until one sends input, or until the end of the script
+// Returns false if the script failed
+bool run_commands(const bool halted) {
+    while (next_command < command_count) {
+        const struct Command *const command = &commands[next_command++];
+        switch (command->kind) {
+            case COMMAND_EXPECT: {
+                const char *const found =
+                    find_output(command->text, command->length);
+                if (found == NULL) {
+                    fail(
+                        command->line,
+                        halted ? "Program halted without the expected output"
+                               : "Program needs input before the expected "
+                                 "output"
+                    );
+                    return false;
+                }
+                matched_until = (size_t)(found - output) + command->length;
+            } break;
+
+            case COMMAND_ASSERT: {
+                if (output_length - matched_until != command->length ||
+                    memcmp(
+                        output + matched_until, command->text, command->length
+                    ) != 0) {
+                    fail(command->line, "Output does not match");
+                    return false;
+                }
+                matched_until = output_length;
+            } break;
+
+            case COMMAND_SEND: {
+                if (halted) {
+                    fail(command->line, "Program halted before reading input");
+                    return false;
+                }
+                input = command->text;
+                input_length = command->length;
+                input_position = 0;
+                return true;
+            }
+
+            case COMMAND_HALT: {
+                if (!halted) {
+                    fail(
+                        command->line, "Program needs input instead of halting"
+                    );
+                    return false;
+                }
+            } break;
+        }
+    }
+    if (!halted) {
+        fail(last_line, "Program needs input after the end of the script");
+        return false;
+    }
+    return true;
+}
+
+int script_read_char(void *const context) {
+    (void)context;
+    while (input_position >= input_length) {
+        if (failed || !run_commands(false))
+            return EOF;
+    }
+    return (unsigned char)input[input_position++];
+}
+
+void script_write_char(void *const context, const char ch) {
+    (void)context;
+    if (output_length == output_capacity) {
+        output_capacity = output_capacity == 0 ? 4096 : output_capacity * 2;
+        output = realloc(output, output_capacity);
+        assert(output != NULL, "Out of memory");
+    }
+    output[output_length++] = ch;
+}
+
+void script_attach() {
+    io.read_char = script_read_char;
+    io.write_char = script_write_char;
+    io.flush = flush_nothing;
+    io.context = NULL;
+    io.read = NULL;
+    io.write = NULL;
+    io.input_ready = NULL;
+}
+
+enum Error script_finish(const enum Error error) {
+    if (failed)
+        return ERR_SCRIPT;
+    if (error != ERR_OK)
+        return error;
+    if (!run_commands(true))
+        return ERR_SCRIPT;
+    return ERR_OK;
+}
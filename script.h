@@ -0,0 +1,35 @@
+// Scripted interaction with a program, for testing
+// The script is run against the program's input and output in memory, so
+// there is no terminal, and no waiting. Each line is one command:
+//
+//     # Comment
+//     expect "Name: "       Wait until this text is output
+//     send "Ada\n"          Input this text
+//     assert "Hi, Ada!\n"   The output since the last match must be exactly
+//                           this text
+//     halt                  The program must halt here
+//
+// Commands are run whenever the program needs input, and once it halts. A
+// program which needs input that the script does not send fails the script.
+// Text is double-quoted, with `\n`, `\r`, `\t`, `\\`, `\"` and `\xHH`
+// escapes.
+
+#ifndef SCRIPT_H
+#define SCRIPT_H
+
+// Libc
+#include <stdbool.h>  // bool
+// Local
+#include "vm.h"  // enum Error
+
+// Returns false (after printing why) if the script could not be read
+bool script_load(const char *filename);
+
+// Connect the program's input and output to the script
+void script_attach();
+
+// Check the rest of the script after the program stops with `error`
+// Returns `ERR_SCRIPT` (after printing why) if the script failed
+enum Error script_finish(enum Error error);
+
+#endif
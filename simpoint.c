@@ -0,0 +1,288 @@
+#include "simpoint.h"
+
+// Libc
+#include <float.h>   // DBL_MAX
+#include <math.h>    // log
+#include <stdint.h>  // uint64_t, etc
+#include <stdlib.h>  // malloc, free
+#include <string.h>  // memcpy
+// Local
+#include "vm.h"  // attach_plugin, etc
+
+#define KMEANS_SEEDS 5  // Clusterings tried for each number of phases
+#define KMEANS_ITERATIONS 100
+#define BIC_THRESHOLD 0.9
+
+// Instructions in each block of the current interval, by the address of the
+// branch which ends it, and which blocks have run at all
+static uint64_t block_counts[MEMORY_SIZE];
+static Word blocks_run[MEMORY_SIZE];
+static size_t blocks_run_count = 0;
+static uint64_t block_start = 0;  // Instruction count at the block's start
+
+void count_block(
+    void *const data, const uint16_t from, const uint16_t to, const int taken
+) {
+    (void)data, (void)to, (void)taken;
+    if (block_counts[from] == 0)
+        blocks_run[blocks_run_count++] = from;
+    block_counts[from] += instructions_retired - block_start;
+    block_start = instructions_retired;
+}
+
+bool simpoint_attach() {
+    const struct Plugin counter = {
+        EVENT_BRANCH,
+        NULL,
+        NULL,
+        NULL,
+        count_block,
+        NULL,
+        NULL,
+        NULL,
+        NULL,
+        NULL,
+    };
+    block_start = instructions_retired;
+    return attach_plugin(&counter);
+}
+
+// A fixed pseudo-random weight in [-1, 1] for projecting dimension
+// `dimension` of the block at `address`
+double projection(const Word address, const unsigned dimension) {
+    uint32_t hash = address * 0x9e3779b1u ^ (dimension + 1) * 0x85ebca77u;
+    hash ^= hash >> 16;
+    hash *= 0x7feb352du;
+    hash ^= hash >> 15;
+    hash *= 0x846ca68bu;
+    hash ^= hash >> 16;
+    return (hash & 0xffff) / 32767.5 - 1.0;
+}
+
+void simpoint_end_interval(double vector[SIMPOINT_DIMENSIONS]) {
+    uint64_t total = 0;
+    for (size_t i = 0; i < blocks_run_count; ++i)
+        total += block_counts[blocks_run[i]];
+    for (unsigned d = 0; d < SIMPOINT_DIMENSIONS; ++d)
+        vector[d] = 0;
+    for (size_t i = 0; i < blocks_run_count; ++i) {
+        const Word address = blocks_run[i];
+        const double share =
+            total > 0 ? (double)block_counts[address] / total : 0;
+        for (unsigned d = 0; d < SIMPOINT_DIMENSIONS; ++d)
+            vector[d] += share * projection(address, d);
+        block_counts[address] = 0;
+    }
+    blocks_run_count = 0;
+    block_start = instructions_retired;
+}
+
+double distance(
+    const double a[SIMPOINT_DIMENSIONS], const double b[SIMPOINT_DIMENSIONS]
+) {
+    double sum = 0;
+    for (unsigned d = 0; d < SIMPOINT_DIMENSIONS; ++d)
+        sum += (a[d] - b[d]) * (a[d] - b[d]);
+    return sum;
+}
+
+// Deterministic, so a clustering can be repeated
+uint64_t next_random(uint64_t *const state) {
+    *state = *state * 6364136223846793005u + 1442695040888963407u;
+    return *state >> 33;
+}
+
+// Cluster into `k` phases with k-means, starting from centres picked with
+// k-means++ from `seed`
+// Sets the phase of each interval, and returns the sum of squared distances
+// to the centres
+double kmeans(
+    const double (*const vectors)[SIMPOINT_DIMENSIONS],
+    const size_t count,
+    const size_t k,
+    const uint64_t seed,
+    double (*const centres)[SIMPOINT_DIMENSIONS],
+    size_t *const phases,
+    double *const distances  // Scratch, one per interval
+) {
+    uint64_t state = seed;
+    memcpy(centres[0], vectors[next_random(&state) % count], sizeof(*centres));
+    for (size_t i = 0; i < count; ++i)
+        distances[i] = distance(vectors[i], centres[0]);
+    for (size_t c = 1; c < k; ++c) {
+        double total = 0;
+        for (size_t i = 0; i < count; ++i)
+            total += distances[i];
+        double target =
+            total * (double)next_random(&state) / (double)(1ull << 31);
+        size_t chosen = 0;
+        while (chosen + 1 < count && target >= distances[chosen])
+            target -= distances[chosen++];
+        memcpy(centres[c], vectors[chosen], sizeof(*centres));
+        for (size_t i = 0; i < count; ++i) {
+            const double d = distance(vectors[i], centres[c]);
+            if (d < distances[i])
+                distances[i] = d;
+        }
+    }
+
+    for (size_t i = 0; i < count; ++i)
+        phases[i] = SIZE_MAX;
+    double distortion = 0;
+    for (int iteration = 0; iteration < KMEANS_ITERATIONS; ++iteration) {
+        bool changed = false;
+        distortion = 0;
+        for (size_t i = 0; i < count; ++i) {
+            size_t best = 0;
+            double best_distance = DBL_MAX;
+            for (size_t c = 0; c < k; ++c) {
+                const double d = distance(vectors[i], centres[c]);
+                if (d < best_distance) {
+                    best = c;
+                    best_distance = d;
+                }
+            }
+            changed |= phases[i] != best;
+            phases[i] = best;
+            distortion += best_distance;
+        }
+        if (!changed)
+            break;
+
+        // A phase left with no intervals keeps its centre
+        for (size_t c = 0; c < k; ++c) {
+            double sum[SIMPOINT_DIMENSIONS] = {0};
+            size_t members = 0;
+            for (size_t i = 0; i < count; ++i) {
+                if (phases[i] != c)
+                    continue;
+                for (unsigned d = 0; d < SIMPOINT_DIMENSIONS; ++d)
+                    sum[d] += vectors[i][d];
+                ++members;
+            }
+            for (unsigned d = 0; members > 0 && d < SIMPOINT_DIMENSIONS; ++d)
+                centres[c][d] = sum[d] / members;
+        }
+    }
+    return distortion;
+}
+
+// Bayesian information criterion of a clustering, modelling each phase as a
+// spherical Gaussian with the same variance (as in X-means)
+double bic(
+    const size_t count,
+    const size_t k,
+    const size_t *const phases,
+    const double distortion
+) {
+    const double r = (double)count;
+    const double m = SIMPOINT_DIMENSIONS;
+    double variance = distortion / (count > k ? r - k : 1.0);
+    if (variance < 1e-12)
+        variance = 1e-12;
+
+    double likelihood = 0;
+    for (size_t c = 0; c < k; ++c) {
+        size_t members = 0;
+        for (size_t i = 0; i < count; ++i)
+            members += phases[i] == c;
+        if (members == 0)
+            continue;
+        const double n = (double)members;
+        likelihood += -n / 2 * log(2 * 3.14159265358979323846) -
+                      n * m / 2 * log(variance) - (n - k) / 2 + n * log(n) -
+                      n * log(r);
+    }
+    const double parameters = (k - 1) + m * k + 1;
+    return likelihood - parameters / 2 * log(r);
+}
+
+// The best of several clusterings into `k` phases
+double best_kmeans(
+    const double (*const vectors)[SIMPOINT_DIMENSIONS],
+    const size_t count,
+    const size_t k,
+    double (*const centres)[SIMPOINT_DIMENSIONS],
+    size_t *const phases,
+    size_t *const scratch,
+    double *const distances
+) {
+    double best = DBL_MAX;
+    double tried[MAX_PHASES][SIMPOINT_DIMENSIONS];
+    for (uint64_t seed = 1; seed <= KMEANS_SEEDS; ++seed) {
+        const double distortion =
+            kmeans(vectors, count, k, seed, tried, scratch, distances);
+        if (distortion < best) {
+            best = distortion;
+            memcpy(centres, tried, k * sizeof(*centres));
+            memcpy(phases, scratch, count * sizeof(*phases));
+        }
+    }
+    return best;
+}
+
+size_t simpoint_choose(
+    const double (*const vectors)[SIMPOINT_DIMENSIONS],
+    const size_t count,
+    size_t max_phases,
+    size_t *const representatives,
+    size_t *const sizes
+) {
+    if (max_phases > count)
+        max_phases = count;
+    if (max_phases > MAX_PHASES)
+        max_phases = MAX_PHASES;
+    size_t *const phases = malloc(count * sizeof(size_t));
+    size_t *const scratch = malloc(count * sizeof(size_t));
+    double *const distances = malloc(count * sizeof(double));
+    assert(
+        phases != NULL && scratch != NULL && distances != NULL, "Out of memory"
+    );
+
+    double centres[MAX_PHASES][SIMPOINT_DIMENSIONS];
+    double scores[MAX_PHASES + 1];
+    double lowest = DBL_MAX;
+    double highest = -DBL_MAX;
+    for (size_t k = 1; k <= max_phases; ++k) {
+        const double distortion = best_kmeans(
+            vectors, count, k, centres, phases, scratch, distances
+        );
+        scores[k] = bic(count, k, phases, distortion);
+        if (scores[k] < lowest)
+            lowest = scores[k];
+        if (scores[k] > highest)
+            highest = scores[k];
+    }
+    size_t k = 1;
+    while (k < max_phases &&
+           scores[k] < lowest + BIC_THRESHOLD * (highest - lowest))
+        ++k;
+    (void)best_kmeans(vectors, count, k, centres, phases, scratch, distances);
+
+    // Phases left empty are dropped
+    size_t phase_count = 0;
+    for (size_t c = 0; c < k; ++c) {
+        size_t closest = SIZE_MAX;
+        double closest_distance = DBL_MAX;
+        size_t members = 0;
+        for (size_t i = 0; i < count; ++i) {
+            if (phases[i] != c)
+                continue;
+            ++members;
+            const double d = distance(vectors[i], centres[c]);
+            if (d < closest_distance) {
+                closest = i;
+                closest_distance = d;
+            }
+        }
+        if (members == 0)
+            continue;
+        representatives[phase_count] = closest;
+        sizes[phase_count] = members;
+        ++phase_count;
+    }
+    free(phases);
+    free(scratch);
+    free(distances);
+    return phase_count;
+}
@@ -0,0 +1,40 @@
+// Phases of a run, from basic block vectors, for sampled simulation
+// While the program runs, the instructions in each basic block (counted at
+// the branch which ends it) are added up per interval. At the end of an
+// interval, the counts are normalized and randomly projected down to a few
+// dimensions. Intervals are then clustered into phases with k-means, trying
+// every number of phases up to a limit, and taking the fewest whose
+// Bayesian information criterion is within 90% of the best. The interval
+// closest to the centre of each phase represents all of it.
+
+#ifndef SIMPOINT_H
+#define SIMPOINT_H
+
+// Libc
+#include <stdbool.h>  // bool
+#include <stddef.h>   // size_t
+
+#define SIMPOINT_DIMENSIONS 15
+#define MAX_PHASES 64
+
+// Count basic blocks of the program run from now on
+// Returns false if too many plugins are attached
+bool simpoint_attach();
+
+// Project the counts since the interval started into `vector`, and start
+// the next interval
+void simpoint_end_interval(double vector[SIMPOINT_DIMENSIONS]);
+
+// Cluster `count` intervals into at most `max_phases` phases
+// Sets the representative interval of each phase, and how many intervals
+// each phase has
+// Returns the number of phases
+size_t simpoint_choose(
+    const double (*vectors)[SIMPOINT_DIMENSIONS],
+    size_t count,
+    size_t max_phases,
+    size_t *representatives,
+    size_t *sizes
+);
+
+#endif
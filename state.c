@@ -0,0 +1,218 @@
+#include "state.h"
+
+// Libc
+#include <stdio.h>   // fprintf, rename
+#include <string.h>  // memcmp, memset
+// POSIX
+#include <fcntl.h>     // open
+#include <sys/mman.h>  // mmap
+#include <sys/stat.h>  // fstat
+#include <unistd.h>    // pread, pwrite
+
+_Static_assert(
+    sizeof(struct StateHeader) <= STATE_PAGE_SIZE, "Header must fit in a page"
+);
+
+// The header, padded to a page
+union HeaderPage {
+    struct StateHeader header;
+    char bytes[STATE_PAGE_SIZE];
+};
+
+bool page_is_zero(const Word *const page) {
+    Word any = 0;
+    for (size_t i = 0; i < STATE_PAGE_WORDS; ++i)
+        any |= page[i];
+    return any == 0;
+}
+
+// Write all of `size` bytes at `offset`
+bool write_all_at(
+    const int file,
+    const void *const buffer,
+    const size_t size,
+    const off_t offset
+) {
+    size_t total = 0;
+    while (total < size) {
+        const ssize_t count = pwrite(
+            file, (const char *)buffer + total, size - total, offset + total
+        );
+        if (count <= 0)
+            return false;
+        total += (size_t)count;
+    }
+    return true;
+}
+
+// Read all of `size` bytes at `offset`
+bool read_all_at(
+    const int file, void *const buffer, const size_t size, const off_t offset
+) {
+    size_t total = 0;
+    while (total < size) {
+        const ssize_t count =
+            pread(file, (char *)buffer + total, size - total, offset + total);
+        if (count <= 0)
+            return false;
+        total += (size_t)count;
+    }
+    return true;
+}
+
+enum Error state_save(const char *const filename, const bool halted) {
+    // Written beside the destination, then renamed over it, so a state which
+    // is being saved never replaces a good one with half of a new one
+    char temporary_path[4096];
+    snprintf(temporary_path, sizeof(temporary_path), "%s.tmp", filename);
+    const int file = open(temporary_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (file < 0) {
+        fprintf(stderr, "Failed to create state file.\n");
+        return ERR_FILE;
+    }
+
+    static union HeaderPage page;
+    struct StateHeader *const header = &page.header;
+    memset(&page, 0, sizeof(page));
+    memcpy(header->magic, STATE_MAGIC, sizeof(header->magic));
+    header->version = STATE_VERSION;
+    header->byte_order = STATE_BYTE_ORDER;
+    header->pc = pc;
+    for (int i = 0; i < 8; ++i)
+        header->registers[i] = registers[i];
+    header->cc = cc;
+    header->stdout_on_new_line = stdout_on_new_line;
+    header->halted = halted;
+    header->instructions_retired = instructions_retired;
+    if (io.read_char == buffer_read_char)
+        header->input_position =
+            ((const struct InputBuffer *)io.context)->position;
+
+    bool ok = true;
+    off_t offset = STATE_PAGE_SIZE;
+    for (size_t i = 0; i < STATE_PAGES && ok; ++i) {
+        const Word *const words = memory + i * STATE_PAGE_WORDS;
+        if (page_is_zero(words))
+            continue;
+        header->present_pages |= 1U << i;
+        ok = write_all_at(file, words, STATE_PAGE_SIZE, offset);
+        offset += STATE_PAGE_SIZE;
+    }
+    // The header goes last, so an incomplete file has no magic number
+    ok = ok && write_all_at(file, &page, sizeof(page), 0);
+    ok = close(file) == 0 && ok;
+    if (!ok || rename(temporary_path, filename) != 0) {
+        fprintf(stderr, "Failed to write state file.\n");
+        (void)unlink(temporary_path);
+        return ERR_FILE;
+    }
+    return ERR_OK;
+}
+
+// Map the saved pages over `memory`, copy-on-write, with the rest zeroed
+// Consecutive pages are mapped together
+bool map_memory(const int file, const uint32_t present_pages) {
+    if (sysconf(_SC_PAGESIZE) != STATE_PAGE_SIZE)
+        return false;
+    if (mmap(
+            memory,
+            sizeof(memory),
+            PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED,
+            -1,
+            0
+        ) == MAP_FAILED)
+        return false;
+
+    off_t offset = STATE_PAGE_SIZE;
+    size_t i = 0;
+    while (i < STATE_PAGES) {
+        if (!(present_pages & (1U << i))) {
+            ++i;
+            continue;
+        }
+        size_t run = 1;
+        while (i + run < STATE_PAGES && (present_pages & (1U << (i + run))))
+            ++run;
+        if (mmap(
+                memory + i * STATE_PAGE_WORDS,
+                run * STATE_PAGE_SIZE,
+                PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_FIXED,
+                file,
+                offset
+            ) == MAP_FAILED)
+            return false;
+        offset += (off_t)(run * STATE_PAGE_SIZE);
+        i += run;
+    }
+    return true;
+}
+
+// Fallback for hosts with a different page size
+bool read_memory(const int file, const uint32_t present_pages) {
+    off_t offset = STATE_PAGE_SIZE;
+    for (size_t i = 0; i < STATE_PAGES; ++i) {
+        Word *const words = memory + i * STATE_PAGE_WORDS;
+        if (!(present_pages & (1U << i))) {
+            memset(words, 0, STATE_PAGE_SIZE);
+            continue;
+        }
+        if (!read_all_at(file, words, STATE_PAGE_SIZE, offset))
+            return false;
+        offset += STATE_PAGE_SIZE;
+    }
+    return true;
+}
+
+enum Error state_load(const char *const filename, bool *const halted) {
+    const int file = open(filename, O_RDONLY);
+    if (file < 0) {
+        fprintf(stderr, "Failed to open state file.\n");
+        return ERR_FILE;
+    }
+
+    static union HeaderPage page;
+    const struct StateHeader *const header = &page.header;
+    struct stat status;
+    if (!read_all_at(file, &page, sizeof(page), 0) ||
+        memcmp(header->magic, STATE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != STATE_VERSION ||
+        header->byte_order != STATE_BYTE_ORDER) {
+        fprintf(stderr, "Not a state file, or saved by another version.\n");
+        (void)close(file);
+        return ERR_FILE;
+    }
+    const off_t pages = __builtin_popcount(header->present_pages);
+    if (fstat(file, &status) != 0 ||
+        status.st_size < (1 + pages) * STATE_PAGE_SIZE) {
+        fprintf(stderr, "State file is too short.\n");
+        (void)close(file);
+        return ERR_FILE;
+    }
+
+    if (!map_memory(file, header->present_pages) &&
+        !read_memory(file, header->present_pages)) {
+        fprintf(stderr, "Failed to read state file.\n");
+        (void)close(file);
+        return ERR_FILE;
+    }
+    (void)close(file);  // Mappings stay valid
+    if (code_watch != NULL)
+        code_watch(0, MEMORY_SIZE);
+
+    pc = header->pc;
+    for (int i = 0; i < 8; ++i)
+        registers[i] = header->registers[i];
+    cc = header->cc;
+    stdout_on_new_line = header->stdout_on_new_line;
+    instructions_retired = header->instructions_retired;
+    *halted = header->halted;
+    if (io.read_char == buffer_read_char) {
+        struct InputBuffer *const input = io.context;
+        input->position = header->input_position < input->length
+                              ? header->input_position
+                              : input->length;
+    }
+    return ERR_OK;
+}
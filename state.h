@@ -0,0 +1,45 @@
+// Saved VM states
+// A state file is a header page followed by every non-zero page of memory,
+// in host byte order and page-aligned, so loading can map the pages straight
+// over `memory` instead of parsing anything. All-zero pages are left out.
+
+#ifndef STATE_H
+#define STATE_H
+
+// Libc
+#include <stdbool.h>  // bool
+#include <stdint.h>   // uint64_t
+// Local
+#include "vm.h"  // Word, enum Error, etc
+
+#define STATE_MAGIC "LC3STATE"
+#define STATE_VERSION 1
+#define STATE_BYTE_ORDER 0x0102  // Reads as 0x0201 with the wrong byte order
+
+#define STATE_PAGE_SIZE 4096
+#define STATE_PAGE_WORDS (STATE_PAGE_SIZE / sizeof(Word))
+#define STATE_PAGES (MEMORY_SIZE / STATE_PAGE_WORDS)
+
+// Padded to a whole page in the file
+struct StateHeader {
+    char magic[8];
+    uint32_t version;
+    uint16_t byte_order;
+    Word pc;
+    Word registers[8];
+    uint8_t cc;
+    uint8_t stdout_on_new_line;
+    uint8_t halted;  // Nothing is left to run
+    uint64_t instructions_retired;
+    uint64_t input_position;  // Into `--input`, if it was used
+    uint32_t present_pages;   // Bit per page of memory; stored in this order
+};
+
+// Write the current state, replacing `filename` atomically
+enum Error state_save(const char *filename, bool halted);
+
+// Replace the current state with a saved one
+// `halted` is set if the program had already halted when it was saved
+enum Error state_load(const char *filename, bool *halted);
+
+#endif
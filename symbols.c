@@ -0,0 +1,107 @@
+#include "symbols.h"
+
+// Libc
+#include <ctype.h>   // isxdigit, isspace
+#include <stdio.h>   // fopen, fgets, etc
+#include <stdlib.h>  // qsort, strtoul
+#include <string.h>  // strlen, etc
+
+#define MAX_SYMBOLS 4096
+#define MAX_SYMBOL_LENGTH 64
+
+struct Symbol {
+    Word address;
+    char name[MAX_SYMBOL_LENGTH];
+};
+
+// Sorted by address once loaded
+static struct Symbol symbols[MAX_SYMBOLS];
+static int symbol_count = 0;
+
+int compare_symbols(const void *const a, const void *const b) {
+    const Word left = ((const struct Symbol *)a)->address;
+    const Word right = ((const struct Symbol *)b)->address;
+    return (left > right) - (left < right);
+}
+
+// Parse a hex address, with an optional `x` or `0x` prefix
+bool parse_address(const char *token, Word *const address) {
+    if (token[0] == '0' && (token[1] == 'x' || token[1] == 'X'))
+        token += 2;
+    else if (token[0] == 'x' || token[0] == 'X')
+        ++token;
+    if (*token == '\0')
+        return false;
+    for (const char *ch = token; *ch != '\0'; ++ch) {
+        if (!isxdigit((unsigned char)*ch))
+            return false;
+    }
+    const unsigned long value = strtoul(token, NULL, 16);
+    if (value > 0xffff)
+        return false;
+    *address = (Word)value;
+    return true;
+}
+
+bool symbols_load(const char *const filename) {
+    FILE *const file = fopen(filename, "r");
+    if (file == NULL)
+        return false;
+
+    char line[256];
+    while (symbol_count < MAX_SYMBOLS && fgets(line, sizeof(line), file)) {
+        // Skip comment markers, then read `NAME ADDRESS`
+        char name[MAX_SYMBOL_LENGTH];
+        char address_token[16];
+        const char *start = line;
+        while (*start == '/' || *start == ';' || isspace((unsigned char)*start))
+            ++start;
+        if (sscanf(start, "%63s %15s", name, address_token) != 2)
+            continue;
+        Word address;
+        if (!parse_address(address_token, &address))
+            continue;
+        symbols[symbol_count].address = address;
+        memcpy(symbols[symbol_count].name, name, sizeof(name));
+        ++symbol_count;
+    }
+    (void)fclose(file);
+
+    qsort(symbols, symbol_count, sizeof(struct Symbol), compare_symbols);
+    return true;
+}
+
+bool symbols_load_for(const char *const object_filename) {
+    char filename[4096];
+    const char *const extension = strrchr(object_filename, '.');
+    const size_t stem_length = extension == NULL
+                                   ? strlen(object_filename)
+                                   : (size_t)(extension - object_filename);
+    const int written = snprintf(
+        filename,
+        sizeof(filename),
+        "%.*s.sym",
+        (int)stem_length,
+        object_filename
+    );
+    if (written < 0 || (size_t)written >= sizeof(filename))
+        return false;
+    return symbols_load(filename);
+}
+
+const char *symbol_at(const Word address, Word *const offset) {
+    // Binary search for the last symbol at or before the address
+    int low = 0;
+    int high = symbol_count;
+    while (low < high) {
+        const int middle = (low + high) / 2;
+        if (symbols[middle].address <= address)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    if (low == 0)
+        return NULL;
+    *offset = address - symbols[low - 1].address;
+    return symbols[low - 1].name;
+}
@@ -0,0 +1,22 @@
+#ifndef SYMBOLS_H
+#define SYMBOLS_H
+
+// Libc
+#include <stdbool.h>  // bool
+// Local
+#include "vm.h"  // Word
+
+// Load labels from an assembler `.sym` file
+// Any line containing a label followed by a hex address (with or without a
+// leading `x`) is read, so comment-prefixed tables are accepted too
+bool symbols_load(const char *filename);
+
+// Replace the extension of an object file with `.sym`, and load that if it
+// exists. Returns false if there is no symbol file
+bool symbols_load_for(const char *object_filename);
+
+// The closest label at or before `address`, or NULL if there is none
+// `offset` is set to the distance from the label
+const char *symbol_at(Word address, Word *offset);
+
+#endif
@@ -0,0 +1,204 @@
+// Live view of running VMs, from the metrics they publish with `--metrics`
+// Usage: minilc3-top [--once] [--interval=MS] [PID]
+
+// Libc
+#include <inttypes.h>  // PRIu64
+#include <signal.h>    // kill
+#include <stdbool.h>   // bool
+#include <stdio.h>     // printf, etc
+#include <stdlib.h>    // strtoul
+#include <string.h>    // strncmp
+// POSIX
+#include <dirent.h>    // opendir, readdir
+#include <fcntl.h>     // O_RDONLY
+#include <sys/mman.h>  // shm_open, mmap
+#include <unistd.h>    // usleep
+// Local
+#include "../metrics.h"
+#include "../vm.h"  // ERR_*
+
+#define MAX_VMS 64
+#define DEFAULT_INTERVAL_MS 1000
+
+// Trap vectors shown by name in the detailed view
+static const char *const trap_names[256] = {
+    [TRAP_GETC] = "GETC",
+    [TRAP_OUT] = "OUT",
+    [TRAP_PUTS] = "PUTS",
+    [TRAP_IN] = "IN",
+    [TRAP_PUTSP] = "PUTSP",
+    [TRAP_HALT] = "HALT",
+    [TRAP_READ] = "READ",
+    [TRAP_READP] = "READP",
+    [TRAP_WRITE] = "WRITE",
+    [TRAP_WRITEP] = "WRITEP",
+};
+
+struct Vm {
+    const struct Metrics *metrics;
+    uint64_t instructions;  // At the previous sample
+    uint64_t input_wait_ns;
+};
+
+static struct Vm vms[MAX_VMS];
+static int vm_count = 0;
+
+// Map the metrics segment of a VM, read-only
+const struct Metrics *open_segment(const char *const name) {
+    char path[300];
+    snprintf(path, sizeof(path), "/%s", name);
+    const int fd = shm_open(path, O_RDONLY, 0);
+    if (fd < 0)
+        return NULL;
+    void *const segment =
+        mmap(NULL, sizeof(struct Metrics), PROT_READ, MAP_SHARED, fd, 0);
+    (void)close(fd);
+    if (segment == MAP_FAILED)
+        return NULL;
+    const struct Metrics *const metrics = segment;
+    if (atomic_load_explicit(&metrics->magic, memory_order_acquire) !=
+            METRICS_MAGIC ||
+        metrics->version != METRICS_VERSION) {
+        (void)munmap(segment, sizeof(struct Metrics));
+        return NULL;
+    }
+    return metrics;
+}
+
+// Find every VM (or just one, if `pid` is not 0)
+void find_vms(const int pid) {
+    for (int i = 0; i < vm_count; ++i)
+        (void)munmap((void *)vms[i].metrics, sizeof(struct Metrics));
+    vm_count = 0;
+
+    DIR *const directory = opendir("/dev/shm");
+    if (directory == NULL)
+        return;
+    const struct dirent *entry;
+    while ((entry = readdir(directory)) != NULL && vm_count < MAX_VMS) {
+        const size_t prefix_length = strlen(METRICS_PREFIX);
+        if (strncmp(entry->d_name, METRICS_PREFIX, prefix_length) != 0)
+            continue;
+        if (pid != 0 && atoi(entry->d_name + prefix_length) != pid)
+            continue;
+        const struct Metrics *const metrics = open_segment(entry->d_name);
+        if (metrics == NULL)
+            continue;
+        vms[vm_count].metrics = metrics;
+        vms[vm_count].instructions = metrics->instructions;
+        vms[vm_count].input_wait_ns = metrics->input_wait_ns;
+        ++vm_count;
+    }
+    (void)closedir(directory);
+}
+
+#define LOAD(_metrics, _field) \
+    atomic_load_explicit(&(_metrics)->_field, memory_order_relaxed)
+
+void print_vms(const double seconds, const bool detailed) {
+    printf(
+        "%-8s%-20s%-8s%-8s%10s%16s%10s%10s%10s%7s\n",
+        "PID",
+        "PROGRAM",
+        "ENGINE",
+        "STATE",
+        "MIPS",
+        "INSTRUCTIONS",
+        "TRAPS",
+        "IN",
+        "OUT",
+        "WAIT%"
+    );
+    for (int i = 0; i < vm_count; ++i) {
+        struct Vm *const vm = &vms[i];
+        const struct Metrics *const metrics = vm->metrics;
+
+        const uint64_t instructions = LOAD(metrics, instructions);
+        const uint64_t input_wait_ns = LOAD(metrics, input_wait_ns);
+        uint64_t traps = 0;
+        for (int vector = 0; vector < 256; ++vector)
+            traps += LOAD(metrics, traps[vector]);
+
+        const char *state = LOAD(metrics, running) ? "run" : "done";
+        if (kill(metrics->pid, 0) != 0)
+            state = "dead";
+
+        printf(
+            "%-8d%-20.19s%-8.7s%-8s%10.2f%16" PRIu64 "%10" PRIu64
+            "%10" PRIu64 "%10" PRIu64 "%7.1f\n",
+            (int)metrics->pid,
+            metrics->program,
+            metrics->engine,
+            state,
+            (instructions - vm->instructions) / seconds / 1e6,
+            instructions,
+            traps,
+            LOAD(metrics, bytes_in),
+            LOAD(metrics, bytes_out),
+            (input_wait_ns - vm->input_wait_ns) / seconds / 1e7
+        );
+        vm->instructions = instructions;
+        vm->input_wait_ns = input_wait_ns;
+
+        if (!detailed)
+            continue;
+        const uint64_t hits = LOAD(metrics, cache_hits);
+        const uint64_t misses = LOAD(metrics, cache_misses);
+        if (hits + misses > 0) {
+            printf(
+                "  cache hit rate: %.2f%%\n", 100.0 * hits / (hits + misses)
+            );
+            printf(
+                "  cache: %" PRIu64 " KiB in %" PRIu64 " blocks, %" PRIu64
+                " evicted, %" PRIu64 " recompiled\n",
+                LOAD(metrics, cache_bytes) / 1024,
+                LOAD(metrics, cache_blocks),
+                LOAD(metrics, cache_evictions),
+                LOAD(metrics, cache_recompilations)
+            );
+        }
+        for (int vector = 0; vector < 256; ++vector) {
+            const uint64_t count = LOAD(metrics, traps[vector]);
+            if (count == 0)
+                continue;
+            if (trap_names[vector] != NULL)
+                printf("  TRAP %-6s%16" PRIu64 "\n", trap_names[vector], count);
+            else
+                printf("  TRAP x%02x   %16" PRIu64 "\n", vector, count);
+        }
+    }
+}
+
+int main(const int argc, const char *const *const argv) {
+    bool once = false;
+    unsigned long interval_ms = DEFAULT_INTERVAL_MS;
+    int pid = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--once") == 0) {
+            once = true;
+        } else if (strncmp(argv[i], "--interval=", 11) == 0) {
+            interval_ms = strtoul(argv[i] + 11, NULL, 10);
+        } else if (argv[i][0] != '-' && pid == 0) {
+            pid = atoi(argv[i]);
+        } else {
+            fprintf(
+                stderr, "Usage: minilc3-top [--once] [--interval=MS] [PID]\n"
+            );
+            return ERR_CLI;
+        }
+    }
+    if (interval_ms == 0)
+        interval_ms = DEFAULT_INTERVAL_MS;
+
+    while (true) {
+        find_vms(pid);
+        // Rates are measured over one interval
+        (void)usleep((useconds_t)(interval_ms * 1000));
+        if (!once)
+            printf("\033[H\033[2J");  // Clear the terminal
+        print_vms(interval_ms / 1e3, pid != 0);
+        (void)fflush(stdout);
+        if (once)
+            return ERR_OK;
+    }
+}
@@ -0,0 +1,335 @@
+#include "trace.h"
+
+// Libc
+#include <inttypes.h>   // PRIu64
+#include <stdatomic.h>  // atomic_load_explicit, etc
+#include <stdint.h>     // uint16_t, etc
+#include <stdlib.h>     // aligned_alloc, free
+// POSIX
+#include <pthread.h>  // pthread_join, etc
+// Local
+#include "perf.h"  // perf_now
+#include "vm.h"    // attach_plugin, etc
+
+#define CACHE_LINE 64
+#define TRACE_CHUNK_EVENTS (16 << 10)
+#define TRACE_CHUNKS 32   // In the pool
+#define TRACE_SPINS 1024  // Polls before sleeping
+
+// One event, with the callback's arguments
+// `type` is the bit number of its `enum PluginEvent`
+struct TraceEvent {
+    uint8_t type;
+    uint8_t flag;  // Whether a branch was taken, or a trap's vector
+    uint16_t address;
+    uint16_t value;  // Instruction, memory value or branch target
+};
+enum TraceType {
+    TRACE_RETIRE,
+    TRACE_MEMORY_READ,
+    TRACE_MEMORY_WRITE,
+    TRACE_BRANCH,
+    TRACE_TRAP,
+};
+
+struct TraceChunk {
+    _Alignas(CACHE_LINE) _Atomic int readers;  // Analyzers not done with it
+    size_t count;
+    struct TraceEvent events[TRACE_CHUNK_EVENTS];
+};
+
+struct Analyzer {
+    struct Plugin plugin;
+    const char *name;
+    pthread_t thread;
+    uint64_t events;
+    uint64_t busy_ns;     // Replaying events
+    uint64_t starved_ns;  // Waiting for chunks to be recorded
+};
+
+static struct Analyzer analyzers[MAX_ANALYZERS];
+static int analyzer_count = 0;
+static unsigned analyzed_events = 0;
+
+// Chunk number `n` is recorded into `chunks[n % TRACE_CHUNKS]`
+static struct TraceChunk *chunks = NULL;
+static _Atomic uint64_t chunks_recorded = 0;
+static _Atomic bool trace_ended = false;
+
+// Recorder
+static struct TraceChunk *recording = NULL;
+static uint64_t recorder_blocked_ns = 0;
+static bool trace_halted = false;
+static uint64_t halt_instructions = 0;
+
+// For the slow path of waiting, once spinning has not been enough
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t chunk_recorded = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t chunk_released = PTHREAD_COND_INITIALIZER;
+static _Atomic int trace_sleepers = 0;
+
+bool trace_add_analyzer(
+    const struct Plugin *const plugin, const char *const name
+) {
+    if (analyzer_count >= MAX_ANALYZERS)
+        return false;
+    analyzers[analyzer_count].plugin = *plugin;
+    analyzers[analyzer_count].name = name;
+    ++analyzer_count;
+    analyzed_events |= plugin->events;
+    return true;
+}
+
+// Spin on `ready` briefly, then sleep on `condition` until it returns true
+// Whoever makes it true calls `trace_wake` afterwards
+void trace_wait(
+    bool (*const ready)(uint64_t argument),
+    const uint64_t argument,
+    pthread_cond_t *const condition
+) {
+    for (int spins = 0; spins < TRACE_SPINS; ++spins) {
+        if (ready(argument))
+            return;
+    }
+    pthread_mutex_lock(&trace_lock);
+    atomic_fetch_add(&trace_sleepers, 1);
+    while (!ready(argument))
+        pthread_cond_wait(condition, &trace_lock);
+    atomic_fetch_sub(&trace_sleepers, 1);
+    pthread_mutex_unlock(&trace_lock);
+}
+
+void trace_wake(pthread_cond_t *const condition) {
+    if (atomic_load(&trace_sleepers) == 0)
+        return;
+    pthread_mutex_lock(&trace_lock);
+    pthread_cond_broadcast(condition);
+    pthread_mutex_unlock(&trace_lock);
+}
+
+// Whether chunk `n` is recorded, or the trace has ended
+bool chunk_ready(const uint64_t n) {
+    // Ended after the last chunk, so loaded before the count
+    const bool ended = atomic_load(&trace_ended);
+    return atomic_load(&chunks_recorded) > n || ended;
+}
+
+// Whether every analyzer is done with whatever chunk `n` is recorded over
+bool chunk_free(const uint64_t n) {
+    return atomic_load(&chunks[n % TRACE_CHUNKS].readers) == 0;
+}
+
+// Record into `chunk`, which every analyzer is done with
+void start_chunk(struct TraceChunk *const chunk) {
+    atomic_store_explicit(
+        &chunk->readers, analyzer_count, memory_order_relaxed
+    );
+    chunk->count = 0;
+    recording = chunk;
+}
+
+// Publish the chunk being recorded, and start the next one
+void record_chunk() {
+    const uint64_t n =
+        atomic_load_explicit(&chunks_recorded, memory_order_relaxed);
+    atomic_store(&chunks_recorded, n + 1);
+    trace_wake(&chunk_recorded);
+
+    if (!chunk_free(n + 1)) {
+        const uint64_t start = perf_now();
+        trace_wait(chunk_free, n + 1, &chunk_released);
+        recorder_blocked_ns += perf_now() - start;
+    }
+    start_chunk(&chunks[(n + 1) % TRACE_CHUNKS]);
+}
+
+static inline void record(
+    const enum TraceType type,
+    const uint8_t flag,
+    const uint16_t address,
+    const uint16_t value
+) {
+    recording->events[recording->count++] =
+        (struct TraceEvent){(uint8_t)type, flag, address, value};
+    if (recording->count == TRACE_CHUNK_EVENTS)
+        record_chunk();
+}
+
+// Recorder callbacks
+void record_retire(
+    void *const data, const uint16_t address, const uint16_t instruction
+) {
+    (void)data;
+    record(TRACE_RETIRE, 0, address, instruction);
+}
+void record_memory_read(
+    void *const data, const uint16_t address, const uint16_t value
+) {
+    (void)data;
+    record(TRACE_MEMORY_READ, 0, address, value);
+}
+void record_memory_write(
+    void *const data, const uint16_t address, const uint16_t value
+) {
+    (void)data;
+    record(TRACE_MEMORY_WRITE, 0, address, value);
+}
+void record_branch(
+    void *const data, const uint16_t from, const uint16_t to, const int taken
+) {
+    (void)data;
+    record(TRACE_BRANCH, taken != 0, from, to);
+}
+void record_trap(
+    void *const data, const uint16_t address, const uint8_t vector
+) {
+    (void)data;
+    record(TRACE_TRAP, vector, address, 0);
+}
+void record_halt(void *const data, const uint64_t instructions) {
+    (void)data;
+    trace_halted = true;
+    halt_instructions = instructions;
+}
+
+// Call the analyzer's callbacks for every event of a chunk it asked for
+void replay_chunk(
+    const struct Plugin *const plugin, const struct TraceChunk *const chunk
+) {
+    for (size_t i = 0; i < chunk->count; ++i) {
+        const struct TraceEvent *const event = &chunk->events[i];
+        if (!(plugin->events & (1u << event->type)))
+            continue;
+        switch (event->type) {
+            case TRACE_RETIRE:
+                plugin->retire(plugin->data, event->address, event->value);
+                break;
+            case TRACE_MEMORY_READ:
+                plugin->memory_read(
+                    plugin->data, event->address, event->value
+                );
+                break;
+            case TRACE_MEMORY_WRITE:
+                plugin->memory_write(
+                    plugin->data, event->address, event->value
+                );
+                break;
+            case TRACE_BRANCH:
+                plugin->branch(
+                    plugin->data, event->address, event->value, event->flag
+                );
+                break;
+            case TRACE_TRAP:
+                plugin->trap(plugin->data, event->address, event->flag);
+                break;
+        }
+    }
+}
+
+void *analyzer_main(void *const argument) {
+    struct Analyzer *const analyzer = argument;
+    for (uint64_t n = 0;; ++n) {
+        if (!chunk_ready(n)) {
+            const uint64_t start = perf_now();
+            trace_wait(chunk_ready, n, &chunk_recorded);
+            analyzer->starved_ns += perf_now() - start;
+        }
+        // Recorded before the end, so loaded after it
+        if (atomic_load(&chunks_recorded) <= n)
+            break;
+
+        struct TraceChunk *const chunk = &chunks[n % TRACE_CHUNKS];
+        const uint64_t start = perf_now();
+        replay_chunk(&analyzer->plugin, chunk);
+        analyzer->busy_ns += perf_now() - start;
+        analyzer->events += chunk->count;
+        if (atomic_fetch_sub(&chunk->readers, 1) == 1)
+            trace_wake(&chunk_released);
+    }
+    return NULL;
+}
+
+void trace_start() {
+    chunks =
+        aligned_alloc(CACHE_LINE, TRACE_CHUNKS * sizeof(struct TraceChunk));
+    assert(chunks != NULL, "Out of memory");
+    for (size_t i = 0; i < TRACE_CHUNKS; ++i)
+        atomic_init(&chunks[i].readers, 0);
+    start_chunk(&chunks[0]);
+
+    // The halt of the VM is recorded too, but only `trace_finish` passes it
+    // on, once every analyzer is done
+    const struct Plugin recorder = {
+        analyzed_events | EVENT_HALT,
+        record_retire,
+        record_memory_read,
+        record_memory_write,
+        record_branch,
+        record_trap,
+        record_halt,
+        NULL,
+        NULL,
+        NULL,
+    };
+    assert(attach_plugin(&recorder), "Failed to attach trace recorder");
+
+    for (int i = 0; i < analyzer_count; ++i) {
+        const int error = start_helper_thread(
+            &analyzers[i].thread, analyzer_main, &analyzers[i]
+        );
+        assert(error == 0, "Failed to create analyzer thread");
+    }
+}
+
+void trace_finish(FILE *const report) {
+    const uint64_t start = perf_now();
+    const uint64_t events_recorded =
+        atomic_load(&chunks_recorded) * TRACE_CHUNK_EVENTS + recording->count;
+    if (recording->count > 0)
+        record_chunk();
+    atomic_store(&trace_ended, true);
+    trace_wake(&chunk_recorded);
+    for (int i = 0; i < analyzer_count; ++i)
+        (void)pthread_join(analyzers[i].thread, NULL);
+    const uint64_t drain_ns = perf_now() - start;
+
+    if (trace_halted) {
+        for (int i = 0; i < analyzer_count; ++i) {
+            const struct Plugin *const plugin = &analyzers[i].plugin;
+            if (plugin->events & EVENT_HALT)
+                plugin->halt(plugin->data, halt_instructions);
+        }
+    }
+
+    fprintf(
+        report,
+        "%-10s%14s%12s%14s  %s\n",
+        "Analyzer",
+        "Events",
+        "Busy (ms)",
+        "Starved (ms)",
+        "Plugin"
+    );
+    for (int i = 0; i < analyzer_count; ++i) {
+        const struct Analyzer *const analyzer = &analyzers[i];
+        fprintf(
+            report,
+            "%-10d%14" PRIu64 "%12.3f%14.3f  %s\n",
+            i,
+            analyzer->events,
+            analyzer->busy_ns / 1e6,
+            analyzer->starved_ns / 1e6,
+            analyzer->name
+        );
+    }
+    fprintf(
+        report,
+        "Recorded %" PRIu64 " events; waited %.3f ms for analyzers while "
+        "running, and %.3f ms after\n",
+        events_recorded,
+        recorder_blocked_ns / 1e6,
+        drain_ns / 1e6
+    );
+    free(chunks);
+    chunks = NULL;
+}
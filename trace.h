@@ -0,0 +1,37 @@
+// Plugins which analyze a recorded trace in parallel
+// Instead of every plugin being called from the interpreter in turn, one
+// hooked callback records the events which any of them asked for into
+// chunks of a binary trace. Each plugin is an analyzer with its own thread,
+// which replays every chunk in order into its callbacks. Chunks come from a
+// fixed pool, and are read-only and shared by every analyzer once recorded;
+// a chunk is recorded over once every analyzer is done with it, and the
+// recording waits for that if the whole pool is in use. So a run takes
+// about as long as recording plus the slowest analyzer, rather than all of
+// them one after the other. `halt` callbacks are only called at the end,
+// from the calling thread, in the order the analyzers were added.
+
+#ifndef TRACE_H
+#define TRACE_H
+
+// Libc
+#include <stdbool.h>  // bool
+#include <stdio.h>    // FILE
+// Local
+#include "plugin.h"  // struct Plugin
+
+#define MAX_ANALYZERS 8
+
+// Analyze the trace with `plugin`, instead of attaching it to the VM
+// `name` is only for the report
+// Returns false if there are already `MAX_ANALYZERS`
+bool trace_add_analyzer(const struct Plugin *plugin, const char *name);
+
+// Attach the recorder to the VM, and start every analyzer
+void trace_start();
+
+// Wait for every analyzer to replay what has been recorded, call their
+// `halt` callbacks if the program halted, and print the time each took to
+// `report`
+void trace_finish(FILE *report);
+
+#endif
@@ -0,0 +1,1296 @@
+#include "vm.h"
+
+// Libc
+#include <signal.h>     // sig_atomic_t, sigfillset
+#include <limits.h>     // INT_MAX
+#include <stdatomic.h>  // _Atomic
+#include <stdbool.h>    // true, false
+#include <stdio.h>      // printf, FILE, etc
+#include <stdlib.h>     // exit
+#include <string.h>     // strcmp
+// POSIX
+#include <fcntl.h>    // open
+#include <poll.h>     // poll
+#include <pthread.h>  // pthread_create, etc
+#include <termios.h>  // struct termios, etc
+#include <unistd.h>   // STDIN_FILENO, read
+// Local
+#include "cjit.h"     // cjit_execute, cjit_execute_until
+#include "formats.h"  // detect_format, load_text, load_text_file
+#include "jit.h"      // jit_execute, jit_execute_until
+#include "metrics.h"  // metrics, metrics_add
+#include "perf.h"     // perf_now
+
+// All program state
+// Memory is page-aligned so saved states can be mapped straight over it
+_Thread_local Word memory[MEMORY_SIZE] __attribute__((aligned(4096)));
+_Thread_local Word registers[8];
+_Thread_local Word pc;
+_Thread_local uint8_t cc;
+
+_Thread_local uint64_t instructions_retired;
+
+// Swap high and low bytes of a word
+// 0x12ab -> 0xab12
+// Object file is stored in different 'endianess' to program memory
+Word swap_endian(const Word word) {
+    return (word << 8) | (word >> 8);
+}
+
+// Set the condition code based on the value stored into a register
+void set_cc(const SignedWord result) {
+    if (result < 0) {
+        cc = 0x4;  // Negative
+    } else if (result == 0) {
+        cc = 0x2;  // Zero
+    } else {
+        cc = 0x1;  // Positive
+    }
+}
+
+// Sign extend a number to be a valid signed word
+// This just makes the number valid in 2's compliment, at a larger size
+SignedWord sign_extend(const Word value, const uint8_t bits) {
+    Word sign_bit = 1 << (bits - 1);
+    return (SignedWord)(value ^ sign_bit) - (SignedWord)sign_bit;
+}
+// Get bits highest to lowest (both inclusive)
+// Note that bits ordered low to high, from 0
+Word bits(const Word instruction, const uint8_t highest, const uint8_t lowest) {
+    assert(highest >= lowest, "%d >= %d", highest, lowest);
+    return (instruction >> lowest) & ((1 << (highest - lowest + 1)) - 1);
+}
+// Get bits and sign extend
+SignedWord bits_sext(
+    const Word instruction, const uint8_t highest, const uint8_t lowest
+) {
+    return sign_extend(
+        bits(instruction, highest, lowest), highest - lowest + 1
+    );
+}
+
+// Alias functions for common `bits` calls, for readability
+uint8_t bits_reg_a(Word instruction) {
+    return bits(instruction, 11, 9);
+}
+uint8_t bits_reg_b(Word instruction) {
+    return bits(instruction, 8, 6);
+}
+uint8_t bits_reg_c(Word instruction) {
+    return bits(instruction, 2, 0);
+}
+SignedWord bits_imm_5(Word instruction) {
+    return bits_sext(instruction, 4, 0);
+}
+SignedWord bits_offset_6(Word instruction) {
+    return bits_sext(instruction, 5, 0);
+}
+SignedWord bits_pc_offset_9(Word instruction) {
+    return bits_sext(instruction, 8, 0);
+}
+SignedWord bits_pc_offset_11(Word instruction) {
+    return bits_sext(instruction, 10, 0);
+}
+
+// Don't worry about this. It's to disable line buffering for stdin.
+void enable_raw_terminal() {
+    struct termios tty;
+    (void)tcgetattr(STDIN_FILENO, &tty);
+    tty.c_lflag &= ~ICANON;
+    tty.c_lflag &= ~ECHO;
+    (void)tcsetattr(STDIN_FILENO, TCSANOW, &tty);
+}
+void disable_raw_terminal() {
+    struct termios tty;
+    (void)tcgetattr(STDIN_FILENO, &tty);
+    tty.c_lflag |= ICANON;
+    tty.c_lflag |= ECHO;
+    (void)tcsetattr(STDIN_FILENO, TCSANOW, &tty);
+}
+
+// Default I/O: unbuffered terminal input, and stdout
+// Input is read without stdio, so `terminal_input_ready` can poll for it
+int terminal_read_char(void *const context) {
+    (void)context;
+    enable_raw_terminal();
+    unsigned char input;
+    const ssize_t count = read(STDIN_FILENO, &input, 1);
+    disable_raw_terminal();
+    return count == 1 ? input : EOF;
+}
+bool terminal_input_ready(void *const context, const int timeout_ms) {
+    (void)context;
+    struct pollfd file = {STDIN_FILENO, POLLIN, 0};
+    enable_raw_terminal();
+    const int count = poll(&file, 1, timeout_ms);
+    disable_raw_terminal();
+    return count > 0;
+}
+void terminal_write_char(void *const context, const char ch) {
+    (void)context;
+    printf("%c", ch);
+}
+void terminal_write(
+    void *const context, const char *const data, const size_t length
+) {
+    (void)context;
+    (void)fwrite(data, 1, length, stdout);
+}
+void terminal_flush(void *const context) {
+    (void)context;
+    (void)fflush(stdout);
+}
+
+int buffer_read_char(void *const context) {
+    struct InputBuffer *const buffer = context;
+    if (buffer->position >= buffer->length)
+        return EOF;
+    return (unsigned char)buffer->data[buffer->position++];
+}
+size_t buffer_read(void *const context, char *const data, size_t size) {
+    struct InputBuffer *const buffer = context;
+    const size_t left = buffer->position < buffer->length
+                            ? buffer->length - buffer->position
+                            : 0;
+    if (size > left)
+        size = left;
+    memcpy(data, buffer->data + buffer->position, size);
+    buffer->position += size;
+    return size;
+}
+void discard_char(void *const context, const char ch) {
+    (void)context, (void)ch;
+}
+void discard(void *const context, const char *const data, const size_t length) {
+    (void)context, (void)data, (void)length;
+}
+void flush_nothing(void *const context) {
+    (void)context;
+}
+
+_Thread_local struct Io io = {
+    terminal_read_char,
+    terminal_write_char,
+    terminal_flush,
+    NULL,
+    NULL,
+    terminal_write,
+    terminal_input_ready,
+};
+
+// Input, output and stores by the program (the latter only counted in
+// variants with devices), so polling loops with no side effects are seen
+static _Thread_local uint64_t side_effects = 0;
+
+int read_char() {
+    ++side_effects;
+    if (metrics == NULL)
+        return io.read_char(io.context);
+    // Readers should see an up-to-date count while the program is blocked
+    metrics_publish(instructions_retired);
+    const uint64_t start = perf_now();
+    const int input = io.read_char(io.context);
+    metrics_add(&metrics->input_wait_ns, perf_now() - start);
+    if (input != EOF)
+        metrics_add(&metrics->bytes_in, 1);
+    return input;
+}
+// Read up to `size` bytes, stopping early only at the end of input
+size_t read_chars(char *const buffer, const size_t size) {
+    ++side_effects;
+    uint64_t start = 0;
+    if (metrics != NULL) {
+        metrics_publish(instructions_retired);
+        start = perf_now();
+    }
+    size_t count = 0;
+    if (io.read != NULL) {
+        count = io.read(io.context, buffer, size);
+    } else {
+        while (count < size) {
+            const int input = io.read_char(io.context);
+            if (input == EOF)
+                break;
+            buffer[count++] = (char)input;
+        }
+    }
+    if (metrics != NULL) {
+        metrics_add(&metrics->input_wait_ns, perf_now() - start);
+        metrics_add(&metrics->bytes_in, count);
+    }
+    return count;
+}
+void flush_output() {
+    io.flush(io.context);
+}
+
+// Helper functions to make sure some `IN` prompt is printed on it's own line
+_Thread_local bool stdout_on_new_line = true;
+void print_char(const char ch) {
+    ++side_effects;
+    io.write_char(io.context, ch);
+    if (metrics != NULL)
+        metrics_add(&metrics->bytes_out, 1);
+    stdout_on_new_line = ch == '\n';
+}
+void print_chars(const char *const data, const size_t length) {
+    if (length == 0)
+        return;
+    ++side_effects;
+    if (io.write != NULL) {
+        io.write(io.context, data, length);
+    } else {
+        for (size_t i = 0; i < length; ++i)
+            io.write_char(io.context, data[i]);
+    }
+    if (metrics != NULL)
+        metrics_add(&metrics->bytes_out, length);
+    stdout_on_new_line = data[length - 1] == '\n';
+}
+void print_string(const char *const string) {
+    for (const char *ch = string; *ch != '\0'; ++ch)
+        print_char(*ch);
+}
+void print_on_new_line() {
+    if (stdout_on_new_line)
+        return;
+    print_char('\n');
+}
+
+// Atomic, so the check is not hoisted out of the loop, and it can be lowered
+// by a signal handler
+static _Thread_local _Atomic uint64_t instruction_limit = 0;
+static _Thread_local volatile sig_atomic_t interrupted = 0;
+// Where the current run stops; an engine may set `instruction_limit` lower
+// while it runs the interpreter a block at a time
+static _Thread_local uint64_t run_limit = 0;
+
+void (*code_watch)(Word start, size_t count) = NULL;
+static void (*code_watches[MAX_CODE_WATCHES])(Word start, size_t count);
+static _Atomic int code_watch_count = 0;
+static pthread_mutex_t code_watch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Attached plugins, and the union of the events they need
+static struct Plugin plugins[MAX_PLUGINS];
+static int plugin_count = 0;
+static unsigned hooked_events = 0;
+
+bool attach_plugin(const struct Plugin *const plugin) {
+    if (plugin_count >= MAX_PLUGINS)
+        return false;
+    plugins[plugin_count++] = *plugin;
+    hooked_events |= plugin->events;
+    return true;
+}
+
+void detach_plugins() {
+    plugin_count = 0;
+    hooked_events = 0;
+}
+
+// Call every plugin which asked for an event
+#define CALL_PLUGINS(_event, _callback, ...)                      \
+    {                                                             \
+        for (int i = 0; i < plugin_count; ++i) {                  \
+            if (plugins[i].events & (_event))                     \
+                plugins[i]._callback(plugins[i].data, __VA_ARGS__); \
+        }                                                         \
+    }
+
+// Attached devices, and which one owns each register
+#define MAX_DEVICES 8
+static struct Device devices[MAX_DEVICES];
+static int device_count = 0;
+static const struct Device *device_registers[MEMORY_SIZE - DEVICE_BASE];
+
+bool attach_device(const struct Device *const device) {
+    if (device_count >= MAX_DEVICES || device->base < DEVICE_BASE ||
+        device->count == 0 || device->base + device->count > MEMORY_SIZE)
+        return false;
+    for (Word i = 0; i < device->count; ++i) {
+        if (device_registers[device->base - DEVICE_BASE + i] != NULL)
+            return false;
+    }
+    devices[device_count] = *device;
+    for (Word i = 0; i < device->count; ++i)
+        device_registers[device->base - DEVICE_BASE + i] =
+            &devices[device_count];
+    ++device_count;
+    return true;
+}
+
+// Kept out of line, since device registers are rarely accessed
+__attribute__((noinline)) void device_load(const Word address) {
+    const struct Device *const device =
+        device_registers[address - DEVICE_BASE];
+    if (device != NULL && device->load != NULL)
+        device->load(device->data, address);
+}
+__attribute__((noinline)) void device_store(
+    const Word address, const Word value
+) {
+    const struct Device *const device =
+        device_registers[address - DEVICE_BASE];
+    if (device != NULL && device->store != NULL)
+        device->store(device->data, address, value);
+}
+
+// Console device
+// A character read ahead by a load of KBSR, until a load of KBDR takes it
+static _Thread_local bool keyboard_has_char = false;
+static _Thread_local char keyboard_char;
+static _Thread_local bool keyboard_at_end = false;
+
+// Polling loop detection: the last load of KBSR which found no input
+#define POLL_LOOP_MAX 16  // Instructions in a polling loop
+#define POLL_CONFIRM 64   // Identical iterations before parking
+struct PollLoop {
+    Word pc;
+    uint64_t instructions;  // When KBSR was loaded
+    uint64_t period;        // Instructions since the load before
+    uint64_t side_effects;
+    unsigned repeats;  // Identical iterations in a row
+    // Start of the repeats, to estimate how fast the loop runs
+    uint64_t start_ns;
+    uint64_t start_instructions;
+};
+static _Thread_local struct PollLoop poll_loop = {0};
+
+void keyboard_fill() {
+    const int input = read_char();
+    if (input == EOF) {
+        keyboard_at_end = true;
+    } else {
+        keyboard_has_char = true;
+        keyboard_char = (char)input;
+    }
+}
+
+// Block until input arrives, instead of running the polling loop, then
+// account for the iterations it would have run in the meantime
+// Waits no longer than the loop would take to reach `run_limit`
+void park_poll_loop() {
+    const uint64_t now = perf_now();
+    const uint64_t limit = run_limit;
+    if (interrupted || limit <= instructions_retired ||
+        now <= poll_loop.start_ns)
+        return;
+    const double per_ns =
+        (double)(instructions_retired - poll_loop.start_instructions) /
+        (double)(now - poll_loop.start_ns);
+    int timeout_ms = -1;
+    if (limit != UINT64_MAX) {
+        const double ms = (limit - instructions_retired) / per_ns / 1e6 + 1;
+        timeout_ms = ms < INT_MAX ? (int)ms : INT_MAX;
+    }
+
+    if (metrics != NULL)
+        metrics_publish(instructions_retired);
+    const bool ready = io.input_ready(io.context, timeout_ms);
+    const uint64_t waited = perf_now() - now;
+    if (metrics != NULL)
+        metrics_add(&metrics->input_wait_ns, waited);
+
+    // Whole iterations only, so the program is left where it was
+    const uint64_t period = poll_loop.period;
+    uint64_t skipped = (uint64_t)(waited * per_ns) / period * period;
+    const uint64_t room = (limit - instructions_retired) / period * period;
+    if (skipped > room)
+        skipped = room;
+    instructions_retired += skipped;
+    poll_loop.instructions += skipped;
+    poll_loop.repeats = 0;
+    if (ready)
+        keyboard_fill();
+}
+
+// KBSR was loaded and there is no input yet
+void watch_poll_loop() {
+    const uint64_t period = instructions_retired - poll_loop.instructions;
+    const bool repeated = pc == poll_loop.pc && period == poll_loop.period &&
+                          period <= POLL_LOOP_MAX &&
+                          side_effects == poll_loop.side_effects;
+    if (repeated) {
+        ++poll_loop.repeats;
+    } else {
+        poll_loop.repeats = 0;
+        poll_loop.start_ns = perf_now();
+        poll_loop.start_instructions = instructions_retired;
+    }
+    poll_loop.pc = pc;
+    poll_loop.instructions = instructions_retired;
+    poll_loop.period = period;
+    poll_loop.side_effects = side_effects;
+    if (poll_loop.repeats >= POLL_CONFIRM && io.input_ready != NULL)
+        park_poll_loop();
+}
+
+bool keyboard_ready() {
+    if (keyboard_has_char)
+        return true;
+    if (keyboard_at_end)
+        return false;
+    if (io.input_ready == NULL || io.input_ready(io.context, 0))
+        keyboard_fill();
+    else
+        watch_poll_loop();
+    return keyboard_has_char;
+}
+
+void console_load(void *const data, const Word address) {
+    (void)data;
+    switch (address) {
+        case CONSOLE_KBSR:
+            memory[CONSOLE_KBSR] = keyboard_ready() ? CONSOLE_READY : 0;
+            break;
+        case CONSOLE_KBDR:
+            if (keyboard_has_char) {
+                memory[CONSOLE_KBDR] = (unsigned char)keyboard_char;
+                keyboard_has_char = false;
+            }
+            memory[CONSOLE_KBSR] = 0;
+            break;
+        case CONSOLE_DSR:
+            memory[CONSOLE_DSR] = CONSOLE_READY;
+            break;
+    }
+}
+
+void console_store(void *const data, const Word address, const Word value) {
+    (void)data;
+    if (address != CONSOLE_DDR)
+        return;
+    print_char((char)value);
+    flush_output();
+}
+
+void console_reset(void *const data) {
+    (void)data;
+    for (Word address = CONSOLE_KBSR; address <= CONSOLE_DDR; ++address)
+        memory[address] = 0;
+    memory[CONSOLE_DSR] = CONSOLE_READY;
+    keyboard_has_char = false;
+    keyboard_at_end = false;
+    poll_loop = (struct PollLoop){0};
+}
+
+bool attach_console() {
+    const struct Device device = {
+        CONSOLE_KBSR,
+        CONSOLE_DDR - CONSOLE_KBSR + 1,
+        console_load,
+        console_store,
+        console_reset,
+        NULL,
+    };
+    if (!attach_device(&device))
+        return false;
+    console_reset(NULL);
+    return true;
+}
+
+uint8_t page_permissions[PROTECTION_PAGES];
+static bool protection_enabled = false;
+
+void enable_protection() {
+    protect_region(0x0000, 0x2fff, PERM_READ | PERM_WRITE | PERM_EXECUTE);
+    protect_region(
+        0x3000, 0xfdff, PERM_READ | PERM_WRITE | PERM_EXECUTE | PERM_USER
+    );
+    protect_region(0xfe00, 0xffff, PERM_READ | PERM_WRITE);
+    protection_enabled = true;
+}
+
+void protect_region(
+    const Word start, const Word end, const uint8_t permissions
+) {
+    for (size_t page = start >> PROTECTION_PAGE_SHIFT;
+         page <= (size_t)(end >> PROTECTION_PAGE_SHIFT);
+         ++page)
+        page_permissions[page] = permissions;
+}
+
+enum Error access_violation(
+    const Word address, const Word target, const uint8_t permission
+) {
+    const char *const access = permission == PERM_READ    ? "read"
+                               : permission == PERM_WRITE ? "write"
+                                                          : "execute";
+    fprintf(
+        stderr,
+        "Access violation: %s of x%04x by instruction at x%04x\n",
+        access,
+        target,
+        address
+    );
+    return ERR_ACCESS;
+}
+
+bool user_may_access(const Word address, const uint8_t permission) {
+    const uint8_t needed = permission | PERM_USER;
+    return !protection_enabled ||
+           (page_permissions[address >> PROTECTION_PAGE_SHIFT] & needed) ==
+               needed;
+}
+
+// Check that the program may access every word of a buffer which a trap
+// accesses for it
+enum Error check_buffer(
+    const Word address,
+    const Word buffer,
+    const size_t words,
+    const uint8_t permission
+) {
+    if (!protection_enabled)
+        return ERR_OK;
+    for (size_t i = 0; i < words; ++i) {
+        const Word target = (Word)(buffer + i);
+        if (!user_may_access(target, permission))
+            return access_violation(address, target, permission);
+    }
+    return ERR_OK;
+}
+
+// Bulk I/O traps (see `enum TrapVect`)
+// Data is moved in chunks, so the host is called once per chunk rather than
+// once per byte
+#define BULK_CHUNK 4096
+
+enum Error trap_read(const Word address, const bool packed) {
+    const Word buffer = registers[0];
+    const size_t size = registers[1];
+    const size_t words = packed ? (size + 1) / 2 : size;
+    const enum Error error = check_buffer(address, buffer, words, PERM_WRITE);
+    if (error != ERR_OK)
+        return error;
+
+    char chunk[BULK_CHUNK];
+    size_t total = 0;
+    while (total < size) {
+        const size_t wanted =
+            size - total < BULK_CHUNK ? size - total : BULK_CHUNK;
+        const size_t count = read_chars(chunk, wanted);
+        for (size_t i = 0; i < count; ++i) {
+            const size_t byte = total + i;
+            const Word ch = (unsigned char)chunk[i];
+            if (!packed)
+                memory[(Word)(buffer + byte)] = ch;
+            else if (byte % 2 == 0)
+                memory[(Word)(buffer + byte / 2)] = (Word)(ch << 8);
+            else
+                memory[(Word)(buffer + byte / 2)] |= ch;
+        }
+        total += count;
+        if (count < wanted)
+            break;
+    }
+    if (code_watch != NULL)
+        code_watch(buffer, words);
+    registers[0] = (Word)total;
+    return ERR_OK;
+}
+
+enum Error trap_write(const Word address, const bool packed) {
+    const Word buffer = registers[0];
+    const size_t size = registers[1];
+    const size_t words = packed ? (size + 1) / 2 : size;
+    const enum Error error = check_buffer(address, buffer, words, PERM_READ);
+    if (error != ERR_OK)
+        return error;
+
+    char chunk[BULK_CHUNK];
+    for (size_t total = 0; total < size;) {
+        const size_t count =
+            size - total < BULK_CHUNK ? size - total : BULK_CHUNK;
+        for (size_t i = 0; i < count; ++i) {
+            const size_t byte = total + i;
+            if (!packed) {
+                chunk[i] = (char)memory[(Word)(buffer + byte)];
+            } else {
+                const Word word = memory[(Word)(buffer + byte / 2)];
+                chunk[i] = (char)(byte % 2 == 0 ? word >> 8 : word);
+            }
+        }
+        print_chars(chunk, count);
+        total += count;
+    }
+    flush_output();
+    registers[0] = (Word)size;
+    return ERR_OK;
+}
+
+// Stop the program if it may not access `_target` in this way
+// One byte is looked up, and only in variants with protection
+#define CHECK_ACCESS(_target, _permission)                            \
+    {                                                                 \
+        const Word target = (_target);                                \
+        const uint8_t needed = (_permission) | PERM_USER;             \
+        if ((features & FEATURE_PROTECTED) &&                         \
+            (page_permissions[target >> PROTECTION_PAGE_SHIFT] &      \
+             needed) != needed)                                       \
+            return access_violation(address, target, (_permission)); \
+    }
+
+// Memory access from instructions, with hooks if enabled
+// `features` is always a constant, so disabled hooks are compiled out
+static inline __attribute__((always_inline)) Word load(
+    const unsigned features, const Word address
+) {
+    if ((features & FEATURE_DEVICES) && address >= DEVICE_BASE)
+        device_load(address);
+    const Word value = memory[address];
+    if (features & EVENT_MEMORY_READ)
+        CALL_PLUGINS(EVENT_MEMORY_READ, memory_read, address, value);
+    return value;
+}
+static inline __attribute__((always_inline)) void store(
+    const unsigned features, const Word address, const Word value
+) {
+    if (features & EVENT_MEMORY_WRITE) {
+        CALL_PLUGINS(EVENT_MEMORY_WRITE, memory_write, address, value);
+        if (code_watch != NULL)
+            code_watch(address, 1);
+    }
+    memory[address] = value;
+    if (features & FEATURE_DEVICES) {
+        ++side_effects;
+        if (address >= DEVICE_BASE)
+            device_store(address, value);
+    }
+}
+static inline __attribute__((always_inline)) void branch(
+    const unsigned features, const Word from, const Word to, const bool taken
+) {
+    if (features & EVENT_BRANCH)
+        CALL_PLUGINS(EVENT_BRANCH, branch, from, to, taken);
+    pc = to;
+}
+
+// The interpreter, specialized for each set of hooked events
+// Rare events (TRAP and HALT) are always checked at runtime instead
+static inline __attribute__((always_inline)) enum Error execute_with(
+    const unsigned features
+) {
+    // See LC-3 instruction set for details on how instructions are layed
+    // out in binary.
+
+    // General layout of instructions (bits ordered low to high, from 0):
+    // * Bits 12-15: Opcode
+    // * Bits 9-11: Destination register (DR) or condition code for BR[nzp]
+    // * Bits 6-8: Source register 1 (SR1) or base register (BaseR)
+    // * Remaining low bits: Immediate (imm5), PC offset
+    //     (PCoffset9/PCoffset11), base offset (offset6), trap vector
+    //     (trapvect8)
+
+    // Some instructions can have single-bit 'flags' to indicate whether some
+    // bits refer to a register or an immediate (ADD, AND, JSR/JSRR).
+
+    // Some instructions use the same opcode, or are aliases of other
+    // instructions. Eg. RET is JMP R7, and JSR and JSRR use the same opcode,
+    // with a flag.
+
+    // Instructions can have padding of 0's (or 1's for NOT) which can be
+    // ignored, but is checked here anyway.
+
+    while (true) {
+        if ((features & FEATURE_BOUNDED) &&
+            instructions_retired >= atomic_load_explicit(
+                                        &instruction_limit, memory_order_relaxed
+                                    ))
+            return ERR_LIMIT;
+
+        // Get next instruction, then increment PC
+        const Word address = pc;
+        CHECK_ACCESS(address, PERM_EXECUTE);
+        const Word instruction = memory[pc++];
+        ++instructions_retired;
+        const enum Opcode opcode = (enum Opcode)bits(instruction, 15, 12);
+
+        switch (opcode) {
+            // ADD*
+            case OP_ADD: {
+                const uint8_t dest_reg = bits_reg_a(instruction);
+                const uint8_t src_reg = bits_reg_b(instruction);
+                SignedWord second_operand;
+                if (bits(instruction, 5, 5) == 0) {
+                    // Second operand is a register
+                    if (bits(instruction, 4, 3) != 0) {
+                        fprintf(stderr, "Invalid padding for ADD\n");
+                        return ERR_INSTRUCTION;
+                    }
+                    second_operand =
+                        (SignedWord)registers[bits_reg_c(instruction)];
+                } else {
+                    // Second operand is an immediate
+                    second_operand = bits_imm_5(instruction);
+                }
+                const SignedWord result =
+                    (SignedWord)registers[src_reg] + second_operand;
+                registers[dest_reg] = (Word)result;
+                set_cc(result);
+            } break;
+
+            // AND*
+            case OP_AND: {
+                const uint8_t dest_reg = bits_reg_a(instruction);
+                const uint8_t src_reg = bits_reg_b(instruction);
+                Word second_operand;
+                if (bits(instruction, 5, 5) == 0) {
+                    // Second operand is a register
+                    if (bits(instruction, 4, 3) != 0) {
+                        fprintf(stderr, "Invalid padding for ADD\n");
+                        return ERR_INSTRUCTION;
+                    }
+                    second_operand = registers[bits_reg_c(instruction)];
+                } else {
+                    // Second operand is an immediate
+                    second_operand = (Word)bits_imm_5(instruction);
+                }
+                const Word result = registers[src_reg] & second_operand;
+                registers[dest_reg] = result;
+                set_cc((SignedWord)result);
+            } break;
+
+            // NOT*
+            case OP_NOT: {
+                const uint8_t dest_reg = bits_reg_a(instruction);
+                const uint8_t src_reg = bits_reg_b(instruction);
+                if (bits(instruction, 5, 0) != 0x3f) {
+                    fprintf(stderr, "Invalid padding for NOT\n");
+                    return ERR_INSTRUCTION;
+                }
+                const Word result = ~registers[src_reg];
+                registers[dest_reg] = result;
+                set_cc((SignedWord)result);
+            } break;
+
+            // LEA*
+            case OP_LEA: {
+                const uint8_t dest_reg = bits_reg_a(instruction);
+                const SignedWord pc_offset = bits_pc_offset_9(instruction);
+                registers[dest_reg] = pc + pc_offset;
+            } break;
+
+            // LD*
+            case OP_LD: {
+                const uint8_t dest_reg = bits_reg_a(instruction);
+                const SignedWord pc_offset = bits_pc_offset_9(instruction);
+                CHECK_ACCESS(pc + pc_offset, PERM_READ);
+                const Word result = load(features, pc + pc_offset);
+                registers[dest_reg] = result;
+                set_cc((SignedWord)result);
+            } break;
+
+            // LDI*
+            case OP_LDI: {
+                const uint8_t dest_reg = bits_reg_a(instruction);
+                const SignedWord pc_offset = bits_pc_offset_9(instruction);
+                CHECK_ACCESS(pc + pc_offset, PERM_READ);
+                const Word pointer = load(features, pc + pc_offset);
+                CHECK_ACCESS(pointer, PERM_READ);
+                const Word result = load(features, pointer);
+                registers[dest_reg] = result;
+                set_cc((SignedWord)result);
+            } break;
+
+            // LDR*
+            case OP_LDR: {
+                const uint8_t dest_reg = bits_reg_a(instruction);
+                const uint8_t base_reg = bits_reg_b(instruction);
+                const SignedWord offset = bits_offset_6(instruction);
+                CHECK_ACCESS(registers[base_reg] + offset, PERM_READ);
+                const Word result =
+                    load(features, registers[base_reg] + offset);
+                registers[dest_reg] = result;
+                set_cc((SignedWord)result);
+            } break;
+
+            // ST
+            case OP_ST: {
+                const uint8_t src_reg = bits_reg_a(instruction);
+                const SignedWord pc_offset = bits_pc_offset_9(instruction);
+                const Word result = registers[src_reg];
+                CHECK_ACCESS(pc + pc_offset, PERM_WRITE);
+                store(features, pc + pc_offset, result);
+            } break;
+
+            // STI
+            case OP_STI: {
+                const uint8_t src_reg = bits_reg_a(instruction);
+                const SignedWord pc_offset = bits_pc_offset_9(instruction);
+                CHECK_ACCESS(pc + pc_offset, PERM_READ);
+                const Word pointer = load(features, pc + pc_offset);
+                const Word result = registers[src_reg];
+                CHECK_ACCESS(pointer, PERM_WRITE);
+                store(features, pointer, result);
+            } break;
+
+            // STR
+            case OP_STR: {
+                const uint8_t src_reg = bits_reg_a(instruction);
+                const uint8_t base_reg = bits_reg_b(instruction);
+                const SignedWord offset = bits_offset_6(instruction);
+                const Word result = registers[src_reg];
+                CHECK_ACCESS(registers[base_reg] + offset, PERM_WRITE);
+                store(features, registers[base_reg] + offset, result);
+            } break;
+
+            // BR[nzp]
+            case OP_BR: {
+                // Skip NOP case
+                if (instruction == 0x0000)
+                    break;
+                const uint8_t condition = bits_reg_a(instruction);
+                // Cannot have no flags. `BR` is assembled as `BRnzp`
+                if (condition == 0) {
+                    fprintf(stderr, "Invalid condition for BR[nzp]\n");
+                    return ERR_INSTRUCTION;
+                }
+                const SignedWord pc_offset = bits_pc_offset_9(instruction);
+                if (cc & condition)
+                    branch(features, address, pc + pc_offset, true);
+                else if (features & EVENT_BRANCH)
+                    branch(features, address, pc, false);
+            } break;
+
+            // JMP/RET
+            case OP_JMP_RET: {
+                if (bits(instruction, 11, 9) != 0 ||
+                    bits(instruction, 5, 0) != 0) {
+                    fprintf(stderr, "Invalid padding for JMP/RET\n");
+                    return ERR_INSTRUCTION;
+                }
+                const uint8_t base_reg = bits_reg_b(instruction);
+                branch(features, address, registers[base_reg], true);
+            } break;
+
+            // JSR/JSRR
+            case OP_JSR_JSRR: {
+                registers[7] = pc;
+                if (bits(instruction, 11, 11)) {
+                    // JSR
+                    const SignedWord pc_offset = bits_pc_offset_11(instruction);
+                    branch(features, address, pc + pc_offset, true);
+                } else {
+                    // JSRR
+                    if (bits(instruction, 11, 9) != 0 ||
+                        bits(instruction, 5, 0) != 0) {
+                        fprintf(stderr, "Invalid padding for JSRR\n");
+                        return ERR_INSTRUCTION;
+                    }
+                    const uint8_t base_reg = bits_reg_b(instruction);
+                    branch(features, address, registers[base_reg], true);
+                }
+            } break;
+
+            // TRAP
+            case OP_TRAP: {
+                if (bits(instruction, 11, 8) != 0) {
+                    fprintf(stderr, "Invalid padding for TRAP\n");
+                    return ERR_INSTRUCTION;
+                }
+                const enum TrapVect trap_vect =
+                    (enum TrapVect)bits(instruction, 8, 0);
+                if (hooked_events & EVENT_TRAP)
+                    CALL_PLUGINS(EVENT_TRAP, trap, address, trap_vect);
+                if (metrics != NULL)
+                    metrics_add(&metrics->traps[trap_vect], 1);
+                switch (trap_vect) {
+                    // GETC
+                    case TRAP_GETC: {
+                        const char input = (char)read_char();
+                        registers[0] = (Word)input;
+                    }; break;
+
+                    // IN
+                    case TRAP_IN: {
+                        print_on_new_line();
+                        print_string("Input> ");
+                        const char input = (char)read_char();
+                        print_char(input);
+                        print_on_new_line();
+                        registers[0] = (Word)input;
+                    }; break;
+
+                    // OUT
+                    case TRAP_OUT: {
+                        print_char((char)(registers[0]));
+                        flush_output();
+                    }; break;
+
+                    // PUTS
+                    case TRAP_PUTS: {
+                        for (Word i = registers[0];; ++i) {
+                            if (!user_may_access(i, PERM_READ))
+                                return access_violation(address, i, PERM_READ);
+                            const char ch = (char)(memory[i]);
+                            if (ch == '\0')
+                                break;
+                            print_char(ch);
+                        }
+                        flush_output();
+                    }; break;
+
+                    // PUTSP
+                    case TRAP_PUTSP: {
+                        for (Word i = registers[0];; ++i) {
+                            if (!user_may_access(i, PERM_READ))
+                                return access_violation(address, i, PERM_READ);
+                            const Word word = memory[i];
+                            const char chars[2] = {
+                                (char)(word >> 8), (char)word
+                            };
+
+                            if (chars[0] == '\0')
+                                break;
+                            print_char(chars[0]);
+                            if (chars[1] == '\0')
+                                break;
+                            print_char(chars[1]);
+                        }
+                        flush_output();
+                    }; break;
+
+                    // Bulk I/O
+                    case TRAP_READ:
+                    case TRAP_READP: {
+                        const enum Error error =
+                            trap_read(address, trap_vect == TRAP_READP);
+                        if (error != ERR_OK)
+                            return error;
+                    }; break;
+                    case TRAP_WRITE:
+                    case TRAP_WRITEP: {
+                        const enum Error error =
+                            trap_write(address, trap_vect == TRAP_WRITEP);
+                        if (error != ERR_OK)
+                            return error;
+                    }; break;
+
+                    // HALT
+                    case TRAP_HALT:
+                        if (hooked_events & EVENT_HALT)
+                            CALL_PLUGINS(
+                                EVENT_HALT, halt, instructions_retired
+                            );
+                        return ERR_OK;
+
+                    // Could be a non-standard trap, so not unreachable
+                    default:
+                        fprintf(
+                            stderr, "Invalid TRAP vector 0x%02hhx\n", trap_vect
+                        );
+                        return ERR_INSTRUCTION;
+                }
+            } break;
+
+            // RTI
+            case OP_RTI:
+                fprintf(stderr, "Cannot use RTI in non-supervisor mode\n");
+                return ERR_INSTRUCTION;
+            // Reserved
+            case OP_RESERVED:
+                fprintf(stderr, "Cannot use reserved instruction\n");
+                return ERR_INSTRUCTION;
+        }
+
+        if (features & EVENT_RETIRE)
+            CALL_PLUGINS(EVENT_RETIRE, retire, address, instruction);
+    }
+}
+
+// Events which select a specialized variant of the interpreter
+#define HOT_EVENTS \
+    (EVENT_RETIRE | EVENT_MEMORY_READ | EVENT_MEMORY_WRITE | EVENT_BRANCH)
+
+// Every supported combination of features gets its own copy of
+// `execute_with`, in a function of its own, so `features` is a constant
+// inside each copy and adding variants cannot change how the others are
+// compiled
+#define VARIANT(_suffix, _features)                                  \
+    static __attribute__((noinline)) enum Error execute##_suffix() { \
+        return execute_with(_features);                              \
+    }
+#define VARIANT_ENTRY(_suffix, _features) [_features] = execute##_suffix,
+#define EACH_4(_macro, _suffix, _features) \
+    _macro(_suffix##0, (_features))        \
+    _macro(_suffix##1, (_features) + 1)    \
+    _macro(_suffix##2, (_features) + 2)    \
+    _macro(_suffix##3, (_features) + 3)
+#define EACH_16(_macro, _suffix, _features)             \
+    EACH_4(_macro, _suffix##0, _features)               \
+    EACH_4(_macro, _suffix##1, (_features) + 4)         \
+    EACH_4(_macro, _suffix##2, (_features) + 8)         \
+    EACH_4(_macro, _suffix##3, (_features) + 12)
+#define EACH_VARIANT(_macro)                                                 \
+    EACH_16(_macro, _0, 0)                                                   \
+    EACH_16(_macro, _1, FEATURE_BOUNDED)                                     \
+    EACH_16(_macro, _2, FEATURE_PROTECTED)                                   \
+    EACH_16(_macro, _3, FEATURE_PROTECTED | FEATURE_BOUNDED)                 \
+    EACH_16(_macro, _4, FEATURE_DEVICES)                                     \
+    EACH_16(_macro, _5, FEATURE_DEVICES | FEATURE_BOUNDED)                   \
+    EACH_16(_macro, _6, FEATURE_DEVICES | FEATURE_PROTECTED)                 \
+    EACH_16(_macro, _7, FEATURE_DEVICES | FEATURE_PROTECTED | FEATURE_BOUNDED)
+
+EACH_VARIANT(VARIANT)
+static enum Error (*const variants[])() = {EACH_VARIANT(VARIANT_ENTRY)};
+
+// Run the variant of the interpreter compiled for `features`
+enum Error execute_variant(const unsigned features) {
+    assert(
+        features < sizeof(variants) / sizeof(variants[0]) &&
+            variants[features] != NULL,
+        "No variant for features 0x%x",
+        features
+    );
+    return variants[features]();
+}
+
+// Features of the variant which runs the program, besides `FEATURE_BOUNDED`
+unsigned enabled_features() {
+    return (hooked_events & HOT_EVENTS) |
+           (protection_enabled ? FEATURE_PROTECTED : 0) |
+           (device_count > 0 ? FEATURE_DEVICES : 0);
+}
+
+enum Error execute_with_runner(enum Error (*const run)(unsigned features)) {
+    if (metrics != NULL)
+        return execute_until_with_runner(run, UINT64_MAX);
+    // Not checked by this variant, but devices may look at it
+    run_limit = UINT64_MAX;
+    atomic_store_explicit(&instruction_limit, UINT64_MAX, memory_order_relaxed);
+    return run(enabled_features());
+}
+
+enum Error execute_until_with_runner(
+    enum Error (*const run)(unsigned features), const uint64_t limit
+) {
+    const unsigned features = enabled_features() | FEATURE_BOUNDED;
+    while (true) {
+        // With metrics, run in slices, publishing the instruction counter
+        // between them
+        const bool sliced = metrics != NULL && instructions_retired < limit &&
+                            limit - instructions_retired > METRICS_SLICE;
+        run_limit = sliced ? instructions_retired + METRICS_SLICE : limit;
+        atomic_store_explicit(
+            &instruction_limit, run_limit, memory_order_relaxed
+        );
+        // A signal which came before the limit was set must not be lost
+        const enum Error error = interrupted ? ERR_LIMIT : run(features);
+        if (metrics != NULL)
+            metrics_publish(instructions_retired);
+        if (error != ERR_LIMIT)
+            return error;
+        if (interrupted) {
+            interrupted = 0;
+            return ERR_LIMIT;
+        }
+        if (instructions_retired >= limit)
+            return ERR_LIMIT;
+    }
+}
+
+enum Error execute() {
+    return execute_with_runner(execute_variant);
+}
+
+enum Error execute_until(const uint64_t limit) {
+    return execute_until_with_runner(execute_variant, limit);
+}
+
+void interrupt_execution() {
+    interrupted = 1;
+    atomic_store_explicit(&instruction_limit, 0, memory_order_relaxed);
+}
+
+int start_helper_thread(
+    pthread_t *const thread, void *(*const routine)(void *), void *argument
+) {
+    // The new thread inherits the mask
+    sigset_t all, previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &previous);
+    const int error = pthread_create(thread, NULL, routine, argument);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    return error;
+}
+
+// `code_watch` when there is more than one
+void watch_all(const Word start, const size_t count) {
+    const int watch_count =
+        atomic_load_explicit(&code_watch_count, memory_order_acquire);
+    for (int i = 0; i < watch_count; ++i)
+        code_watches[i](start, count);
+}
+
+bool add_code_watch(void (*const watch)(Word start, size_t count)) {
+    pthread_mutex_lock(&code_watch_lock);
+    const int watch_count =
+        atomic_load_explicit(&code_watch_count, memory_order_relaxed);
+    const bool added = watch_count < MAX_CODE_WATCHES;
+    if (added) {
+        code_watches[watch_count] = watch;
+        atomic_store_explicit(
+            &code_watch_count, watch_count + 1, memory_order_release
+        );
+        code_watch = watch_count == 0 ? watch : watch_all;
+    }
+    pthread_mutex_unlock(&code_watch_lock);
+    return added;
+}
+
+uint64_t current_run_limit() {
+    return run_limit;
+}
+
+void set_instruction_limit(const uint64_t limit) {
+    atomic_store_explicit(&instruction_limit, limit, memory_order_relaxed);
+}
+
+bool execution_interrupted() {
+    return interrupted;
+}
+
+void count_side_effect() {
+    ++side_effects;
+}
+
+void reset_state(const Word origin) {
+    pc = origin;
+    cc = 0x2;  // Zero flag
+    for (int i = 0; i < 8; ++i)
+        registers[i] = 0;
+    instructions_retired = 0;
+    stdout_on_new_line = true;
+    for (int i = 0; i < device_count; ++i) {
+        if (devices[i].reset != NULL)
+            devices[i].reset(devices[i].data);
+    }
+    if (code_watch != NULL)
+        code_watch(0, MEMORY_SIZE);
+}
+
+// Read until `size` bytes are read or the end of the file is reached
+// Returns the amount of bytes read, or -1 on error
+ssize_t read_all(const int file, void *const buffer, const size_t size) {
+    size_t total = 0;
+    while (total < size) {
+        const ssize_t count = read(file, (char *)buffer + total, size - total);
+        if (count < 0)
+            return -1;
+        if (count == 0)
+            break;
+        total += (size_t)count;
+    }
+    return (ssize_t)total;
+}
+
+// Files are read directly into memory with `read`, rather than through
+// stdio, since loading is a large part of the run time of small programs
+enum Error load_file(const char *const filename) {
+    // Try to open file
+    const int file = open(filename, O_RDONLY);
+    if (file < 0) {
+        fprintf(stderr, "Failed to open file.\n");
+        return ERR_FILE;
+    }
+
+    // Text formats are recognized from their first line
+    char head[FORMAT_SNIFF_SIZE];
+    const ssize_t head_length = pread(file, head, sizeof(head), 0);
+    const enum Format format = detect_format(
+        filename, head, head_length < 0 ? 0 : (size_t)head_length
+    );
+    if (format != FORMAT_OBJECT) {
+        const enum Error error = load_text_file(file, format);
+        (void)close(file);
+        return error;
+    }
+
+    // Read the first word: the memory origin
+    Word origin;
+    const ssize_t origin_bytes = read_all(file, &origin, sizeof(Word));
+    if (origin_bytes < 0) {
+        fprintf(stderr, "Failed to read file.");
+        (void)close(file);
+        return ERR_FILE;
+    }
+    if (origin_bytes < (ssize_t)sizeof(Word)) {
+        fprintf(stderr, "File is too short.");
+        (void)close(file);
+        return ERR_FILE;
+    }
+    origin = swap_endian(origin);  // Fix endianess
+
+    // Read the rest of the file into memory
+    const size_t capacity = (MEMORY_SIZE - origin) * sizeof(Word);
+    const ssize_t bytes_read = read_all(file, memory + origin, capacity);
+    if (bytes_read < 0) {
+        fprintf(stderr, "Failed to read file.");
+        (void)close(file);
+        return ERR_FILE;
+    }
+    // Check for anything past the end of memory
+    char extra;
+    if ((size_t)bytes_read == capacity && read_all(file, &extra, 1) != 0) {
+        fprintf(stderr, "File is too long.");
+        (void)close(file);
+        return ERR_FILE;
+    }
+    (void)close(file);  // Close file
+    const size_t words_read = (size_t)bytes_read / sizeof(Word);
+    if (words_read == 0) {
+        fprintf(stderr, "File is too short.");
+        return ERR_FILE;
+    }
+
+    // Fix endianess
+    for (size_t i = origin; i < origin + words_read; ++i)
+        memory[i] = swap_endian(memory[i]);
+
+    reset_state(origin);
+    return ERR_OK;
+}
+
+enum Error load_data(
+    const char *const filename, const char *const data, const size_t length
+) {
+    const enum Format format = detect_format(
+        filename, data, length < FORMAT_SNIFF_SIZE ? length : FORMAT_SNIFF_SIZE
+    );
+    if (format != FORMAT_OBJECT)
+        return load_text(data, length, format);
+
+    if (length < 2 * sizeof(Word)) {
+        fprintf(stderr, "File is too short.");
+        return ERR_FILE;
+    }
+    // Bytes are big-endian, and `data` may not be aligned
+    const unsigned char *const bytes = (const unsigned char *)data;
+    const Word origin = (Word)(bytes[0] << 8 | bytes[1]);
+    const size_t words = length / sizeof(Word) - 1;
+    if (words > (size_t)(MEMORY_SIZE - origin)) {
+        fprintf(stderr, "File is too long.");
+        return ERR_FILE;
+    }
+    for (size_t i = 1; i <= words; ++i)
+        memory[origin + i - 1] = (Word)(bytes[i * 2] << 8 | bytes[i * 2 + 1]);
+
+    reset_state(origin);
+    return ERR_OK;
+}
+
+const struct Engine engines[] = {
+    {"switch", execute, execute_until},
+    {"jit", jit_execute, jit_execute_until},
+    {"cc", cjit_execute, cjit_execute_until},
+};
+const size_t engine_count = sizeof(engines) / sizeof(engines[0]);
+
+const struct Engine *find_engine(const char *const name) {
+    for (size_t i = 0; i < engine_count; ++i) {
+        if (strcmp(engines[i].name, name) == 0)
+            return &engines[i];
+    }
+    return NULL;
+}
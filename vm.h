@@ -0,0 +1,262 @@
+#ifndef VM_H
+#define VM_H
+
+// Libc
+#include <stdbool.h>  // bool
+#include <stddef.h>   // size_t
+#include <stdint.h>   // uint16_t, etc
+#include <stdio.h>    // fprintf
+#include <stdlib.h>   // exit
+// POSIX
+#include <pthread.h>  // pthread_t
+// Local
+#include "plugin.h"  // struct Plugin
+
+// Total amount of words in memory
+#define MEMORY_SIZE 0x10000L
+
+// Sanity check for functions
+// If condition fails then the program is incorrect and should exit
+#define assert(_condition, ...)                                      \
+    {                                                                \
+        if (!(_condition)) {                                         \
+            fprintf(stderr, "Assertion failed:\n" #_condition "\n"); \
+            fprintf(stderr, "" __VA_ARGS__);                         \
+            fprintf(stderr, "\n");                                   \
+            exit(ERR_ASSERT);                                        \
+        }                                                            \
+    }
+
+// 1 Word = 2 Bytes
+typedef uint16_t Word;
+typedef int16_t SignedWord;
+
+// All program state
+// Each thread has its own VM, so batch workers can run programs in parallel
+extern _Thread_local Word memory[MEMORY_SIZE];
+extern _Thread_local Word registers[8];  // General purpose registers
+extern _Thread_local Word pc;            // Program counter
+extern _Thread_local uint8_t cc;         // Condition code
+
+// Total instructions fetched since the program was loaded
+extern _Thread_local uint64_t instructions_retired;
+
+// Device state
+extern _Thread_local bool stdout_on_new_line;  // Last output was a newline
+
+// All opcodes. Note that some refer to multiple instruction names
+enum Opcode {
+    OP_BR = 0x0,  // For all BR[nzp] instructions
+    OP_ADD = 0x1,
+    OP_LD = 0x2,
+    OP_ST = 0x3,
+    OP_JSR_JSRR = 0x4,  // Bitflag determines immediate or register
+    OP_AND = 0x5,
+    OP_LDR = 0x6,
+    OP_STR = 0x7,
+    OP_RTI = 0x8,  // Not used in non-supervisor mode
+    OP_NOT = 0x9,
+    OP_LDI = 0xa,
+    OP_STI = 0xb,
+    OP_JMP_RET = 0xc,   // RET == JMP R7
+    OP_RESERVED = 0xd,  // Reserved instruction
+    OP_LEA = 0xe,
+    OP_TRAP = 0xf,
+};
+
+// All trap vectors
+enum TrapVect {
+    TRAP_GETC = 0x20,
+    TRAP_OUT = 0x21,
+    TRAP_PUTS = 0x22,
+    TRAP_IN = 0x23,
+    TRAP_PUTSP = 0x24,
+    TRAP_HALT = 0x25,
+    // Extensions, for buffered I/O
+    // R0 is the address of the buffer, and R1 the number of bytes. Packed
+    // buffers hold two bytes per word, high byte first, like PUTSP. The
+    // number of bytes read or written is returned in R0
+    TRAP_READ = 0x26,    // Read until the buffer is full, or end of input
+    TRAP_READP = 0x27,   // Same, packed
+    TRAP_WRITE = 0x28,   // Write the low byte of each word
+    TRAP_WRITEP = 0x29,  // Same, packed
+};
+
+// Kinds of user errors
+enum Error {
+    ERR_OK,           // Halted successfully
+    ERR_CLI,          // Parsing command-line arguments
+    ERR_FILE,         // Opening/reading file, invalid file structure
+    ERR_INSTRUCTION,  // Invalid instruction or padding
+    ERR_ASSERT,       // Assertion failed; this codebase has a bug
+    ERR_PLUGIN,       // Loading or initializing a plugin
+    ERR_LIMIT,        // Stopped at an instruction limit; not a failure
+    ERR_ACCESS,       // Access control violation, with protection enabled
+    ERR_SCRIPT,       // Program did not behave as its script expects
+};
+
+// Load an object file into memory and reset registers to run it
+enum Error load_file(const char *filename);
+// Same, from the contents of the file, already read into `data`
+enum Error load_data(const char *filename, const char *data, size_t length);
+
+// Reset registers and device state to start running at `origin`
+// Memory is left as it is
+void reset_state(Word origin);
+
+// Run the loaded program until it halts or fails
+enum Error execute();
+// Same, but return `ERR_LIMIT` once `instructions_retired` reaches `limit`,
+// or after `interrupt_execution` is called
+enum Error execute_until(uint64_t limit);
+// Make `execute_until` return at the next instruction
+// Safe to call from a signal handler
+void interrupt_execution();
+// Start a thread which never runs a VM, with every signal blocked, so that
+// signals such as SIGUSR1 (to save the state) are handled by a VM thread
+// Returns the error from `pthread_create`
+int start_helper_thread(
+    pthread_t *thread, void *(*routine)(void *), void *argument
+);
+
+// Memory protection
+// Permissions are set per page, and checked on every fetch, load and store
+// by the program, which runs in user mode. Trap routines run as the
+// supervisor, but every string or buffer they access for the program is
+// checked as if the program accessed it. Disabled unless `enable_protection`
+// is called, in which case a separate variant of the interpreter is used
+#define PROTECTION_PAGE_SHIFT 8  // 256 words per page
+#define PROTECTION_PAGES (MEMORY_SIZE >> PROTECTION_PAGE_SHIFT)
+enum Permission {
+    PERM_READ = 1 << 0,
+    PERM_WRITE = 1 << 1,
+    PERM_EXECUTE = 1 << 2,
+    PERM_USER = 1 << 3,  // Without this, only the supervisor has access
+};
+extern uint8_t page_permissions[PROTECTION_PAGES];
+// Start with the standard layout: the trap table and operating system below
+// x3000, and device registers from xFE00, are for the supervisor only
+void enable_protection();
+// Set the permissions of every page from `start` to `end`, inclusive
+void protect_region(Word start, Word end, uint8_t permissions);
+
+// Hook plugin callbacks into the VM
+// Returns false if too many plugins are attached
+#define MAX_PLUGINS 8
+bool attach_plugin(const struct Plugin *plugin);
+// Unhook every plugin, eg. in a process which runs again with others
+void detach_plugins();
+
+// Memory-mapped devices
+// Device registers are words of memory from `DEVICE_BASE`. A device is told
+// when the program stores to one of its registers, and may update one just
+// before the program loads it. Only a separate variant of the interpreter
+// checks for device registers, which is used once a device is attached
+#define DEVICE_BASE 0xfe00
+struct Device {
+    Word base;   // First register
+    Word count;  // Number of registers
+    // Any may be NULL
+    void (*load)(void *data, Word address);
+    void (*store)(void *data, Word address, Word value);
+    void (*reset)(void *data);  // Set the initial value of every register
+    void *data;
+};
+// Returns false if a register is out of range or taken by another device
+bool attach_device(const struct Device *device);
+
+// Standard keyboard and display registers, for programs which poll them
+// instead of using traps
+// A program which polls KBSR in a small loop with no other side effects
+// while there is no input is parked until input arrives, and the iterations
+// it would have run in that time are added to `instructions_retired`
+#define CONSOLE_KBSR 0xfe00
+#define CONSOLE_KBDR 0xfe02
+#define CONSOLE_DSR 0xfe04
+#define CONSOLE_DDR 0xfe06
+#define CONSOLE_READY 0x8000
+bool attach_console();
+
+// Whether the program may access `address` in this way, if protection is
+// enabled; for devices which access memory on its behalf
+bool user_may_access(Word address, uint8_t permission);
+
+// Where trap input comes from and trap output goes to
+// Defaults to the terminal and stdout
+struct Io {
+    int (*read_char)(void *context);  // Next input byte, or EOF
+    void (*write_char)(void *context, char ch);
+    void (*flush)(void *context);
+    void *context;
+    // For bulk traps; if NULL, `read_char` and `write_char` are used instead
+    // Reads fill the buffer, unless the end of input is reached first
+    size_t (*read)(void *context, char *buffer, size_t size);
+    void (*write)(void *context, const char *data, size_t length);
+    // Whether input (or its end) can be read without blocking, after waiting
+    // up to `timeout_ms` (-1 to wait for as long as it takes)
+    // NULL if reads never block
+    bool (*input_ready)(void *context, int timeout_ms);
+};
+extern _Thread_local struct Io io;
+
+// Input for `buffer_read_char`, which can be rewound by resetting `position`
+struct InputBuffer {
+    const char *data;
+    size_t length;
+    size_t position;
+};
+int buffer_read_char(void *context);
+size_t buffer_read(void *context, char *buffer, size_t size);
+// Null output sink
+void discard_char(void *context, char ch);
+void discard(void *context, const char *data, size_t length);
+void flush_nothing(void *context);
+
+void flush_output();
+// Make sure the output is left on a new line
+void print_on_new_line();
+
+// A way of executing the loaded program
+// Every engine must behave identically; they only differ in speed
+struct Engine {
+    const char *name;
+    enum Error (*execute)();
+    enum Error (*execute_until)(uint64_t limit);
+};
+extern const struct Engine engines[];
+extern const size_t engine_count;
+
+// Returns NULL if there is no engine with that name
+const struct Engine *find_engine(const char *name);
+
+// For engines which translate code, and leave the rest to the interpreter
+// The interpreter has a variant for each combination of plugin events (see
+// `enum PluginEvent`) and these features
+#define FEATURE_BOUNDED (1 << 6)    // Stop at the instruction limit
+#define FEATURE_PROTECTED (1 << 7)  // Check `page_permissions`
+#define FEATURE_DEVICES (1 << 8)    // Check for device registers
+enum Error execute_variant(unsigned features);
+// Like `execute` and `execute_until`, but running the program with `run`,
+// which behaves like `execute_variant`
+enum Error execute_with_runner(enum Error (*run)(unsigned features));
+enum Error execute_until_with_runner(
+    enum Error (*run)(unsigned features), uint64_t limit
+);
+// Where a bounded `run` must stop
+uint64_t current_run_limit();
+// Where the bounded variants of the interpreter stop, until `run` returns
+void set_instruction_limit(uint64_t limit);
+// Whether `interrupt_execution` was called during this run
+bool execution_interrupted();
+// For stores by translated code, when devices are attached, so a loop which
+// stores is not taken for a polling loop
+void count_side_effect();
+// Told about memory written by anything but a store instruction, or by a
+// store in a variant with `EVENT_MEMORY_WRITE`; NULL if unused
+extern void (*code_watch)(Word start, size_t count);
+// Have `watch` told too, as well as any other engine's
+// Returns false if there are already `MAX_CODE_WATCHES`
+#define MAX_CODE_WATCHES 4
+bool add_code_watch(void (*watch)(Word start, size_t count));
+
+#endif